@@ -193,6 +193,14 @@ class Cr4 {
      */
     bool pke() const;
 
+    /**
+     * @brief Get the CET (Control-flow Enforcement Technology) bit
+     *
+     * @return true if the CET bit is set
+     * @return false if the CET bit is not set
+     */
+    bool cet() const;
+
     /**
      * @brief Get the raw value
      *
@@ -20,16 +20,55 @@
 #include <introvirt/core/fwd.hh>
 #include <introvirt/util/compiler.hh>
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <unordered_map>
+#include <vector>
 
 namespace introvirt {
 namespace x86 {
 
+class TranslationCache;
+
 class PageDirectory final {
   public:
+    /**
+     * @brief Counters for the translation cache
+     */
+    struct TranslationCacheStats {
+        uint64_t hits = 0;          ///< Translations served from the cache
+        uint64_t misses = 0;        ///< Translations that required a page walk
+        uint64_t bypasses = 0;      ///< Translations that skipped the cache (see load())
+        uint64_t fills = 0;         ///< Translations added to the cache
+        uint64_t flushes = 0;       ///< Full flushes
+        uint64_t invalidations = 0; ///< CR3 and INVLPG driven invalidations
+    };
+
+    /**
+     * @brief A run of consecutive virtual pages that are all present or all absent
+     */
+    struct PageRun {
+        uint64_t first_page = 0; ///< Index of the first page of the run in the range
+        uint64_t page_count = 0; ///< The number of pages in the run
+        bool present = false;    ///< True if the pages are present
+    };
+
+    /**
+     * @brief The result of a hardware page walk
+     *
+     * The permission bits are combined across every level, the same way the processor does.
+     */
+    struct PageWalk {
+        uint64_t physical_address = 0; ///< The translated address
+        bool writable = false;         ///< True if R/W is set at every level
+        bool user = false;             ///< True if U/S is set at every level
+        bool accessed = false;         ///< True if the accessed bit is set at every level
+        bool dirty = false;            ///< True if the dirty bit is set in the leaf entry
+    };
+
     /**
      * @brief
      *
@@ -46,6 +85,26 @@ class PageDirectory final {
      */
     static constexpr uint64_t PAGE_MASK = (~(PAGE_SIZE - 1));
 
+    /**
+     * @brief The page directory bits of a CR3 or DirectoryTableBase value
+     *
+     * Leaves out the PCID and flag bits, as well as bit 63 (no-flush) and the other high bits.
+     */
+    static constexpr uint64_t DIRECTORY_TABLE_BASE_MASK = 0x000FFFFFFFFFF000ull;
+
+    /**
+     * @brief Normalize a CR3 value so that it can be compared with another
+     *
+     * Use this wherever page directories are compared or used as keys, so that the same address
+     * space always gives the same value regardless of the PCID it was loaded with.
+     *
+     * @param cr3 A CR3 or DirectoryTableBase value
+     * @return The page directory base
+     */
+    static constexpr uint64_t directory_table_base(uint64_t cr3) {
+        return cr3 & DIRECTORY_TABLE_BASE_MASK;
+    }
+
     /**
      * @brief Convert a virtual address to a physical address
      *
@@ -56,11 +115,127 @@ class PageDirectory final {
      */
     uint64_t translate(uint64_t virtual_address, uint64_t page_directory) const HOT;
 
+    /**
+     * @brief Convert a virtual address to a physical address, if it is present
+     *
+     * This is the same as translate(), but a missing page is reported by returning an empty
+     * optional instead of throwing. Use this when "not present" is an expected outcome, such as
+     * when scanning memory.
+     *
+     * @param virtual_address The virtual address to translate
+     * @param page_directory The page directory to use for address translation
+     * @return The translated address, or std::nullopt if the virtual address is not present
+     */
+    std::optional<uint64_t> try_translate(uint64_t virtual_address,
+                                          uint64_t page_directory) const HOT;
+
+    /**
+     * @brief Walk the page tables exactly as the processor would
+     *
+     * Unlike try_translate(), this never consults the translation cache or the guest's page
+     * fault handler, and never modifies the page tables. Only entries that are really present
+     * are followed, so the result describes what a memory access by the vcpu would see.
+     *
+     * @param virtual_address The virtual address to translate
+     * @param page_directory The page directory to use for address translation
+     * @return The translation and its permissions, or std::nullopt if the page is not present
+     */
+    std::optional<PageWalk> walk(uint64_t virtual_address, uint64_t page_directory) const;
+
+    /**
+     * @brief Translate consecutive virtual pages in one pass
+     *
+     * This gives the same results as calling try_translate() for each page, but the page tables
+     * are walked once: a page only reads the levels that differ from the page before it, so the
+     * upper levels are read once per 2MiB (or more) instead of once per page. When an upper level
+     * entry is not present, every page it would map is reported absent without walking them.
+     *
+     * @param virtual_address An address in the first page to translate
+     * @param page_count The number of pages to translate
+     * @param page_directory The page directory to use for address translation
+     * @param pfns Receives page_count physical frame numbers, 0 for pages that are not present
+     * @param stop_at_absent If true, stop at the first page that is not present. The remaining
+     * pages are left out of the result.
+     * @return The present and absent runs, in order
+     */
+    std::vector<PageRun> translate_range(uint64_t virtual_address, uint64_t page_count,
+                                         uint64_t page_directory, uint64_t* pfns,
+                                         bool stop_at_absent = false) const;
+
     /**
      * @brief Reset the cached addresses
      */
     void reconfigure(const Vcpu& vcpu);
 
+    /**
+     * @brief Enable or disable the translation cache
+     *
+     * The cache is only coherent while CR3 writes and INVLPG are being intercepted, and is only
+     * used for address spaces that a vcpu has loaded since it was enabled. It is bypassed while
+     * CR4.PCIDE is set, because INVPCID can't be intercepted.
+     * Use Domain::translation_cache() instead of calling this directly.
+     *
+     * @param enabled If true, translations are cached by (page directory, virtual page)
+     */
+    void translation_cache(bool enabled);
+
+    /**
+     * @brief Check if the translation cache is enabled
+     */
+    bool translation_cache() const;
+
+    /**
+     * @brief Choose whether page walks set the accessed bit in the guest's page tables
+     *
+     * Walks are read-only by default. Use Domain::page_walk_accessed_bits() instead of calling
+     * this directly.
+     *
+     * @param enabled If true, the accessed bit is set in every entry walked
+     */
+    void accessed_bits(bool enabled);
+
+    /**
+     * @brief Check if page walks set the accessed bit
+     */
+    bool accessed_bits() const;
+
+    /**
+     * @brief Drop every cached translation
+     */
+    void flush() const;
+
+    /**
+     * @brief Drop cached translations for one address space
+     *
+     * @param page_directory The page directory (CR3 value) of the address space
+     */
+    void invalidate(uint64_t page_directory) const;
+
+    /**
+     * @brief Record that a vcpu loaded a page directory
+     *
+     * Drops cached translations for the address space. Translations are only cached for address
+     * spaces that are loaded on a vcpu, since the guest doesn't have to INVLPG changes it makes
+     * to page tables that aren't in use.
+     *
+     * @param vcpu_id The vcpu that wrote CR3
+     * @param page_directory The new CR3 value
+     * @param pcid True if CR4.PCIDE is set on the vcpu. The cache is bypassed from then on.
+     */
+    void load(uint32_t vcpu_id, uint64_t page_directory, bool pcid) const;
+
+    /**
+     * @brief Drop cached translations containing a virtual address, in every address space
+     *
+     * @param virtual_address The virtual address, as given to INVLPG
+     */
+    void invalidate_page(uint64_t virtual_address) const;
+
+    /**
+     * @brief Get the translation cache counters
+     */
+    TranslationCacheStats translation_cache_stats() const;
+
     /**
      * @brief Create a PageDirectory
      *
@@ -73,9 +248,18 @@ class PageDirectory final {
      */
     ~PageDirectory();
 
+  private:
+    uint64_t root(uint64_t page_directory) const;
+    bool cacheable(uint64_t table_root) const HOT;
+
   private:
     Domain& domain_;
 
+    std::unique_ptr<TranslationCache> cache_;
+    std::atomic_bool cache_enabled_ = false;
+    std::atomic_bool accessed_bits_ = false;
+    mutable std::atomic_bool pcid_ = false;
+
     int pt_levels_ = 0;
     int pte_size_ = 0;
     uint64_t va_mask_ = 0;
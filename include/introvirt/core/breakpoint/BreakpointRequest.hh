@@ -0,0 +1,52 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/fwd.hh>
+#include <introvirt/core/memory/guest_ptr.hh>
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace introvirt {
+
+/**
+ * @brief A single site for Domain::create_breakpoints()
+ */
+struct BreakpointRequest {
+    /**
+     * @brief The address to place the breakpoint
+     */
+    guest_ptr<void> address;
+
+    /**
+     * @brief The callback function to run
+     */
+    std::function<void(Event&)> callback;
+
+    /**
+     * @brief The page directories to scope the breakpoint to
+     *
+     * If empty, the breakpoint fires for every address space that maps the site. Otherwise the
+     * callback only runs when one of these is loaded in CR3, and hits from anywhere else are
+     * stepped over without creating an event. A process can have more than one, such as
+     * PROCESS::DirectoryTableBase() and PROCESS::UserDirectoryTableBase() with KVA shadowing.
+     */
+    std::vector<uint64_t> page_directories;
+};
+
+} // namespace introvirt
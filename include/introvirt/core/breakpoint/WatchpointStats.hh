@@ -0,0 +1,53 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+
+namespace introvirt {
+
+/**
+ * @brief Counters for memory access watchpoints
+ *
+ * Retrieved with Domain::watchpoint_stats(). All values are totals since the domain was opened.
+ */
+struct WatchpointStats {
+    /**
+     * @brief The number of memory access faults on watched pages seen by the vcpu pollers
+     */
+    uint64_t faults = 0;
+
+    /**
+     * @brief The number of faults handled by the vcpu poller without creating an event or using
+     * a delivery thread
+     *
+     * These either missed every watched byte range on the page and were stepped over, or were
+     * only needed by a WriteTracker.
+     */
+    uint64_t absorbed = 0;
+
+    /**
+     * @brief The number of first writes to a page recorded by WriteTracker objects
+     */
+    uint64_t tracked_writes = 0;
+
+    /**
+     * @brief The number of faults that were handed to a delivery thread
+     */
+    uint64_t delivered = 0;
+};
+
+} // namespace introvirt
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/fwd.hh>
+
+#include <cstdint>
+#include <vector>
+
+namespace introvirt {
+
+/**
+ * @brief Records which pages of a region are written to
+ *
+ * Each page is write protected until the first write to it in the current epoch. That write
+ * marks the page as dirty and removes the protection, so tracking costs one fault per page per
+ * epoch instead of one event per store. No callbacks are delivered.
+ *
+ * Bit i of a bitmap is the page containing the tracked address plus i pages.
+ */
+class WriteTracker {
+  public:
+    /**
+     * @brief Get the number of pages being tracked
+     */
+    virtual uint64_t page_count() const = 0;
+
+    /**
+     * @brief Get the current epoch number
+     *
+     * The first epoch starts when the tracker is created and is numbered 0.
+     */
+    virtual uint64_t epoch() const = 0;
+
+    /**
+     * @brief Get the pages written to so far in the current epoch
+     *
+     * @return One bit per page
+     */
+    virtual std::vector<bool> dirty_pages() const = 0;
+
+    /**
+     * @brief Start a new epoch
+     *
+     * Every page that was written to is write protected again, in a single batch.
+     *
+     * @return The pages that were written to during the epoch that just ended
+     */
+    virtual std::vector<bool> flip() = 0;
+
+    virtual ~WriteTracker() = default;
+};
+
+} // namespace introvirt
@@ -22,8 +22,11 @@
 #include <introvirt/core/arch/arch.hh>
 
 #include <introvirt/core/breakpoint/Breakpoint.hh>
+#include <introvirt/core/breakpoint/BreakpointRequest.hh>
 #include <introvirt/core/breakpoint/SingleStep.hh>
 #include <introvirt/core/breakpoint/Watchpoint.hh>
+#include <introvirt/core/breakpoint/WatchpointStats.hh>
+#include <introvirt/core/breakpoint/WriteTracker.hh>
 
 #include <introvirt/core/domain/Domain.hh>
 #include <introvirt/core/domain/Guest.hh>
@@ -33,8 +36,10 @@
 #include <introvirt/core/event/ControlRegisterEvent.hh>
 #include <introvirt/core/event/Event.hh>
 #include <introvirt/core/event/EventCallback.hh>
+#include <introvirt/core/event/EventDeliveryStats.hh>
 #include <introvirt/core/event/EventFilter.hh>
 #include <introvirt/core/event/EventTaskInformation.hh>
+#include <introvirt/core/event/EventTimingStats.hh>
 #include <introvirt/core/event/EventType.hh>
 #include <introvirt/core/event/ExceptionEvent.hh>
 #include <introvirt/core/event/MemAccessEvent.hh>
@@ -71,6 +76,7 @@
 #include <introvirt/core/injection/system_call.hh>
 
 #include <introvirt/core/memory/GuestMemoryMapping.hh>
+#include <introvirt/core/memory/MemorySnapshot.hh>
 
 #include <introvirt/core/syscall/SystemCall.hh>
 #include <introvirt/core/syscall/SystemCallFilter.hh>
\ No newline at end of file
@@ -19,10 +19,14 @@
 #include <introvirt/core/breakpoint/Breakpoint.hh>
 #include <introvirt/core/breakpoint/SingleStep.hh>
 #include <introvirt/core/breakpoint/Watchpoint.hh>
+#include <introvirt/core/breakpoint/WatchpointStats.hh>
+#include <introvirt/core/breakpoint/WriteTracker.hh>
 #include <introvirt/core/domain/Guest.hh>
 #include <introvirt/core/event/EventCallback.hh>
+#include <introvirt/core/event/EventDeliveryStats.hh>
 #include <introvirt/core/fwd.hh>
 #include <introvirt/core/memory/GuestMemoryMapping.hh>
+#include <introvirt/core/memory/MemorySnapshot.hh>
 #include <introvirt/core/memory/guest_ptr.hh>
 #include <introvirt/util/compiler.hh>
 
@@ -53,6 +57,38 @@ class Domain {
     virtual std::shared_ptr<Breakpoint> create_breakpoint(const guest_ptr<void>& address,
                                                           std::function<void(Event&)> callback) = 0;
 
+    /**
+     * @brief Track which pages of a region of guest memory are written to
+     *
+     * The pages are translated when the tracker is created. Writes are recorded per epoch; see
+     * WriteTracker::flip().
+     *
+     * @param address The start of the region
+     * @param length Size in bytes of the region
+     * @return std::unique_ptr<WriteTracker> Stops tracking when destroyed
+     * @throws VirtualAddressNotPresentException if a page of the region is not present
+     * @throws NotImplementedException if memory access interception is not supported
+     */
+    virtual std::unique_ptr<WriteTracker> create_write_tracker(const guest_ptr<void>& address,
+                                                               uint64_t length) = 0;
+
+    /**
+     * @brief Create a set of execution breakpoints at once
+     *
+     * The breakpoints are all installed during a single pause of the domain. Sites on the same
+     * physical page are installed together and share one mapping of the page, which makes this
+     * much cheaper than calling create_breakpoint() for each site when there are many of them.
+     *
+     * Requests with BreakpointRequest::page_directories set only fire for those address spaces,
+     * which is useful for user-mode code shared by every process.
+     *
+     * @param requests The sites to place breakpoints at, and their callbacks
+     * @return One entry per request, in the same order. An entry is nullptr if that site could
+     * not be installed (for example, because the address is not present).
+     */
+    virtual std::vector<std::shared_ptr<Breakpoint>>
+    create_breakpoints(const std::vector<BreakpointRequest>& requests) = 0;
+
     /**
      * @brief Create a watchpoint on guest memory (e.g. break on read/write)
      *
@@ -147,6 +183,101 @@ class Domain {
      */
     virtual const x86::PageDirectory& page_directory() const = 0;
 
+    /**
+     * @brief Toggle the translation cache used by page_directory()
+     *
+     * When enabled, virtual to physical translations are cached for the address spaces that are
+     * currently loaded on a vcpu. The cache is kept coherent by intercepting CR3 writes, CR4
+     * writes and INVLPG on every vcpu, which are consumed internally and are not delivered to the
+     * poll() callback unless requested separately. Any CR4 write flushes the whole cache, since
+     * toggling CR4.PGE is how the guest flushes global translations.
+     *
+     * Translations in any other address space walk the page tables, because the guest doesn't
+     * have to INVLPG changes to page tables that aren't in use. Once CR4.PCIDE is seen the cache
+     * isn't used at all, because INVPCID can't be intercepted. Guests that use PCIDs, such as
+     * current 64-bit Windows, therefore get no benefit from it. Hit, miss and bypass counters
+     * are available from PageDirectory::translation_cache_stats().
+     *
+     * @param enabled If set to true, translations will be cached
+     * @throws NotImplementedException if the hypervisor cannot intercept INVLPG
+     * @throws CommandFailedException If the hypervisor reports an error
+     */
+    virtual void translation_cache(bool enabled) = 0;
+
+    /**
+     * @brief Toggle setting the accessed bit in guest page tables during translation
+     *
+     * By default, page_directory() walks are read-only: page table pages are mapped read-only
+     * and nothing is written to the guest, so introspection doesn't disturb the guest's working
+     * set accounting. When enabled, the accessed bit is set in every entry walked, the same as
+     * the processor would do.
+     *
+     * @param enabled If set to true, page walks set the accessed bit
+     */
+    virtual void page_walk_accessed_bits(bool enabled) = 0;
+
+    /**
+     * @brief Check if page walks set the accessed bit in guest page tables
+     */
+    virtual bool page_walk_accessed_bits() const = 0;
+
+    /**
+     * @brief Toggle a persistent mapping of all guest physical memory
+     *
+     * When enabled, guest RAM is mapped into our address space once, and map_pfns() returns
+     * pointers into that mapping instead of mapping each page on demand. Pages that fall outside
+     * of the persistent mapping, and ranges that are not physically contiguous, are still mapped
+     * individually.
+     *
+     * Mappings that were handed out while enabled remain valid after disabling. The mapping also
+     * stays enabled while a MemorySnapshot is using it, and is disabled once the last one goes
+     * away unless it was enabled here.
+     *
+     * On KVM, the first access to each page of the mapping is checked by reading it under a
+     * SIGBUS handler. The process-wide SIGBUS handler is replaced while a page is checked, and
+     * while the mapping is being built. SIGBUS signals that aren't from a check are passed on to
+     * the previous handler, and a handler installed by the application in the meantime is kept.
+     *
+     * @param enabled If set to true, guest physical memory will be mapped persistently
+     * @throws NotImplementedException if the hypervisor does not support it
+     * @throws CommandFailedException if guest memory could not be mapped
+     */
+    virtual void direct_memory_map(bool enabled) = 0;
+
+    /**
+     * @brief Check if the persistent guest memory mapping is active
+     */
+    virtual bool direct_memory_map() const = 0;
+
+    /**
+     * @brief Get the ranges of guest physical memory that are backed by RAM
+     *
+     * The layout is checked on every call, so memory that was added or removed since the last
+     * call is reflected.
+     *
+     * @return The ranges, sorted by address
+     * @throws NotImplementedException if the hypervisor does not support it
+     */
+    virtual std::vector<PhysicalMemoryRange> physical_memory_ranges() const = 0;
+
+    /**
+     * @brief Create a snapshot file of all guest physical memory
+     *
+     * The file is created by the first MemorySnapshot::capture(), and later captures only write
+     * the pages that changed. The persistent guest memory mapping is enabled, if the hypervisor
+     * supports it, while the snapshot exists.
+     *
+     * @param path The file to write
+     * @param format The format of the file
+     * @param threads The number of copy threads, or 0 for one per host CPU
+     * @return The snapshot
+     * @throws NotImplementedException if the hypervisor can't report its physical memory ranges
+     */
+    virtual std::unique_ptr<MemorySnapshot>
+    create_memory_snapshot(const std::string& path,
+                           MemorySnapshotFormat format = MemorySnapshotFormat::RAW,
+                           uint32_t threads = 0) = 0;
+
     /**
      * @brief Poll for events and deliver them to the callback
      *
@@ -156,6 +287,145 @@ class Domain {
      */
     virtual void poll(EventCallback& callback) = 0;
 
+    /**
+     * @brief Set the number of persistent threads used to deliver events to the poll() callback
+     *
+     * Events from a single vcpu are always delivered in order. Threads that are parked waiting
+     * for a system call return do not count against this limit.
+     *
+     * @param count The number of threads, or 0 for one per vcpu (the default)
+     */
+    virtual void event_delivery_threads(uint32_t count) = 0;
+
+    /**
+     * @brief Get the configured number of event delivery threads
+     *
+     * @return The number of threads, or 0 if one per vcpu is used
+     */
+    virtual uint32_t event_delivery_threads() const = 0;
+
+    /**
+     * @brief Set the maximum number of events waiting for a delivery thread
+     *
+     * When the queue is full, the vcpu pollers wait (and their vcpus stay paused) until a
+     * delivery thread takes an event.
+     *
+     * @param depth The maximum queue depth, or 0 for the default
+     */
+    virtual void event_delivery_queue_depth(uint32_t depth) = 0;
+
+    /**
+     * @brief Get the configured event delivery queue depth
+     *
+     * @return The maximum queue depth, or 0 if the default is used
+     */
+    virtual uint32_t event_delivery_queue_depth() const = 0;
+
+    /**
+     * @brief Get counters for the event delivery threads
+     *
+     * @return The counters since the last call to poll() started
+     */
+    virtual EventDeliveryStats event_delivery_stats() const = 0;
+
+    /**
+     * @brief Toggle timing of the event pipeline
+     *
+     * When enabled, each event is timed from the moment it's read from the hypervisor until its
+     * vcpu is resumed, and the stages are added to per-vcpu histograms by event type. System
+     * call events are also tracked by system call index. Turning timing on clears the histograms.
+     *
+     * @param enabled If set to true, events will be timed
+     */
+    virtual void event_timing(bool enabled) = 0;
+
+    /**
+     * @brief Check if the event pipeline is being timed
+     */
+    virtual bool event_timing() const = 0;
+
+    /**
+     * @brief Get the event pipeline histograms
+     *
+     * @return The histograms since timing was last enabled
+     */
+    virtual EventTimingStats event_timing_stats() const = 0;
+
+    /**
+     * @brief Record events to a file for later replay
+     *
+     * Every event read from the hypervisor is written with the register state of its vcpu, along
+     * with the contents of each guest page the first time it's mapped (and again whenever it's
+     * mapped with different contents). The file can then be opened with the replay hypervisor
+     * (INTROVIRT_HYPERVISOR=replay), which delivers the same events through the same pipeline
+     * without a live guest.
+     *
+     * Start recording before detect_guest() so that the pages used to detect the guest are in
+     * the recording. Memory that stays mapped replays with the contents it had when it was
+     * mapped.
+     *
+     * @param path The file to write, or an empty string to stop recording
+     * @throws CommandFailedException If the file could not be created
+     */
+    virtual void record_events(const std::string& path) = 0;
+
+    /**
+     * @brief Check if events are being recorded
+     */
+    virtual bool recording_events() const = 0;
+
+    /**
+     * @brief Toggle system call return hooking without parked threads
+     *
+     * By default, a system call with SystemCallEvent::hook_return() set keeps its delivery thread
+     * parked until the matching EVENT_FAST_SYSCALL_RET arrives, so a guest with many threads in
+     * blocking calls ties up as many host threads.
+     *
+     * When enabled, the call's SystemCall handler is stored in a table keyed by guest thread and
+     * stack pointer, and the delivery thread moves on. The return event is then delivered to the
+     * poll() callback like any other event, with the original handler attached, so pending
+     * returns only cost memory.
+     *
+     * @param enabled If set to true, returns are correlated instead of parking threads
+     */
+    virtual void syscall_return_correlation(bool enabled) = 0;
+
+    /**
+     * @brief Check if system call returns are correlated without parked threads
+     */
+    virtual bool syscall_return_correlation() const = 0;
+
+    /**
+     * @brief Toggle emulation of the instruction under a breakpoint
+     *
+     * To get past a breakpoint, the original byte has to be restored and the vcpu stepped over
+     * it. While that happens, every other vcpu is paused so that none of them can run through
+     * the unprotected instruction.
+     *
+     * When enabled (the default), common instructions such as register moves, stack operations
+     * and relative jumps are emulated instead, and the breakpoint is never removed. Other vcpus
+     * keep running. Anything that can't be emulated falls back to pausing and stepping.
+     *
+     * @param enabled If set to true, breakpoint instructions are emulated when possible
+     */
+    virtual void breakpoint_emulation(bool enabled) = 0;
+
+    /**
+     * @brief Check if instructions under breakpoints are emulated
+     */
+    virtual bool breakpoint_emulation() const = 0;
+
+    /**
+     * @brief Get counters for memory access watchpoints
+     *
+     * Watchpoints intercept whole pages. Faults on a watched page that don't touch any watched
+     * byte range are stepped over by the vcpu poller thread without being delivered; the
+     * counters show how many faults were handled that way.
+     *
+     * @return The counters since the domain was opened
+     */
+    virtual WatchpointStats watchpoint_stats() const = 0;
+
     /**
      * @brief Interrupt a poll() call
      */
@@ -232,6 +502,37 @@ class Domain {
      */
     virtual void intercept_system_calls(bool enabled) = 0;
 
+    /**
+     * @brief Only intercept system calls while a vcpu runs a process the task filter accepts
+     *
+     * Normally intercept_system_calls() makes every system call of every process exit to the
+     * hypervisor, and the TaskFilter drops the ones that aren't wanted. When this is enabled,
+     * CR3 writes are intercepted as well, and each one turns the vcpu's system call intercept on
+     * or off depending on the process that owns the new page directory. Untargeted processes then
+     * only cost a VM exit per address space switch.
+     *
+     * Page directories are matched to processes as their system calls are seen, so a process is
+     * intercepted until its first system call has been through the task filter. Changes to the
+     * task filter take effect at the next address space switch.
+     *
+     * This does not change intercept_system_calls(), which still has to be enabled.
+     *
+     * Guests with kernel address space isolation (Windows KVA shadowing) write CR3 on every
+     * kernel entry and exit, so every system call would exit twice. Call detect_guest() first, so
+     * that this is refused for those guests.
+     *
+     * @param enabled If set to true, system calls are only intercepted for targeted processes
+     * @throws NotImplementedException if CR3 writes cannot be intercepted, or the guest uses KVA
+     * shadowing
+     * @throws CommandFailedException If the hypervisor reports an error
+     */
+    virtual void targeted_system_calls(bool enabled) = 0;
+
+    /**
+     * @brief Check if system call interception follows the targeted processes
+     */
+    virtual bool targeted_system_calls() const = 0;
+
     /**
      * @brief Toggle control register write interception on all VCPUs
      *
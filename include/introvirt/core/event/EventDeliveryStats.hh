@@ -0,0 +1,88 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+
+namespace introvirt {
+
+/**
+ * @brief Counters for the pool of threads that deliver events to callbacks
+ *
+ * Retrieved with Domain::event_delivery_stats(). All values are totals since the last
+ * call to Domain::poll() started, except where noted.
+ */
+struct EventDeliveryStats {
+    /**
+     * @brief The configured number of persistent delivery threads
+     */
+    uint32_t threads = 0;
+
+    /**
+     * @brief The configured maximum number of events waiting for a delivery thread
+     */
+    uint32_t queue_depth = 0;
+
+    /**
+     * @brief The number of delivery threads that are currently alive
+     */
+    uint32_t live_threads = 0;
+
+    /**
+     * @brief The number of delivery threads currently parked in a suspended event
+     */
+    uint32_t blocked_threads = 0;
+
+    /**
+     * @brief The total number of delivery threads started, including replacements for
+     * threads parked in suspended events
+     */
+    uint64_t threads_started = 0;
+
+    /**
+     * @brief The number of events handed to a delivery thread
+     */
+    uint64_t events_delivered = 0;
+
+    /**
+     * @brief The number of times a vcpu poller had to wait for room in the queue
+     */
+    uint64_t queue_full_waits = 0;
+
+    /**
+     * @brief The largest number of events that were waiting in the queue at once
+     */
+    uint32_t queue_high_water = 0;
+
+    /**
+     * @brief The sum of the time events spent in the queue, in nanoseconds
+     */
+    uint64_t queue_wait_ns_total = 0;
+
+    /**
+     * @brief The longest time a single event spent in the queue, in nanoseconds
+     */
+    uint64_t queue_wait_ns_max = 0;
+
+    /**
+     * @brief The number of hooked system call returns currently waiting in the correlation table
+     *
+     * See Domain::syscall_return_correlation().
+     */
+    uint32_t pending_syscall_returns = 0;
+};
+
+} // namespace introvirt
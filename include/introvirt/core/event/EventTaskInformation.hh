@@ -41,6 +41,16 @@ class EventTaskInformation {
      * @return The name of the currently running process
      */
     virtual std::string process_name() const = 0;
+
+    /**
+     * @brief Get an OS-specific value identifying the current process object
+     *
+     * Used together with pid() to cache per-process results. On Windows this is the address of
+     * the EPROCESS.
+     *
+     * @return The process object address, or 0 if there isn't one
+     */
+    virtual uint64_t process_address() const = 0;
 };
 
 } // namespace introvirt
\ No newline at end of file
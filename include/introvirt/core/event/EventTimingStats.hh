@@ -0,0 +1,145 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/event/EventType.hh>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace introvirt {
+
+/**
+ * @brief The stages an event passes through while its vcpu is paused
+ */
+enum class EventStage : int {
+    FETCH,     ///< Reading the event from the hypervisor
+    FILTER,    ///< Domain level filtering, not counting CONSTRUCT
+    CONSTRUCT, ///< Building the OS-specific event
+    QUEUE,     ///< Waiting for a delivery thread
+    CALLBACK,  ///< The poll() callback, including breakpoint handling
+    COMPLETE,  ///< Resuming the vcpu
+    TOTAL,     ///< From FETCH to COMPLETE
+
+    STAGE_COUNT, ///< The number of stages
+};
+
+/**
+ * @brief Get a string representation of EventStage
+ *
+ * @param stage The stage to convert to string
+ * @return The string representation of the EventStage
+ */
+const std::string& to_string(EventStage stage);
+
+/**
+ * @brief Stream operator overload for EventStage
+ *
+ * @param os The stream to write to
+ * @param stage The stage to convert to a string
+ * @return The stream that was passed in
+ */
+std::ostream& operator<<(std::ostream& os, EventStage stage);
+
+/**
+ * @brief A histogram of durations with power-of-two buckets
+ */
+struct LatencyHistogram {
+    static constexpr unsigned int BUCKET_COUNT = 40;
+
+    /**
+     * @brief The number of samples
+     */
+    uint64_t count = 0;
+
+    /**
+     * @brief The sum of all samples, in nanoseconds
+     */
+    uint64_t total_ns = 0;
+
+    /**
+     * @brief The largest sample, in nanoseconds
+     */
+    uint64_t max_ns = 0;
+
+    /**
+     * @brief Bucket 0 counts samples of 0ns, and bucket N counts samples in [2^(N-1), 2^N)
+     *
+     * The last bucket also holds anything larger.
+     */
+    std::array<uint64_t, BUCKET_COUNT> buckets{};
+
+    /**
+     * @return The average sample, in nanoseconds
+     */
+    uint64_t mean_ns() const;
+
+    /**
+     * @brief Estimate a percentile
+     *
+     * @param percentile The percentile, from 0 to 100
+     * @return The upper bound of the bucket holding the percentile, in nanoseconds
+     */
+    uint64_t percentile_ns(double percentile) const;
+
+    /**
+     * @brief Add the samples from another histogram
+     */
+    LatencyHistogram& operator+=(const LatencyHistogram& other);
+};
+
+/**
+ * @brief Timing for the event pipeline, retrieved with Domain::event_timing_stats()
+ *
+ * Only events that were timed from the start are included, so events that are already in flight
+ * when timing is enabled are skipped.
+ */
+struct EventTimingStats {
+    using StageHistograms = std::array<LatencyHistogram, static_cast<int>(EventStage::STAGE_COUNT)>;
+
+    /**
+     * @brief Delivered events, indexed by vcpu and then by event type
+     */
+    std::vector<std::map<EventType, StageHistograms>> delivered;
+
+    /**
+     * @brief Events that were consumed or dropped by the filters, indexed by vcpu and then by
+     * event type
+     *
+     * Only the FETCH, FILTER, CONSTRUCT and TOTAL stages are used.
+     */
+    std::vector<std::map<EventType, StageHistograms>> filtered;
+
+    /**
+     * @brief The TOTAL stage of delivered system call events, by raw system call index
+     */
+    std::map<uint64_t, LatencyHistogram> syscalls;
+
+    /**
+     * @brief Combine the per-vcpu histograms
+     *
+     * @param per_vcpu Either delivered or filtered
+     * @return The histograms for all vcpus, by event type
+     */
+    static std::map<EventType, StageHistograms>
+    combine(const std::vector<std::map<EventType, StageHistograms>>& per_vcpu);
+};
+
+} // namespace introvirt
@@ -41,8 +41,9 @@ enum class EventType : int {
     EVENT_HYPERCALL,        ///< An intercepted hypercall
     EVENT_REBOOT,           ///< The guest VM has rebooted
     EVENT_SHUTDOWN,         ///< The guest VM has shutdown
+    EVENT_INVLPG,           ///< An INVLPG instruction was executed
 
-    EVENT_MAX = EVENT_SHUTDOWN, ///< The highest valid event type
+    EVENT_MAX = EVENT_INVLPG, ///< The highest valid event type
     EVENT_UNKNOWN = -1,         ///< An unknown event
 };
 
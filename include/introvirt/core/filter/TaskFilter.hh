@@ -17,8 +17,11 @@
 
 #include <introvirt/core/event/Event.hh>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
-#include <shared_mutex>
 #include <unordered_set>
 
 namespace introvirt {
@@ -30,6 +33,10 @@ namespace introvirt {
  * process, thread, or process name. Adding an entry to the list
  * means that events will be delivered for tasks matching the entry.
  *
+ * Changes compile the entries into an immutable predicate that matches() uses without locking;
+ * old predicates are only deleted once no thread can still be using them.
+ * Process name results are cached by process address and PID, so most events for a process only
+ * read the process name once.
  */
 class TaskFilter final {
   public:
@@ -92,6 +99,13 @@ class TaskFilter final {
      */
     void clear();
 
+    /**
+     * @brief Check if the filter has no entries, and therefore lets every event through
+     *
+     * This is a single atomic load, so it can be used to skip finding the task of an event.
+     */
+    bool empty() const;
+
     /**
      * @brief Check if the event matches our task filter
      *
@@ -101,14 +115,36 @@ class TaskFilter final {
      */
     bool matches(const Event& event) const;
 
-    TaskFilter() = default;
-    ~TaskFilter() = default;
+    /**
+     * @brief Check a process against the filter without reading anything from the guest
+     *
+     * This only uses the PID entries and previously cached process name results. It can't decide
+     * anything while thread entries are present, since those depend on the current thread.
+     *
+     * @param process_address The process object, as from EventTaskInformation::process_address()
+     * @param pid The process ID
+     * @return What matches() would return for events in the process, or an empty optional if that
+     * can't be decided without more information
+     */
+    std::optional<bool> matches_process(uint64_t process_address, uint64_t pid) const;
+
+    TaskFilter();
+    ~TaskFilter();
+
+  private:
+    class Predicate;
+
+    void update();
 
   private:
-    mutable std::shared_mutex mtx_;
+    std::mutex mtx_;
     std::unordered_set<uint64_t> tid_filter_;
     std::unordered_set<uint64_t> pid_filter_;
     std::set<std::string> proc_name_filter_;
+
+    // Replaced as a whole by update(), and retired through SnapshotEpoch
+    std::atomic<const Predicate*> predicate_ = nullptr;
+    std::atomic_bool empty_ = true;
 };
 
 } // namespace introvirt
\ No newline at end of file
@@ -28,8 +28,11 @@
 namespace introvirt {
 
 class Breakpoint;
+struct BreakpointRequest;
 class SingleStep;
 class Watchpoint;
+struct WatchpointStats;
+class WriteTracker;
 
 class Domain;
 class Guest;
@@ -39,8 +42,10 @@ class Vcpu;
 class ControlRegisterEvent;
 class Event;
 class EventCallback;
+struct EventDeliveryStats;
 class EventFilter;
 class EventTaskInformation;
+struct EventTimingStats;
 class ExceptionEvent;
 class MemAccessEvent;
 class MsrAccessEvent;
@@ -71,6 +76,9 @@ class TaskFilter;
 class FunctionCall;
 
 class GuestMemoryMapping;
+class MemorySnapshot;
+struct MemorySnapshotStats;
+struct PhysicalMemoryRange;
 
 class SystemCall;
 class SystemCallFilter;
@@ -18,6 +18,7 @@
 #include <introvirt/util/compiler.hh>
 
 #include <cstdint>
+#include <memory>
 
 namespace introvirt {
 
@@ -67,6 +68,19 @@ class GuestMemoryMapping final {
      */
     GuestMemoryMapping(void* mapping, unsigned int length) : mapping_(mapping), length_(length) {}
 
+    /**
+     * @brief Construct a GuestMemoryMapping that points into a longer-lived mapping
+     *
+     * The memory is not unmapped when this instance is destroyed. Instead, a reference to the
+     * backing object is held so that it outlives this mapping.
+     *
+     * @param mapping The mapped guest memory
+     * @param length The number of bytes that are accessible
+     * @param backing The owner of the underlying mapping
+     */
+    GuestMemoryMapping(void* mapping, unsigned int length, std::shared_ptr<const void> backing)
+        : mapping_(mapping), length_(length), backing_(std::move(backing)) {}
+
     /**
      * @brief Copy constructor
      */
@@ -96,6 +110,7 @@ class GuestMemoryMapping final {
   private:
     void* mapping_;
     std::size_t length_;
+    std::shared_ptr<const void> backing_;
 };
 
 } // namespace introvirt
\ No newline at end of file
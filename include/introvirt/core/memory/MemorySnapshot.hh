@@ -0,0 +1,89 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace introvirt {
+
+/**
+ * @brief The file formats a MemorySnapshot can write
+ */
+enum class MemorySnapshotFormat {
+    RAW, ///< The file offset is the guest physical address; holes are left sparse
+    ELF, ///< An ELF core file with one PT_LOAD segment per range of guest RAM
+};
+
+/**
+ * @brief A range of guest physical address space backed by RAM
+ */
+struct PhysicalMemoryRange {
+    uint64_t address = 0; ///< The guest physical address of the start of the range
+    uint64_t length = 0;  ///< The length of the range in bytes
+};
+
+/**
+ * @brief The results of one MemorySnapshot::capture()
+ */
+struct MemorySnapshotStats {
+    bool full = false;           ///< True if every page was written
+    uint64_t pages = 0;          ///< The number of pages of guest RAM
+    uint64_t written_pages = 0;  ///< The number of pages written to the file
+    uint64_t failed_pages = 0;   ///< Pages that could not be mapped, and were left as they were
+    uint64_t duration_ns = 0;    ///< Wall time spent in capture()
+};
+
+/**
+ * @brief A file holding a copy of all guest physical memory
+ *
+ * Created with Domain::create_memory_snapshot(). The first capture() writes every page. Later
+ * captures hash every page and only write the ones that changed since the previous capture, so
+ * the file is brought up to date in place at the cost of reading guest memory, not rewriting it.
+ *
+ * Pages are copied by several threads, from the persistent guest memory mapping when the
+ * hypervisor supports one. Nothing is paused; pause the domain around capture() for a consistent
+ * copy.
+ */
+class MemorySnapshot {
+  public:
+    /**
+     * @brief Copy guest memory to the file
+     *
+     * @return What was written
+     * @throws CommandFailedException if the file could not be written
+     */
+    virtual MemorySnapshotStats capture() = 0;
+
+    /**
+     * @brief Get the number of completed captures
+     */
+    virtual uint64_t captures() const = 0;
+
+    /**
+     * @brief Get the path of the snapshot file
+     */
+    virtual const std::string& path() const = 0;
+
+    /**
+     * @brief Get the format of the snapshot file
+     */
+    virtual MemorySnapshotFormat format() const = 0;
+
+    virtual ~MemorySnapshot() = default;
+};
+
+} // namespace introvirt
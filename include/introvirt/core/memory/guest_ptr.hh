@@ -22,6 +22,7 @@
 #include <introvirt/core/arch/x86/PageDirectory.hh>
 #include <introvirt/core/domain/Domain.hh>
 #include <introvirt/core/domain/Vcpu.hh>
+#include <introvirt/core/exception/VirtualAddressNotPresentException.hh>
 #include <introvirt/core/fwd.hh>
 #include <introvirt/util/compiler.hh>
 #include <introvirt/util/introvirt_assert.hh>
@@ -29,6 +30,7 @@
 #include <introvirt/windows/common/Utf16String.hh>
 
 #include <cstdint>
+#include <memory>
 #include <ostream>
 #include <string_view>
 
@@ -484,6 +486,47 @@ class basic_guest_ptr : public basic_guest_ptr_members<
         }
     }
 
+    /// Non-throwing resets for virtual pointers
+    // If any page of the target is not present, the pointer is reset to null and false is
+    // returned instead of throwing VirtualAddressNotPresentException. Other errors still throw.
+    // Single
+    template <bool is_array = _is_array_v,
+              typename std::enable_if_t<!is_array && !_Physical>* dummy = nullptr>
+    bool try_reset(const Domain& domain, uint64_t address, uint64_t page_directory) {
+        static_assert(!_is_guest_ptr_t_v, "try_reset() is not supported for guest_ptr_t");
+        if (this->domain_ != &domain || this->page_directory_ != page_directory) {
+            this->domain_ = &domain;
+            this->page_directory_ = page_directory;
+            this->mapping_.reset();
+        }
+        return this->template _reset<false>(address);
+    }
+    // Array
+    template <bool is_array = _is_array_v,
+              typename std::enable_if_t<is_array && !_Physical>* dummy = nullptr>
+    bool try_reset(const Domain& domain, uint64_t address, uint64_t page_directory,
+                   size_t length) {
+        static_assert(!_is_guest_ptr_t_v, "try_reset() is not supported for guest_ptr_t");
+        if (this->domain_ != &domain || this->page_directory_ != page_directory) {
+            this->domain_ = &domain;
+            this->page_directory_ = page_directory;
+            this->mapping_.reset();
+        }
+        return this->template _reset<false>(address, length);
+    }
+    // Single using a vcpu
+    template <bool is_array = _is_array_v,
+              typename std::enable_if_t<!is_array && !_Physical>* dummy = nullptr>
+    bool try_reset(const Vcpu& vcpu, uint64_t address) {
+        return this->try_reset(vcpu.domain(), address, vcpu.registers().cr3());
+    }
+    // Array using a vcpu
+    template <bool is_array = _is_array_v,
+              typename std::enable_if_t<is_array && !_Physical>* dummy = nullptr>
+    bool try_reset(const Vcpu& vcpu, uint64_t address, size_t length) {
+        return this->try_reset(vcpu.domain(), address, vcpu.registers().cr3(), length);
+    }
+
     /// Helper reset methods specifying only an address (and length for arrays)
     // Single
     void reset(uint64_t address) {
@@ -760,55 +803,84 @@ class basic_guest_ptr : public basic_guest_ptr_members<
         }
     }
 
+    // Mappings up to this many pages build their pfn list on the stack
+    static constexpr uint64_t _max_stack_pages = 64;
+
+    // Get room for a pfn list, from the heap if it's too big for the stack buffer
+    static uint64_t* _pfn_buffer(uint64_t page_count, uint64_t (&stack)[_max_stack_pages],
+                                 std::unique_ptr<uint64_t[]>& heap) {
+        if (likely(page_count <= _max_stack_pages))
+            return stack;
+        heap = std::make_unique<uint64_t[]>(page_count);
+        return heap.get();
+    }
+
     // Remap function for physical addresses
-    template <bool Physical = _Physical, typename std::enable_if_t<Physical>* dummy = nullptr>
-    void _remap() {
+    template <bool Throw = true, bool Physical = _Physical,
+              typename std::enable_if_t<Physical>* dummy = nullptr>
+    bool _remap() {
         // Calculate the number of pages required
         const uint64_t buffer_length = this->_buffer_length();
         const uint64_t first_pfn = this->page_number();
         const uint64_t last_pfn = (this->address_ + buffer_length - 1) >> PageDirectory::PAGE_SHIFT;
-        const int page_count = (last_pfn - first_pfn) + 1;
+        const uint64_t page_count = (last_pfn - first_pfn) + 1;
 
-        uint64_t pfns[page_count];
+        uint64_t stack_pfns[_max_stack_pages];
+        std::unique_ptr<uint64_t[]> heap_pfns;
+        uint64_t* pfns = _pfn_buffer(page_count, stack_pfns, heap_pfns);
 
         // Add all of the pages to our pfn_list
         uint64_t pfn = this->page_number();
-        for (int i = 0; i < page_count; ++i) {
+        for (uint64_t i = 0; i < page_count; ++i) {
             pfns[i] = pfn;
             ++pfn;
         }
 
         this->mapping_ = this->domain_->map_pfns(pfns, page_count);
         _reconfigure_buffer();
+        return true;
     }
 
     // Remap function for virtual addresses
-    template <bool Physical = _Physical, typename std::enable_if_t<!Physical>* dummy = nullptr>
-    void _remap() {
+    // If Throw is false, returns false instead of throwing when a page is not present
+    template <bool Throw = true, bool Physical = _Physical,
+              typename std::enable_if_t<!Physical>* dummy = nullptr>
+    bool _remap() {
         // Calculate the number of pages required
         const uint64_t buffer_length = this->_buffer_length();
         const uint64_t first_pfn = this->page_number();
         const uint64_t last_pfn = (this->address_ + buffer_length - 1) >> PageDirectory::PAGE_SHIFT;
-        const int page_count = (last_pfn - first_pfn) + 1;
-
-        uint64_t pfns[page_count];
-
-        // Translate the pages to physical addresses
-        uint64_t va = this->address_ & PageDirectory::PAGE_MASK;
-        for (int i = 0; i < page_count; ++i) {
-            const uint64_t pa =
-                this->domain_->page_directory().translate(va, this->page_directory_);
-            const uint64_t pfn = pa >> PageDirectory::PAGE_SHIFT;
-            pfns[i] = pfn;
-            va += PageDirectory::PAGE_SIZE;
+        const uint64_t page_count = (last_pfn - first_pfn) + 1;
+
+        uint64_t stack_pfns[_max_stack_pages];
+        std::unique_ptr<uint64_t[]> heap_pfns;
+        uint64_t* pfns = _pfn_buffer(page_count, stack_pfns, heap_pfns);
+
+        // Translate the pages to physical addresses in one walk
+        const auto& page_directory = this->domain_->page_directory();
+        const auto runs = page_directory.translate_range(this->address_, page_count,
+                                                         this->page_directory_, pfns, true);
+        if (unlikely(runs.size() != 1 || !runs[0].present)) {
+            if constexpr (Throw) {
+                // Report the page that translate_range() found missing. Walking it again could
+                // give a different answer if the guest changed its page tables in between.
+                const uint64_t missing = runs.back().first_page;
+                throw VirtualAddressNotPresentException(
+                    (this->address_ & PageDirectory::PAGE_MASK) +
+                        (missing << PageDirectory::PAGE_SHIFT),
+                    this->page_directory_);
+            }
+            return false;
         }
 
         // Map and return
         this->mapping_ = this->domain_->map_pfns(pfns, page_count);
         _reconfigure_buffer();
+        return true;
     }
 
-    void _reset(uint64_t address, size_t length = 0) {
+    template <bool Throw = true>
+    bool _reset(uint64_t address, size_t length = 0) {
         if constexpr (_is_guest_ptr_t_v) {
             // Special handling for our wrapped pointer
             if constexpr (_is_array_v) {
@@ -816,17 +888,18 @@ class basic_guest_ptr : public basic_guest_ptr_members<
             } else {
                 this->ptr_.reset(address);
             }
+            return true;
         } else {
             // Clear everything if a null address or length is provided
             if constexpr (_is_array_v) {
                 if (address == 0 || length == 0) {
                     reset();
-                    return;
+                    return true;
                 }
             } else {
                 if (address == 0) {
                     reset();
-                    return;
+                    return true;
                 }
             }
 
@@ -848,7 +921,7 @@ class basic_guest_ptr : public basic_guest_ptr_members<
                             this->length_ = length;
                         }
                         _reconfigure_buffer();
-                        return;
+                        return true;
                     }
                 }
             }
@@ -860,11 +933,15 @@ class basic_guest_ptr : public basic_guest_ptr_members<
 
             // A remap is required
             if constexpr (_is_access_allowed) {
-                this->_remap();
+                if (!this->template _remap<Throw>()) {
+                    reset();
+                    return false;
+                }
             } else {
                 this->mapping_.reset();
                 _reconfigure_buffer();
             }
+            return true;
         }
     }
 
@@ -31,6 +31,9 @@ namespace introvirt {
  * Ideally, the hypervisor library exends this class, and has the hypervisor map in the bitmap page.
  * Then, system call filtering can be performed at the hypervisor level, rather than in
  * libintrovirt.
+ *
+ * All methods are thread safe, and checks never block: entries can be changed while events are
+ * being filtered on other threads.
  */
 class SystemCallFilter {
   public:
@@ -92,6 +95,26 @@ class SystemCallFilter {
      */
     bool matches(const Vcpu& vcpu) const;
 
+    /**
+     * @brief Check if a 32-bit system call number matches the filter
+     *
+     * Unlike the other overloads, this does not consider whether the filter is enabled.
+     *
+     * @param index The raw system call number (the mask is applied)
+     * @return true if the entry is set
+     */
+    bool matches_32(uint32_t index) const;
+
+    /**
+     * @brief Check if a 64-bit system call number matches the filter
+     *
+     * Unlike the other overloads, this does not consider whether the filter is enabled.
+     *
+     * @param index The raw system call number (the mask is applied)
+     * @return true if the entry is set
+     */
+    bool matches_64(uint32_t index) const;
+
     /**
      * @brief Set a filter entry for 32-bit system calls
      *
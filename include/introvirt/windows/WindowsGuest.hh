@@ -99,6 +99,17 @@ class WindowsGuest : public Guest {
      */
     virtual void enable_category(const std::string& category, SystemCallFilter& filter) const = 0;
 
+    /**
+     * @brief Rebuild the index of process page directories now
+     *
+     * Page walks made outside of an event use the index to find the VADs of the address space,
+     * so that pages backed by prototype PTEs can be resolved. The index is otherwise only
+     * rebuilt in the background after a page directory isn't found in it, so the first walk of a
+     * new address space would miss. Call this with the domain paused before walking an address
+     * space outside of an event. It reads every process, so don't call it while polling.
+     */
+    virtual void refresh_process_index() = 0;
+
     virtual ~WindowsGuest() = default;
 
   private:
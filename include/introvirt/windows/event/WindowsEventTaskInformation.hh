@@ -29,6 +29,8 @@ class WindowsEventTaskInformation final : public EventTaskInformation {
 
     std::string process_name() const override;
 
+    uint64_t process_address() const override;
+
     /**
      * @brief Get the Processor Control Region
      *
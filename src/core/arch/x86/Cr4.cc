@@ -40,6 +40,7 @@ static constexpr uint64_t CR4_OSXSAVE = (1 << 18);
 static constexpr uint64_t CR4_SMEP = (1 << 20);
 static constexpr uint64_t CR4_SMAP = (1 << 21);
 static constexpr uint64_t CR4_PKE = (1 << 22);
+static constexpr uint64_t CR4_CET = (1 << 23);
 
 bool Cr4::vme() const { return cr4_ & CR4_VME; }
 bool Cr4::pvi() const { return cr4_ & CR4_PVI; }
@@ -62,6 +63,7 @@ bool Cr4::osxsave() const { return cr4_ & CR4_OSXSAVE; }
 bool Cr4::smep() const { return cr4_ & CR4_SMEP; }
 bool Cr4::smap() const { return cr4_ & CR4_SMAP; }
 bool Cr4::pke() const { return cr4_ & CR4_PKE; }
+bool Cr4::cet() const { return cr4_ & CR4_CET; }
 uint64_t Cr4::value() const { return cr4_; }
 
 Cr4::Cr4(uint64_t cr4) : cr4_(cr4) {}
@@ -0,0 +1,590 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "InstructionEmulator.hh"
+
+#include "core/domain/DomainImpl.hh"
+
+#include <introvirt/core/arch/x86/PageDirectory.hh>
+#include <introvirt/core/arch/x86/Registers.hh>
+#include <introvirt/core/domain/Domain.hh>
+#include <introvirt/core/domain/Vcpu.hh>
+#include <introvirt/core/exception/TraceableException.hh>
+#include <introvirt/core/memory/guest_ptr.hh>
+
+#include <cstring>
+
+namespace introvirt {
+namespace x86 {
+
+namespace {
+
+constexpr uint64_t CARRY_FLAG = 1ull << 0;
+constexpr uint64_t PARITY_FLAG = 1ull << 2;
+constexpr uint64_t ADJUST_FLAG = 1ull << 4;
+constexpr uint64_t ZERO_FLAG = 1ull << 6;
+constexpr uint64_t SIGN_FLAG = 1ull << 7;
+constexpr uint64_t OVERFLOW_FLAG = 1ull << 11;
+constexpr uint64_t ARITHMETIC_FLAGS =
+    CARRY_FLAG | PARITY_FLAG | ADJUST_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG;
+
+constexpr uint8_t RSP_INDEX = 4;
+
+uint64_t read_register(const Registers& regs, uint8_t index) {
+    switch (index) {
+    case 0:
+        return regs.rax();
+    case 1:
+        return regs.rcx();
+    case 2:
+        return regs.rdx();
+    case 3:
+        return regs.rbx();
+    case 4:
+        return regs.rsp();
+    case 5:
+        return regs.rbp();
+    case 6:
+        return regs.rsi();
+    case 7:
+        return regs.rdi();
+    case 8:
+        return regs.r8();
+    case 9:
+        return regs.r9();
+    case 10:
+        return regs.r10();
+    case 11:
+        return regs.r11();
+    case 12:
+        return regs.r12();
+    case 13:
+        return regs.r13();
+    case 14:
+        return regs.r14();
+    default:
+        return regs.r15();
+    }
+}
+
+void set_register(Registers& regs, uint8_t index, uint64_t value) {
+    switch (index) {
+    case 0:
+        return regs.rax(value);
+    case 1:
+        return regs.rcx(value);
+    case 2:
+        return regs.rdx(value);
+    case 3:
+        return regs.rbx(value);
+    case 4:
+        return regs.rsp(value);
+    case 5:
+        return regs.rbp(value);
+    case 6:
+        return regs.rsi(value);
+    case 7:
+        return regs.rdi(value);
+    case 8:
+        return regs.r8(value);
+    case 9:
+        return regs.r9(value);
+    case 10:
+        return regs.r10(value);
+    case 11:
+        return regs.r11(value);
+    case 12:
+        return regs.r12(value);
+    case 13:
+        return regs.r13(value);
+    case 14:
+        return regs.r14(value);
+    default:
+        return regs.r15(value);
+    }
+}
+
+inline uint64_t operand_mask(uint8_t size) { return (size == 8) ? ~0ull : 0xFFFFFFFFull; }
+
+/**
+ * @brief Write a general purpose register the way the hardware would
+ *
+ * 32-bit results are zero extended to 64 bits.
+ */
+inline void write_register(Registers& regs, uint8_t index, uint64_t value, uint8_t size) {
+    set_register(regs, index, value & operand_mask(size));
+}
+
+inline bool canonical(uint64_t address) {
+    return static_cast<uint64_t>(static_cast<int64_t>(address << 16) >> 16) == address;
+}
+
+/**
+ * Access guest memory the way the instruction would, or fail so that the caller steps it instead.
+ *
+ * The access is only done if the processor would complete it without a fault and without
+ * changing the page tables: the page must be present and accessed at every level, its U/S and
+ * R/W bits must allow the access, and a write requires the page to be dirty already. Anything
+ * else (including copy-on-write pages, which are mapped read-only) is left to the real
+ * instruction, so that the guest sees the fault or the accessed and dirty bits get set. The same
+ * goes for frames with a memory access intercept, which watchpoints and write trackers rely on.
+ */
+bool access_memory(Vcpu& vcpu, uint64_t address, void* buffer, uint8_t size, bool write) {
+    if ((address & ~PageDirectory::PAGE_MASK) + size > PageDirectory::PAGE_SIZE)
+        return false;
+
+    const Registers& regs = vcpu.registers();
+    const std::optional<PageDirectory::PageWalk> page =
+        vcpu.domain().page_directory().walk(address, regs.cr3());
+    if (!page || !page->accessed)
+        return false;
+
+    if (regs.ss().dpl() == 3) {
+        if (!page->user)
+            return false;
+    } else if (page->user && regs.cr4().smap() && !regs.rflags().alignment_check()) {
+        return false;
+    }
+
+    if (write && (!page->writable || !page->dirty))
+        return false;
+
+    // Watchpoints and write trackers only see accesses that fault, so let the real one happen
+    auto& domain = static_cast<DomainImpl&>(vcpu.domain());
+    const uint64_t gfn = page->physical_address >> PageDirectory::PAGE_SHIFT;
+    if (domain.watchpoint_manager().intercepted(gfn, write))
+        return false;
+
+    try {
+        guest_phys_ptr<uint8_t[]> ptr(vcpu.domain(), page->physical_address, size);
+        if (write)
+            std::memcpy(ptr.get(), buffer, size);
+        else
+            std::memcpy(buffer, ptr.get(), size);
+    } catch (TraceableException&) {
+        return false;
+    }
+    return true;
+}
+
+template <typename T>
+inline T read_immediate(const uint8_t* bytes) {
+    T result;
+    std::memcpy(&result, bytes, sizeof(T));
+    return result;
+}
+
+} // namespace
+
+bool InstructionEmulator::decode(const uint8_t* bytes, size_t length, bool long_mode) {
+    operation_ = Operation::INVALID;
+    long_mode_ = long_mode;
+    base_ = -1;
+    index_ = -1;
+    scale_ = 0;
+    rip_relative_ = false;
+    displacement_ = 0;
+    immediate_ = 0;
+
+    if (length > MAX_INSTRUCTION_LENGTH)
+        length = MAX_INSTRUCTION_LENGTH;
+
+    size_t pos = 0;
+    auto available = [&](size_t count) { return pos + count <= length; };
+
+    // Only the operand size prefix is accepted, and only for NOPs.
+    // Segment overrides, LOCK and REP all change what an instruction does.
+    bool operand_size_prefix = false;
+    while (available(1) && bytes[pos] == 0x66) {
+        operand_size_prefix = true;
+        ++pos;
+    }
+
+    // In 32-bit mode 0x40-0x4F are INC/DEC, which we don't emulate
+    uint8_t rex = 0;
+    if (long_mode && available(1) && (bytes[pos] & 0xF0) == 0x40)
+        rex = bytes[pos++];
+
+    const bool rex_w = rex & 0x8;
+    const bool rex_r = rex & 0x4;
+    const bool rex_x = rex & 0x2;
+    const bool rex_b = rex & 0x1;
+
+    if (!available(1))
+        return false;
+    const uint8_t opcode = bytes[pos++];
+    operand_size_ = rex_w ? 8 : 4;
+
+    bool has_memory = false;
+    auto decode_modrm = [&]() -> bool {
+        if (!available(1))
+            return false;
+        const uint8_t modrm = bytes[pos++];
+        const uint8_t mod = modrm >> 6;
+        const uint8_t rm = modrm & 0x7;
+        reg_ = ((modrm >> 3) & 0x7) | (rex_r ? 8 : 0);
+
+        if (mod == 3) {
+            rm_ = rm | (rex_b ? 8 : 0);
+            has_memory = false;
+            return true;
+        }
+        has_memory = true;
+
+        bool disp32 = (mod == 2);
+        if (rm == 4) {
+            // SIB byte
+            if (!available(1))
+                return false;
+            const uint8_t sib = bytes[pos++];
+            const uint8_t index = ((sib >> 3) & 0x7) | (rex_x ? 8 : 0);
+            const uint8_t base = sib & 0x7;
+
+            scale_ = 1 << (sib >> 6);
+            if (index != RSP_INDEX)
+                index_ = index;
+            if (base == 5 && mod == 0)
+                disp32 = true;
+            else
+                base_ = base | (rex_b ? 8 : 0);
+        } else if (rm == 5 && mod == 0) {
+            // RIP relative in 64-bit mode, an absolute address otherwise
+            rip_relative_ = long_mode;
+            disp32 = true;
+        } else {
+            base_ = rm | (rex_b ? 8 : 0);
+        }
+
+        if (mod == 1) {
+            if (!available(1))
+                return false;
+            displacement_ = read_immediate<int8_t>(bytes + pos);
+            pos += 1;
+        } else if (disp32) {
+            if (!available(4))
+                return false;
+            displacement_ = read_immediate<int32_t>(bytes + pos);
+            pos += 4;
+        }
+        return true;
+    };
+
+    // Memory operands must be on the stack
+    auto stack_operand = [&]() { return has_memory && base_ == RSP_INDEX && !rip_relative_; };
+
+    Operation operation = Operation::INVALID;
+
+    if (opcode == 0x90) {
+        // With REX.B this is XCHG R8, RAX
+        if (!rex_b)
+            operation = Operation::NOP;
+    } else if (opcode == 0x0F) {
+        if (available(1) && bytes[pos] == 0x1F) {
+            ++pos;
+            if (decode_modrm() && (reg_ & 0x7) == 0)
+                operation = Operation::NOP;
+        }
+    } else if (operand_size_prefix) {
+        // 16-bit operands are not supported
+    } else if (opcode == 0x89 || opcode == 0x8B) {
+        if (decode_modrm()) {
+            if (!has_memory) {
+                // MOV_REG is reg_ <- rm_
+                if (opcode == 0x89)
+                    std::swap(reg_, rm_);
+                operation = Operation::MOV_REG;
+            } else if (stack_operand()) {
+                operation = (opcode == 0x89) ? Operation::MOV_STORE : Operation::MOV_LOAD;
+            }
+        }
+    } else if (opcode == 0xC7) {
+        if (decode_modrm() && !has_memory && (reg_ & 0x7) == 0 && available(4)) {
+            immediate_ = read_immediate<int32_t>(bytes + pos);
+            pos += 4;
+            operation = Operation::MOV_IMM;
+        }
+    } else if (opcode >= 0xB8 && opcode <= 0xBF) {
+        rm_ = (opcode & 0x7) | (rex_b ? 8 : 0);
+        if (rex_w) {
+            if (available(8)) {
+                immediate_ = read_immediate<int64_t>(bytes + pos);
+                pos += 8;
+                operation = Operation::MOV_IMM;
+            }
+        } else if (available(4)) {
+            immediate_ = read_immediate<uint32_t>(bytes + pos);
+            pos += 4;
+            operation = Operation::MOV_IMM;
+        }
+    } else if (opcode == 0x8D) {
+        if (decode_modrm() && has_memory)
+            operation = Operation::LEA;
+    } else if (opcode == 0x81 || opcode == 0x83) {
+        static constexpr AluOp group1[8] = {AluOp::ADD, AluOp::OR,  AluOp::ADD, AluOp::ADD,
+                                            AluOp::AND, AluOp::SUB, AluOp::XOR, AluOp::CMP};
+        if (decode_modrm() && !has_memory) {
+            const uint8_t op = reg_ & 0x7;
+            const size_t immediate_size = (opcode == 0x81) ? 4 : 1;
+            // ADC and SBB depend on the carry flag, leave them to the hardware
+            if (op != 2 && op != 3 && available(immediate_size)) {
+                if (opcode == 0x81)
+                    immediate_ = read_immediate<int32_t>(bytes + pos);
+                else
+                    immediate_ = read_immediate<int8_t>(bytes + pos);
+                pos += immediate_size;
+                alu_ = group1[op];
+                operation = Operation::ALU_IMM;
+            }
+        }
+    } else if (opcode == 0x01 || opcode == 0x03 || opcode == 0x09 || opcode == 0x0B ||
+               opcode == 0x21 || opcode == 0x23 || opcode == 0x29 || opcode == 0x2B ||
+               opcode == 0x31 || opcode == 0x33 || opcode == 0x39 || opcode == 0x3B ||
+               opcode == 0x85) {
+        if (decode_modrm() && !has_memory) {
+            switch (opcode & 0xF8) {
+            case 0x00:
+                alu_ = AluOp::ADD;
+                break;
+            case 0x08:
+                alu_ = AluOp::OR;
+                break;
+            case 0x20:
+                alu_ = AluOp::AND;
+                break;
+            case 0x28:
+                alu_ = AluOp::SUB;
+                break;
+            case 0x30:
+                alu_ = AluOp::XOR;
+                break;
+            case 0x38:
+                alu_ = AluOp::CMP;
+                break;
+            default:
+                alu_ = AluOp::TEST;
+                break;
+            }
+            // ALU_REG is rm_ <- rm_ op reg_, so swap for the "reg, r/m" forms
+            if ((opcode & 0x2) && opcode != 0x85)
+                std::swap(reg_, rm_);
+            operation = Operation::ALU_REG;
+        }
+    } else if (opcode >= 0x50 && opcode <= 0x57) {
+        rm_ = (opcode & 0x7) | (rex_b ? 8 : 0);
+        operation = Operation::PUSH;
+    } else if (opcode >= 0x58 && opcode <= 0x5F) {
+        rm_ = (opcode & 0x7) | (rex_b ? 8 : 0);
+        operation = Operation::POP;
+    } else if (opcode == 0xEB) {
+        if (available(1)) {
+            immediate_ = read_immediate<int8_t>(bytes + pos);
+            pos += 1;
+            operation = Operation::JMP;
+        }
+    } else if (opcode == 0xE9 || opcode == 0xE8) {
+        if (available(4)) {
+            immediate_ = read_immediate<int32_t>(bytes + pos);
+            pos += 4;
+            operation = (opcode == 0xE9) ? Operation::JMP : Operation::CALL;
+        }
+    } else if (opcode == 0xC3) {
+        operation = Operation::RET;
+    } else if (opcode == 0xC2) {
+        if (available(2)) {
+            immediate_ = read_immediate<uint16_t>(bytes + pos);
+            pos += 2;
+            operation = Operation::RET;
+        }
+    }
+
+    // Stack operations always use the natural width
+    if (operation == Operation::PUSH || operation == Operation::POP ||
+        operation == Operation::CALL || operation == Operation::RET) {
+        operand_size_ = long_mode ? 8 : 4;
+    }
+
+    operation_ = operation;
+    length_ = pos;
+    return operation_ != Operation::INVALID;
+}
+
+uint64_t InstructionEmulator::effective_address(const Registers& regs, uint64_t next_rip) const {
+    uint64_t result = displacement_;
+    if (rip_relative_)
+        result += next_rip;
+    if (base_ >= 0)
+        result += read_register(regs, base_);
+    if (index_ >= 0)
+        result += read_register(regs, index_) * scale_;
+
+    if (!long_mode_)
+        result &= 0xFFFFFFFF;
+    return result;
+}
+
+bool InstructionEmulator::execute(Vcpu& vcpu) const {
+    auto& regs = vcpu.registers();
+    const uint64_t address_mask = long_mode_ ? ~0ull : 0xFFFFFFFFull;
+    const uint64_t rip = regs.rip();
+    uint64_t next_rip = (rip + length_) & address_mask;
+
+    // Helpers for the stack, which is assumed to be flat in 32-bit mode
+    const uint64_t rsp = regs.rsp();
+    const uint64_t stack_pointer = rsp & address_mask;
+    auto set_stack_pointer = [&](uint64_t value) {
+        regs.rsp((rsp & ~address_mask) | (value & address_mask));
+    };
+    auto memory = [&](uint64_t address, void* buffer, bool write) {
+        address &= address_mask;
+        if (long_mode_ && !canonical(address))
+            return false;
+        return access_memory(vcpu, address, buffer, operand_size_, write);
+    };
+
+    // CALL and RET also push and pop the CET shadow stack, which isn't emulated. Leaving it out
+    // of sync would fail the next RET with #CP.
+    if ((operation_ == Operation::CALL || operation_ == Operation::RET) && regs.cr4().cet())
+        return false;
+
+    switch (operation_) {
+    case Operation::NOP:
+        break;
+    case Operation::MOV_REG:
+        write_register(regs, reg_, read_register(regs, rm_), operand_size_);
+        break;
+    case Operation::MOV_IMM:
+        write_register(regs, rm_, immediate_, operand_size_);
+        break;
+    case Operation::MOV_LOAD: {
+        uint64_t value = 0;
+        if (!memory(effective_address(regs, next_rip), &value, false))
+            return false;
+        write_register(regs, reg_, value, operand_size_);
+        break;
+    }
+    case Operation::MOV_STORE: {
+        uint64_t value = read_register(regs, reg_);
+        if (!memory(effective_address(regs, next_rip), &value, true))
+            return false;
+        break;
+    }
+    case Operation::LEA:
+        write_register(regs, reg_, effective_address(regs, next_rip), operand_size_);
+        break;
+    case Operation::ALU_REG:
+    case Operation::ALU_IMM: {
+        const uint64_t mask = operand_mask(operand_size_);
+        const uint64_t sign = 1ull << (operand_size_ * 8 - 1);
+        const uint64_t a = read_register(regs, rm_) & mask;
+        const uint64_t b =
+            ((operation_ == Operation::ALU_REG) ? read_register(regs, reg_) : immediate_) & mask;
+
+        uint64_t result;
+        uint64_t flags = 0;
+        switch (alu_) {
+        case AluOp::ADD:
+            result = (a + b) & mask;
+            if (result < a)
+                flags |= CARRY_FLAG;
+            if ((a ^ result) & (b ^ result) & sign)
+                flags |= OVERFLOW_FLAG;
+            flags |= (a ^ b ^ result) & ADJUST_FLAG;
+            break;
+        case AluOp::SUB:
+        case AluOp::CMP:
+            result = (a - b) & mask;
+            if (a < b)
+                flags |= CARRY_FLAG;
+            if ((a ^ b) & (a ^ result) & sign)
+                flags |= OVERFLOW_FLAG;
+            flags |= (a ^ b ^ result) & ADJUST_FLAG;
+            break;
+        case AluOp::OR:
+            result = a | b;
+            break;
+        case AluOp::XOR:
+            result = a ^ b;
+            break;
+        case AluOp::AND:
+        case AluOp::TEST:
+        default:
+            result = a & b;
+            break;
+        }
+
+        if (result == 0)
+            flags |= ZERO_FLAG;
+        if (result & sign)
+            flags |= SIGN_FLAG;
+        if (!__builtin_parity(result & 0xFF))
+            flags |= PARITY_FLAG;
+
+        if (alu_ != AluOp::CMP && alu_ != AluOp::TEST)
+            write_register(regs, rm_, result, operand_size_);
+
+        auto& rflags = regs.rflags();
+        rflags.value((rflags.value() & ~ARITHMETIC_FLAGS) | flags);
+        break;
+    }
+    case Operation::PUSH: {
+        uint64_t value = read_register(regs, rm_);
+        const uint64_t target = stack_pointer - operand_size_;
+        if (!memory(target, &value, true))
+            return false;
+        set_stack_pointer(target);
+        break;
+    }
+    case Operation::POP: {
+        uint64_t value = 0;
+        if (!memory(stack_pointer, &value, false))
+            return false;
+        // POP RSP loads the value after the increment
+        set_stack_pointer(stack_pointer + operand_size_);
+        write_register(regs, rm_, value, operand_size_);
+        break;
+    }
+    case Operation::JMP:
+        next_rip = (next_rip + immediate_) & address_mask;
+        break;
+    case Operation::CALL: {
+        uint64_t value = next_rip;
+        const uint64_t target = stack_pointer - operand_size_;
+        if (!memory(target, &value, true))
+            return false;
+        set_stack_pointer(target);
+        next_rip = (next_rip + immediate_) & address_mask;
+        break;
+    }
+    case Operation::RET: {
+        uint64_t value = 0;
+        if (!memory(stack_pointer, &value, false))
+            return false;
+        if (long_mode_ && !canonical(value))
+            return false;
+        set_stack_pointer(stack_pointer + operand_size_ + immediate_);
+        next_rip = value & address_mask;
+        break;
+    }
+    case Operation::INVALID:
+    default:
+        return false;
+    }
+
+    regs.rip(next_rip);
+    return true;
+}
+
+} // namespace x86
+} // namespace introvirt
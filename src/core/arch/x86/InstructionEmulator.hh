@@ -0,0 +1,124 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/fwd.hh>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace introvirt {
+namespace x86 {
+
+class Registers;
+
+/**
+ * @brief Decodes and executes a small set of common instructions against a vcpu
+ *
+ * This is used to move a vcpu past a breakpoint without restoring the original byte and single
+ * stepping, which requires every other vcpu to be paused. Only instructions with no side effects
+ * beyond general purpose registers, RIP, the arithmetic flags and the stack are supported:
+ *
+ * - NOP and the multi-byte NOP (0F 1F)
+ * - MOV between registers, MOV of an immediate to a register, and MOV to/from [RSP+disp]
+ * - LEA
+ * - ADD, OR, AND, SUB, XOR, CMP and TEST between registers or with an immediate
+ * - PUSH/POP of a register
+ * - JMP rel8/rel32, CALL rel32 and RET
+ *
+ * Anything else is rejected by decode(), and the caller falls back to stepping the real
+ * instruction. Memory accesses go through a hardware-style page walk, and execute() gives up
+ * instead of doing an access that would fault or change the page tables: the page must be
+ * present, accessed, permitted for the current privilege level, and already dirty for a store.
+ * Read-only copy-on-write pages are therefore never written. Accesses to a frame with a
+ * watchpoint or write tracker on it are also refused, since the hypervisor would never see them.
+ */
+class InstructionEmulator final {
+  public:
+    /**
+     * @brief The longest possible x86 instruction
+     */
+    static constexpr size_t MAX_INSTRUCTION_LENGTH = 15;
+
+    /**
+     * @brief Decode an instruction
+     *
+     * @param bytes The instruction bytes
+     * @param length The number of valid bytes in the buffer
+     * @param long_mode True if the instruction is executing in 64-bit mode
+     * @return true if the instruction is supported and fits in the buffer
+     */
+    bool decode(const uint8_t* bytes, size_t length, bool long_mode);
+
+    /**
+     * @brief Execute the decoded instruction
+     *
+     * Registers are only modified if the instruction completes. CALL and RET are refused while
+     * CR4.CET is set, since the shadow stack isn't emulated.
+     *
+     * @param vcpu The vcpu to execute the instruction on. RIP must be at the instruction.
+     * @return false if the instruction could not be completed (for example, the stack is not
+     * present), in which case the vcpu is left unchanged
+     */
+    bool execute(Vcpu& vcpu) const;
+
+    /**
+     * @brief Get the length of the decoded instruction
+     */
+    uint8_t length() const { return length_; }
+
+  private:
+    enum class Operation : uint8_t {
+        INVALID,
+        NOP,
+        MOV_REG,   // reg <- rm (register)
+        MOV_IMM,   // rm <- imm
+        MOV_LOAD,  // reg <- [mem]
+        MOV_STORE, // [mem] <- reg
+        LEA,
+        ALU_REG,   // rm <- rm op reg
+        ALU_IMM,   // rm <- rm op imm
+        PUSH,
+        POP,
+        JMP,
+        CALL,
+        RET,
+    };
+
+    enum class AluOp : uint8_t { ADD, OR, AND, SUB, XOR, CMP, TEST };
+
+    uint64_t effective_address(const Registers& regs, uint64_t next_rip) const;
+
+    Operation operation_ = Operation::INVALID;
+    AluOp alu_ = AluOp::ADD;
+    uint8_t length_ = 0;
+    uint8_t operand_size_ = 0; // In bytes
+    uint8_t reg_ = 0;
+    uint8_t rm_ = 0;
+    bool long_mode_ = false;
+
+    // Memory operand
+    int8_t base_ = -1;
+    int8_t index_ = -1;
+    uint8_t scale_ = 0;
+    bool rip_relative_ = false;
+    int64_t displacement_ = 0;
+
+    int64_t immediate_ = 0;
+};
+
+} // namespace x86
+} // namespace introvirt
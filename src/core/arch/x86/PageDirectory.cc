@@ -13,6 +13,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include "TranslationCache.hh"
 #include "core/domain/DomainImpl.hh"
 #include "core/domain/GuestImpl.hh"
 #include "core/domain/VcpuImpl.hh"
@@ -24,6 +25,7 @@
 
 #include <log4cxx/logger.h>
 
+#include <algorithm>
 #include <iostream>
 
 namespace introvirt {
@@ -162,11 +164,84 @@ class PageTableEntry {
     uint64_t value_;
 };
 
+/**
+ * @brief Reads page table entries for a walk
+ *
+ * The table page is kept mapped while consecutive reads stay on it. Unless accessed bits are
+ * being set, table pages are mapped read-only and nothing is ever written to the guest.
+ */
+class PageTableReader {
+  public:
+    /**
+     * @brief Read the entry at a guest physical address
+     */
+    uint64_t read(uint64_t physical_address) {
+        const uint64_t pfn = physical_address >> PageDirectory::PAGE_SHIFT;
+        if (!mapping_ || pfn != pfn_) {
+            mapping_ = writable_ ? domain_.map_pfns(&pfn, 1) : domain_.map_pfns_read_only(&pfn, 1);
+            pfn_ = pfn;
+        }
+        entry_ = static_cast<char*>(mapping_->get()) +
+                 (physical_address & ~PageDirectory::PAGE_MASK);
+
+        if (pte_size_ == 8)
+            return __atomic_load_n(reinterpret_cast<uint64_t*>(entry_), __ATOMIC_RELAXED);
+        return __atomic_load_n(reinterpret_cast<uint32_t*>(entry_), __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief Set the accessed bit in the entry last read, if enabled
+     *
+     * This is atomic so that it can't lose an update the processor makes at the same time.
+     */
+    void set_accessed() {
+        if (!writable_)
+            return;
+        if (pte_size_ == 8)
+            __atomic_fetch_or(reinterpret_cast<uint64_t*>(entry_), 1ull << 5, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_or(reinterpret_cast<uint32_t*>(entry_), 1u << 5, __ATOMIC_RELAXED);
+    }
+
+    PageTableReader(const DomainImpl& domain, int pte_size, bool writable)
+        : domain_(domain), pte_size_(pte_size), writable_(writable) {}
+
+  private:
+    const DomainImpl& domain_;
+    const int pte_size_;
+    const bool writable_;
+
+    std::shared_ptr<GuestMemoryMapping> mapping_;
+    uint64_t pfn_ = 0;
+    char* entry_ = nullptr;
+};
+
+uint64_t PageDirectory::root(uint64_t page_directory) const {
+    return page_directory & ((pt_levels_ == 3) ? 0xFFFFFFE0 : 0x7FFFFFFFFFFFF000LL);
+}
+
 uint64_t PageDirectory::translate(uint64_t virtual_address, uint64_t page_directory) const {
+    const std::optional<uint64_t> result = try_translate(virtual_address, page_directory);
+    if (unlikely(!result))
+        throw VirtualAddressNotPresentException(virtual_address, page_directory);
+    return *result;
+}
+
+std::optional<uint64_t> PageDirectory::try_translate(uint64_t virtual_address,
+                                                     uint64_t page_directory) const {
+    const bool use_cache = cacheable(root(page_directory));
+    TranslationCache::Ticket ticket;
+
+    if (use_cache) {
+        uint64_t result;
+        if (likely(cache_->lookup(root(page_directory), virtual_address & va_mask_, result)))
+            return result;
+        ticket = cache_->begin_walk(root(page_directory));
+    }
 
 retry:
     uint64_t virt = virtual_address & va_mask_;
-    uint64_t paddr = page_directory & ((pt_levels_ == 3) ? 0xFFFFFFE0 : 0x7FFFFFFFFFFFF000LL);
+    uint64_t paddr = root(page_directory);
     uint64_t mask = mask_;
 
     PageTableEntry pte(0);
@@ -176,14 +251,14 @@ retry:
     /*
      *  Walk the page tables
      */
-    guest_phys_ptr<guest_size_t> pte_mapping;
+    PageTableReader reader(static_cast<const DomainImpl&>(domain_), pte_size_,
+                           accessed_bits_.load(std::memory_order_relaxed));
     for (int level = pt_levels_; level > 0; level--) {
         // Offset to the correct PTE
         paddr += ((virt & mask) >> (__builtin_ffsll(mask) - 1)) * pte_size_;
 
         // Read in the PTE
-        pte_mapping.reset(pte_size_ == 8, domain_, paddr);
-        uint64_t pte_val = *pte_mapping;
+        uint64_t pte_val = reader.read(paddr);
         pte = PageTableEntry(pte_val);
         if (unlikely(pte.present() == false)) {
             if (likely(domain_.guest() != nullptr)) {
@@ -197,15 +272,15 @@ retry:
                 case GuestPageFaultResult::RETRY:
                     goto retry;
                 case GuestPageFaultResult::FAILURE:
-                    throw VirtualAddressNotPresentException(virtual_address, page_directory);
+                    return std::nullopt;
                 }
             } else {
-                throw VirtualAddressNotPresentException(virtual_address, page_directory);
+                return std::nullopt;
             }
         }
 
         if (update_pte)
-            pte_mapping.set(pte_mapping.get() | (1 << 5));
+            reader.set_accessed();
 
         // Read the address provided in the PTE
         paddr = pte.physical_address();
@@ -214,16 +289,215 @@ retry:
             if ((level == 2 || (level == 3 && pt_levels_ == 4))) {
                 mask = ((mask ^ ~-mask) >> 1); /* All bits below first set bit */
 
+                // Translations fixed up by the guest handler are not real page table state
+                if (use_cache && update_pte)
+                    cache_->insert(ticket, root(page_directory), virt, paddr & ~mask,
+                                   __builtin_popcountll(mask));
+
                 return ((paddr & ~mask) | (virt & mask));
             }
         }
         mask >>= (pt_levels_ == 2 ? 10 : 9);
     }
 
+    if (use_cache && update_pte)
+        cache_->insert(ticket, root(page_directory), virt, paddr & PAGE_MASK, PAGE_SHIFT);
+
     // Done
     return (paddr & PAGE_MASK) | (virt & ~PAGE_MASK);
 }
 
+std::optional<PageDirectory::PageWalk> PageDirectory::walk(uint64_t virtual_address,
+                                                          uint64_t page_directory) const {
+    const uint64_t virt = virtual_address & va_mask_;
+    uint64_t paddr = root(page_directory);
+    uint64_t mask = mask_;
+
+    PageWalk result;
+    result.writable = true;
+    result.user = true;
+    result.accessed = true;
+
+    PageTableReader reader(static_cast<const DomainImpl&>(domain_), pte_size_, false);
+    for (int level = pt_levels_; level > 0; level--) {
+        paddr += ((virt & mask) >> (__builtin_ffsll(mask) - 1)) * pte_size_;
+
+        PageTableEntry pte(reader.read(paddr));
+        if (!pte.present())
+            return std::nullopt;
+
+        // PAE PDPTEs are loaded with CR3 and don't have permission or accessed bits
+        if (!(pt_levels_ == 3 && level == 3)) {
+            result.writable &= pte.writable();
+            result.user &= pte.user();
+            result.accessed &= pte.accessed();
+        }
+
+        paddr = pte.physical_address();
+
+        if (pte.huge() && (level == 2 || (level == 3 && pt_levels_ == 4))) {
+            mask = ((mask ^ ~-mask) >> 1); /* All bits below first set bit */
+            result.dirty = pte.dirty();
+            result.physical_address = (paddr & ~mask) | (virt & mask);
+            return result;
+        }
+        if (level == 1)
+            result.dirty = pte.dirty();
+        mask >>= (pt_levels_ == 2 ? 10 : 9);
+    }
+
+    result.physical_address = (paddr & PAGE_MASK) | (virt & ~PAGE_MASK);
+    return result;
+}
+
+std::vector<PageDirectory::PageRun>
+PageDirectory::translate_range(uint64_t virtual_address, uint64_t page_count,
+                               uint64_t page_directory, uint64_t* pfns,
+                               bool stop_at_absent) const {
+    std::vector<PageRun> runs;
+    if (unlikely(page_count == 0))
+        return runs;
+
+    const uint64_t table_root = root(page_directory);
+    const bool use_cache = cacheable(table_root);
+
+    // The index mask for each level, and the bits above it that select the table at that level
+    uint64_t masks[5] = {};
+    uint64_t tag_masks[5] = {};
+    {
+        uint64_t mask = mask_;
+        for (int level = pt_levels_; level > 0; level--) {
+            masks[level] = mask;
+            tag_masks[level] = va_mask_ & ~(mask | (mask - 1));
+            mask >>= (pt_levels_ == 2 ? 10 : 9);
+        }
+    }
+
+    // The table each level was read from for the previous page
+    struct KnownTable {
+        uint64_t table;
+        uint64_t tag;
+        bool valid;
+    };
+    KnownTable known[5] = {};
+
+    PageTableReader reader(static_cast<const DomainImpl&>(domain_), pte_size_,
+                           accessed_bits_.load(std::memory_order_relaxed));
+    uint64_t va = virtual_address & PAGE_MASK;
+    for (uint64_t i = 0; i < page_count; ++i, va += PAGE_SIZE) {
+        const uint64_t virt = va & va_mask_;
+        std::optional<uint64_t> result;
+        TranslationCache::Ticket ticket;
+        uint64_t paddr;
+        bool update_pte;
+        int level;
+        int absent_level = 0;
+
+        if (use_cache) {
+            uint64_t cached;
+            if (cache_->lookup(table_root, virt, cached)) {
+                result = cached;
+                goto found;
+            }
+            ticket = cache_->begin_walk(table_root);
+        }
+
+    retry:
+        // Start at the lowest level that is still valid for this address
+        level = pt_levels_;
+        paddr = table_root;
+        for (int l = 1; l < pt_levels_; ++l) {
+            if (known[l].valid && known[l].tag == (virt & tag_masks[l])) {
+                level = l;
+                paddr = known[l].table;
+                break;
+            }
+        }
+
+        update_pte = true;
+        for (; level > 0; level--) {
+            const uint64_t mask = masks[level];
+
+            // Tables found through a PTE the guest handler fixed up can't be reused
+            known[level] = KnownTable{paddr, virt & tag_masks[level], update_pte};
+
+            // Offset to the correct PTE
+            paddr += ((virt & mask) >> (__builtin_ffsll(mask) - 1)) * pte_size_;
+
+            // Read in the PTE
+            uint64_t pte_val = reader.read(paddr);
+            PageTableEntry pte(pte_val);
+            if (unlikely(pte.present() == false)) {
+                if (likely(domain_.guest() != nullptr)) {
+                    // Let the guest handler give it a try
+                    switch (
+                        domain_.guest()->impl().handle_page_fault(va, page_directory, pte_val)) {
+                    case GuestPageFaultResult::PTE_FIXED:
+                        pte = PageTableEntry(pte_val);
+                        update_pte = false;
+                        break;
+                    case GuestPageFaultResult::RETRY:
+                        for (auto& entry : known)
+                            entry.valid = false;
+                        goto retry;
+                    case GuestPageFaultResult::FAILURE:
+                        absent_level = level;
+                        goto found;
+                    }
+                } else {
+                    absent_level = level;
+                    goto found;
+                }
+            }
+
+            if (update_pte)
+                reader.set_accessed();
+
+            // Read the address provided in the PTE
+            paddr = pte.physical_address();
+
+            if (pte.huge() && (level == 2 || (level == 3 && pt_levels_ == 4))) {
+                // All bits below the first set bit
+                const uint64_t page_mask = ((mask ^ ~-mask) >> 1);
+                if (use_cache && update_pte)
+                    cache_->insert(ticket, table_root, virt, paddr & ~page_mask,
+                                   __builtin_popcountll(page_mask));
+                result = (paddr & ~page_mask) | (virt & page_mask);
+                goto found;
+            }
+        }
+
+        if (use_cache && update_pte)
+            cache_->insert(ticket, table_root, virt, paddr & PAGE_MASK, PAGE_SHIFT);
+        result = (paddr & PAGE_MASK) | (virt & ~PAGE_MASK);
+
+    found:
+        pfns[i] = result ? (*result >> PAGE_SHIFT) : 0;
+
+        const bool present = result.has_value();
+        if (!runs.empty() && runs.back().present == present)
+            ++runs.back().page_count;
+        else
+            runs.push_back(PageRun{i, 1, present});
+
+        if (!present && stop_at_absent)
+            break;
+
+        if (absent_level > 1) {
+            // Nothing under a missing table is present, skip to the end of what it would map
+            const uint64_t span = 1ull << (__builtin_ffsll(masks[absent_level]) - 1);
+            const uint64_t skipped = std::min(((virt | (span - 1)) - virt) >> PAGE_SHIFT,
+                                              page_count - i - 1);
+            std::fill_n(pfns + i + 1, skipped, 0);
+            runs.back().page_count += skipped;
+            i += skipped;
+            va += skipped * PAGE_SIZE;
+        }
+    }
+
+    return runs;
+}
+
 void PageDirectory::reconfigure(const Vcpu& vcpu) {
     const Registers& regs = vcpu.registers();
     if (regs.efer().lma()) {
@@ -251,9 +525,60 @@ void PageDirectory::reconfigure(const Vcpu& vcpu) {
         pte_size_ = 4;
         break;
     }
+
+    pcid_ = regs.cr4().pcide();
+    cache_->configure(pt_levels_);
+}
+
+bool PageDirectory::cacheable(uint64_t table_root) const {
+    if (!cache_enabled_.load(std::memory_order_relaxed))
+        return false;
+    if (unlikely(pcid_.load(std::memory_order_relaxed) || !cache_->active(table_root))) {
+        cache_->count_bypass();
+        return false;
+    }
+    return true;
+}
+
+void PageDirectory::translation_cache(bool enabled) {
+    // CR3 writes weren't intercepted while the cache was off, so the loaded roots are unknown
+    cache_->reset_roots();
+    cache_->flush();
+    cache_enabled_ = enabled;
+    LOG4CXX_DEBUG(logger, "Translation cache " << (enabled ? "enabled" : "disabled"));
+}
+
+bool PageDirectory::translation_cache() const { return cache_enabled_; }
+
+void PageDirectory::accessed_bits(bool enabled) {
+    accessed_bits_ = enabled;
+    LOG4CXX_DEBUG(logger, "Page walk accessed bits " << (enabled ? "enabled" : "disabled"));
+}
+
+bool PageDirectory::accessed_bits() const { return accessed_bits_; }
+
+void PageDirectory::flush() const { cache_->flush(); }
+
+void PageDirectory::invalidate(uint64_t page_directory) const {
+    cache_->invalidate_root(root(page_directory));
+}
+
+void PageDirectory::load(uint32_t vcpu_id, uint64_t page_directory, bool pcid) const {
+    if (unlikely(pcid && !pcid_.exchange(true, std::memory_order_relaxed)))
+        LOG4CXX_DEBUG(logger, "CR4.PCIDE is set, bypassing the translation cache");
+    cache_->load_root(vcpu_id, root(page_directory));
+}
+
+void PageDirectory::invalidate_page(uint64_t virtual_address) const {
+    cache_->invalidate_address(virtual_address & va_mask_);
+}
+
+PageDirectory::TranslationCacheStats PageDirectory::translation_cache_stats() const {
+    return cache_->stats();
 }
 
-PageDirectory::PageDirectory(Domain& domain) : domain_(domain) {}
+PageDirectory::PageDirectory(Domain& domain)
+    : domain_(domain), cache_(std::make_unique<TranslationCache>()) {}
 
 PageDirectory::~PageDirectory() = default;
 
@@ -0,0 +1,238 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "TranslationCache.hh"
+
+namespace introvirt {
+namespace x86 {
+
+static inline uint64_t make_tag(uint64_t virtual_address, unsigned int page_shift) {
+    return (virtual_address & ~((1ull << page_shift) - 1)) | page_shift;
+}
+
+unsigned int TranslationCache::set_index(uint64_t tag) {
+    const uint64_t page = tag >> PageDirectory::PAGE_SHIFT;
+    return ((page ^ (page >> 10) ^ (tag & 0x3F)) * 0x9E3779B97F4A7C15ull >> 54) % SET_COUNT;
+}
+
+unsigned int TranslationCache::root_epoch_index(uint64_t root) {
+    return ((root >> PageDirectory::PAGE_SHIFT) * 0x9E3779B97F4A7C15ull >> 56) % ROOT_EPOCH_COUNT;
+}
+
+bool TranslationCache::probe(uint64_t root, uint64_t tag, uint64_t& physical_base) const {
+    const Set& set = sets_[set_index(tag)];
+    const uint64_t generation = generation_.load(std::memory_order_acquire);
+    const uint32_t root_epoch =
+        root_epochs_[root_epoch_index(root)].load(std::memory_order_acquire);
+
+    for (const Entry& entry : set.ways) {
+        const uint32_t seq = entry.seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            continue;
+
+        const bool match = entry.tag.load(std::memory_order_relaxed) == tag &&
+                           entry.root.load(std::memory_order_relaxed) == root &&
+                           entry.generation.load(std::memory_order_relaxed) == generation &&
+                           entry.root_epoch.load(std::memory_order_relaxed) == root_epoch;
+        const uint64_t base = entry.physical_base.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (match && entry.seq.load(std::memory_order_relaxed) == seq) {
+            physical_base = base;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TranslationCache::lookup(uint64_t root, uint64_t virtual_address,
+                              uint64_t& physical_address) const {
+    for (const auto& shift_value : shifts_) {
+        const unsigned int shift = shift_value.load(std::memory_order_relaxed);
+        if (shift == 0)
+            break;
+
+        uint64_t base;
+        if (probe(root, make_tag(virtual_address, shift), base)) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            physical_address = base | (virtual_address & ((1ull << shift) - 1));
+            return true;
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+TranslationCache::Ticket TranslationCache::begin_walk(uint64_t root) const {
+    Ticket result;
+    result.generation = generation_.load(std::memory_order_acquire);
+    result.address_invalidations = address_invalidations_.load(std::memory_order_acquire);
+    result.root_epoch = root_epochs_[root_epoch_index(root)].load(std::memory_order_acquire);
+    return result;
+}
+
+void TranslationCache::insert(const Ticket& ticket, uint64_t root, uint64_t virtual_address,
+                              uint64_t physical_base, unsigned int page_shift) {
+    // An INVLPG raced with the walk, so the result may already be stale
+    if (address_invalidations_.load(std::memory_order_acquire) != ticket.address_invalidations)
+        return;
+
+    const uint64_t tag = make_tag(virtual_address, page_shift);
+    Set& set = sets_[set_index(tag)];
+
+    // Stale tickets produce entries that will never match
+    const uint64_t generation = ticket.generation;
+    const uint32_t root_epoch = ticket.root_epoch;
+
+    // Prefer a stale entry, otherwise spread address spaces across the ways
+    Entry* victim = &set.ways[(root >> PageDirectory::PAGE_SHIFT) % WAY_COUNT];
+    for (Entry& entry : set.ways) {
+        if (entry.generation.load(std::memory_order_relaxed) !=
+                generation_.load(std::memory_order_relaxed) ||
+            (entry.tag.load(std::memory_order_relaxed) == tag &&
+             entry.root.load(std::memory_order_relaxed) == root)) {
+            victim = &entry;
+            break;
+        }
+    }
+
+    // If another thread is writing this entry, just skip the fill
+    uint32_t seq = victim->seq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !victim->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+        return;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    victim->root.store(root, std::memory_order_relaxed);
+    victim->tag.store(tag, std::memory_order_relaxed);
+    victim->physical_base.store(physical_base, std::memory_order_relaxed);
+    victim->generation.store(generation, std::memory_order_relaxed);
+    victim->root_epoch.store(root_epoch, std::memory_order_relaxed);
+
+    // Pairs with the fence in invalidate_address(): either it sees our tag, or we see its count
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (address_invalidations_.load(std::memory_order_relaxed) != ticket.address_invalidations)
+        victim->tag.store(0, std::memory_order_relaxed);
+
+    victim->seq.store(seq + 2, std::memory_order_release);
+    fills_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TranslationCache::flush() {
+    generation_.fetch_add(1, std::memory_order_acq_rel);
+    flushes_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TranslationCache::invalidate_root(uint64_t root) {
+    // Roots that share an epoch slot are invalidated together, which is harmless
+    root_epochs_[root_epoch_index(root)].fetch_add(1, std::memory_order_acq_rel);
+    invalidations_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TranslationCache::invalidate_tag(uint64_t tag) {
+    Set& set = sets_[set_index(tag)];
+    for (Entry& entry : set.ways) {
+        if (entry.tag.load(std::memory_order_relaxed) != tag)
+            continue;
+
+        // Wait out any writer, since a skipped invalidation would leave a stale entry
+        uint32_t seq = entry.seq.load(std::memory_order_relaxed);
+        while ((seq & 1) || !entry.seq.compare_exchange_weak(seq, seq + 1,
+                                                             std::memory_order_acquire)) {
+            seq = entry.seq.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        entry.tag.store(0, std::memory_order_relaxed);
+        entry.seq.store(seq + 2, std::memory_order_release);
+    }
+}
+
+void TranslationCache::invalidate_address(uint64_t virtual_address) {
+    address_invalidations_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (const auto& shift_value : shifts_) {
+        const unsigned int shift = shift_value.load(std::memory_order_relaxed);
+        if (shift == 0)
+            break;
+        invalidate_tag(make_tag(virtual_address, shift));
+    }
+    invalidations_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TranslationCache::load_root(uint32_t vcpu_id, uint64_t root) {
+    invalidate_root(root);
+    if (unlikely(vcpu_id >= MAX_VCPUS))
+        return;
+
+    active_roots_[vcpu_id].store(root, std::memory_order_release);
+
+    unsigned int count = active_count_.load(std::memory_order_relaxed);
+    while (count <= vcpu_id &&
+           !active_count_.compare_exchange_weak(count, vcpu_id + 1, std::memory_order_release)) {
+    }
+}
+
+bool TranslationCache::active(uint64_t root) const {
+    const unsigned int count = active_count_.load(std::memory_order_acquire);
+    for (unsigned int i = 0; i < count; ++i) {
+        if (active_roots_[i].load(std::memory_order_acquire) == root)
+            return true;
+    }
+    return false;
+}
+
+void TranslationCache::reset_roots() {
+    for (auto& root : active_roots_)
+        root.store(0, std::memory_order_relaxed);
+    active_count_.store(0, std::memory_order_release);
+}
+
+void TranslationCache::configure(int pt_levels) {
+    switch (pt_levels) {
+    case 4:
+        shifts_[0] = 12;
+        shifts_[1] = 21;
+        shifts_[2] = 30;
+        break;
+    case 3:
+        shifts_[0] = 12;
+        shifts_[1] = 21;
+        shifts_[2] = 0;
+        break;
+    default:
+        shifts_[0] = 12;
+        shifts_[1] = 22;
+        shifts_[2] = 0;
+        break;
+    }
+    flush();
+}
+
+PageDirectory::TranslationCacheStats TranslationCache::stats() const {
+    PageDirectory::TranslationCacheStats result;
+    result.hits = hits_.load(std::memory_order_relaxed);
+    result.misses = misses_.load(std::memory_order_relaxed);
+    result.bypasses = bypasses_.load(std::memory_order_relaxed);
+    result.fills = fills_.load(std::memory_order_relaxed);
+    result.flushes = flushes_.load(std::memory_order_relaxed);
+    result.invalidations = invalidations_.load(std::memory_order_relaxed);
+    return result;
+}
+
+TranslationCache::TranslationCache() : sets_(std::make_unique<Set[]>(SET_COUNT)) { configure(4); }
+
+TranslationCache::~TranslationCache() = default;
+
+} // namespace x86
+} // namespace introvirt
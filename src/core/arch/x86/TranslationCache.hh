@@ -0,0 +1,183 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/arch/x86/PageDirectory.hh>
+#include <introvirt/util/compiler.hh>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace introvirt {
+namespace x86 {
+
+/**
+ * @brief A software TLB for PageDirectory::translate()
+ *
+ * Entries are keyed by (page table root, virtual page) and can describe 4KiB, 2MiB, 4MiB or 1GiB
+ * pages. The cache is set-associative, and the set is chosen from the virtual page alone so that
+ * an INVLPG can drop a page from every address space without a full flush.
+ *
+ * Lookups and fills are lock-free. Each entry is protected by a sequence counter; a reader that
+ * races with a writer simply treats the lookup as a miss.
+ */
+class TranslationCache final {
+  public:
+    /**
+     * @brief Look up a cached translation
+     *
+     * @param root The physical address of the page table root
+     * @param virtual_address The (masked) virtual address to translate
+     * @param physical_address Set to the translated address on a hit
+     * @return true on a hit
+     */
+    bool lookup(uint64_t root, uint64_t virtual_address, uint64_t& physical_address) const HOT;
+
+    /**
+     * @brief The cache state captured before a page walk
+     *
+     * A fill is dropped if the cache was invalidated while the walk was running.
+     */
+    struct Ticket {
+        uint64_t generation;
+        uint64_t address_invalidations;
+        uint32_t root_epoch;
+    };
+
+    /**
+     * @brief Capture the cache state before starting a page walk
+     *
+     * @param root The physical address of the page table root
+     */
+    Ticket begin_walk(uint64_t root) const HOT;
+
+    /**
+     * @brief Add a translation from a completed page walk
+     *
+     * @param ticket The value returned by begin_walk() before the walk started
+     * @param root The physical address of the page table root
+     * @param virtual_address The (masked) virtual address that was translated
+     * @param physical_base The physical address of the start of the page
+     * @param page_shift log2 of the page size
+     */
+    void insert(const Ticket& ticket, uint64_t root, uint64_t virtual_address,
+                uint64_t physical_base, unsigned int page_shift) HOT;
+
+    /**
+     * @brief Drop every entry
+     */
+    void flush();
+
+    /**
+     * @brief Drop every entry for the given page table root
+     */
+    void invalidate_root(uint64_t root);
+
+    /**
+     * @brief Drop every entry containing the given virtual address, in all address spaces
+     */
+    void invalidate_address(uint64_t virtual_address);
+
+    /**
+     * @brief Record the page table root a vcpu just loaded, and drop its entries
+     *
+     * Only roots loaded on some vcpu are cached, since the guest doesn't have to INVLPG changes
+     * to page tables that aren't in use.
+     *
+     * @param vcpu_id The vcpu that loaded the root
+     * @param root The physical address of the page table root
+     */
+    void load_root(uint32_t vcpu_id, uint64_t root);
+
+    /**
+     * @brief Check if a page table root is loaded on any vcpu
+     */
+    bool active(uint64_t root) const HOT;
+
+    /**
+     * @brief Forget which roots are loaded, until the vcpus load them again
+     */
+    void reset_roots();
+
+    /**
+     * @brief Count a translation that was done without the cache while it was enabled
+     */
+    void count_bypass() const { bypasses_.fetch_add(1, std::memory_order_relaxed); }
+
+    /**
+     * @brief Set the page sizes used by the current paging mode, and flush
+     *
+     * @param pt_levels The number of page table levels (2, 3, or 4)
+     */
+    void configure(int pt_levels);
+
+    PageDirectory::TranslationCacheStats stats() const;
+
+    TranslationCache();
+    ~TranslationCache();
+
+  private:
+    static constexpr unsigned int SET_COUNT = 1024;
+    static constexpr unsigned int WAY_COUNT = 4;
+    static constexpr unsigned int ROOT_EPOCH_COUNT = 256;
+    static constexpr unsigned int MAX_VCPUS = 256;
+
+    struct Entry {
+        std::atomic<uint32_t> seq{0};
+        std::atomic<uint32_t> root_epoch{0};
+        std::atomic<uint64_t> generation{0};
+        std::atomic<uint64_t> root{0};
+        // Page aligned virtual address, with the page shift in the low bits
+        std::atomic<uint64_t> tag{0};
+        std::atomic<uint64_t> physical_base{0};
+    };
+
+    struct alignas(64) Set {
+        std::array<Entry, WAY_COUNT> ways;
+    };
+
+    static unsigned int set_index(uint64_t tag);
+    static unsigned int root_epoch_index(uint64_t root);
+
+    bool probe(uint64_t root, uint64_t tag, uint64_t& physical_base) const;
+    void invalidate_tag(uint64_t tag);
+
+  private:
+    std::unique_ptr<Set[]> sets_;
+
+    std::atomic<uint64_t> generation_{1};
+    std::array<std::atomic<uint32_t>, ROOT_EPOCH_COUNT> root_epochs_{};
+    std::atomic<uint64_t> address_invalidations_{0};
+
+    // The root each vcpu last loaded, or 0 if it isn't known
+    std::array<std::atomic<uint64_t>, MAX_VCPUS> active_roots_{};
+    std::atomic<unsigned int> active_count_{0};
+
+    // Page shifts to probe, smallest first. Unused slots are 0.
+    std::array<std::atomic<unsigned int>, 3> shifts_{};
+
+    mutable std::atomic<uint64_t> hits_{0};
+    mutable std::atomic<uint64_t> misses_{0};
+    mutable std::atomic<uint64_t> bypasses_{0};
+    std::atomic<uint64_t> fills_{0};
+    std::atomic<uint64_t> flushes_{0};
+    std::atomic<uint64_t> invalidations_{0};
+};
+
+} // namespace x86
+} // namespace introvirt
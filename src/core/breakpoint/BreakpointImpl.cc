@@ -28,22 +28,19 @@ void BreakpointImpl::data(const std::shared_ptr<void>& value) { data_ = value; }
 void BreakpointImpl::data(std::shared_ptr<void>&& value) { data_ = std::move(value); }
 
 void BreakpointImpl::callback(std::function<void(Event&)> callback) {
-    std::lock_guard lock(cbdata_->mtx_);
-    cbdata_->callback_ = callback;
+    cbdata_->callback(std::move(callback));
 }
 
-guest_phys_ptr<uint8_t> BreakpointImpl::ptr() const { return ptr_; }
-
-BreakpointImpl::BreakpointImpl(const guest_phys_ptr<void>& ptr,
-                               std::function<void(Event&)> callback)
-    : ptr_(ptr), cbdata_(std::make_shared<BreakpointImplCallback>(std::move(callback))) {}
+BreakpointImpl::BreakpointImpl(DomainImpl& domain, uint64_t physical_address,
+                               std::function<void(Event&)> callback, std::vector<uint64_t> scope)
+    : domain_(domain), physical_address_(physical_address), scope_(std::move(scope)),
+      cbdata_(std::make_shared<BreakpointImplCallback>(std::move(callback))) {}
 
 BreakpointImpl::~BreakpointImpl() {
     // Notify the breakpoint manager that we're done
     cbdata_->destroyed_ = true;
 
-    auto& domain = const_cast<DomainImpl&>(static_cast<const DomainImpl&>(ptr_.domain()));
-    domain.breakpoint_manager().remove_ref(*this);
+    domain_.breakpoint_manager().remove_ref(*this);
 }
 
 } // namespace introvirt
\ No newline at end of file
@@ -16,13 +16,16 @@
 #pragma once
 
 #include "core/domain/DomainImpl.hh"
+#include "core/util/AtomicSnapshot.hh"
 
 #include <introvirt/core/breakpoint/Breakpoint.hh>
 #include <introvirt/core/memory/guest_ptr.hh>
 
 #include <cstdint>
 #include <memory>
-#include <mutex>
+#include <atomic>
+#include <functional>
+#include <vector>
 
 namespace introvirt {
 
@@ -32,19 +35,29 @@ class InternalBreakpoint;
  * This is a separate class so that BreakpointImpl can go off scope while leaving a valid
  * BreakpointImplCallback. The BreakpointImplCallback will have it's callback set to nullptr.
  *
+ * Events are delivered without a lock, so the callback is an immutable snapshot that
+ * callback() swaps atomically. A delivery that races with a swap runs either the old or the new
+ * callback, never a half-assigned one.
  */
 class BreakpointImplCallback {
   public:
+    using Callback = std::function<void(Event&)>;
+
     void deliver_event(Event& event) {
-        if (likely(!destroyed_))
-            callback_(event);
+        if (unlikely(destroyed_))
+            return;
+        SnapshotReadGuard guard;
+        (*callback_.load())(event);
+    }
+
+    void callback(Callback callback) {
+        callback_.store(std::make_unique<const Callback>(std::move(callback)));
     }
 
-    BreakpointImplCallback(std::function<void(Event&)>&& callback)
-        : callback_(std::move(callback)) {}
+    BreakpointImplCallback(Callback&& callback)
+        : callback_(std::make_unique<const Callback>(std::move(callback))) {}
 
-    std::function<void(Event&)> callback_;
-    std::recursive_mutex mtx_;
+    AtomicSnapshot<Callback> callback_;
     std::atomic_bool destroyed_ = false;
 };
 
@@ -58,7 +71,20 @@ class BreakpointImpl final : public Breakpoint {
 
     void callback(std::function<void(Event&)> callback) override;
 
-    guest_phys_ptr<uint8_t> ptr() const;
+    /**
+     * @brief Get the physical address of the breakpoint
+     */
+    uint64_t physical_address() const { return physical_address_; }
+
+    /**
+     * @brief Get the page directories the breakpoint is scoped to, or an empty list for all
+     */
+    const std::vector<uint64_t>& scope() const { return scope_; }
+
+    /**
+     * @brief Get the domain that the breakpoint is in
+     */
+    DomainImpl& domain() const { return domain_; }
 
     std::shared_ptr<BreakpointImplCallback> callback() { return cbdata_; }
 
@@ -68,12 +94,15 @@ class BreakpointImpl final : public Breakpoint {
 
     std::shared_ptr<InternalBreakpoint> internal_breakpoint() { return internal_breakpoint_; }
 
-    BreakpointImpl(const guest_phys_ptr<void>& ptr, std::function<void(Event&)> callback);
+    BreakpointImpl(DomainImpl& domain, uint64_t physical_address,
+                   std::function<void(Event&)> callback, std::vector<uint64_t> scope = {});
 
     ~BreakpointImpl() override;
 
   private:
-    const guest_phys_ptr<uint8_t> ptr_;
+    DomainImpl& domain_;
+    const uint64_t physical_address_;
+    const std::vector<uint64_t> scope_;
     std::shared_ptr<BreakpointImplCallback> cbdata_;
     std::shared_ptr<void> data_;
     std::shared_ptr<InternalBreakpoint> internal_breakpoint_;
@@ -23,6 +23,7 @@
 
 #include <log4cxx/logger.h>
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 
@@ -66,51 +67,78 @@ void InternalBreakpoint::step_event() {
     single_step_.reset();
 }
 
-void InternalBreakpoint::deliver_breakpoint(Event& event) {
-    // Get a copy of the callback set so that we don't have to hold a lock
-    std::unique_lock lock(mtx_);
-
-    std::vector<std::shared_ptr<BreakpointImplCallback>> callbacks;
-    callbacks.reserve(breakpoint_list_.size());
+// Page directories are compared without the PCID and high bits
+static bool scope_contains(const std::vector<uint64_t>& scope, uint64_t cr3) {
+    if (scope.empty())
+        return true;
+    const uint64_t page_directory = x86::PageDirectory::directory_table_base(cr3);
+    return std::find(scope.begin(), scope.end(), page_directory) != scope.end();
+}
 
-    for (auto& weakptr : breakpoint_list_) {
-        auto entry = weakptr.lock();
-        if (entry)
-            callbacks.push_back(entry->callback());
-    }
-    lock.unlock();
+void InternalBreakpoint::deliver_breakpoint(Event& event) {
+    // The list is never modified in place, so a snapshot is all we need
+    SnapshotReadGuard guard;
+    const CallbackList* callbacks = callbacks_.load();
+    const uint64_t cr3 = event.vcpu().registers().cr3();
+
+    LOG4CXX_DEBUG(logger, "Delivering " << callbacks->size() << " breakpoint callbacks");
+    for (auto& entry : *callbacks) {
+        if (!scope_contains(entry.scope, cr3))
+            continue;
+
+        std::shared_ptr<BreakpointImplCallback> callback;
+        if (auto breakpoint = entry.breakpoint.lock())
+            callback = breakpoint->callback();
+        if (!callback)
+            continue;
 
-    LOG4CXX_DEBUG(logger, "Delivering " << callbacks.size() << " breakpoint callbacks");
-    for (auto& entry : callbacks) {
         try {
-            entry->deliver_event(event);
+            callback->deliver_event(event);
         } catch (TraceableException& ex) {
             LOG4CXX_WARN(logger, "Caught exception in deliver_breakpoint(): " << ex);
         }
     }
 }
 
+bool InternalBreakpoint::in_scope(uint64_t cr3) const {
+    SnapshotReadGuard guard;
+    const CallbackList* callbacks = callbacks_.load();
+    for (auto& entry : *callbacks) {
+        if (scope_contains(entry.scope, cr3))
+            return true;
+    }
+    return false;
+}
+
 void InternalBreakpoint::add_callback(const std::shared_ptr<BreakpointImpl>& bpimpl) {
-    std::unique_lock lock(mtx_);
-    breakpoint_list_.push_back(bpimpl);
+    std::lock_guard lock(page_->mutex());
 
-    if (breakpoint_list_.size() == 1) {
+    auto updated = std::make_unique<CallbackList>(*callbacks_.load());
+    updated->push_back(Callback{bpimpl, bpimpl->scope()});
+    const bool first = updated->size() == 1;
+    callbacks_.store(std::move(updated));
+
+    if (first) {
         enable();
     }
 }
 
 bool InternalBreakpoint::remove_expired() {
-    std::unique_lock lock(mtx_);
-    for (auto iter = breakpoint_list_.begin(); iter != breakpoint_list_.end();) {
-        auto& weakptr = *iter;
-        if (weakptr.expired()) {
-            iter = breakpoint_list_.erase(iter);
-        } else {
-            ++iter;
-        }
+    std::lock_guard lock(page_->mutex());
+
+    const CallbackList* callbacks = callbacks_.load();
+    auto updated = std::make_unique<CallbackList>();
+    updated->reserve(callbacks->size());
+    for (auto& entry : *callbacks) {
+        if (!entry.breakpoint.expired())
+            updated->push_back(entry);
     }
 
-    if (breakpoint_list_.empty()) {
+    const bool empty = updated->empty();
+    if (updated->size() != callbacks->size())
+        callbacks_.store(std::move(updated));
+
+    if (empty) {
         disable();
         return true;
     }
@@ -118,17 +146,19 @@ bool InternalBreakpoint::remove_expired() {
     return false;
 }
 
-InternalBreakpoint::InternalBreakpoint(const guest_phys_ptr<void>& address)
-    : mapping_(static_ptr_cast<uint8_t>(address)), original_byte_(*mapping_) {
+InternalBreakpoint::InternalBreakpoint(std::shared_ptr<BreakpointPage> page,
+                                       uint64_t physical_address)
+    : page_(std::move(page)), mapping_(page_->site(physical_address)),
+      original_byte_(*mapping_) {
 
-    enable();
+    // The breakpoint is written by add_callback(), once the site can be found
 
     // Configure out watchpoint if supported
     try {
 #if 0
-        auto& domain = const_cast<DomainImpl&>(static_cast<const DomainImpl&>(address.domain()));
+        auto& domain = const_cast<DomainImpl&>(static_cast<const DomainImpl&>(mapping_.domain()));
         watchpoint_ = domain.create_watchpoint(
-            address, 1, true, true, false,
+            mapping_, 1, true, true, false,
             std::bind(&InternalBreakpoint::watchpoint_event, this, std::placeholders::_1));
 #endif
     } catch (CommandFailedException& ex) {
@@ -139,47 +169,199 @@ InternalBreakpoint::InternalBreakpoint(const guest_phys_ptr<void>& address)
 
 InternalBreakpoint::~InternalBreakpoint() { disable(); }
 
-void BreakpointManager::add_ref(const std::shared_ptr<BreakpointImpl>& breakpoint) {
-    std::lock_guard lock(breakpoints_.mtx_);
-    if (unlikely(interrupted_))
+std::shared_ptr<InternalBreakpoint> BreakpointPage::find(uint64_t physical_address) const {
+    SnapshotReadGuard guard;
+    const SiteMap* sites = sites_.load();
+    auto iter = sites->find(physical_address);
+    if (iter == sites->end())
+        return nullptr;
+    return iter->second.lock();
+}
+
+bool BreakpointPage::contains(uint64_t physical_address) const {
+    SnapshotReadGuard guard;
+    return sites_.load()->count(physical_address) != 0;
+}
+
+guest_phys_ptr<uint8_t> BreakpointPage::site(uint64_t physical_address) const {
+    // Same page, so this shares our mapping
+    return mapping_ + (physical_address & ~x86::PageDirectory::PAGE_MASK);
+}
+
+BreakpointPage::BreakpointPage(const Domain& domain, uint64_t page_address)
+    : mapping_(domain, page_address) {}
+
+std::shared_ptr<BreakpointPage> BreakpointManager::find_page(uint64_t physical_address) const {
+    SnapshotReadGuard guard;
+    const PageMap* pages = pages_.load();
+    auto iter = pages->find(physical_address & x86::PageDirectory::PAGE_MASK);
+    if (iter == pages->end())
+        return nullptr;
+    return iter->second;
+}
+
+std::shared_ptr<InternalBreakpoint> BreakpointManager::find(uint64_t physical_address) const {
+    auto page = find_page(physical_address);
+    if (!page)
+        return nullptr;
+    return page->find(physical_address);
+}
+
+std::shared_ptr<BreakpointPage> BreakpointManager::acquire_page(const Domain& domain,
+                                                               uint64_t physical_address) {
+    const uint64_t page_address = physical_address & x86::PageDirectory::PAGE_MASK;
+
+    std::lock_guard lock(pages_mtx_);
+    const PageMap* pages = pages_.load();
+    auto iter = pages->find(page_address);
+    if (iter != pages->end())
+        return iter->second;
+
+    auto page = std::make_shared<BreakpointPage>(domain, page_address);
+    auto updated = std::make_unique<PageMap>(*pages);
+    updated->emplace(page_address, page);
+    pages_.store(std::move(updated));
+    return page;
+}
+
+void BreakpointManager::release(const std::shared_ptr<InternalBreakpoint>& entry,
+                                uint64_t physical_address) {
+    auto& page = entry->page();
+    std::lock_guard lock(page->mtx_);
+
+    if (!entry->remove_expired()) {
+        // Someone added a callback while we weren't looking
+        return;
+    }
+
+    // Make sure the site hasn't been replaced already
+    const BreakpointPage::SiteMap* sites = page->sites_.load();
+    auto iter = sites->find(physical_address);
+    if (iter == sites->end())
         return;
+    auto current = iter->second.lock();
+    if (current && current != entry)
+        return;
+
+    if (sites->size() > 1) {
+        auto updated = std::make_unique<BreakpointPage::SiteMap>(*sites);
+        updated->erase(physical_address);
+        page->sites_.store(std::move(updated));
+        return;
+    }
+
+    // That was the last site on the page, drop the page too.
+    // Anyone that already has it will see that it's retired and get a new one.
+    page->retired_ = true;
+    page->sites_.store(std::make_unique<const BreakpointPage::SiteMap>());
+
+    std::lock_guard pages_lock(pages_mtx_);
+    const PageMap* pages = pages_.load();
+    auto page_iter = pages->find(physical_address & x86::PageDirectory::PAGE_MASK);
+    if (page_iter != pages->end() && page_iter->second == page) {
+        auto updated = std::make_unique<PageMap>(*pages);
+        updated->erase(page_iter->first);
+        pages_.store(std::move(updated));
+    }
+}
+
+void BreakpointManager::add_page_refs(BreakpointList::const_iterator begin,
+                                      BreakpointList::const_iterator end) {
+    const uint64_t page_address = (*begin)->physical_address() & x86::PageDirectory::PAGE_MASK;
+
+    while (true) {
+        auto page = acquire_page((*begin)->domain(), page_address);
+
+        std::lock_guard lock(page->mtx_);
+        if (unlikely(interrupted_))
+            return;
+        if (unlikely(page->retired_)) {
+            // The page was emptied after we got it, try again
+            continue;
+        }
 
-    std::shared_ptr<InternalBreakpoint> entry;
-
-    guest_phys_ptr<uint8_t> physical_address = breakpoint->ptr();
-
-    // See if we can find it in the breakpoint map
-    auto iter = breakpoints_.map_.find(physical_address.address());
-    if (iter == breakpoints_.map_.end()) {
-        // Entry doesn't exist, create it
-        entry = std::make_shared<InternalBreakpoint>(physical_address);
-        iter = breakpoints_.map_.emplace(physical_address.address(), std::move(entry)).first;
-    } else {
-        // Entry exists, try to lock it
-        entry = iter->second.lock();
-        if (!entry) {
-            // Entry has expired, recreate it
-            entry = std::make_shared<InternalBreakpoint>(physical_address);
-            iter = breakpoints_.map_.emplace(physical_address.address(), std::move(entry)).first;
+        // Find or create every site first. Nothing is written to the guest until the new sites
+        // have been published, so that a hit on another vcpu can always find its breakpoint.
+        const BreakpointPage::SiteMap* sites = page->sites_.load();
+        std::unique_ptr<BreakpointPage::SiteMap> updated;
+        std::vector<std::shared_ptr<InternalBreakpoint>> entries;
+        entries.reserve(end - begin);
+
+        for (auto iter = begin; iter != end; ++iter) {
+            const uint64_t address = (*iter)->physical_address();
+            const auto& current = updated ? *updated : *sites;
+
+            // See if we can find it in the page, recreating it if it has expired
+            std::shared_ptr<InternalBreakpoint> entry;
+            auto site = current.find(address);
+            if (site != current.end())
+                entry = site->second.lock();
+
+            if (!entry) {
+                entry = std::make_shared<InternalBreakpoint>(page, address);
+                if (!updated)
+                    updated = std::make_unique<BreakpointPage::SiteMap>(*sites);
+                (*updated)[address] = entry;
+            }
+            entries.push_back(std::move(entry));
         }
+
+        if (updated)
+            page->sites_.store(std::move(updated));
+
+        auto entry = entries.begin();
+        for (auto iter = begin; iter != end; ++iter, ++entry) {
+            // Store it with the breakpoint
+            (*iter)->internal_breakpoint(*entry);
+
+            // Register the breakpoint with the internal breakpoint
+            (*entry)->add_callback(*iter);
+            if (!(*iter)->scope().empty())
+                scoped_count_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
     }
+}
 
-    // Store it with the breakpoint
-    breakpoint->internal_breakpoint(entry);
+void BreakpointManager::add_ref(const std::shared_ptr<BreakpointImpl>& breakpoint) {
+    const BreakpointList breakpoints{breakpoint};
+    add_page_refs(breakpoints.begin(), breakpoints.end());
+}
 
-    // Register the breakpoint with the internal breakpoint
-    entry->add_callback(breakpoint);
+void BreakpointManager::add_refs(BreakpointList breakpoints) {
+    // Group the sites by page, so that each page is only locked and updated once
+    std::sort(breakpoints.begin(), breakpoints.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs->physical_address() < rhs->physical_address();
+    });
+
+    for (auto begin = breakpoints.cbegin(); begin != breakpoints.cend();) {
+        const uint64_t page_number = (*begin)->physical_address() >> x86::PageDirectory::PAGE_SHIFT;
+        auto end = std::find_if(begin, breakpoints.cend(), [page_number](const auto& breakpoint) {
+            return (breakpoint->physical_address() >> x86::PageDirectory::PAGE_SHIFT) !=
+                   page_number;
+        });
+
+        try {
+            add_page_refs(begin, end);
+        } catch (TraceableException& ex) {
+            // Leave the breakpoints unattached, the caller will see that they failed
+            LOG4CXX_WARN(logger, "Failed to install breakpoints on page 0x"
+                                     << std::hex << (page_number << x86::PageDirectory::PAGE_SHIFT)
+                                     << ": " << ex);
+        }
+        begin = end;
+    }
 }
 
 void BreakpointManager::remove_ref(BreakpointImpl& breakpoint) {
-    std::lock_guard lock(breakpoints_.mtx_);
     if (unlikely(interrupted_))
         return;
 
     auto entry = breakpoint.internal_breakpoint();
-    if (entry->remove_expired()) {
-        // The internal breakpoint has no more callbacks and can be erased
-        breakpoints_.map_.erase(breakpoint.ptr().address());
+    if (entry) {
+        if (!breakpoint.scope().empty())
+            scoped_count_.fetch_sub(1, std::memory_order_relaxed);
+        release(entry, breakpoint.physical_address());
     }
 }
 
@@ -194,11 +376,10 @@ bool BreakpointManager::handle_int3_event(Event& event, bool deliver_events) {
     }
 
     // Find the breakpoint for the event
-    std::unique_lock breakpoints_lock(breakpoints_.mtx_);
     LOG4CXX_DEBUG(logger, "VCPU " << vcpu.id() << ": INT3 received for " << rip);
 
-    auto iter = breakpoints_.map_.find(physical_rip);
-    if (unlikely(iter == breakpoints_.map_.end())) {
+    auto page = find_page(physical_rip);
+    if (unlikely(!page || !page->contains(physical_rip))) {
         // We don't have a breakpoint for this!
         // Check to see if there's an actual int3 instruction in place
         if (*guest_ptr<uint8_t>(rip) == 0xCC) {
@@ -212,7 +393,7 @@ bool BreakpointManager::handle_int3_event(Event& event, bool deliver_events) {
     }
 
     // Get our breakpoint entry
-    active_breakpoint = iter->second.lock();
+    active_breakpoint = page->find(physical_rip);
     if (unlikely(!active_breakpoint)) {
         // Maybe all of our breakpoints were removed while we were waiting.
         // If that's the case, the breakpoint instruction should have already been removed.
@@ -220,9 +401,6 @@ bool BreakpointManager::handle_int3_event(Event& event, bool deliver_events) {
         return false;
     }
 
-    // No longer need to lock on this since we have out internal breakpoint
-    breakpoints_lock.unlock();
-
     // Reinject the exeception if this is a nested Int3
     if (active_breakpoint->nested_bp())
         vcpu.inject_exception(x86::Exception::INT3);
@@ -237,17 +415,16 @@ bool BreakpointManager::handle_int3_event(Event& event, bool deliver_events) {
             // No one left waiting for this breakpoint. No need for a callback.
             LOG4CXX_TRACE(logger, "Breakpoing removed, not stepping VCPU " << vcpu.id());
 
+            release(active_breakpoint, physical_rip);
             active_breakpoint.reset();
-            breakpoints_lock.lock();
-            breakpoints_.map_.erase(physical_rip);
             return false;
         }
 
         // Check if one of our callbacks changed RIP
         if (regs.rip() != rip.address()) {
             // A callback must have changed RIP, just turn the breakpoint back on
-            active_breakpoint.reset();
             active_breakpoint->enable();
+            active_breakpoint.reset();
             LOG4CXX_TRACE(logger, "RIP changed, not stepping VCPU " << vcpu.id());
             return false;
         }
@@ -258,6 +435,141 @@ bool BreakpointManager::handle_int3_event(Event& event, bool deliver_events) {
     return true;
 }
 
+bool BreakpointManager::decode_instruction(Vcpu& vcpu, const BreakpointPage& page,
+                                           uint64_t physical_rip, const InternalBreakpoint& entry,
+                                           x86::InstructionEmulator& emulator) {
+    auto& regs = vcpu.registers();
+    const uint64_t rip = regs.rip();
+
+    // Stay within the page, so the physical address of every byte is known
+    const size_t length = std::min<uint64_t>(x86::InstructionEmulator::MAX_INSTRUCTION_LENGTH,
+                                             x86::PageDirectory::PAGE_SIZE -
+                                                 (rip & ~x86::PageDirectory::PAGE_MASK));
+
+    guest_ptr<uint8_t[]> code;
+    if (!code.try_reset(vcpu, rip, length))
+        return false;
+
+    uint8_t bytes[x86::InstructionEmulator::MAX_INSTRUCTION_LENGTH];
+    std::copy_n(code.get(), length, bytes);
+    bytes[0] = entry.original_byte();
+
+    if (!emulator.decode(bytes, length, regs.cs_long_mode()))
+        return false;
+
+    // Another breakpoint inside of the instruction would have been decoded as 0xCC
+    for (size_t i = 1; i < emulator.length(); ++i) {
+        if (page.contains(physical_rip + i))
+            return false;
+    }
+    return true;
+}
+
+std::shared_ptr<InternalBreakpoint>
+BreakpointManager::find_emulatable(Vcpu& vcpu, uint64_t& physical_rip,
+                                   std::shared_ptr<BreakpointPage>& page) {
+    auto& regs = vcpu.registers();
+
+    // The guest's own trap flag expects a #DB after the instruction, leave that to the hardware
+    if (regs.rflags().trap())
+        return nullptr;
+
+    guest_ptr<uint8_t> rip_ptr;
+    if (!rip_ptr.try_reset(vcpu, regs.rip()))
+        return nullptr;
+    physical_rip = guest_phys_ptr<uint8_t>(rip_ptr).address();
+
+    page = find_page(physical_rip);
+    if (!page)
+        return nullptr;
+
+    auto entry = page->find(physical_rip);
+    if (!entry || entry->nested_bp())
+        return nullptr;
+    return entry;
+}
+
+BreakpointManager::EmulationResult BreakpointManager::handle_int3_emulated(Event& event,
+                                                                           bool deliver_events) {
+    auto& vcpu = event.vcpu();
+    auto& regs = vcpu.registers();
+    const uint64_t rip = regs.rip();
+
+    if (unlikely(interrupted_))
+        return EmulationResult::NOT_HANDLED;
+
+    uint64_t physical_rip;
+    std::shared_ptr<BreakpointPage> page;
+    auto entry = find_emulatable(vcpu, physical_rip, page);
+    if (!entry)
+        return EmulationResult::NOT_HANDLED;
+
+    x86::InstructionEmulator emulator;
+    if (!decode_instruction(vcpu, *page, physical_rip, *entry, emulator)) {
+        LOG4CXX_TRACE(logger, "VCPU " << vcpu.id() << ": Can't emulate instruction at 0x"
+                                      << std::hex << rip);
+        return EmulationResult::NOT_HANDLED;
+    }
+
+    LOG4CXX_DEBUG(logger, "VCPU " << vcpu.id() << ": INT3 received for 0x" << std::hex << rip);
+
+    if (deliver_events) {
+        entry->deliver_breakpoint(event);
+
+        if (entry->remove_expired()) {
+            // The original byte is back, so the instruction can just run
+            LOG4CXX_TRACE(logger, "Breakpoint removed, not emulating on VCPU " << vcpu.id());
+
+            release(entry, physical_rip);
+            return EmulationResult::HANDLED;
+        }
+
+        if (regs.rip() != rip) {
+            LOG4CXX_TRACE(logger, "RIP changed, not emulating on VCPU " << vcpu.id());
+            return EmulationResult::HANDLED;
+        }
+    }
+
+    if (emulator.execute(vcpu)) {
+        LOG4CXX_TRACE(logger, "VCPU " << vcpu.id() << ": Emulated 0x" << std::hex << rip
+                                      << "->0x" << regs.rip());
+        return EmulationResult::HANDLED;
+    }
+
+    // Most likely the stack isn't present. The callbacks have already run, so step it instead.
+    LOG4CXX_DEBUG(logger, "Emulation failed, waiting for BP step on VCPU " << vcpu.id());
+    active_breakpoint = std::move(entry);
+    return EmulationResult::STEP_REQUIRED;
+}
+
+bool BreakpointManager::absorb_int3(Vcpu& vcpu) {
+    if (unlikely(interrupted_))
+        return false;
+
+    uint64_t physical_rip;
+    std::shared_ptr<BreakpointPage> page;
+    auto entry = find_emulatable(vcpu, physical_rip, page);
+    if (!entry || entry->in_scope(vcpu.registers().cr3()))
+        return false;
+
+    x86::InstructionEmulator emulator;
+    if (!decode_instruction(vcpu, *page, physical_rip, *entry, emulator))
+        return false;
+
+    const uint64_t rip = vcpu.registers().rip();
+    if (!emulator.execute(vcpu))
+        return false;
+
+    LOG4CXX_TRACE(logger, "VCPU " << vcpu.id() << ": Out of scope breakpoint, emulated 0x"
+                                  << std::hex << rip << "->0x" << vcpu.registers().rip());
+    return true;
+}
+
+void BreakpointManager::disarm_active() {
+    if (active_breakpoint)
+        active_breakpoint->disable();
+}
+
 void BreakpointManager::step(Event& event) {
     if (HiddenBreakpoint != nullptr) {
         // Unhide the BP
@@ -277,13 +589,16 @@ void BreakpointManager::interrupt() {
     // Clean up and unblock any pending events
     interrupted_ = true;
 
-    std::lock_guard lock2(breakpoints_.mtx_);
-
     // Disable all breakpoints
-    for (auto& [address, weakptr] : breakpoints_.map_) {
-        auto entry = weakptr.lock();
-        if (entry)
-            entry->disable();
+    SnapshotReadGuard guard;
+    const PageMap* pages = pages_.load();
+    for (auto& [page_address, page] : *pages) {
+        std::lock_guard lock(page->mtx_);
+        for (auto& [address, weakptr] : *page->sites_.load()) {
+            auto entry = weakptr.lock();
+            if (entry)
+                entry->disable();
+        }
     }
 }
 
@@ -299,6 +614,11 @@ void BreakpointManager::end_injection() {
 }
 
 BreakpointManager::BreakpointManager() {}
-BreakpointManager::~BreakpointManager() = default;
+BreakpointManager::~BreakpointManager() {
+    // The page map goes with us, and retired ones must not keep pages (and their mappings)
+    // around after the domain is gone
+    pages_.store(std::make_unique<const PageMap>());
+    SnapshotEpoch::synchronize();
+}
 
 } // namespace introvirt
@@ -15,22 +15,70 @@
  */
 #pragma once
 
+#include "core/arch/x86/InstructionEmulator.hh"
+#include "core/util/AtomicSnapshot.hh"
+
 #include <introvirt/core/breakpoint/SingleStep.hh>
 #include <introvirt/core/breakpoint/Watchpoint.hh>
 
 #include <introvirt/core/memory/guest_ptr.hh>
 
 #include <atomic>
-#include <list>
 #include <memory>
 #include <mutex>
-#include <set>
 #include <unordered_map>
+#include <vector>
 
 namespace introvirt {
 
 class BreakpointImpl;
 class DomainImpl;
+class InternalBreakpoint;
+
+/**
+ * @brief The breakpoint sites on one physical page
+ *
+ * All of the sites on a page share the page's mapping, which is released along with the page
+ * once its last site is removed.
+ *
+ * Anything that modifies the page (adding or removing sites, changing a site's callbacks, or
+ * writing breakpoint bytes) holds the page's mutex, so unrelated pages never contend. Lookups
+ * don't lock: the site map is immutable and replaced as a whole when it changes, and old maps are
+ * reclaimed through SnapshotEpoch once no lookup can still be using them.
+ */
+class BreakpointPage final {
+  public:
+    using SiteMap = std::unordered_map<uint64_t, std::weak_ptr<InternalBreakpoint>>;
+
+    /**
+     * @brief Find the breakpoint at a physical address on this page
+     *
+     * @return The breakpoint, or nullptr if there isn't one
+     */
+    std::shared_ptr<InternalBreakpoint> find(uint64_t physical_address) const;
+
+    /**
+     * @brief Check if there is a site at the given physical address
+     */
+    bool contains(uint64_t physical_address) const;
+
+    /**
+     * @brief Get a pointer to a site on this page, using the page's mapping
+     */
+    guest_phys_ptr<uint8_t> site(uint64_t physical_address) const;
+
+    std::recursive_mutex& mutex() { return mtx_; }
+
+    BreakpointPage(const Domain& domain, uint64_t page_address);
+
+  private:
+    friend class BreakpointManager;
+
+    const guest_phys_ptr<uint8_t> mapping_;
+    std::recursive_mutex mtx_;
+    AtomicSnapshot<SiteMap> sites_{std::make_unique<const SiteMap>()};
+    bool retired_ = false; // Removed from the manager, guarded by mtx_
+};
 
 /**
  * @brief This is the low-level breakpoint class
@@ -41,66 +89,180 @@ class InternalBreakpoint final {
     /**
      * @brief Insert the Int3 breakpoint
      */
-    void enable() { *mapping_ = 0xCC; }
+    void enable() {
+        std::lock_guard lock(page_->mutex());
+        *mapping_ = 0xCC;
+    }
 
     /**
      * @brief Restore the original instruction
      */
-    void disable() { *mapping_ = original_byte_; }
+    void disable() {
+        std::lock_guard lock(page_->mutex());
+        *mapping_ = original_byte_;
+    }
 
     /**
      * @brief Check if the guest already had a breakpoint instruction at the target address
      */
     bool nested_bp() const { return original_byte_ == 0xCC; }
 
+    /**
+     * @brief Get the guest's byte that the breakpoint replaced
+     */
+    uint8_t original_byte() const { return original_byte_; }
+
+    /**
+     * @brief Get the page that this breakpoint is on
+     */
+    const std::shared_ptr<BreakpointPage>& page() const { return page_; }
+
     void watchpoint_event(Event& event);
     void step_event();
 
+    /**
+     * @brief Run the callbacks whose scope includes the event's address space
+     */
     void deliver_breakpoint(Event& event);
 
+    /**
+     * @brief Check if any callback would run for a hit with the given CR3
+     *
+     * This does not lock. Callbacks that have gone away but haven't been removed yet still count.
+     */
+    bool in_scope(uint64_t cr3) const;
+
     void add_callback(const std::shared_ptr<BreakpointImpl>& bpimpl);
     bool remove_expired();
 
-    InternalBreakpoint(const guest_phys_ptr<void>& address);
+    InternalBreakpoint(std::shared_ptr<BreakpointPage> page, uint64_t physical_address);
     ~InternalBreakpoint();
 
   private:
+    struct Callback {
+        std::weak_ptr<BreakpointImpl> breakpoint;
+        std::vector<uint64_t> scope;
+    };
+    using CallbackList = std::vector<Callback>;
+
+    const std::shared_ptr<BreakpointPage> page_;
     guest_phys_ptr<uint8_t> mapping_;
     std::unique_ptr<Watchpoint> watchpoint_;
     std::unique_ptr<SingleStep> single_step_;
     uint8_t original_byte_;
 
-    std::list<std::weak_ptr<BreakpointImpl>> breakpoint_list_;
-    std::recursive_mutex mtx_;
+    // Replaced as a whole under the page mutex, so delivery can use it without locking
+    AtomicSnapshot<CallbackList> callbacks_{std::make_unique<const CallbackList>()};
 };
 
 /**
  * @brief Internal class for managing low-level breakpoints
  *
+ * Breakpoints are grouped by physical page. Finding the breakpoint for an INT3 is lock-free, and
+ * changes only lock the page being modified, so vcpus hitting unrelated breakpoints never wait
+ * on each other.
  */
 class BreakpointManager final {
   public:
+    /**
+     * @brief The outcome of handle_int3_emulated()
+     */
+    enum class EmulationResult {
+        NOT_HANDLED,  // Nothing was done, use handle_int3_event()
+        HANDLED,      // Callbacks were delivered and the vcpu was moved past the breakpoint
+        STEP_REQUIRED // Callbacks were delivered, but the instruction must be stepped
+    };
+
     bool handle_int3_event(Event& event, bool deliver_events);
+
+    /**
+     * @brief Handle a breakpoint by emulating the instruction it replaced
+     *
+     * The breakpoint stays armed the whole time, so other vcpus don't need to be paused.
+     * If STEP_REQUIRED is returned, the caller must pause the other vcpus, call disarm_active(),
+     * and step the vcpu before calling step().
+     */
+    EmulationResult handle_int3_emulated(Event& event, bool deliver_events);
+
+    /**
+     * @brief Remove the breakpoint that is waiting to be stepped over on this thread
+     */
+    void disarm_active();
+
+    /**
+     * @brief Step over a breakpoint that is scoped to other address spaces
+     *
+     * Called by the poller before an event is created. If no callback at the site wants the
+     * vcpu's current CR3, the instruction under the breakpoint is emulated and the hit never
+     * becomes an event. Breakpoints stay armed for every address space, so vcpus running other
+     * processes against the same physical page are unaffected.
+     *
+     * @return true if the vcpu was moved past the breakpoint
+     */
+    bool absorb_int3(Vcpu& vcpu);
+
+    /**
+     * @brief Check if any breakpoint is scoped to a set of page directories
+     */
+    bool scoped() const { return scoped_count_.load(std::memory_order_relaxed) != 0; }
+
     void step(Event& event);
 
     void interrupt();
 
+    /**
+     * @brief Find the breakpoint at a physical address
+     *
+     * This does not lock, and is safe to call while breakpoints are being added and removed.
+     *
+     * @return The breakpoint, or nullptr if there isn't one
+     */
+    std::shared_ptr<InternalBreakpoint> find(uint64_t physical_address) const;
+
+    using BreakpointList = std::vector<std::shared_ptr<BreakpointImpl>>;
+
     void add_ref(const std::shared_ptr<BreakpointImpl>& breakpoint);
+
+    /**
+     * @brief Install a set of breakpoints
+     *
+     * Sites are grouped by physical page, and each page is locked and updated once. A site that
+     * can't be installed is logged and skipped; its internal_breakpoint() is left empty.
+     */
+    void add_refs(BreakpointList breakpoints);
     void remove_ref(BreakpointImpl& breakpoint);
 
     void start_injection();
     void end_injection();
 
     BreakpointManager();
+
+    /**
+     * @brief Destroy the instance
+     *
+     * Waits for readers of retired page maps, so that no page outlives the domain through one.
+     */
     ~BreakpointManager();
 
   private:
-    struct {
-        std::recursive_mutex mtx_;
-        std::unordered_map<uint64_t, std::weak_ptr<InternalBreakpoint>> map_;
-    } breakpoints_;
+    using PageMap = std::unordered_map<uint64_t, std::shared_ptr<BreakpointPage>>;
+
+    std::shared_ptr<BreakpointPage> find_page(uint64_t physical_address) const;
+    std::shared_ptr<BreakpointPage> acquire_page(const Domain& domain, uint64_t physical_address);
+    void add_page_refs(BreakpointList::const_iterator begin, BreakpointList::const_iterator end);
+    void release(const std::shared_ptr<InternalBreakpoint>& entry, uint64_t physical_address);
+
+    std::shared_ptr<InternalBreakpoint> find_emulatable(Vcpu& vcpu, uint64_t& physical_rip,
+                                                        std::shared_ptr<BreakpointPage>& page);
+    bool decode_instruction(Vcpu& vcpu, const BreakpointPage& page, uint64_t physical_rip,
+                            const InternalBreakpoint& entry, x86::InstructionEmulator& emulator);
+
+    // Replaced as a whole under pages_mtx_ when a page is added or removed
+    AtomicSnapshot<PageMap> pages_{std::make_unique<const PageMap>()};
+    std::mutex pages_mtx_;
 
     std::atomic_bool interrupted_ = {false};
+    std::atomic<uint32_t> scoped_count_ = {0};
 };
 
 } // namespace introvirt
\ No newline at end of file
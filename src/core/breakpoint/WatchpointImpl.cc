@@ -28,33 +28,36 @@ bool WatchpointImpl::read() const { return read_; }
 bool WatchpointImpl::write() const { return write_; }
 bool WatchpointImpl::execute() const { return execute_; }
 
-void WatchpointImpl::deliver_event(Event& event) {
-    auto& mem_access = event.mem_access();
-    const bool read_violation = mem_access.read_violation();
-    const bool write_violation = mem_access.write_violation();
-    const bool execute_violation = mem_access.execute_violation();
-
+bool WatchpointImpl::matches(uint64_t physical_address, bool read_violation, bool write_violation,
+                             bool execute_violation) const {
     // Check if we care about this access
     if (!((read_violation && read()) || (write_violation && write()) ||
           (execute_violation && execute())))
-        return;
+        return false;
 
     // Check if the target address is in our range
-    guest_phys_ptr<void> addr = event.mem_access().physical_address();
-    const uint64_t pfn = addr.address() >> PageDirectory::PAGE_SHIFT;
+    const uint64_t pfn = physical_address >> PageDirectory::PAGE_SHIFT;
 
     // Check if we're in range
     if (pfn == first_pfn_ || pfn == last_pfn_) {
         if (pfn == first_pfn_)
-            if (addr.address() < first_pfn_start_)
-                return;
+            if (physical_address < first_pfn_start_)
+                return false;
         if (pfn == last_pfn_)
-            if (addr.address() > last_pfn_end_)
-                return;
+            if (physical_address > last_pfn_end_)
+                return false;
     }
 
     // If we're not the first or last page, then presumably we want this pfn.
     // If not, it's a bug in WatchpointManager.
+    return true;
+}
+
+void WatchpointImpl::deliver_event(Event& event) {
+    auto& mem_access = event.mem_access();
+    if (!matches(mem_access.physical_address().address(), mem_access.read_violation(),
+                 mem_access.write_violation(), mem_access.execute_violation()))
+        return;
 
     callback_(event);
 }
@@ -35,6 +35,17 @@ class WatchpointImpl final : public Watchpoint {
     bool write() const;
     bool execute() const;
 
+    /**
+     * @brief Check if an access would be delivered to this watchpoint
+     *
+     * @param physical_address The faulting guest physical address
+     * @param read If the access was a read
+     * @param write If the access was a write
+     * @param execute If the access was an instruction fetch
+     * @return true if the access is one we asked for and is inside of our range
+     */
+    bool matches(uint64_t physical_address, bool read, bool write, bool execute) const;
+
     void deliver_event(Event& event);
 
     WatchpointImpl(const guest_ptr<void>& ptr, uint64_t length, bool read, bool write, bool execute,
@@ -15,14 +15,17 @@
  */
 #include "WatchpointManager.hh"
 #include "WatchpointImpl.hh"
+#include "WriteTrackerImpl.hh"
 
 #include "core/domain/DomainImpl.hh"
 #include "core/domain/VcpuImpl.hh"
+#include "core/event/HypervisorEvent.hh"
 
 #include <introvirt/util/compiler.hh>
 
 #include <log4cxx/logger.h>
 
+#include <algorithm>
 #include <cassert>
 
 namespace introvirt {
@@ -30,6 +33,9 @@ namespace introvirt {
 static thread_local std::set<WatchpointMapEntry*> SteppingWatchpoints;
 static thread_local std::set<WatchpointImpl*> SteppingDelivered;
 
+// Frames whose intercepts this poller thread removed to step over an unwatched access
+static thread_local std::vector<uint64_t> AbsorbedGfns;
+
 static log4cxx::LoggerPtr
     logger(log4cxx::Logger::getLogger("introvirt.breakpoint.WatchpointManager"));
 
@@ -51,22 +57,56 @@ void InternalWatchpoint::write(bool val) { write_ = val; }
 bool InternalWatchpoint::execute() const { return execute_; }
 void InternalWatchpoint::execute(bool val) { execute_ = val; }
 
+bool InternalWatchpoint::pending() const {
+    if (enabled_)
+        return read_ != current_read_ || write_ != current_write_ || execute_ != current_execute_;
+    return current_read_ || current_write_ || current_execute_;
+}
+
 void InternalWatchpoint::update() {
-    if (enabled_) {
-        if (read_ != current_read_ || write_ != current_write_ || execute_ != current_execute_) {
-            domain_.intercept_mem_access(gfn_, read_, read_ || write_, execute_);
-            current_read_ = read_;
-            current_write_ = write_;
-            current_execute_ = execute_;
-        }
+    std::vector<MemAccessRange> batch;
+    update(batch);
+    if (!batch.empty())
+        domain_.intercept_mem_access(gfn_, batch[0].on_read, batch[0].on_write,
+                                     batch[0].on_execute);
+}
+
+void InternalWatchpoint::update(std::vector<MemAccessRange>& batch) {
+    if (!pending())
+        return;
+
+    const bool read = enabled_ && read_;
+    const bool write = enabled_ && write_;
+    const bool execute = enabled_ && execute_;
+
+    // Merge with the previous change if this frame directly follows it
+    MemAccessRange* last = batch.empty() ? nullptr : &batch.back();
+    if (last && last->gfn + last->count == gfn_ && last->on_read == read &&
+        last->on_write == (read || write) && last->on_execute == execute) {
+        ++last->count;
     } else {
-        domain_.intercept_mem_access(gfn_, false, false, false);
-        current_read_ = false;
-        current_write_ = false;
-        current_execute_ = false;
+        batch.push_back(MemAccessRange{gfn_, 1, read, read || write, execute});
     }
+
+    current_read_ = read;
+    current_write_ = write;
+    current_execute_ = execute;
+}
+
+bool InternalWatchpoint::intercepts(bool read, bool write, bool execute) const {
+    return (read && current_read_) || (write && (current_read_ || current_write_)) ||
+           (execute && current_execute_);
 }
 
+void InternalWatchpoint::forget() {
+    enabled_ = false;
+    current_read_ = false;
+    current_write_ = false;
+    current_execute_ = false;
+}
+
+DomainImpl& InternalWatchpoint::domain() const { return domain_; }
+
 InternalWatchpoint::InternalWatchpoint(DomainImpl& domain, uint64_t gfn)
     : domain_(domain), gfn_(gfn) {}
 
@@ -78,7 +118,17 @@ void WatchpointManager::interrupt() {
 
     std::lock_guard lock2(watchpoints_.mtx_);
 
-    // Disable all breakpoints
+    // Disable all watchpoints with a single bulk reset instead of one call per page
+    if (!watchpoints_.map_.empty()) {
+        auto& domain = watchpoints_.map_.begin()->second->internal_watchpoint->domain();
+        try {
+            domain.clear_mem_access_intercepts();
+            for (auto& [gfn, entry] : watchpoints_.map_)
+                entry->internal_watchpoint->forget();
+        } catch (TraceableException& ex) {
+            LOG4CXX_WARN(logger, "Failed to clear memory access intercepts: " << ex);
+        }
+    }
     watchpoints_.map_.clear();
 
     if (stepping_active_) {
@@ -93,6 +143,14 @@ inline static uint64_t round_to_page_size(uint32_t value) {
     return (value + x86::PageDirectory::PAGE_SIZE - 1) & -x86::PageDirectory::PAGE_SIZE;
 }
 
+void WatchpointManager::apply(DomainImpl& domain, const std::vector<MemAccessRange>& batch) {
+    if (batch.empty())
+        return;
+
+    LOG4CXX_DEBUG(logger, "Applying " << batch.size() << " memory access intercept ranges");
+    domain.intercept_mem_access(batch);
+}
+
 void WatchpointManager::add_ref(WatchpointImpl& watchpoint) {
     auto& domain = static_cast<DomainImpl&>(const_cast<Domain&>(watchpoint.ptr().domain()));
 
@@ -105,44 +163,52 @@ void WatchpointManager::add_ref(WatchpointImpl& watchpoint) {
     if (unlikely(interrupted_))
         return;
 
-    for (auto address = watchpoint.ptr(); address.page_number() <= end_page;
-         address += x86::PageDirectory::PAGE_SIZE) {
+    std::vector<MemAccessRange> batch;
+    try {
+        for (auto address = watchpoint.ptr(); address.page_number() <= end_page;
+             address += x86::PageDirectory::PAGE_SIZE) {
+
+            uint64_t physical_address =
+                domain.page_directory().translate(address.address(), address.page_directory());
+            const uint64_t gfn = physical_address >> PageDirectory::PAGE_SHIFT;
+            auto iter = watchpoints_.map_.find(gfn);
+            if (iter == watchpoints_.map_.end()) {
+                // Create it
+                LOG4CXX_DEBUG(logger, "Adding watchpoint for gfn 0x" << std::hex << gfn);
+                auto entry = std::make_unique<WatchpointMapEntry>();
+                entry->internal_watchpoint = std::make_unique<InternalWatchpoint>(domain, gfn);
+                iter = watchpoints_.map_.try_emplace(gfn, std::move(entry)).first;
+            }
 
-        uint64_t physical_address =
-            domain.page_directory().translate(address.address(), address.page_directory());
-        const uint64_t gfn = physical_address >> PageDirectory::PAGE_SHIFT;
-        auto iter = watchpoints_.map_.find(gfn);
-        if (iter == watchpoints_.map_.end()) {
-            // Create it
-            LOG4CXX_DEBUG(logger, "Adding watchpoint for gfn 0x" << std::hex << gfn);
-            auto entry = std::make_unique<WatchpointMapEntry>();
-            entry->internal_watchpoint = std::make_unique<InternalWatchpoint>(domain, gfn);
-            iter = watchpoints_.map_.try_emplace(gfn, std::move(entry)).first;
+            auto& entry = iter->second;
+            std::lock_guard<decltype(WatchpointMapEntry::mtx)> lock2(entry->mtx);
+
+            // Increment the requested intercepts
+            if (watchpoint.read())
+                if (++entry->read_count == 1)
+                    entry->internal_watchpoint->read(true);
+            if (watchpoint.write())
+                if (++entry->write_count == 1)
+                    entry->internal_watchpoint->write(true);
+            if (watchpoint.execute())
+                if (++entry->execute_count == 1)
+                    entry->internal_watchpoint->execute(true);
+
+            entry->internal_watchpoint->update(batch);
+            entry->watchpoint_set.emplace(&watchpoint);
         }
-
-        auto& entry = iter->second;
-        std::lock_guard<decltype(WatchpointMapEntry::mtx)> lock2(entry->mtx);
-
-        // Increment the requested intercepts
-        if (watchpoint.read())
-            if (++entry->read_count == 1)
-                entry->internal_watchpoint->read(true);
-        if (watchpoint.write())
-            if (++entry->write_count == 1)
-                entry->internal_watchpoint->write(true);
-        if (watchpoint.execute())
-            if (++entry->execute_count == 1)
-                entry->internal_watchpoint->execute(true);
-
-        entry->internal_watchpoint->update();
-        entry->watchpoint_set.emplace(&watchpoint);
+    } catch (...) {
+        // The entries already record the queued state, so it has to be applied regardless
+        apply(domain, batch);
+        throw;
     }
+    apply(domain, batch);
 }
 void WatchpointManager::remove_ref(WatchpointImpl& watchpoint) {
     // Get a copy of the address starting at the beginning of the page
     guest_ptr<uint8_t> address = watchpoint.ptr();
     address -= address.page_offset();
-    const Domain& domain = address.domain();
+    auto& domain = static_cast<DomainImpl&>(const_cast<Domain&>(address.domain()));
 
     // Round up to full pages
     const uint64_t length = round_to_page_size(watchpoint.length());
@@ -152,51 +218,59 @@ void WatchpointManager::remove_ref(WatchpointImpl& watchpoint) {
     if (unlikely(interrupted_))
         return;
 
-    for (; address.address() < end; address += x86::PageDirectory::PAGE_SIZE) {
-        const uint64_t physical_address =
-            domain.page_directory().translate(address.address(), address.page_directory());
-        const uint64_t gfn = physical_address >> PageDirectory::PAGE_SHIFT;
-
-        LOG4CXX_DEBUG(logger, "Removing watchpoint for gfn 0x" << std::hex << gfn);
-
-        auto iter = watchpoints_.map_.find(gfn);
-        if (unlikely(iter == watchpoints_.map_.end()))
-            throw std::runtime_error("Could not find gfn in WatchpointManager::remove_ref()");
+    std::vector<MemAccessRange> batch;
+    try {
+        for (; address.address() < end; address += x86::PageDirectory::PAGE_SIZE) {
+            const uint64_t physical_address =
+                domain.page_directory().translate(address.address(), address.page_directory());
+            const uint64_t gfn = physical_address >> PageDirectory::PAGE_SHIFT;
+
+            LOG4CXX_DEBUG(logger, "Removing watchpoint for gfn 0x" << std::hex << gfn);
+
+            auto iter = watchpoints_.map_.find(gfn);
+            if (unlikely(iter == watchpoints_.map_.end()))
+                throw std::runtime_error("Could not find gfn in WatchpointManager::remove_ref()");
+
+            auto& entry = iter->second;
+            std::lock_guard<decltype(WatchpointMapEntry::mtx)> lock2(entry->mtx);
+
+            LOG4CXX_DEBUG(logger, "Pre R/W/X: " << entry->read_count << "," << entry->write_count
+                                                << "," << entry->execute_count);
+
+            // Decrement stuff
+            if (watchpoint.read())
+                if (--entry->read_count == 0)
+                    entry->internal_watchpoint->read(false);
+            if (watchpoint.write())
+                if (--entry->write_count == 0)
+                    entry->internal_watchpoint->write(entry->clean_trackers > 0);
+            if (watchpoint.execute())
+                if (--entry->execute_count == 0)
+                    entry->internal_watchpoint->execute(false);
+
+            LOG4CXX_DEBUG(logger, "Post R/W/X: " << entry->read_count << "," << entry->write_count
+                                                 << "," << entry->execute_count);
+
+            entry->internal_watchpoint->update(batch);
+
+            if (entry->in_delivery) {
+                // We're in the middle of the delivery loop, queue the watchpoint up to be removed
+                LOG4CXX_DEBUG(logger,
+                              "Queued removal for watchpoint for gfn 0x" << std::hex << gfn);
+                entry->pending_delete.insert(&watchpoint);
+                continue;
+            }
 
-        auto& entry = iter->second;
-        std::lock_guard<decltype(WatchpointMapEntry::mtx)> lock2(entry->mtx);
-
-        LOG4CXX_DEBUG(logger, "Pre R/W/X: " << entry->read_count << "," << entry->write_count << ","
-                                            << entry->execute_count);
-
-        // Decrement stuff
-        if (watchpoint.read())
-            if (--entry->read_count == 0)
-                entry->internal_watchpoint->read(false);
-        if (watchpoint.write())
-            if (--entry->write_count == 0)
-                entry->internal_watchpoint->write(false);
-        if (watchpoint.execute())
-            if (--entry->execute_count == 0)
-                entry->internal_watchpoint->execute(false);
-
-        LOG4CXX_DEBUG(logger, "Post R/W/X: " << entry->read_count << "," << entry->write_count
-                                             << "," << entry->execute_count);
-
-        entry->internal_watchpoint->update();
-
-        if (entry->in_delivery) {
-            // We're in the middle of the delivery loop, queue the watchpoint up to be removed
-            LOG4CXX_DEBUG(logger, "Queued removal for watchpoint for gfn 0x" << std::hex << gfn);
-            entry->pending_delete.insert(&watchpoint);
-            continue;
+            // Not in delivery, we can remove it now.
+            entry->watchpoint_set.erase(&watchpoint);
+            if (entry->watchpoint_set.empty() && entry->trackers.empty())
+                watchpoints_.map_.erase(iter);
         }
-
-        // Not in delivery, we can remove it now.
-        entry->watchpoint_set.erase(&watchpoint);
-        if (entry->watchpoint_set.empty())
-            watchpoints_.map_.erase(iter);
+    } catch (...) {
+        apply(domain, batch);
+        throw;
     }
+    apply(domain, batch);
 }
 
 bool WatchpointManager::deliver_watchpoint(Event& event) {
@@ -223,6 +297,13 @@ bool WatchpointManager::deliver_watchpoint(Event& event) {
 
     auto& entry = iter->second;
     std::lock_guard<decltype(entry->mtx)> lock(entry->mtx);
+
+    // A write that only trackers wanted can go ahead now that the page is writable
+    if (event.mem_access().write_violation())
+        mark_written(*entry);
+    if (entry->watchpoint_set.empty())
+        return false;
+
     entry->internal_watchpoint->disable();
 
     LOG4CXX_TRACE(logger, "VCPU " << vcpu.id() << ": Delivering memory access event for "
@@ -254,7 +335,10 @@ bool WatchpointManager::deliver_watchpoint(Event& event) {
     entry->pending_delete.clear();
 
     if (entry->watchpoint_set.empty()) {
-        watchpoints_.map_.erase(iter);
+        if (entry->trackers.empty())
+            watchpoints_.map_.erase(iter);
+        else
+            entry->internal_watchpoint->enable();
         return false;
     }
 
@@ -301,6 +385,222 @@ void WatchpointManager::step(Event& event) {
     }
 }
 
+bool WatchpointManager::absorb_mem_event(const HypervisorEvent& event,
+                                         const std::function<bool()>& prepare) {
+    faults_.fetch_add(1, std::memory_order_relaxed);
+
+    if (unlikely(interrupted_))
+        return false;
+
+    // Delivery threads hold this during callbacks, don't make the poller wait for one
+    std::unique_lock<decltype(watchpoints_.mtx_)> watchpoint_lock(watchpoints_.mtx_,
+                                                                   std::try_to_lock);
+    if (!watchpoint_lock.owns_lock())
+        return false;
+
+    const uint64_t physical_address = event.mem_access_physical_address().address();
+    const uint64_t gfn = physical_address >> PageDirectory::PAGE_SHIFT;
+
+    auto iter = watchpoints_.map_.find(gfn);
+    if (iter == watchpoints_.map_.end())
+        return false;
+
+    auto& entry = iter->second;
+    std::unique_lock<decltype(entry->mtx)> lock(entry->mtx, std::try_to_lock);
+    if (!lock.owns_lock() || entry->in_delivery)
+        return false;
+
+    const bool read = event.mem_access_read();
+    const bool write = event.mem_access_write();
+    const bool execute = event.mem_access_execute();
+
+    // A write that only trackers wanted can go ahead without a step once the page is writable
+    if (write && mark_written(*entry) &&
+        !entry->internal_watchpoint->intercepts(read, write, execute)) {
+        absorbed_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    for (auto* wp : entry->watchpoint_set) {
+        if (entry->pending_delete.count(wp) == 0 &&
+            wp->matches(physical_address, read, write, execute))
+            return false;
+    }
+
+    if (!prepare())
+        return false;
+
+    LOG4CXX_TRACE(logger, "VCPU " << event.vcpu().id() << ": Absorbing memory access for 0x"
+                                  << std::hex << physical_address);
+
+    entry->internal_watchpoint->disable();
+    AbsorbedGfns.push_back(gfn);
+    absorbed_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool WatchpointManager::mark_written(WatchpointMapEntry& entry) {
+    if (entry.clean_trackers == 0)
+        return false;
+
+    for (auto& [tracker, index] : entry.trackers)
+        tracker->mark(index);
+
+    entry.clean_trackers = 0;
+    entry.internal_watchpoint->write(entry.write_count > 0);
+    entry.internal_watchpoint->update();
+    tracked_writes_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void WatchpointManager::add_tracker(WriteTrackerImpl& tracker) {
+    auto& domain = static_cast<DomainImpl&>(const_cast<Domain&>(tracker.ptr().domain()));
+
+    std::lock_guard<decltype(watchpoints_.mtx_)> watchpoint_lock(watchpoints_.mtx_);
+    if (unlikely(interrupted_))
+        return;
+
+    std::vector<MemAccessRange> batch;
+    for (uint64_t index = 0; index < tracker.page_count(); ++index) {
+        const uint64_t gfn = tracker.gfn(index);
+        auto iter = watchpoints_.map_.find(gfn);
+        if (iter == watchpoints_.map_.end()) {
+            LOG4CXX_DEBUG(logger, "Adding write tracking for gfn 0x" << std::hex << gfn);
+            auto entry = std::make_unique<WatchpointMapEntry>();
+            entry->internal_watchpoint = std::make_unique<InternalWatchpoint>(domain, gfn);
+            iter = watchpoints_.map_.try_emplace(gfn, std::move(entry)).first;
+        }
+
+        auto& entry = iter->second;
+        std::lock_guard<decltype(WatchpointMapEntry::mtx)> lock(entry->mtx);
+        entry->trackers.emplace_back(&tracker, index);
+        ++entry->clean_trackers;
+        entry->internal_watchpoint->write(true);
+        entry->internal_watchpoint->update(batch);
+    }
+    apply(domain, batch);
+}
+
+void WatchpointManager::remove_tracker(WriteTrackerImpl& tracker) {
+    auto& domain = static_cast<DomainImpl&>(const_cast<Domain&>(tracker.ptr().domain()));
+
+    std::lock_guard<decltype(watchpoints_.mtx_)> watchpoint_lock(watchpoints_.mtx_);
+    if (unlikely(interrupted_))
+        return;
+
+    std::vector<MemAccessRange> batch;
+    for (uint64_t index = 0; index < tracker.page_count(); ++index) {
+        const uint64_t gfn = tracker.gfn(index);
+        auto iter = watchpoints_.map_.find(gfn);
+        if (unlikely(iter == watchpoints_.map_.end()))
+            continue;
+
+        auto& entry = iter->second;
+        std::unique_lock<decltype(WatchpointMapEntry::mtx)> lock(entry->mtx);
+
+        auto& trackers = entry->trackers;
+        auto pos = std::find(trackers.begin(), trackers.end(), std::make_pair(&tracker, index));
+        if (pos == trackers.end())
+            continue;
+        trackers.erase(pos);
+
+        if (!tracker.dirty(index))
+            --entry->clean_trackers;
+        entry->internal_watchpoint->write(entry->write_count > 0 || entry->clean_trackers > 0);
+        entry->internal_watchpoint->update(batch);
+
+        if (entry->watchpoint_set.empty() && trackers.empty() && !entry->in_delivery) {
+            lock.unlock();
+            watchpoints_.map_.erase(iter);
+        }
+    }
+
+    // This runs from the tracker's destructor, so don't throw
+    try {
+        apply(domain, batch);
+    } catch (TraceableException& ex) {
+        LOG4CXX_WARN(logger, "Failed to remove write tracking: " << ex);
+    }
+}
+
+std::vector<bool> WatchpointManager::flip(WriteTrackerImpl& tracker) {
+    auto& domain = static_cast<DomainImpl&>(const_cast<Domain&>(tracker.ptr().domain()));
+
+    std::lock_guard<decltype(watchpoints_.mtx_)> watchpoint_lock(watchpoints_.mtx_);
+
+    // Protect the pages before the bitmap is reset, so that no write can go unrecorded
+    std::vector<MemAccessRange> batch;
+    if (likely(!interrupted_)) {
+        for (uint64_t index = 0; index < tracker.page_count(); ++index) {
+            if (!tracker.dirty(index))
+                continue;
+
+            auto iter = watchpoints_.map_.find(tracker.gfn(index));
+            if (unlikely(iter == watchpoints_.map_.end()))
+                continue;
+
+            auto& entry = iter->second;
+            std::lock_guard<decltype(WatchpointMapEntry::mtx)> lock(entry->mtx);
+            ++entry->clean_trackers;
+            entry->internal_watchpoint->write(true);
+            entry->internal_watchpoint->update(batch);
+        }
+    }
+
+    apply(domain, batch);
+
+    // Writes from now on fault, and wait for the lock to be recorded in the new epoch
+    return tracker.take();
+}
+
+bool WatchpointManager::intercepted(uint64_t gfn, bool write) {
+    std::unique_lock<decltype(watchpoints_.mtx_)> watchpoint_lock(watchpoints_.mtx_,
+                                                                   std::try_to_lock);
+    if (!watchpoint_lock.owns_lock())
+        return true;
+
+    auto iter = watchpoints_.map_.find(gfn);
+    if (iter == watchpoints_.map_.end())
+        return false;
+
+    auto& entry = iter->second;
+    std::unique_lock<decltype(entry->mtx)> lock(entry->mtx, std::try_to_lock);
+    if (!lock.owns_lock() || entry->in_delivery)
+        return true;
+
+    // Read watchpoints write protect the frame too, see InternalWatchpoint::update()
+    if (write)
+        return entry->read_count > 0 || entry->write_count > 0 || entry->clean_trackers > 0;
+    return entry->read_count > 0;
+}
+
+bool WatchpointManager::absorbing() const { return !AbsorbedGfns.empty(); }
+
+void WatchpointManager::end_absorbed_step() {
+    std::lock_guard<decltype(watchpoints_.mtx_)> watchpoint_lock(watchpoints_.mtx_);
+
+    for (uint64_t gfn : AbsorbedGfns) {
+        // The watchpoints may have been removed while we were stepping
+        auto iter = watchpoints_.map_.find(gfn);
+        if (iter == watchpoints_.map_.end())
+            continue;
+
+        auto& entry = iter->second;
+        std::lock_guard<decltype(entry->mtx)> lock(entry->mtx);
+        entry->internal_watchpoint->enable();
+    }
+    AbsorbedGfns.clear();
+}
+
+WatchpointStats WatchpointManager::stats() const {
+    WatchpointStats result;
+    result.faults = faults_.load(std::memory_order_relaxed);
+    result.absorbed = absorbed_.load(std::memory_order_relaxed);
+    result.delivered = result.faults - result.absorbed;
+    result.tracked_writes = tracked_writes_.load(std::memory_order_relaxed);
+    return result;
+}
+
 WatchpointManager::WatchpointManager() {}
 WatchpointManager::~WatchpointManager() = default;
 
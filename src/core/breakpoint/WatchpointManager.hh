@@ -15,20 +15,26 @@
  */
 #pragma once
 
+#include <introvirt/core/breakpoint/WatchpointStats.hh>
 #include <introvirt/core/event/Event.hh>
 #include <introvirt/core/memory/guest_ptr.hh>
 
 #include <atomic>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <unordered_map>
+#include <vector>
 
 namespace introvirt {
 
 class DomainImpl;
+class HypervisorEvent;
 class WatchpointImpl;
+class WriteTrackerImpl;
+struct MemAccessRange;
 
 class InternalWatchpoint final {
   public:
@@ -51,12 +57,40 @@ class InternalWatchpoint final {
     bool execute() const;
     void execute(bool val);
 
+    /**
+     * @brief Apply any pending permission changes immediately
+     */
     void update();
 
+    /**
+     * @brief Queue any pending permission changes instead of applying them
+     *
+     * Contiguous frames with the same permissions are merged into a single range.
+     *
+     * @param batch The list of changes to append to
+     */
+    void update(std::vector<MemAccessRange>& batch);
+
+    /**
+     * @brief Check if the current intercepts would fault on an access
+     */
+    bool intercepts(bool read, bool write, bool execute) const;
+
+    /**
+     * @brief Drop the intercept state without touching the hypervisor
+     *
+     * Used after the domain's intercepts have been cleared in bulk.
+     */
+    void forget();
+
+    DomainImpl& domain() const;
+
     InternalWatchpoint(DomainImpl& domain, uint64_t gfn);
     ~InternalWatchpoint();
 
   private:
+    bool pending() const;
+
     DomainImpl& domain_;
     const uint64_t gfn_;
     bool read_ = false;
@@ -74,6 +108,12 @@ struct WatchpointMapEntry {
     std::set<WatchpointImpl*> watchpoint_set;
     std::set<WatchpointImpl*> pending_delete;
 
+    // Write trackers covering this frame, with the index of the page in each
+    std::vector<std::pair<WriteTrackerImpl*, uint64_t>> trackers;
+
+    // The number of trackers that haven't seen a write to this frame in their current epoch
+    int clean_trackers = 0;
+
     int read_count = 0;
     int write_count = 0;
     int execute_count = 0;
@@ -88,15 +128,87 @@ class WatchpointManager final {
     bool handle_mem_event(Event& event);
     void step(Event& event);
 
+    /**
+     * @brief Try to step over a memory access without delivering it
+     *
+     * Called by the vcpu poller before an event is created. If the access doesn't hit the byte
+     * range of any watchpoint on the page, the page's intercept is disabled until
+     * end_absorbed_step() is called from the same thread, and the caller must single step the
+     * vcpu.
+     *
+     * This never blocks on a delivery thread; if the watchpoint state is busy the access is
+     * left for the normal path.
+     *
+     * @param event The EVENT_MEM_ACCESS event from the hypervisor
+     * @param prepare Called after the access has been checked, before the intercept is removed.
+     * Returning false leaves the access for the normal path.
+     * @return true if the access was absorbed
+     */
+    bool absorb_mem_event(const HypervisorEvent& event, const std::function<bool()>& prepare);
+
+    /**
+     * @return true if the current thread has absorbed accesses waiting for their step
+     */
+    bool absorbing() const;
+
+    /**
+     * @brief Restore the intercepts removed by absorb_mem_event() on the current thread
+     */
+    void end_absorbed_step();
+
+    /**
+     * @brief Check if an access to a frame has to be seen by the hypervisor
+     *
+     * Used by code that touches guest memory on the guest's behalf, such as the instruction
+     * emulator, so that watchpoints and write trackers still see the access. This doesn't block;
+     * if the watchpoint state is busy the frame is reported as intercepted.
+     *
+     * @param gfn The frame being accessed
+     * @param write True for a store, false for a load
+     * @return true if a watchpoint or write tracker wants to see the access
+     */
+    bool intercepted(uint64_t gfn, bool write);
+
+    WatchpointStats stats() const;
+
     void interrupt();
 
     void add_ref(WatchpointImpl& breakpoint);
     void remove_ref(WatchpointImpl& breakpoint);
 
+    /**
+     * @brief Start write protecting the pages of a tracker
+     */
+    void add_tracker(WriteTrackerImpl& tracker);
+
+    /**
+     * @brief Stop tracking the pages of a tracker
+     */
+    void remove_tracker(WriteTrackerImpl& tracker);
+
+    /**
+     * @brief Write protect the dirty pages of a tracker again, and start a new epoch
+     *
+     * @return The bitmap for the epoch that ended
+     */
+    std::vector<bool> flip(WriteTrackerImpl& tracker);
+
     WatchpointManager();
     ~WatchpointManager();
 
   private:
+    /**
+     * @brief Apply queued permission changes in one hypervisor call
+     */
+    static void apply(DomainImpl& domain, const std::vector<MemAccessRange>& batch);
+
+    /**
+     * @brief Record a write for every tracker on the frame, and stop write protecting it
+     *
+     * @return true if any tracker hadn't seen a write to the frame yet
+     */
+    bool mark_written(WatchpointMapEntry& entry);
+
     /**
      * @return true if there are still active watchpoints for this gfn
      * @return false if there are no active watchpoints for this gfn
@@ -111,6 +223,10 @@ class WatchpointManager final {
     } watchpoints_;
 
     std::atomic_bool interrupted_ = {false};
+
+    std::atomic<uint64_t> faults_ = 0;
+    std::atomic<uint64_t> absorbed_ = 0;
+    std::atomic<uint64_t> tracked_writes_ = 0;
 };
 
 } // namespace introvirt
\ No newline at end of file
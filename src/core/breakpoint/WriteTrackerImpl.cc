@@ -0,0 +1,82 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "WriteTrackerImpl.hh"
+
+#include "core/domain/DomainImpl.hh"
+
+#include <introvirt/core/exception/BufferTooSmallException.hh>
+
+namespace introvirt {
+
+uint64_t WriteTrackerImpl::page_count() const { return gfns_.size(); }
+uint64_t WriteTrackerImpl::epoch() const { return epoch_.load(std::memory_order_relaxed); }
+
+std::vector<bool> WriteTrackerImpl::dirty_pages() const {
+    std::lock_guard lock(mtx_);
+    return dirty_;
+}
+
+std::vector<bool> WriteTrackerImpl::flip() {
+    auto& domain = const_cast<DomainImpl&>(static_cast<const DomainImpl&>(ptr_.domain()));
+    return domain.watchpoint_manager().flip(*this);
+}
+
+const guest_ptr<void>& WriteTrackerImpl::ptr() const { return ptr_; }
+uint64_t WriteTrackerImpl::gfn(uint64_t index) const { return gfns_[index]; }
+
+bool WriteTrackerImpl::dirty(uint64_t index) const {
+    std::lock_guard lock(mtx_);
+    return dirty_[index];
+}
+
+bool WriteTrackerImpl::mark(uint64_t index) {
+    std::lock_guard lock(mtx_);
+    if (dirty_[index])
+        return false;
+    dirty_[index] = true;
+    return true;
+}
+
+std::vector<bool> WriteTrackerImpl::take() {
+    std::lock_guard lock(mtx_);
+    std::vector<bool> result(dirty_.size(), false);
+    result.swap(dirty_);
+    epoch_.fetch_add(1, std::memory_order_relaxed);
+    return result;
+}
+
+WriteTrackerImpl::WriteTrackerImpl(const guest_ptr<void>& ptr, uint64_t length) : ptr_(ptr) {
+    if (unlikely(length == 0))
+        throw BufferTooSmallException(1, 0);
+
+    // Translate every page up front, so that registering can't fail part way through
+    const auto& page_directory = ptr.domain().page_directory();
+    const uint64_t first_page = ptr.address() & -x86::PageDirectory::PAGE_SIZE;
+    const uint64_t end = ptr.address() + length;
+    for (uint64_t va = first_page; va < end; va += x86::PageDirectory::PAGE_SIZE) {
+        const uint64_t physical_address = page_directory.translate(va, ptr.page_directory());
+        gfns_.push_back(physical_address >> x86::PageDirectory::PAGE_SHIFT);
+    }
+    dirty_.resize(gfns_.size(), false);
+}
+
+WriteTrackerImpl::~WriteTrackerImpl() {
+    // Notify the watchpoint manager that we're done
+    auto& domain = const_cast<DomainImpl&>(static_cast<const DomainImpl&>(ptr_.domain()));
+    domain.watchpoint_manager().remove_tracker(*this);
+}
+
+} // namespace introvirt
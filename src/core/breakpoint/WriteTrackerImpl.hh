@@ -0,0 +1,73 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/breakpoint/WriteTracker.hh>
+#include <introvirt/core/memory/guest_ptr.hh>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace introvirt {
+
+class WriteTrackerImpl final : public WriteTracker {
+  public:
+    uint64_t page_count() const override;
+    uint64_t epoch() const override;
+    std::vector<bool> dirty_pages() const override;
+    std::vector<bool> flip() override;
+
+    const guest_ptr<void>& ptr() const;
+
+    /**
+     * @brief Get the guest frame that a tracked page was translated to
+     */
+    uint64_t gfn(uint64_t index) const;
+
+    /**
+     * @brief Check if a page has been written to in the current epoch
+     */
+    bool dirty(uint64_t index) const;
+
+    /**
+     * @brief Record a write to a page
+     *
+     * @return true if the page was clean
+     */
+    bool mark(uint64_t index);
+
+    /**
+     * @brief Start a new epoch
+     *
+     * @return The bitmap for the epoch that ended
+     */
+    std::vector<bool> take();
+
+    WriteTrackerImpl(const guest_ptr<void>& ptr, uint64_t length);
+    ~WriteTrackerImpl();
+
+  private:
+    const guest_ptr<void> ptr_;
+    std::vector<uint64_t> gfns_;
+
+    mutable std::mutex mtx_;
+    std::vector<bool> dirty_;
+    std::atomic<uint64_t> epoch_ = 0;
+};
+
+} // namespace introvirt
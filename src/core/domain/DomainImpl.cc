@@ -18,12 +18,15 @@
 #include "core/breakpoint/BreakpointImpl.hh"
 #include "core/breakpoint/SingleStepImpl.hh"
 #include "core/breakpoint/WatchpointImpl.hh"
+#include "core/breakpoint/WriteTrackerImpl.hh"
 #include "core/domain/VcpuImpl.hh"
 #include "core/event/EventImpl.hh"
 #include "core/event/NoOsEvent.hh"
 #include "core/event/SystemCallEventImpl.hh"
+#include "core/memory/MemorySnapshotImpl.hh"
 #include "windows/WindowsGuestImpl.hh"
 
+#include <introvirt/core/breakpoint/BreakpointRequest.hh>
 #include <introvirt/core/domain/Vcpu.hh>
 #include <introvirt/core/event/EventFilter.hh>
 #include <introvirt/core/event/ThreadLocalEvent.hh>
@@ -69,24 +72,64 @@ void DomainImpl::step_breakpoints(Event& event) {
     resume_all_other_vcpus(vcpu);
 }
 
+// Set while this thread holds bp_mutex_ with the other VCPUs paused to step over a breakpoint
+static thread_local bool tls_breakpoint_paused_;
+
+// For each injection started on this thread, whether start_injection() released the pause
+static thread_local std::vector<bool> tls_injection_released_;
+
 void DomainImpl::handle_breakpoint(Event& event) {
-    std::unique_ptr<Event> new_event;
-    Event* working_event = &event;
     auto& vcpu = event.vcpu();
 
-    // We only want one of these to happen at a time
-    std::lock_guard lock(bp_mutex_);
+    // Without a guest there's no injection, and no task information to check it with
+    bool deliver_events = true;
+    if (guest_) {
+        std::lock_guard lock(injection_tids_.mtx_);
+        deliver_events = injection_tids_.set_.count(event.task().tid()) == 0;
+    }
 
+    // Try to get past the breakpoint without stopping the other VCPUs.
+    // Leave it alone if someone is single stepping this VCPU, they expect to see the step.
+    bool step_only = false;
+    if (event.type() == EventType::EVENT_EXCEPTION &&
+        breakpoint_emulation_.load(std::memory_order_relaxed) &&
+        !static_cast<VcpuImpl&>(vcpu).single_step()) {
+
+        switch (breakpoint_manager_.handle_int3_emulated(event, deliver_events)) {
+        case BreakpointManager::EmulationResult::HANDLED:
+            return;
+        case BreakpointManager::EmulationResult::STEP_REQUIRED:
+            step_only = true;
+            break;
+        case BreakpointManager::EmulationResult::NOT_HANDLED:
+            break;
+        }
+    }
+
+    // Stepping requires every other VCPU to be stopped, so only one of these can happen at a time
+    std::lock_guard lock(bp_mutex_);
     pause_all_other_vcpus(vcpu);
 
-    bool deliver_events;
-    {
-        std::lock_guard lock(injection_tids_.mtx_);
-        deliver_events = injection_tids_.set_.count(event.task().tid()) == 0;
+    const bool was_paused = tls_breakpoint_paused_;
+    tls_breakpoint_paused_ = true;
+    step_over_breakpoint(event, deliver_events, step_only);
+    tls_breakpoint_paused_ = was_paused;
+}
+
+void DomainImpl::step_over_breakpoint(Event& event, bool deliver_events, bool step_only) {
+    std::unique_ptr<Event> new_event;
+    Event* working_event = &event;
+    auto& vcpu = event.vcpu();
+    bool step_required;
+
+    if (step_only) {
+        // The callbacks have already been delivered
+        breakpoint_manager_.disarm_active();
+        goto step;
     }
 
 retry:
-    bool step_required = false;
+    step_required = false;
 
     switch (working_event->type()) {
     case EventType::EVENT_EXCEPTION:
@@ -105,6 +148,7 @@ retry:
         return;
     }
 
+step:
     const uint64_t old_rip = vcpu.registers().rip();
 
     LOG4CXX_TRACE(logger, "Stepping VCPU " << vcpu.id());
@@ -138,21 +182,99 @@ done:
     resume_all_other_vcpus(event.vcpu());
 }
 
+// Time spent in get_guest_event() by the current poller thread, for event timing
+static thread_local uint64_t tls_construct_ns_;
+
 std::unique_ptr<Event>
 DomainImpl::get_guest_event(std::unique_ptr<HypervisorEvent>&& hypervisor_event) {
+    const uint64_t start = event_timing_.enabled() ? EventTimingRecorder::now() : 0;
+
+    std::unique_ptr<Event> result;
     if (guest_) {
         // We have guest support, wrap the hypervisor event
-        return guest_->impl().filter_event(std::move(hypervisor_event));
+        result = guest_->impl().filter_event(std::move(hypervisor_event));
     } else {
         // No guest support.
-        return std::make_unique<NoOsEvent>(std::move(hypervisor_event));
+        result = std::make_unique<NoOsEvent>(std::move(hypervisor_event));
+    }
+
+    if (unlikely(start))
+        tls_construct_ns_ += EventTimingRecorder::now() - start;
+    return result;
+}
+
+bool DomainImpl::absorb_watchpoint_event(HypervisorEvent& event) {
+    auto& vcpu = static_cast<VcpuImpl&>(event.vcpu());
+    const bool stepping = watchpoint_manager_.absorbing();
+
+    if (event.type() == EventType::EVENT_MEM_ACCESS) {
+        const bool absorbed = watchpoint_manager_.absorb_mem_event(event, [&]() {
+            // An instruction can touch more than one watched page, those all share the same step
+            if (stepping)
+                return true;
+
+            // Leave it alone if someone is single stepping this VCPU, they expect to see the step.
+            // If the slow path is busy stepping, don't wait for it in the poller.
+            if (vcpu.single_step() || !bp_mutex_.try_lock())
+                return false;
+
+            // Nothing else may run through the page while its intercept is off
+            pause_all_other_vcpus(vcpu);
+            vcpu.single_step(true);
+            return true;
+        });
+
+        if (absorbed)
+            return true;
     }
+
+    if (!stepping)
+        return false;
+
+    // Either the instruction completed, or something else happened first. Restore the intercepts
+    // and let anything but our own step through.
+    end_absorbed_step(vcpu);
+    return event.type() == EventType::EVENT_SINGLE_STEP;
+}
+
+void DomainImpl::end_absorbed_step(VcpuImpl& vcpu) {
+    vcpu.single_step(false);
+    watchpoint_manager_.end_absorbed_step();
+    resume_all_other_vcpus(vcpu);
+    bp_mutex_.unlock();
 }
 
 std::unique_ptr<Event>
 DomainImpl::filter_event(std::unique_ptr<HypervisorEvent>&& hypervisor_event) {
     auto& vcpu = hypervisor_event->vcpu();
 
+    // Keep the translation cache coherent before anything walks the page tables
+    switch (hypervisor_event->type()) {
+    case EventType::EVENT_CR_WRITE:
+        if (hypervisor_event->control_register() == 3) {
+            const uint64_t cr3 = hypervisor_event->control_register_value();
+            if (page_directory_.translation_cache())
+                page_directory_.load(vcpu.id(), cr3, vcpu.registers().cr4().pcide());
+
+            // Only let system calls exit while the vcpu runs a process we might want
+            if (targeted_syscalls_.load(std::memory_order_relaxed) && guest_) {
+                const auto match = guest_->impl().match_page_directory(cr3, task_filter_);
+                static_cast<VcpuImpl&>(vcpu).system_call_gate(match.value_or(true));
+            }
+        } else if (hypervisor_event->control_register() == 4) {
+            // Toggling CR4.PGE flushes the TLB, including global pages, so drop everything.
+            // Windows does this for a full flush, which has no INVLPG for each page.
+            if (page_directory_.translation_cache())
+                page_directory_.flush();
+        }
+        break;
+    case EventType::EVENT_INVLPG:
+        page_directory_.invalidate_page(hypervisor_event->invlpg_address());
+        break;
+    default:
+        break;
+    }
+
     // Before we do anything, check if there is a stepping event for the current vcpu
     {
         std::lock_guard lock(stepping_events_.mtx_);
@@ -175,6 +297,13 @@ DomainImpl::filter_event(std::unique_ptr<HypervisorEvent>&& hypervisor_event) {
         }
     }
 
+    // Step over watchpoint faults that no watchpoint wants without creating an event for them
+    if (hypervisor_event->type() == EventType::EVENT_MEM_ACCESS ||
+        unlikely(watchpoint_manager_.absorbing())) {
+        if (absorb_watchpoint_event(*hypervisor_event))
+            return nullptr;
+    }
+
     // Check if there is another thread pending for this thread
     {
         std::unique_lock lock(suspended_events_.mtx_);
@@ -225,6 +354,14 @@ DomainImpl::filter_event(std::unique_ptr<HypervisorEvent>&& hypervisor_event) {
         }
     }
 
+    // Step over breakpoints scoped to other address spaces without creating an event for them
+    if (hypervisor_event->type() == EventType::EVENT_EXCEPTION &&
+        hypervisor_event->exception() == x86::Exception::INT3 && breakpoint_manager_.scoped() &&
+        breakpoint_emulation_.load(std::memory_order_relaxed) &&
+        !static_cast<VcpuImpl&>(vcpu).single_step() && breakpoint_manager_.absorb_int3(vcpu)) {
+        return nullptr;
+    }
+
     if (hypervisor_event->type() == EventType::EVENT_CR_WRITE) {
         // Verify the VCPU is configured to want it
         if (!hypervisor_event->vcpu().intercept_cr_writes(hypervisor_event->control_register())) {
@@ -233,7 +370,16 @@ DomainImpl::filter_event(std::unique_ptr<HypervisorEvent>&& hypervisor_event) {
     }
 
     if (hypervisor_event->type() == EventType::EVENT_FAST_SYSCALL_RET) {
-        // This would've been handled by a suspended thread above
+        // Returns hooked without parking a thread are correlated here
+        if (pending_returns_.count_.load(std::memory_order_acquire) != 0 && guest_)
+            return take_pending_syscall_return(std::move(hypervisor_event));
+
+        // Otherwise this would've been handled by a suspended thread above
+        return nullptr;
+    }
+
+    if (hypervisor_event->type() == EventType::EVENT_INVLPG) {
+        // Only used internally
         return nullptr;
     }
 
@@ -251,6 +397,10 @@ DomainImpl::filter_event(std::unique_ptr<HypervisorEvent>&& hypervisor_event) {
         if (!matches_syscall_filters(vcpu))
             return nullptr;
 
+        // Drop calls from processes the task filter is known to reject, before parsing anything
+        if (guest_ && !guest_->impl().prefilter_event(*hypervisor_event, task_filter_))
+            return nullptr;
+
         // Matches our filter, jump down to test the task filter
         event = get_guest_event(std::move(hypervisor_event));
         goto check_task_filter;
@@ -292,7 +442,39 @@ void DomainImpl::resume() {
     }
 }
 
+bool DomainImpl::detect_guest(VcpuImpl& v) {
+    const bool is64bit = v.registers().efer().lme();
+    page_directory_.reconfigure(v);
+
+    // Try a Windows guest
+    try {
+        using namespace windows;
+
+        if (is64bit)
+            guest_ = std::make_unique<WindowsGuestImpl<uint64_t>>(*this);
+        else
+            guest_ = std::make_unique<WindowsGuestImpl<uint32_t>>(*this);
+
+        return true;
+    } catch (GuestDetectionException& ex) {
+        LOG4CXX_DEBUG(logger, "Failed to detect WindowsGuest: " << ex);
+    }
+    return false;
+}
+
 bool DomainImpl::detect_guest() {
+    if (pollfds_.empty()) {
+        // No events to wait for (e.g., a memory image). The vcpus never run, so use vcpu 0 as-is.
+        std::unique_lock<std::shared_mutex> lock(event_filter_mtx_);
+        LOG4CXX_DEBUG(logger, "Attempting OS detection on a stopped domain...");
+        try {
+            return detect_guest(static_cast<VcpuImpl&>(vcpu(0)));
+        } catch (TraceableException& ex) {
+            LOG4CXX_ERROR(logger, "Failed to detect OS: " << ex);
+        }
+        return false;
+    }
+
     uint64_t efd_init = 0;
     if (unlikely(::write(efd_, &efd_init, sizeof(efd_init)) < 0)) {
         LOG4CXX_ERROR(logger, "Failed to clear eventfd");
@@ -341,22 +523,9 @@ bool DomainImpl::detect_guest() {
                         if (!event)
                             continue;
 
-                        const bool is64bit = v.registers().efer().lme();
-                        page_directory_.reconfigure(v);
-
-                        // Try a Windows guest
-                        try {
-                            using namespace windows;
-
-                            if (is64bit)
-                                guest_ = std::make_unique<WindowsGuestImpl<uint64_t>>(*this);
-                            else
-                                guest_ = std::make_unique<WindowsGuestImpl<uint32_t>>(*this);
-
+                        if (detect_guest(v)) {
                             result = true;
                             goto done;
-                        } catch (GuestDetectionException& ex) {
-                            LOG4CXX_DEBUG(logger, "Failed to detect WindowsGuest: " << ex);
                         }
                     }
                 }
@@ -386,6 +555,38 @@ void DomainImpl::intercept_system_calls(bool enabled) {
     }
 }
 
+void DomainImpl::targeted_system_calls(bool enabled) {
+    std::lock_guard lock(targeted_syscalls_mtx_);
+    if (enabled == targeted_syscalls_)
+        return;
+
+    // Every system call would exit twice for the CR3 writes, which is worse than not gating
+    if (enabled && guest_ && guest_->impl().kva_shadowing()) {
+        throw NotImplementedException(
+            "Targeted system calls are not supported when the guest uses KVA shadowing");
+    }
+
+    if (!enabled)
+        targeted_syscalls_ = false;
+
+    for (uint32_t i = 0; i < vcpu_count(); ++i) {
+        auto& v = static_cast<VcpuImpl&>(vcpu(i));
+        if (enabled) {
+            v.add_cr_write_intercept_ref(3);
+        } else {
+            v.remove_cr_write_intercept_ref(3);
+            v.system_call_gate(true);
+        }
+    }
+
+    if (enabled)
+        targeted_syscalls_ = true;
+
+    LOG4CXX_DEBUG(logger, "Targeted system calls " << (enabled ? "enabled" : "disabled"));
+}
+
+bool DomainImpl::targeted_system_calls() const { return targeted_syscalls_; }
+
 void DomainImpl::intercept_cr_writes(int cr, bool enabled) {
     for (unsigned int i = 0; i < vcpu_count(); ++i) {
         vcpu(i).intercept_cr_writes(cr, enabled);
@@ -427,19 +628,22 @@ inline bool DomainImpl::matches_syscall_filters(const Vcpu& vcpu) const {
     return true;
 }
 
-struct worker_thread_info {
-    std::thread thread;
-    std::mutex mtx;
-    std::unique_ptr<Event> event;
-    std::atomic_bool completed = false;
-};
-
-void DomainImpl::event_deliverer(EventCallback* callback, struct worker_thread_info* worker_info) {
+void DomainImpl::event_deliverer(EventCallback* callback, EventDeliveryPool::Slot& slot) {
 restart:
     DomainImpl::thread_local_domain(*this);
-    Event* event = worker_info->event.get();
+    Event* event = slot.event.get();
     ThreadLocalEvent::set(*event);
 
+    // Only events that the poller started timing are recorded
+    const EventTimestamps timestamps = event->impl().timestamps();
+    uint64_t dequeued = timestamps.fetch_start ? EventTimingRecorder::now() : 0;
+    uint64_t callback_end = 0;
+    const uint32_t vcpu_id = event->vcpu().id();
+    const EventType type = event->type();
+    const uint64_t syscall_index = (dequeued && guest_ && type == EventType::EVENT_FAST_SYSCALL)
+                                       ? event->syscall().raw_index()
+                                       : EventTimingRecorder::NO_SYSCALL;
+
     try {
         switch (event->type()) {
         case EventType::EVENT_EXCEPTION:
@@ -456,7 +660,11 @@ restart:
         if (event)
             callback->process_event(*event);
 
-        if (event->type() == EventType::EVENT_FAST_SYSCALL) {
+        if (dequeued)
+            callback_end = EventTimingRecorder::now();
+
+        // Without a guest there's no system call information, so nothing was injected or hooked
+        if (event->type() == EventType::EVENT_FAST_SYSCALL && guest_) {
 
             if (event->impl().injection_performed()) {
                 // If injection was performed, RIP was changed, so the instruction will not be
@@ -489,6 +697,15 @@ restart:
             if (event->syscall().hook_return()) {
                 if (event->syscall().handler() && event->syscall().handler()->will_return()) {
 
+                    if (syscall_return_correlation_.load(std::memory_order_relaxed)) {
+                        // The return will be matched up in filter_event()
+                        add_pending_syscall_return(*event);
+                        goto done;
+                    }
+
+                    // The vcpu is resumed while we wait, so the wait isn't part of the timing
+                    dequeued = 0;
+
                     // Bad naming here, but we want to prevent system calls from being turned off
                     static_cast<VcpuImpl&>(event->vcpu()).syscall_injection_start();
 
@@ -523,7 +740,10 @@ restart:
                                                   << event->syscall().name());
 
                         event->impl().discard(true);
-                        worker_info->event = std::move(return_event);
+                        {
+                            std::lock_guard lock(slot.mtx);
+                            slot.event = std::move(return_event);
+                        }
 
                         auto& vcpu = event->vcpu();
                         if (!vcpu.intercept_system_calls())
@@ -568,9 +788,18 @@ restart:
     }
 
 done:
-    std::lock_guard lock(worker_info->mtx);
-    worker_info->event.reset();
-    worker_info->completed = true;
+    if (dequeued && !callback_end)
+        callback_end = EventTimingRecorder::now();
+
+    {
+        std::lock_guard lock(slot.mtx);
+        slot.event.reset();
+    }
+
+    if (dequeued) {
+        event_timing_.record_delivered(vcpu_id, type, syscall_index, timestamps, dequeued,
+                                       callback_end, EventTimingRecorder::now());
+    }
 }
 
 void DomainImpl::vcpu_poller_thread(Vcpu* ivcpu, EventCallback* callback, int efd) {
@@ -578,7 +807,6 @@ void DomainImpl::vcpu_poller_thread(Vcpu* ivcpu, EventCallback* callback, int ef
     DomainImpl::thread_local_domain(*this);
 
     struct pollfd fd_entries[2];
-    std::list<worker_thread_info> threads;
 
     fd_entries[0].fd = vcpu.event_fd();
     fd_entries[0].events = POLLIN;
@@ -597,34 +825,48 @@ void DomainImpl::vcpu_poller_thread(Vcpu* ivcpu, EventCallback* callback, int ef
                                                     << ": Interrupted by eventfd");
 
                     // Interrupt all suspended threads
-                    for (auto& entry : threads) {
-                        std::lock_guard lock(entry.mtx);
-                        if (!entry.completed) {
-                            entry.event->impl().interrupt();
-                            LOG4CXX_DEBUG(logger, "Interrupted suspended thread");
-                        }
-                    }
+                    delivery_pool_.interrupt();
 
                     break;
                 }
 
                 // Check if the vcpu has an event
                 if (likely(fd_entries[0].revents & POLLIN)) {
+                    EventTimestamps timestamps;
+                    const bool timed = event_timing_.enabled();
+                    if (unlikely(timed)) {
+                        tls_construct_ns_ = 0;
+                        timestamps.fetch_start = EventTimingRecorder::now();
+                    }
+
                     std::unique_ptr<HypervisorEvent> hypervisor_event = vcpu.event();
 
                     if (unlikely(hypervisor_event == nullptr))
                         continue;
 
+                    if (unlikely(recording_.load(std::memory_order_relaxed)))
+                        record_event(*hypervisor_event);
+
+                    const EventType type = hypervisor_event->type();
+                    if (unlikely(timed))
+                        timestamps.fetch_end = EventTimingRecorder::now();
+
                     auto event = filter_event(std::move(hypervisor_event));
+
+                    if (unlikely(timed)) {
+                        timestamps.filter_end = EventTimingRecorder::now();
+                        timestamps.construct_ns = tls_construct_ns_;
+                        if (event)
+                            event->impl().timestamps() = timestamps;
+                        else
+                            event_timing_.record_filtered(vcpu.id(), type, timestamps);
+                    }
+
                     if (!event)
                         continue;
 
                     try {
-                        worker_thread_info& entry = threads.emplace_back();
-                        entry.event = std::move(event);
-                        entry.thread =
-                            std::thread(&DomainImpl::event_deliverer, this, callback, &entry);
-
+                        delivery_pool_.submit(vcpu.id(), std::move(event));
                     } catch (TraceableException& ex) {
                         LOG4CXX_WARN(logger, "Domain " << name() << " Vcpu " << vcpu.id()
                                                        << " poller threw an exception: " << ex);
@@ -632,22 +874,6 @@ void DomainImpl::vcpu_poller_thread(Vcpu* ivcpu, EventCallback* callback, int ef
                     }
                 }
             }
-
-            // Expire dead threads
-            for (auto iter = threads.begin(); iter != threads.end();) {
-                auto& entry = *iter;
-
-                std::unique_lock lock(entry.mtx, std::try_to_lock);
-                if (lock.owns_lock() && entry.completed) {
-                    if (entry.thread.joinable())
-                        entry.thread.join();
-
-                    lock.unlock();
-                    iter = threads.erase(iter);
-                } else {
-                    ++iter;
-                }
-            }
         } catch (EventPollException& ex) {
             LOG4CXX_WARN(logger, "Vcpu " << vcpu.id() << " poll exception");
             vcpu.domain().interrupt();
@@ -655,10 +881,14 @@ void DomainImpl::vcpu_poller_thread(Vcpu* ivcpu, EventCallback* callback, int ef
         }
     }
 
-    // Wait for all threads to exit
-    for (auto& entry : threads) {
-        if (entry.thread.joinable())
-            entry.thread.join();
+    // Don't leave the other VCPUs paused if we were interrupted during a step
+    if (unlikely(watchpoint_manager_.absorbing())) {
+        try {
+            end_absorbed_step(vcpu);
+        } catch (TraceableException& ex) {
+            LOG4CXX_WARN(logger,
+                         "Vcpu " << vcpu.id() << " failed to finish watchpoint step: " << ex);
+        }
     }
 }
 
@@ -675,6 +905,11 @@ void DomainImpl::poll(EventCallback& callback) {
     sigfillset(&set);
     pthread_sigmask(SIG_SETMASK, &set, &oldset);
 
+    // Start the threads that deliver events to the callback
+    delivery_pool_.start(vcpu_count(), [this, &callback](EventDeliveryPool::Slot& slot) {
+        event_deliverer(&callback, slot);
+    });
+
     // Create a thread for each Vcpu
     std::vector<std::thread> pollers_threads;
     for (uint32_t i = 0; i < vcpu_count(); ++i) {
@@ -691,6 +926,199 @@ void DomainImpl::poll(EventCallback& callback) {
     for (std::thread& thread : pollers_threads) {
         thread.join();
     }
+
+    // Wait for in-flight events to finish
+    delivery_pool_.stop();
+
+    // Nothing will deliver the returns that are still pending
+    clear_pending_syscall_returns();
+}
+
+void DomainImpl::add_pending_syscall_return(Event& event) {
+    auto& vcpu = static_cast<VcpuImpl&>(event.vcpu());
+    const uint64_t thread_id = event.impl().thread_id();
+    const uint64_t return_rsp = vcpu.registers().rsp();
+
+    PendingSyscallReturn pending;
+    pending.handler = event.syscall().impl().release_handler();
+    pending.raw_index = event.syscall().raw_index();
+    pending.vcpu = &vcpu;
+
+    // Keep system call interception on until the return arrives
+    vcpu.syscall_injection_start();
+
+    std::vector<PendingSyscallReturn> stale;
+    {
+        std::lock_guard lock(pending_returns_.mtx_);
+        auto& calls = pending_returns_.map_[thread_id];
+
+        /*
+         * Nested calls (from an APC during an alertable wait, for example) are made further down
+         * the stack. A pending call at or below the current stack pointer must have returned
+         * without us seeing it, or belonged to a thread that has since exited.
+         */
+        auto end = calls.upper_bound(return_rsp);
+        for (auto iter = calls.begin(); iter != end; ++iter)
+            stale.push_back(std::move(iter->second));
+        calls.erase(calls.begin(), end);
+
+        calls.emplace(return_rsp, std::move(pending));
+        pending_returns_.count_.fetch_add(1, std::memory_order_release);
+        pending_returns_.count_.fetch_sub(stale.size(), std::memory_order_relaxed);
+    }
+
+    for (auto& entry : stale) {
+        LOG4CXX_DEBUG(logger, "Dropping stale system call return for thread 0x"
+                                  << std::hex << thread_id << ": " << entry.handler->name());
+        entry.vcpu->syscall_injection_end();
+    }
+}
+
+std::unique_ptr<Event>
+DomainImpl::take_pending_syscall_return(std::unique_ptr<HypervisorEvent>&& hypervisor_event) {
+    auto& vcpu = hypervisor_event->vcpu();
+    const uint64_t thread_id = guest_->impl().get_current_thread_id(vcpu);
+    const uint64_t rsp = vcpu.registers().rsp();
+
+    PendingSyscallReturn pending;
+    {
+        std::lock_guard lock(pending_returns_.mtx_);
+        auto thread_iter = pending_returns_.map_.find(thread_id);
+        if (thread_iter == pending_returns_.map_.end())
+            return nullptr;
+
+        auto& calls = thread_iter->second;
+        auto iter = calls.find(rsp);
+        if (iter == calls.end()) {
+            // This is not necessarily a bug, but can happen when the kernel
+            // runs stuff in the context of the thread that is waiting.
+            LOG4CXX_TRACE(logger, "Thread 0x" << std::hex << thread_id
+                                              << " has no pending call for return rsp 0x" << rsp);
+            return nullptr;
+        }
+
+        pending = std::move(iter->second);
+        calls.erase(iter);
+        if (calls.empty())
+            pending_returns_.map_.erase(thread_iter);
+        pending_returns_.count_.fetch_sub(1, std::memory_order_release);
+    }
+
+    // It's okay for system calls to be disabled now
+    pending.vcpu->syscall_injection_end();
+
+    auto event = get_guest_event(std::move(hypervisor_event));
+
+    // Set the system call index from the original call
+    event->syscall().impl().raw_index(pending.raw_index);
+
+    // Give the original handler the new data, and pass it in to the new event
+    pending.handler->handle_return_event(*event);
+    event->syscall().impl().handler(std::move(pending.handler));
+
+    return event;
+}
+
+void DomainImpl::clear_pending_syscall_returns() {
+    std::unordered_map<uint64_t, std::map<uint64_t, PendingSyscallReturn>> pending;
+    {
+        std::lock_guard lock(pending_returns_.mtx_);
+        pending.swap(pending_returns_.map_);
+        pending_returns_.count_.store(0, std::memory_order_release);
+    }
+
+    for (auto& [thread_id, calls] : pending) {
+        for (auto& [rsp, entry] : calls)
+            entry.vcpu->syscall_injection_end();
+    }
+}
+
+void DomainImpl::syscall_return_correlation(bool enabled) {
+    syscall_return_correlation_.store(enabled, std::memory_order_relaxed);
+}
+
+bool DomainImpl::syscall_return_correlation() const {
+    return syscall_return_correlation_.load(std::memory_order_relaxed);
+}
+
+void DomainImpl::breakpoint_emulation(bool enabled) {
+    breakpoint_emulation_.store(enabled, std::memory_order_relaxed);
+}
+
+bool DomainImpl::breakpoint_emulation() const {
+    return breakpoint_emulation_.load(std::memory_order_relaxed);
+}
+
+void DomainImpl::event_delivery_threads(uint32_t count) { delivery_pool_.threads(count); }
+uint32_t DomainImpl::event_delivery_threads() const { return delivery_pool_.threads(); }
+
+void DomainImpl::event_delivery_queue_depth(uint32_t depth) { delivery_pool_.queue_depth(depth); }
+uint32_t DomainImpl::event_delivery_queue_depth() const { return delivery_pool_.queue_depth(); }
+
+void DomainImpl::event_timing(bool enabled) { event_timing_.enable(enabled, vcpu_count()); }
+bool DomainImpl::event_timing() const { return event_timing_.enabled(); }
+EventTimingStats DomainImpl::event_timing_stats() const { return event_timing_.stats(); }
+
+void DomainImpl::record_events(const std::string& path) {
+    std::lock_guard lock(event_log_mtx_);
+
+    std::shared_ptr<EventLogWriter> writer;
+    if (!path.empty()) {
+        writer = std::make_shared<EventLogWriter>(path, vcpu_count());
+
+        // Every vcpu's starting state goes first, so nothing can run in between
+        pause();
+        try {
+            for (uint32_t i = 0; i < vcpu_count(); ++i)
+                writer->record_vcpu(vcpu(i));
+        } catch (...) {
+            resume();
+            throw;
+        }
+        std::atomic_store(&event_log_, writer);
+        recording_ = true;
+        resume();
+    } else {
+        recording_ = false;
+        std::atomic_store(&event_log_, writer);
+    }
+}
+
+bool DomainImpl::recording_events() const { return recording_.load(std::memory_order_relaxed); }
+
+void DomainImpl::record_event(const HypervisorEvent& event) {
+    auto writer = std::atomic_load(&event_log_);
+    if (unlikely(writer == nullptr))
+        return;
+
+    try {
+        writer->record_event(event);
+    } catch (TraceableException& ex) {
+        LOG4CXX_ERROR(logger, "Stopping event recording: " << ex);
+        recording_ = false;
+    }
+}
+
+void DomainImpl::record_pages_slow(const uint64_t* pfns, size_t count,
+                                   const GuestMemoryMapping& mapping) const {
+    auto writer = std::atomic_load(&event_log_);
+    if (unlikely(writer == nullptr))
+        return;
+
+    try {
+        writer->record_pages(pfns, count, mapping.get());
+    } catch (TraceableException& ex) {
+        LOG4CXX_ERROR(logger, "Stopping event recording: " << ex);
+        recording_ = false;
+    }
+}
+
+WatchpointStats DomainImpl::watchpoint_stats() const { return watchpoint_manager_.stats(); }
+
+EventDeliveryStats DomainImpl::event_delivery_stats() const {
+    EventDeliveryStats result = delivery_pool_.stats();
+    result.pending_syscall_returns = pending_returns_.count_.load(std::memory_order_relaxed);
+    return result;
 }
 
 void DomainImpl::initialize() {
@@ -701,6 +1129,10 @@ void DomainImpl::initialize() {
         vcpu0.resume();
     }
 
+    for (uint32_t i = 0; i < vcpu_count(); ++i) {
+        stepping_events_.by_vcpu_.push_back(nullptr);
+    }
+
     try {
         for (uint32_t i = 0; i < vcpu_count(); ++i) {
             struct pollfd fd_entry;
@@ -708,8 +1140,6 @@ void DomainImpl::initialize() {
             fd_entry.events = POLLIN;
             fd_entry.revents = 0;
             pollfds_.push_back(fd_entry);
-
-            stepping_events_.by_vcpu_.push_back(nullptr);
         }
         // Add the eventfd descriptor
         struct pollfd fd_entry;
@@ -718,9 +1148,9 @@ void DomainImpl::initialize() {
         fd_entry.revents = 0;
         pollfds_.push_back(fd_entry);
     } catch (NotImplementedException& ex) {
-        // The base class should be overriding poll() if this happens
-        LOG4CXX_ERROR(logger, "Domain " << id() << " does not support VCPU level polling");
-        throw;
+        // The subclass has to override poll() if this happens
+        LOG4CXX_DEBUG(logger, "Domain " << id() << " does not support VCPU level polling");
+        pollfds_.clear();
     }
 }
 
@@ -745,11 +1175,60 @@ void DomainImpl::resume_all_other_vcpus(const Vcpu& v) {
 std::shared_ptr<Breakpoint> DomainImpl::create_breakpoint(const guest_ptr<void>& address,
                                                           std::function<void(Event&)> callback) {
 
-    auto result = std::make_shared<BreakpointImpl>(address, callback);
+    const uint64_t physical_address =
+        page_directory_.translate(address.address(), address.page_directory());
+
+    auto result = std::make_shared<BreakpointImpl>(*this, physical_address, callback);
     breakpoint_manager_.add_ref(result);
     return result;
 }
 
+std::vector<std::shared_ptr<Breakpoint>>
+DomainImpl::create_breakpoints(const std::vector<BreakpointRequest>& requests) {
+    std::vector<std::shared_ptr<Breakpoint>> result(requests.size());
+
+    // Translate everything up front. Sites that aren't present are left as nullptr.
+    BreakpointManager::BreakpointList breakpoints;
+    breakpoints.reserve(requests.size());
+    for (size_t i = 0; i < requests.size(); ++i) {
+        const auto& address = requests[i].address;
+        const auto physical_address =
+            page_directory_.try_translate(address.address(), address.page_directory());
+        if (!physical_address) {
+            LOG4CXX_DEBUG(logger, "Breakpoint address not present: " << address);
+            continue;
+        }
+
+        // Compare page directories without the PCID and high bits
+        std::vector<uint64_t> scope;
+        scope.reserve(requests[i].page_directories.size());
+        for (uint64_t page_directory : requests[i].page_directories)
+            scope.push_back(x86::PageDirectory::directory_table_base(page_directory));
+
+        auto breakpoint = std::make_shared<BreakpointImpl>(*this, *physical_address,
+                                                           requests[i].callback, std::move(scope));
+        result[i] = breakpoint;
+        breakpoints.push_back(std::move(breakpoint));
+    }
+
+    // Install them all in one pause, so the guest never runs with part of the set
+    pause();
+    try {
+        breakpoint_manager_.add_refs(std::move(breakpoints));
+    } catch (...) {
+        resume();
+        throw;
+    }
+    resume();
+
+    // Anything that didn't get installed failed
+    for (auto& entry : result) {
+        if (entry && !static_cast<BreakpointImpl&>(*entry).internal_breakpoint())
+            entry.reset();
+    }
+    return result;
+}
+
 std::unique_ptr<Watchpoint> DomainImpl::create_watchpoint(const guest_ptr<void>& address,
                                                           uint64_t length, bool read, bool write,
                                                           bool execute,
@@ -759,6 +1238,13 @@ std::unique_ptr<Watchpoint> DomainImpl::create_watchpoint(const guest_ptr<void>&
     return result;
 }
 
+std::unique_ptr<WriteTracker> DomainImpl::create_write_tracker(const guest_ptr<void>& address,
+                                                               uint64_t length) {
+    auto result = std::make_unique<WriteTrackerImpl>(address, length);
+    watchpoint_manager_.add_tracker(*result);
+    return result;
+}
+
 std::unique_ptr<SingleStep> DomainImpl::single_step(Vcpu& vcpu,
                                                     std::function<void(Event&)> callback) {
     auto result = std::make_unique<SingleStepImpl>(vcpu, callback);
@@ -791,18 +1277,16 @@ void DomainImpl::start_injection(Event& event) {
 
     breakpoint_manager_.start_injection();
 
-    switch (event.type()) {
-    case EventType::EVENT_EXCEPTION:
-        if (event.exception().vector() != x86::Exception::INT3)
-            break;
-        // Fall through
-    case EventType::EVENT_MEM_ACCESS:
+    // Let the other VCPUs run while the injection is in progress.
+    // Breakpoints that were emulated never paused them in the first place.
+    bool released = false;
+    if (tls_breakpoint_paused_) {
         resume_all_other_vcpus(event.vcpu());
         bp_mutex_.unlock();
-        break;
-    default:
-        break;
+        tls_breakpoint_paused_ = false;
+        released = true;
     }
+    tls_injection_released_.push_back(released);
 }
 
 void DomainImpl::end_injection(Event& event) {
@@ -817,17 +1301,14 @@ void DomainImpl::end_injection(Event& event) {
     LOG4CXX_DEBUG(logger, "Ending injection on TID " << event.task().tid()
                                                      << " Event Type: " << event.type());
 
-    switch (event.type()) {
-    case EventType::EVENT_EXCEPTION:
-        if (event.exception().vector() != x86::Exception::INT3)
-            break;
-        // Fall through
-    case EventType::EVENT_MEM_ACCESS:
-        bp_mutex_.lock();
-        pause_all_other_vcpus(event.vcpu());
-        break;
-    default:
-        break;
+    if (!tls_injection_released_.empty()) {
+        const bool released = tls_injection_released_.back();
+        tls_injection_released_.pop_back();
+        if (released) {
+            bp_mutex_.lock();
+            pause_all_other_vcpus(event.vcpu());
+            tls_breakpoint_paused_ = true;
+        }
     }
 
     std::lock_guard lock(injection_.mtx_);
@@ -855,6 +1336,98 @@ void DomainImpl::suspend_event_step(Event& event) {
 
 const x86::PageDirectory& DomainImpl::page_directory() const { return page_directory_; }
 
+void DomainImpl::translation_cache(bool enabled) {
+    std::lock_guard lock(translation_cache_mtx_);
+    if (enabled == page_directory_.translation_cache())
+        return;
+
+    // CR4 writes are watched because toggling CR4.PGE flushes global translations
+    auto enable = [](VcpuImpl& v) {
+        v.add_cr_write_intercept_ref(3);
+        try {
+            v.add_cr_write_intercept_ref(4);
+            try {
+                v.intercept_invlpg(true);
+            } catch (...) {
+                v.remove_cr_write_intercept_ref(4);
+                throw;
+            }
+        } catch (...) {
+            v.remove_cr_write_intercept_ref(3);
+            throw;
+        }
+    };
+    auto disable = [](VcpuImpl& v) {
+        v.intercept_invlpg(false);
+        v.remove_cr_write_intercept_ref(4);
+        v.remove_cr_write_intercept_ref(3);
+    };
+
+    // Put the vcpus that were already changed back if one fails, so that a retry starts clean
+    uint32_t i = 0;
+    try {
+        for (; i < vcpu_count(); ++i) {
+            auto& v = static_cast<VcpuImpl&>(vcpu(i));
+            if (enabled)
+                enable(v);
+            else
+                disable(v);
+        }
+    } catch (...) {
+        while (i-- > 0) {
+            auto& v = static_cast<VcpuImpl&>(vcpu(i));
+            try {
+                if (enabled)
+                    disable(v);
+                else
+                    enable(v);
+            } catch (TraceableException& ex) {
+                LOG4CXX_WARN(logger, "Failed to restore translation cache intercepts on vcpu "
+                                         << i << ": " << ex);
+            }
+        }
+        throw;
+    }
+
+    page_directory_.translation_cache(enabled);
+}
+
+void DomainImpl::page_walk_accessed_bits(bool enabled) {
+    page_directory_.accessed_bits(enabled);
+}
+
+bool DomainImpl::page_walk_accessed_bits() const { return page_directory_.accessed_bits(); }
+
+std::shared_ptr<GuestMemoryMapping> DomainImpl::map_pfns_read_only(const uint64_t* pfns,
+                                                                   size_t count) const {
+    return map_pfns(pfns, count);
+}
+
+void DomainImpl::direct_memory_map(bool enabled) {
+    if (enabled)
+        throw NotImplementedException("Domain does not support direct memory mapping");
+}
+
+bool DomainImpl::direct_memory_map() const { return false; }
+
+void DomainImpl::add_direct_memory_map_ref() {
+    throw NotImplementedException("Domain does not support direct memory mapping");
+}
+
+void DomainImpl::remove_direct_memory_map_ref() {}
+
+std::vector<PhysicalMemoryRange> DomainImpl::physical_memory_ranges() const {
+    throw NotImplementedException("Domain does not report its physical memory ranges");
+}
+
+std::unique_ptr<MemorySnapshot> DomainImpl::create_memory_snapshot(const std::string& path,
+                                                                   MemorySnapshotFormat format,
+                                                                   uint32_t threads) {
+    // Fail now rather than at the first capture
+    physical_memory_ranges();
+    return std::make_unique<MemorySnapshotImpl>(*this, path, format, threads);
+}
+
 DomainImpl::DomainImpl()
     : watchpoint_manager_(), breakpoint_manager_(), page_directory_(*this),
       efd_(eventfd(0, EFD_SEMAPHORE)) {}
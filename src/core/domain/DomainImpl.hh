@@ -18,6 +18,9 @@
 #include "core/breakpoint/BreakpointManager.hh"
 #include "core/breakpoint/SingleStepManager.hh"
 #include "core/breakpoint/WatchpointManager.hh"
+#include "core/domain/EventDeliveryPool.hh"
+#include "core/domain/EventLog.hh"
+#include "core/domain/EventTimingRecorder.hh"
 
 #include "core/event/HypervisorEvent.hh"
 
@@ -28,6 +31,7 @@
 #include <introvirt/core/fwd.hh>
 #include <introvirt/core/memory/GuestMemoryMapping.hh>
 #include <introvirt/core/memory/guest_ptr.hh>
+#include <introvirt/core/syscall/SystemCall.hh>
 #include <introvirt/core/syscall/SystemCallFilter.hh>
 #include <introvirt/util/compiler.hh>
 
@@ -35,6 +39,7 @@
 #include <condition_variable>
 #include <cstdint>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <poll.h>
@@ -46,7 +51,18 @@
 namespace introvirt {
 
 class BreakpointManager;
-struct worker_thread_info;
+class VcpuImpl;
+
+/**
+ * @brief A run of guest frames that get the same memory access intercepts
+ */
+struct MemAccessRange {
+    uint64_t gfn;   // The first guest frame number
+    uint64_t count; // The number of frames
+    bool on_read;
+    bool on_write;
+    bool on_execute;
+};
 
 /**
  * @brief Common base class code for domains
@@ -63,10 +79,16 @@ class DomainImpl : public Domain {
     std::shared_ptr<Breakpoint> create_breakpoint(const guest_ptr<void>& address,
                                                   std::function<void(Event&)> callback) override;
 
+    std::vector<std::shared_ptr<Breakpoint>>
+    create_breakpoints(const std::vector<BreakpointRequest>& requests) override;
+
     std::unique_ptr<Watchpoint> create_watchpoint(const guest_ptr<void>& address, uint64_t length,
                                                   bool read, bool write, bool execute,
                                                   std::function<void(Event&)> callback) override;
 
+    std::unique_ptr<WriteTracker> create_write_tracker(const guest_ptr<void>& address,
+                                                       uint64_t length) override;
+
     std::unique_ptr<SingleStep> single_step(Vcpu& vcpu,
                                             std::function<void(Event&)> callback) override;
 
@@ -76,6 +98,29 @@ class DomainImpl : public Domain {
 
     void poll(EventCallback& callback) override;
 
+    void event_delivery_threads(uint32_t count) override;
+    uint32_t event_delivery_threads() const override;
+
+    void event_delivery_queue_depth(uint32_t depth) override;
+    uint32_t event_delivery_queue_depth() const override;
+
+    EventDeliveryStats event_delivery_stats() const override;
+
+    void event_timing(bool enabled) override;
+    bool event_timing() const override;
+    EventTimingStats event_timing_stats() const override;
+
+    void record_events(const std::string& path) override;
+    bool recording_events() const override;
+
+    void syscall_return_correlation(bool enabled) override;
+    bool syscall_return_correlation() const override;
+
+    void breakpoint_emulation(bool enabled) override;
+    bool breakpoint_emulation() const override;
+
+    WatchpointStats watchpoint_stats() const override;
+
     void interrupt() override;
 
     void pause() override;
@@ -94,11 +139,57 @@ class DomainImpl : public Domain {
     void intercept_system_calls(bool enabled) override;
     void intercept_cr_writes(int cr, bool enabled) override;
 
+    void targeted_system_calls(bool enabled) override;
+    bool targeted_system_calls() const override;
+
     void suspend_event(Event& event) override;
     void suspend_event_step(Event& event) override;
 
     const x86::PageDirectory& page_directory() const override;
 
+    void translation_cache(bool enabled) override;
+
+    void page_walk_accessed_bits(bool enabled) override;
+    bool page_walk_accessed_bits() const override;
+
+    /**
+     * @brief Map guest physical pages for reading only
+     *
+     * Used for page table walks. The default implementation uses map_pfns().
+     *
+     * @param pfns An array of pfns to map
+     * @param count The number of pfns in the array
+     * @return The mapped memory, which must not be written to
+     * @throws BadPhysicalAddressException If the guest physical address could not be mapped
+     */
+    virtual std::shared_ptr<GuestMemoryMapping> map_pfns_read_only(const uint64_t* pfns,
+                                                                   size_t count) const;
+
+    void direct_memory_map(bool enabled) override;
+    bool direct_memory_map() const override;
+
+    /**
+     * @brief Take a library-internal reference on the persistent guest memory mapping
+     *
+     * While any reference is held, the mapping stays enabled regardless of direct_memory_map().
+     * Once the last reference is released, the mapping goes back to what the user set.
+     *
+     * @throws NotImplementedException if the hypervisor does not support it
+     * @throws CommandFailedException if guest memory could not be mapped
+     */
+    virtual void add_direct_memory_map_ref();
+
+    /**
+     * @brief Release a reference taken with add_direct_memory_map_ref()
+     */
+    virtual void remove_direct_memory_map_ref();
+
+    std::vector<PhysicalMemoryRange> physical_memory_ranges() const override;
+
+    std::unique_ptr<MemorySnapshot> create_memory_snapshot(const std::string& path,
+                                                           MemorySnapshotFormat format,
+                                                           uint32_t threads) override;
+
     /**
      * @brief Intercept memory access for a guest frame number
      *
@@ -115,6 +206,17 @@ class DomainImpl : public Domain {
     virtual void intercept_mem_access(uint64_t gfn, bool on_read, bool on_write,
                                       bool on_execute) = 0;
 
+    /**
+     * @brief Apply a set of memory access intercept changes at once
+     *
+     * This is the same as calling intercept_mem_access() for every gfn in every range, except
+     * that the domain is only paused once for the whole set.
+     *
+     * @param ranges The changes to make
+     * @throws NotImplementedException if memory access interception is not supported
+     */
+    virtual void intercept_mem_access(const std::vector<MemAccessRange>& ranges) = 0;
+
     /**
      * @brief Clear all memory access intercepts
      *
@@ -153,7 +255,7 @@ class DomainImpl : public Domain {
     void end_injection(Event& event);
     void step_breakpoints(Event& event);
 
-    void event_deliverer(EventCallback* callback, struct worker_thread_info* worker_info);
+    void event_deliverer(EventCallback* callback, EventDeliveryPool::Slot& slot);
 
     /**
      * @brief Destroy the instance
@@ -178,16 +280,44 @@ class DomainImpl : public Domain {
      */
     void reset_guest() { guest_.reset(); }
 
+    /**
+     * @brief Called by subclasses with every mapping of guest memory they hand out
+     *
+     * Writes the pages to the event recording, if one is in progress.
+     *
+     * @param pfns The pfns that were mapped
+     * @param count The number of pfns
+     * @param mapping The mapping of the pfns
+     */
+    void record_pages(const uint64_t* pfns, size_t count, const GuestMemoryMapping& mapping) const {
+        if (unlikely(recording_.load(std::memory_order_relaxed)))
+            record_pages_slow(pfns, count, mapping);
+    }
+
   private:
     void handle_breakpoint(Event& event);
+    void step_over_breakpoint(Event& event, bool deliver_events, bool step_only);
+
+    bool detect_guest(VcpuImpl& vcpu);
 
     std::unique_ptr<Event> filter_event(std::unique_ptr<HypervisorEvent>&& event) HOT;
     std::unique_ptr<Event> get_guest_event(std::unique_ptr<HypervisorEvent>&& event) HOT;
 
     void vcpu_poller_thread(Vcpu* vcpu, EventCallback* callback, int efd);
 
+    void record_event(const HypervisorEvent& event);
+    void record_pages_slow(const uint64_t* pfns, size_t count,
+                           const GuestMemoryMapping& mapping) const;
+
+    bool absorb_watchpoint_event(HypervisorEvent& event);
+    void end_absorbed_step(VcpuImpl& vcpu);
+
     bool matches_syscall_filters(const Vcpu& vcpu) const;
 
+    void add_pending_syscall_return(Event& event);
+    std::unique_ptr<Event> take_pending_syscall_return(std::unique_ptr<HypervisorEvent>&& event);
+    void clear_pending_syscall_returns();
+
   private:
     std::unique_ptr<Guest> guest_;
 
@@ -205,6 +335,19 @@ class DomainImpl : public Domain {
 
     x86::PageDirectory page_directory_;
 
+    EventDeliveryPool delivery_pool_;
+    EventTimingRecorder event_timing_;
+
+    std::mutex translation_cache_mtx_;
+
+    // Swapped atomically so the pollers never take a lock to check for it
+    std::mutex event_log_mtx_;
+    std::shared_ptr<EventLogWriter> event_log_;
+    mutable std::atomic<bool> recording_ = false;
+
+    std::mutex targeted_syscalls_mtx_;
+    std::atomic<bool> targeted_syscalls_ = false;
+
     // The event fd for interrupting the threads
     const int efd_;
     bool interrupted_ = false;
@@ -219,6 +362,22 @@ class DomainImpl : public Domain {
         std::unordered_multimap<uint64_t, Event*> map_;
     } suspended_events_;
 
+    struct PendingSyscallReturn {
+        std::unique_ptr<SystemCall> handler;
+        uint64_t raw_index;
+        VcpuImpl* vcpu;
+    };
+
+    std::atomic<bool> syscall_return_correlation_ = false;
+    std::atomic<bool> breakpoint_emulation_ = true;
+
+    struct {
+        std::mutex mtx_;
+        // Keyed by thread id, then by the stack pointer at the time of the call
+        std::unordered_map<uint64_t, std::map<uint64_t, PendingSyscallReturn>> map_;
+        std::atomic<uint32_t> count_ = 0;
+    } pending_returns_;
+
     struct {
         std::mutex mtx_;
         std::condition_variable cv_;
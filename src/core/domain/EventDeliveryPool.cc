@@ -0,0 +1,310 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "EventDeliveryPool.hh"
+
+#include "core/event/EventImpl.hh"
+
+#include <introvirt/util/compiler.hh>
+#include <introvirt/util/introvirt_assert.hh>
+
+#include <log4cxx/logger.h>
+
+#include <algorithm>
+
+namespace introvirt {
+
+static log4cxx::LoggerPtr
+    logger(log4cxx::Logger::getLogger("introvirt.domain.EventDeliveryPool"));
+
+// Set for the lifetime of each worker thread so that ScopedBlocking can find its pool
+static thread_local EventDeliveryPool* tls_pool_;
+static thread_local void* tls_worker_;
+
+static constexpr uint32_t MIN_QUEUE_DEPTH = 16;
+
+EventDeliveryPool::ScopedBlocking::ScopedBlocking() : pool_(tls_pool_) {
+    if (pool_)
+        pool_->blocking_begin(*static_cast<Worker*>(tls_worker_));
+}
+
+EventDeliveryPool::ScopedBlocking::~ScopedBlocking() {
+    if (pool_)
+        pool_->blocking_end();
+}
+
+void EventDeliveryPool::start(uint32_t vcpu_count, Handler handler) {
+    std::lock_guard lock(mtx_);
+    introvirt_assert(!running_, "");
+
+    handler_ = std::move(handler);
+    vcpu_count_ = vcpu_count;
+    vcpu_busy_.assign(vcpu_count, false);
+    running_ = true;
+    stopping_ = false;
+    interrupted_ = false;
+    blocked_threads_ = 0;
+
+    stats_ = EventDeliveryStats();
+
+    while (live_threads_ < target_threads_locked())
+        spawn_worker_locked();
+
+    LOG4CXX_DEBUG(logger, "Started " << live_threads_ << " event delivery threads");
+}
+
+void EventDeliveryPool::submit(uint32_t vcpu_id, std::unique_ptr<Event>&& event) {
+    reap_workers();
+
+    std::unique_lock lock(mtx_);
+    introvirt_assert(running_ && vcpu_id < vcpu_count_, "");
+
+    if (queue_.size() >= target_queue_depth_locked()) {
+        stats_.queue_full_waits++;
+        space_cv_.wait(lock, [this] {
+            return queue_.size() < target_queue_depth_locked() || stopping_ || interrupted_;
+        });
+    }
+
+    if (unlikely(interrupted_))
+        event->impl().interrupt();
+
+    queue_.push_back(Work{vcpu_id, std::move(event), std::chrono::steady_clock::now()});
+    stats_.queue_high_water =
+        std::max(stats_.queue_high_water, static_cast<uint32_t>(queue_.size()));
+
+    if (!vcpu_busy_[vcpu_id])
+        work_cv_.notify_one();
+}
+
+void EventDeliveryPool::interrupt() {
+    std::lock_guard lock(mtx_);
+    interrupted_ = true;
+
+    for (auto& work : queue_)
+        work.event->impl().interrupt();
+
+    for (auto& worker : workers_) {
+        std::lock_guard slot_lock(worker.slot.mtx);
+        if (worker.slot.event) {
+            worker.slot.event->impl().interrupt();
+            LOG4CXX_DEBUG(logger, "Interrupted event delivery thread");
+        }
+    }
+
+    space_cv_.notify_all();
+}
+
+void EventDeliveryPool::stop() {
+    {
+        std::unique_lock lock(mtx_);
+        if (!running_)
+            return;
+
+        // Workers drain the queue before exiting
+        stopping_ = true;
+        work_cv_.notify_all();
+        space_cv_.notify_all();
+        exit_cv_.wait(lock, [this] { return live_threads_ == 0; });
+    }
+
+    // Nothing can start new workers once they have all exited
+    for (auto& worker : workers_) {
+        if (worker.thread.joinable())
+            worker.thread.join();
+    }
+
+    std::lock_guard lock(mtx_);
+    workers_.clear();
+    queue_.clear();
+    handler_ = Handler();
+    running_ = false;
+}
+
+void EventDeliveryPool::threads(uint32_t count) {
+    std::lock_guard lock(mtx_);
+    threads_ = count;
+
+    if (running_ && !stopping_) {
+        while (live_threads_ < target_threads_locked())
+            spawn_worker_locked();
+    }
+
+    // Let any surplus workers retire
+    work_cv_.notify_all();
+}
+
+uint32_t EventDeliveryPool::threads() const {
+    std::lock_guard lock(mtx_);
+    return threads_;
+}
+
+void EventDeliveryPool::queue_depth(uint32_t depth) {
+    std::lock_guard lock(mtx_);
+    queue_depth_ = depth;
+    space_cv_.notify_all();
+}
+
+uint32_t EventDeliveryPool::queue_depth() const {
+    std::lock_guard lock(mtx_);
+    return queue_depth_;
+}
+
+EventDeliveryStats EventDeliveryPool::stats() const {
+    std::lock_guard lock(mtx_);
+    EventDeliveryStats result = stats_;
+    result.threads = threads_ ? threads_ : vcpu_count_;
+    result.queue_depth = target_queue_depth_locked();
+    result.live_threads = live_threads_;
+    result.blocked_threads = blocked_threads_;
+    return result;
+}
+
+void EventDeliveryPool::worker_thread(Worker* worker) {
+    tls_pool_ = this;
+    tls_worker_ = worker;
+
+    std::unique_lock lock(mtx_);
+    while (true) {
+        work_cv_.wait(lock, [this] {
+            return has_runnable_locked() || (stopping_ && queue_.empty()) ||
+                   live_threads_ > target_threads_locked();
+        });
+
+        if (live_threads_ > target_threads_locked()) {
+            // Surplus from a suspended event that has since been released
+            worker->retired = true;
+            break;
+        }
+
+        if (!has_runnable_locked()) {
+            // Stopping, and the queue has been drained
+            break;
+        }
+
+        // Take the oldest event whose vcpu isn't already being delivered
+        auto iter = std::find_if(queue_.begin(), queue_.end(),
+                                 [this](const Work& work) { return !vcpu_busy_[work.vcpu_id]; });
+        Work work = std::move(*iter);
+        queue_.erase(iter);
+
+        vcpu_busy_[work.vcpu_id] = true;
+        worker->vcpu_id = work.vcpu_id;
+        worker->owns_vcpu = true;
+
+        const uint64_t wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now() - work.queued)
+                                     .count();
+        stats_.events_delivered++;
+        stats_.queue_wait_ns_total += wait_ns;
+        stats_.queue_wait_ns_max = std::max(stats_.queue_wait_ns_max, wait_ns);
+
+        {
+            std::lock_guard slot_lock(worker->slot.mtx);
+            worker->slot.event = std::move(work.event);
+        }
+
+        space_cv_.notify_one();
+        lock.unlock();
+
+        handler_(worker->slot);
+
+        {
+            std::lock_guard slot_lock(worker->slot.mtx);
+            worker->slot.event.reset();
+        }
+
+        lock.lock();
+        release_vcpu_locked(*worker);
+    }
+
+    live_threads_--;
+    exit_cv_.notify_all();
+
+    tls_pool_ = nullptr;
+    tls_worker_ = nullptr;
+}
+
+void EventDeliveryPool::spawn_worker_locked() {
+    Worker& worker = workers_.emplace_back();
+    live_threads_++;
+    stats_.threads_started++;
+    worker.thread = std::thread(&EventDeliveryPool::worker_thread, this, &worker);
+}
+
+void EventDeliveryPool::reap_workers() {
+    std::list<Worker> retired;
+    {
+        std::lock_guard lock(mtx_);
+        for (auto iter = workers_.begin(); iter != workers_.end();) {
+            auto next = std::next(iter);
+            if (iter->retired)
+                retired.splice(retired.end(), workers_, iter);
+            iter = next;
+        }
+    }
+
+    for (auto& worker : retired) {
+        if (worker.thread.joinable())
+            worker.thread.join();
+    }
+}
+
+bool EventDeliveryPool::has_runnable_locked() const {
+    return std::any_of(queue_.begin(), queue_.end(),
+                       [this](const Work& work) { return !vcpu_busy_[work.vcpu_id]; });
+}
+
+uint32_t EventDeliveryPool::target_threads_locked() const {
+    const uint32_t base = threads_ ? threads_ : std::max(vcpu_count_, 1u);
+    return base + blocked_threads_;
+}
+
+uint32_t EventDeliveryPool::target_queue_depth_locked() const {
+    if (queue_depth_)
+        return queue_depth_;
+    return std::max(MIN_QUEUE_DEPTH, vcpu_count_ * 4);
+}
+
+void EventDeliveryPool::release_vcpu_locked(Worker& worker) {
+    if (worker.owns_vcpu) {
+        vcpu_busy_[worker.vcpu_id] = false;
+        worker.owns_vcpu = false;
+        work_cv_.notify_all();
+    }
+}
+
+void EventDeliveryPool::blocking_begin(Worker& worker) {
+    std::lock_guard lock(mtx_);
+
+    // The vcpu is resumed by the suspended event, so its next event may start
+    release_vcpu_locked(worker);
+
+    blocked_threads_++;
+    while (live_threads_ < target_threads_locked())
+        spawn_worker_locked();
+}
+
+void EventDeliveryPool::blocking_end() {
+    std::lock_guard lock(mtx_);
+    blocked_threads_--;
+    work_cv_.notify_all();
+}
+
+EventDeliveryPool::EventDeliveryPool() = default;
+
+EventDeliveryPool::~EventDeliveryPool() { stop(); }
+
+} // namespace introvirt
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/event/EventDeliveryStats.hh>
+#include <introvirt/core/fwd.hh>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace introvirt {
+
+/**
+ * @brief A reusable pool of threads for delivering events to callbacks
+ *
+ * The vcpu poller threads submit filtered events, and a fixed set of persistent worker threads
+ * deliver them. Events from the same vcpu are started in the order they were submitted, and the
+ * next event for a vcpu is not started until the previous one has finished or has been suspended.
+ *
+ * A worker that parks inside a suspended event (see EventImplTpl::suspend()) does not count
+ * against the pool size. A replacement worker is started so that a guest with many threads
+ * waiting on hooked system call returns cannot starve delivery. Surplus workers exit once the
+ * suspended events are released.
+ */
+class EventDeliveryPool final {
+  public:
+    /**
+     * @brief An event being delivered by a worker
+     *
+     * The handler may replace the event while holding the mutex.
+     */
+    struct Slot {
+        std::mutex mtx;
+        std::unique_ptr<Event> event;
+    };
+
+    using Handler = std::function<void(Slot&)>;
+
+    /**
+     * @brief Marks the calling worker as parked for the lifetime of the object
+     *
+     * Releases the worker's vcpu so that the next event for the vcpu can start. Does nothing when
+     * not called from a pool worker.
+     */
+    class ScopedBlocking final {
+      public:
+        ScopedBlocking();
+        ~ScopedBlocking();
+
+        ScopedBlocking(const ScopedBlocking&) = delete;
+        ScopedBlocking& operator=(const ScopedBlocking&) = delete;
+
+      private:
+        EventDeliveryPool* pool_;
+    };
+
+    /**
+     * @brief Start the worker threads
+     *
+     * @param vcpu_count The number of vcpus that will submit events
+     * @param handler The function to call for each event
+     */
+    void start(uint32_t vcpu_count, Handler handler);
+
+    /**
+     * @brief Queue an event for delivery
+     *
+     * Blocks while the queue is full.
+     *
+     * @param vcpu_id The vcpu that generated the event
+     * @param event The event to deliver
+     */
+    void submit(uint32_t vcpu_id, std::unique_ptr<Event>&& event);
+
+    /**
+     * @brief Interrupt every queued and in-flight event
+     *
+     * Suspended events will throw InterruptedException.
+     */
+    void interrupt();
+
+    /**
+     * @brief Wait for queued events to finish and join all worker threads
+     */
+    void stop();
+
+    /**
+     * @param count The number of persistent worker threads, or 0 for one per vcpu
+     */
+    void threads(uint32_t count);
+    uint32_t threads() const;
+
+    /**
+     * @param depth The maximum number of queued events, or 0 for the default
+     */
+    void queue_depth(uint32_t depth);
+    uint32_t queue_depth() const;
+
+    EventDeliveryStats stats() const;
+
+    EventDeliveryPool();
+    ~EventDeliveryPool();
+
+  private:
+    struct Work {
+        uint32_t vcpu_id;
+        std::unique_ptr<Event> event;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    struct Worker {
+        std::thread thread;
+        Slot slot;
+        uint32_t vcpu_id = 0;
+        bool owns_vcpu = false;
+        bool retired = false;
+    };
+
+    void worker_thread(Worker* worker);
+    void spawn_worker_locked();
+    void reap_workers();
+    bool has_runnable_locked() const;
+    uint32_t target_threads_locked() const;
+    uint32_t target_queue_depth_locked() const;
+    void release_vcpu_locked(Worker& worker);
+
+    void blocking_begin(Worker& worker);
+    void blocking_end();
+
+  private:
+    mutable std::mutex mtx_;
+    std::condition_variable work_cv_;
+    std::condition_variable space_cv_;
+    std::condition_variable exit_cv_;
+
+    Handler handler_;
+    std::deque<Work> queue_;
+    std::list<Worker> workers_;
+    std::vector<bool> vcpu_busy_;
+
+    uint32_t threads_ = 0;
+    uint32_t queue_depth_ = 0;
+    uint32_t vcpu_count_ = 0;
+    uint32_t live_threads_ = 0;
+    uint32_t blocked_threads_ = 0;
+    bool running_ = false;
+    bool stopping_ = false;
+    bool interrupted_ = false;
+
+    EventDeliveryStats stats_;
+};
+
+} // namespace introvirt
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "EventLog.hh"
+#include "core/memory/PageHash.hh"
+
+#include <introvirt/core/arch/x86/Msr.hh>
+#include <introvirt/core/arch/x86/Registers.hh>
+#include <introvirt/core/domain/Vcpu.hh>
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/TraceableException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace introvirt {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.core.EventLog"));
+
+// Read on every event, since they change when the guest switches between user and kernel mode
+static const x86::Msr EventMsrs[] = {
+    x86::Msr::MSR_KERNEL_GS_BASE,
+};
+
+// Only read for the initial vcpu state, the guest sets these once at boot
+static const x86::Msr VcpuMsrs[] = {
+    x86::Msr::MSR_KERNEL_GS_BASE,    x86::Msr::MSR_STAR,
+    x86::Msr::MSR_LSTAR,             x86::Msr::MSR_CSTAR,
+    x86::Msr::MSR_SYSCALL_MASK,      x86::Msr::MSR_IA32_SYSENTER_CS,
+    x86::Msr::MSR_IA32_SYSENTER_ESP, x86::Msr::MSR_IA32_SYSENTER_EIP,
+};
+
+static void save_segment(EventLogSegment& dst, const x86::Segment& src) {
+    dst.selector = src.selector().value();
+    dst.base = src.base();
+    dst.limit = src.limit();
+    dst.flags = (src.type() << 8) | (src.s() << 12) | (src.dpl() << 13) | (src.present() << 15);
+
+    // The remaining bits are only defined for code and data segments
+    if (src.s()) {
+        dst.flags |= (src.avl() << 20) | (src.long_mode() << 21) | (src.db() << 22) |
+                     (src.granularity() << 23);
+    }
+}
+
+void EventLogWriter::write(const void* data, size_t length) {
+    if (unlikely(std::fwrite(data, 1, length, file_) != length))
+        throw CommandFailedException("Failed to write event log " + path_, errno);
+}
+
+void EventLogWriter::write_registers(EventLogRegisters& dst, const Vcpu& vcpu, bool all_msrs) {
+    const auto& regs = vcpu.registers();
+
+    dst.rax = regs.rax();
+    dst.rbx = regs.rbx();
+    dst.rcx = regs.rcx();
+    dst.rdx = regs.rdx();
+    dst.rsi = regs.rsi();
+    dst.rdi = regs.rdi();
+    dst.rsp = regs.rsp();
+    dst.rbp = regs.rbp();
+    dst.r8 = regs.r8();
+    dst.r9 = regs.r9();
+    dst.r10 = regs.r10();
+    dst.r11 = regs.r11();
+    dst.r12 = regs.r12();
+    dst.r13 = regs.r13();
+    dst.r14 = regs.r14();
+    dst.r15 = regs.r15();
+    dst.rip = regs.rip();
+    dst.rflags = regs.rflags().value();
+
+    dst.cr0 = regs.cr0().value();
+    dst.cr2 = regs.cr2();
+    dst.cr3 = regs.cr3();
+    dst.cr4 = regs.cr4().value();
+    dst.cr8 = regs.cr8();
+    dst.efer = regs.efer().value();
+
+    save_segment(dst.cs, regs.cs());
+    save_segment(dst.ds, regs.ds());
+    save_segment(dst.es, regs.es());
+    save_segment(dst.fs, regs.fs());
+    save_segment(dst.gs, regs.gs());
+    save_segment(dst.ss, regs.ss());
+    save_segment(dst.tr, regs.tr());
+    save_segment(dst.ldt, regs.ldt());
+
+    dst.gdtr_base = regs.gdtr_base();
+    dst.gdtr_limit = regs.gdtr_limit();
+    dst.idtr_base = regs.idtr_base();
+    dst.idtr_limit = regs.idtr_limit();
+
+    msrs_.clear();
+    auto save_msr = [&](x86::Msr msr) {
+        try {
+            msrs_.push_back(EventLogMsr{static_cast<uint32_t>(msr), 0, regs.msr(msr)});
+        } catch (TraceableException& ex) {
+            LOG4CXX_DEBUG(logger, "Failed to read MSR 0x" << std::hex << static_cast<uint32_t>(msr)
+                                                          << ": " << ex.what());
+        }
+    };
+    if (all_msrs) {
+        for (x86::Msr msr : VcpuMsrs)
+            save_msr(msr);
+    } else {
+        for (x86::Msr msr : EventMsrs)
+            save_msr(msr);
+    }
+    dst.msr_count = msrs_.size();
+}
+
+void EventLogWriter::record_vcpu(const Vcpu& vcpu) {
+    EventLogVcpu record = {};
+    record.vcpu_id = vcpu.id();
+
+    std::lock_guard lock(mtx_);
+    write_registers(record.registers, vcpu, true);
+
+    const EventLogRecordType type = EventLogRecordType::VCPU;
+    write(&type, sizeof(type));
+    write(&record, sizeof(record));
+    write(msrs_.data(), msrs_.size() * sizeof(EventLogMsr));
+}
+
+void EventLogWriter::record_event(const HypervisorEvent& event) {
+    EventLogEvent record = {};
+    record.id = event.id();
+    record.vcpu_id = event.vcpu().id();
+    record.type = static_cast<uint32_t>(event.type());
+    record.fastcall_type = static_cast<uint32_t>(event.system_call_type());
+
+    // Only the fields that belong to the event type are meaningful
+    switch (event.type()) {
+    case EventType::EVENT_FAST_SYSCALL:
+        record.syscall_return_address = event.syscall_return_address();
+        break;
+    case EventType::EVENT_CR_READ:
+    case EventType::EVENT_CR_WRITE:
+        record.control_register = event.control_register();
+        record.control_register_value = event.control_register_value();
+        break;
+    case EventType::EVENT_EXCEPTION:
+        record.exception = static_cast<uint32_t>(event.exception());
+        break;
+    case EventType::EVENT_MEM_ACCESS:
+        record.mem_access_address = event.mem_access_physical_address().address();
+        record.mem_access = (event.mem_access_read() ? EVENT_LOG_MEM_READ : 0) |
+                            (event.mem_access_write() ? EVENT_LOG_MEM_WRITE : 0) |
+                            (event.mem_access_execute() ? EVENT_LOG_MEM_EXECUTE : 0);
+        break;
+    case EventType::EVENT_INVLPG:
+        record.invlpg_address = event.invlpg_address();
+        break;
+    default:
+        break;
+    }
+
+    std::lock_guard lock(mtx_);
+    write_registers(record.registers, event.vcpu(), false);
+
+    const EventLogRecordType type = EventLogRecordType::EVENT;
+    write(&type, sizeof(type));
+    write(&record, sizeof(record));
+    write(msrs_.data(), msrs_.size() * sizeof(EventLogMsr));
+    ++events_;
+}
+
+void EventLogWriter::record_pages(const uint64_t* pfns, size_t count, const void* data) {
+    const EventLogRecordType type = EventLogRecordType::PAGE;
+    const char* page = static_cast<const char*>(data);
+
+    std::lock_guard lock(mtx_);
+    for (size_t i = 0; i < count; ++i, page += sizeof(EventLogPage::data)) {
+        const uint64_t hash = hash_page(page);
+        auto [iter, inserted] = page_hashes_.try_emplace(pfns[i], hash);
+        if (!inserted) {
+            if (iter->second == hash)
+                continue;
+            iter->second = hash;
+        }
+
+        write(&type, sizeof(type));
+        write(&pfns[i], sizeof(pfns[i]));
+        write(page, sizeof(EventLogPage::data));
+        ++pages_;
+    }
+}
+
+uint64_t EventLogWriter::events() const {
+    std::lock_guard lock(mtx_);
+    return events_;
+}
+
+uint64_t EventLogWriter::pages() const {
+    std::lock_guard lock(mtx_);
+    return pages_;
+}
+
+EventLogWriter::EventLogWriter(const std::string& path, uint32_t vcpu_count) : path_(path) {
+    file_ = std::fopen(path.c_str(), "wb");
+    if (file_ == nullptr)
+        throw CommandFailedException("Failed to create event log " + path, errno);
+
+    // Records are small, don't make a system call for each of them
+    std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+
+    EventLogHeader header = {};
+    std::memcpy(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic));
+    header.version = EVENT_LOG_VERSION;
+    header.vcpu_count = vcpu_count;
+    try {
+        write(&header, sizeof(header));
+    } catch (...) {
+        std::fclose(file_);
+        throw;
+    }
+}
+
+EventLogWriter::~EventLogWriter() {
+    if (std::fclose(file_) != 0)
+        LOG4CXX_ERROR(logger, "Failed to close event log " << path_ << ": " << strerror(errno));
+    LOG4CXX_DEBUG(logger, "Event log " << path_ << ": " << events_ << " events, " << pages_
+                                       << " pages");
+}
+
+} // namespace introvirt
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "core/event/HypervisorEvent.hh"
+
+#include <introvirt/core/fwd.hh>
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace introvirt {
+
+/*
+ * Layout of an event recording, see Domain::record_events().
+ *
+ * The file starts with an EventLogHeader and is followed by records until the end of the file.
+ * Each record is an EventLogRecordType byte and then its body:
+ *
+ *   VCPU   EventLogVcpu, then registers.msr_count EventLogMsr entries
+ *   EVENT  EventLogEvent, then registers.msr_count EventLogMsr entries
+ *   PAGE   EventLogPage
+ *
+ * A PAGE record is written when a page is first mapped, and again whenever it's mapped with
+ * different contents. Values are in host byte order.
+ */
+static constexpr char EVENT_LOG_MAGIC[8] = {'I', 'V', 'E', 'V', 'L', 'O', 'G', '\0'};
+static constexpr uint32_t EVENT_LOG_VERSION = 1;
+
+struct EventLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vcpu_count;
+};
+
+enum class EventLogRecordType : uint8_t {
+    VCPU = 1,
+    EVENT = 2,
+    PAGE = 3,
+};
+
+/**
+ * @brief A segment register
+ *
+ * The flags use the high dword layout of a segment descriptor, the same as ImageSegment.
+ */
+struct EventLogSegment {
+    uint64_t base;
+    uint32_t limit;
+    uint32_t flags;
+    uint32_t selector;
+    uint32_t reserved;
+};
+
+struct EventLogRegisters {
+    uint64_t rax, rbx, rcx, rdx, rsi, rdi, rsp, rbp;
+    uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
+    uint64_t rip, rflags;
+    uint64_t cr0, cr2, cr3, cr4, cr8, efer;
+    EventLogSegment cs, ds, es, fs, gs, ss, tr, ldt;
+    uint64_t gdtr_base, idtr_base;
+    uint32_t gdtr_limit, idtr_limit;
+    uint32_t msr_count;
+    uint32_t reserved;
+};
+
+struct EventLogMsr {
+    uint32_t index;
+    uint32_t reserved;
+    uint64_t value;
+};
+
+/**
+ * @brief The state of a vcpu when recording started
+ */
+struct EventLogVcpu {
+    uint32_t vcpu_id;
+    uint32_t reserved;
+    EventLogRegisters registers;
+};
+
+/**
+ * @brief A hypervisor event and the register state that came with it
+ */
+struct EventLogEvent {
+    uint64_t id;
+    uint32_t vcpu_id;
+    uint32_t type;          // EventType
+    uint32_t fastcall_type; // FastCallType
+    int32_t control_register;
+    uint64_t control_register_value;
+    uint64_t syscall_return_address;
+    uint32_t exception;  // x86::Exception
+    uint32_t mem_access; // EVENT_LOG_MEM_* bits
+    uint64_t mem_access_address;
+    uint64_t invlpg_address;
+    EventLogRegisters registers;
+};
+
+static constexpr uint32_t EVENT_LOG_MEM_READ = 0x1;
+static constexpr uint32_t EVENT_LOG_MEM_WRITE = 0x2;
+static constexpr uint32_t EVENT_LOG_MEM_EXECUTE = 0x4;
+
+struct EventLogPage {
+    uint64_t pfn;
+    uint8_t data[4096];
+};
+
+/**
+ * @brief Writes an event recording
+ *
+ * Safe to use from every poller and delivery thread at once; records are appended under a lock.
+ */
+class EventLogWriter final {
+  public:
+    /**
+     * @brief Record the current state of a vcpu
+     *
+     * The vcpu must be paused or handling an event.
+     */
+    void record_vcpu(const Vcpu& vcpu);
+
+    /**
+     * @brief Record an event, along with the registers of its vcpu
+     */
+    void record_event(const HypervisorEvent& event);
+
+    /**
+     * @brief Record the contents of mapped guest pages
+     *
+     * Pages that haven't changed since they were last recorded are skipped.
+     *
+     * @param pfns The pfns that were mapped
+     * @param count The number of pfns
+     * @param data The mapping, count pages long
+     */
+    void record_pages(const uint64_t* pfns, size_t count, const void* data);
+
+    /**
+     * @brief Get the number of events written so far
+     */
+    uint64_t events() const;
+
+    /**
+     * @brief Get the number of page records written so far
+     */
+    uint64_t pages() const;
+
+    /**
+     * @brief Create a new recording
+     *
+     * @param path The file to write, replacing anything already there
+     * @param vcpu_count The number of vcpus in the domain
+     * @throws CommandFailedException if the file can't be created
+     */
+    EventLogWriter(const std::string& path, uint32_t vcpu_count);
+
+    /**
+     * @brief Flush and close the file
+     */
+    ~EventLogWriter();
+
+  private:
+    void write(const void* data, size_t length);
+    void write_registers(EventLogRegisters& registers, const Vcpu& vcpu, bool all_msrs);
+
+  private:
+    mutable std::mutex mtx_;
+    std::FILE* file_;
+    const std::string path_;
+
+    // Hash of the last recorded contents of each page
+    std::unordered_map<uint64_t, uint64_t> page_hashes_;
+    std::vector<EventLogMsr> msrs_;
+
+    uint64_t events_ = 0;
+    uint64_t pages_ = 0;
+};
+
+} // namespace introvirt
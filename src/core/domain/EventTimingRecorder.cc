@@ -0,0 +1,175 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "EventTimingRecorder.hh"
+
+#include <chrono>
+
+namespace introvirt {
+
+static inline unsigned int bucket_index(uint64_t ns) {
+    if (ns == 0)
+        return 0;
+    const unsigned int index = 64 - __builtin_clzll(ns);
+    return std::min(index, LatencyHistogram::BUCKET_COUNT - 1);
+}
+
+static inline uint64_t elapsed(uint64_t start, uint64_t end) { return end > start ? end - start : 0; }
+
+uint64_t EventTimingRecorder::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void EventTimingRecorder::Histogram::add(uint64_t ns) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t current = max_ns.load(std::memory_order_relaxed);
+    while (ns > current &&
+           !max_ns.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void EventTimingRecorder::Histogram::clear() {
+    count.store(0, std::memory_order_relaxed);
+    total_ns.store(0, std::memory_order_relaxed);
+    max_ns.store(0, std::memory_order_relaxed);
+    for (auto& bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+LatencyHistogram EventTimingRecorder::Histogram::read() const {
+    LatencyHistogram result;
+    result.count = count.load(std::memory_order_relaxed);
+    result.total_ns = total_ns.load(std::memory_order_relaxed);
+    result.max_ns = max_ns.load(std::memory_order_relaxed);
+    for (unsigned int i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i)
+        result.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+    return result;
+}
+
+void EventTimingRecorder::enable(bool enabled, uint32_t vcpu_count) {
+    std::lock_guard lock(mtx_);
+    if (!enabled) {
+        enabled_.store(false, std::memory_order_relaxed);
+        return;
+    }
+    if (enabled_.load(std::memory_order_relaxed))
+        return;
+
+    if (!owned_state_) {
+        owned_state_ = std::make_unique<State>();
+        owned_state_->vcpu_count = vcpu_count;
+        owned_state_->vcpus = std::make_unique<VcpuHistograms[]>(vcpu_count);
+        owned_state_->syscalls = std::make_unique<Histogram[]>(SYSCALL_COUNT);
+        state_.store(owned_state_.get(), std::memory_order_release);
+    } else {
+        State& state = *owned_state_;
+        for (uint32_t i = 0; i < state.vcpu_count; ++i) {
+            for (auto& stages : state.vcpus[i].delivered)
+                for (auto& histogram : stages)
+                    histogram.clear();
+            for (auto& stages : state.vcpus[i].filtered)
+                for (auto& histogram : stages)
+                    histogram.clear();
+        }
+        for (unsigned int i = 0; i < SYSCALL_COUNT; ++i)
+            state.syscalls[i].clear();
+    }
+
+    enabled_.store(true, std::memory_order_release);
+}
+
+void EventTimingRecorder::record_filtered(uint32_t vcpu_id, EventType type,
+                                          const EventTimestamps& timestamps) {
+    const State* state = state_.load(std::memory_order_acquire);
+    const unsigned int type_index = static_cast<int>(type);
+    if (unlikely(state == nullptr || vcpu_id >= state->vcpu_count || type_index >= TYPE_COUNT))
+        return;
+
+    Stages& stages = state->vcpus[vcpu_id].filtered[type_index];
+    const uint64_t filter_ns = elapsed(timestamps.fetch_end, timestamps.filter_end);
+
+    add(stages, EventStage::FETCH, elapsed(timestamps.fetch_start, timestamps.fetch_end));
+    add(stages, EventStage::FILTER, elapsed(timestamps.construct_ns, filter_ns));
+    add(stages, EventStage::CONSTRUCT, timestamps.construct_ns);
+    add(stages, EventStage::TOTAL, elapsed(timestamps.fetch_start, timestamps.filter_end));
+}
+
+void EventTimingRecorder::record_delivered(uint32_t vcpu_id, EventType type,
+                                           uint64_t syscall_index,
+                                           const EventTimestamps& timestamps, uint64_t dequeued,
+                                           uint64_t callback_end, uint64_t completed) {
+    const State* state = state_.load(std::memory_order_acquire);
+    const unsigned int type_index = static_cast<int>(type);
+    if (unlikely(state == nullptr || vcpu_id >= state->vcpu_count || type_index >= TYPE_COUNT))
+        return;
+
+    Stages& stages = state->vcpus[vcpu_id].delivered[type_index];
+    const uint64_t filter_ns = elapsed(timestamps.fetch_end, timestamps.filter_end);
+    const uint64_t total_ns = elapsed(timestamps.fetch_start, completed);
+
+    add(stages, EventStage::FETCH, elapsed(timestamps.fetch_start, timestamps.fetch_end));
+    add(stages, EventStage::FILTER, elapsed(timestamps.construct_ns, filter_ns));
+    add(stages, EventStage::CONSTRUCT, timestamps.construct_ns);
+    add(stages, EventStage::QUEUE, elapsed(timestamps.filter_end, dequeued));
+    add(stages, EventStage::CALLBACK, elapsed(dequeued, callback_end));
+    add(stages, EventStage::COMPLETE, elapsed(callback_end, completed));
+    add(stages, EventStage::TOTAL, total_ns);
+
+    if (syscall_index < SYSCALL_COUNT)
+        state->syscalls[syscall_index].add(total_ns);
+}
+
+EventTimingStats EventTimingRecorder::stats() const {
+    EventTimingStats result;
+    const State* state = state_.load(std::memory_order_acquire);
+    if (state == nullptr)
+        return result;
+
+    auto read = [](const std::array<Stages, TYPE_COUNT>& types) {
+        std::map<EventType, EventTimingStats::StageHistograms> histograms;
+        for (unsigned int type = 0; type < TYPE_COUNT; ++type) {
+            if (types[type][static_cast<int>(EventStage::TOTAL)].count.load(
+                    std::memory_order_relaxed) == 0)
+                continue;
+
+            auto& stages = histograms[static_cast<EventType>(type)];
+            for (unsigned int stage = 0; stage < STAGE_COUNT; ++stage)
+                stages[stage] = types[type][stage].read();
+        }
+        return histograms;
+    };
+
+    for (uint32_t i = 0; i < state->vcpu_count; ++i) {
+        result.delivered.push_back(read(state->vcpus[i].delivered));
+        result.filtered.push_back(read(state->vcpus[i].filtered));
+    }
+
+    for (unsigned int i = 0; i < SYSCALL_COUNT; ++i) {
+        if (state->syscalls[i].count.load(std::memory_order_relaxed))
+            result.syscalls[i] = state->syscalls[i].read();
+    }
+
+    return result;
+}
+
+EventTimingRecorder::EventTimingRecorder() = default;
+EventTimingRecorder::~EventTimingRecorder() = default;
+
+} // namespace introvirt
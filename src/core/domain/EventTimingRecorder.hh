@@ -0,0 +1,136 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/event/EventTimingStats.hh>
+#include <introvirt/util/compiler.hh>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace introvirt {
+
+/**
+ * @brief Timestamps collected for an event before it's delivered
+ *
+ * All values are from EventTimingRecorder::now(). A fetch_start of 0 means the event wasn't timed.
+ */
+struct EventTimestamps {
+    uint64_t fetch_start = 0;
+    uint64_t fetch_end = 0;
+    uint64_t filter_end = 0;
+    uint64_t construct_ns = 0;
+};
+
+/**
+ * @brief Lock-free per-vcpu latency histograms for the event pipeline
+ *
+ * The histograms are allocated the first time timing is enabled and kept until the recorder is
+ * destroyed, so recording never has to synchronize with enable(). Every counter is a relaxed
+ * atomic; a snapshot taken while events are flowing may be slightly inconsistent.
+ */
+class EventTimingRecorder final {
+  public:
+    /**
+     * @brief Get a timestamp in nanoseconds
+     */
+    static uint64_t now() HOT;
+
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Toggle timing, clearing the histograms when turned on
+     *
+     * @param enabled If set to true, events will be timed
+     * @param vcpu_count The number of vcpus in the domain
+     */
+    void enable(bool enabled, uint32_t vcpu_count);
+
+    /**
+     * @brief Record an event that didn't make it to delivery
+     *
+     * @param vcpu_id The vcpu the event came from
+     * @param type The type of the event
+     * @param timestamps The times collected by the poller
+     */
+    void record_filtered(uint32_t vcpu_id, EventType type, const EventTimestamps& timestamps) HOT;
+
+    /**
+     * @brief Record a delivered event
+     *
+     * @param vcpu_id The vcpu the event came from
+     * @param type The type of the event
+     * @param syscall_index The raw system call index, or NO_SYSCALL
+     * @param timestamps The times collected by the poller
+     * @param dequeued When a delivery thread took the event
+     * @param callback_end When the callback returned
+     * @param completed When the vcpu was resumed
+     */
+    void record_delivered(uint32_t vcpu_id, EventType type, uint64_t syscall_index,
+                          const EventTimestamps& timestamps, uint64_t dequeued,
+                          uint64_t callback_end, uint64_t completed) HOT;
+
+    EventTimingStats stats() const;
+
+    static constexpr uint64_t NO_SYSCALL = ~0ull;
+
+    EventTimingRecorder();
+    ~EventTimingRecorder();
+
+  private:
+    static constexpr unsigned int TYPE_COUNT = static_cast<int>(EventType::EVENT_MAX) + 1;
+    static constexpr unsigned int STAGE_COUNT = static_cast<int>(EventStage::STAGE_COUNT);
+    static constexpr unsigned int SYSCALL_COUNT = 8192;
+
+    struct Histogram {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+        std::array<std::atomic<uint64_t>, LatencyHistogram::BUCKET_COUNT> buckets{};
+
+        void add(uint64_t ns);
+        void clear();
+        LatencyHistogram read() const;
+    };
+
+    using Stages = std::array<Histogram, STAGE_COUNT>;
+
+    struct alignas(64) VcpuHistograms {
+        std::array<Stages, TYPE_COUNT> delivered;
+        std::array<Stages, TYPE_COUNT> filtered;
+    };
+
+    struct State {
+        uint32_t vcpu_count;
+        std::unique_ptr<VcpuHistograms[]> vcpus;
+        std::unique_ptr<Histogram[]> syscalls;
+    };
+
+    static void add(Stages& stages, EventStage stage, uint64_t ns) {
+        stages[static_cast<int>(stage)].add(ns);
+    }
+
+  private:
+    std::mutex mtx_;
+    std::atomic<bool> enabled_{false};
+    std::atomic<State*> state_{nullptr};
+    std::unique_ptr<State> owned_state_;
+};
+
+} // namespace introvirt
@@ -18,11 +18,13 @@
 #include <introvirt/core/domain/Guest.hh>
 
 #include <memory>
+#include <optional>
 
 namespace introvirt {
 
 class Event;
 class HypervisorEvent;
+class TaskFilter;
 
 enum class GuestPageFaultResult { PTE_FIXED, RETRY, FAILURE };
 
@@ -39,6 +41,41 @@ class GuestImpl {
      */
     virtual std::unique_ptr<Event> filter_event(std::unique_ptr<HypervisorEvent>&& event) = 0;
 
+    /**
+     * @brief Check if an event can be dropped before filter_event() is called
+     *
+     * This is called for events that are subject to the task filter, and should only use
+     * information that is cheap to get from the raw event.
+     *
+     * @param event The incoming event
+     * @param filter The domain task filter
+     * @return false if the event is known not to match the filter
+     */
+    virtual bool prefilter_event(const HypervisorEvent& event, const TaskFilter& filter) = 0;
+
+    /**
+     * @brief Check the process that owns a page directory against the task filter
+     *
+     * This is called for every intercepted CR3 write, so it should only use information that has
+     * already been gathered.
+     *
+     * @param cr3 The CR3 value
+     * @param filter The domain task filter
+     * @return What the filter decides for the owning process, or an empty optional if the owner
+     * isn't known or the filter can't decide without reading more
+     */
+    virtual std::optional<bool> match_page_directory(uint64_t cr3, const TaskFilter& filter) = 0;
+
+    /**
+     * @brief Check if the guest switches page directories on every kernel entry and exit
+     *
+     * With kernel address space isolation (Windows KVA shadowing, Linux KPTI), every system call
+     * writes CR3 twice, so intercepting CR3 writes costs more than intercepting system calls.
+     *
+     * @return true if the guest is known to use separate user and kernel page directories
+     */
+    virtual bool kva_shadowing() = 0;
+
     /**
      * @brief Called when the normal page fault handler can't handle a fault
      *
@@ -16,13 +16,17 @@
 #include <introvirt/core/domain/Hypervisor.hh>
 #include <introvirt/core/exception/UnsupportedHypervisorException.hh>
 
+#include "../../hypervisor/image/ImageHypervisor.hh"
 #include "../../hypervisor/kvm/KvmHypervisor.hh"
+#include "../../hypervisor/replay/ReplayHypervisor.hh"
+#include "../../hypervisor/synthetic/SyntheticHypervisor.hh"
 
 #include <boost/algorithm/string/predicate.hpp>
 
 #include <log4cxx/logger.h>
 
 #include <cstdlib>
+#include <cstring>
 #include <dlfcn.h>
 
 #if __GNUC__ >= 8
@@ -39,6 +43,19 @@ static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.core.Hype
 
 // Try the builtin hypervisor support
 static std::unique_ptr<Hypervisor> try_builtin_hypervisors() {
+    // Offline memory images, event recordings and synthetic domains have to be asked for
+    // explicitly
+    const char* env_hypervisor = getenv("INTROVIRT_HYPERVISOR");
+    if (env_hypervisor != nullptr && strcmp(env_hypervisor, "image") == 0) {
+        return std::make_unique<image::ImageHypervisor>();
+    }
+    if (env_hypervisor != nullptr && strcmp(env_hypervisor, "replay") == 0) {
+        return std::make_unique<replay::ReplayHypervisor>();
+    }
+    if (env_hypervisor != nullptr && strcmp(env_hypervisor, "synthetic") == 0) {
+        return std::make_unique<synthetic::SyntheticHypervisor>();
+    }
+
     // Try kvm first
     try {
         auto result = std::make_unique<kvm::KvmHypervisor>();
@@ -63,6 +63,24 @@ std::unique_ptr<HypervisorEvent> VcpuImpl::event() {
     throw NotImplementedException("Vcpu does not support event polling");
 }
 
+void VcpuImpl::add_cr_write_intercept_ref(int cr) {
+    throw NotImplementedException("Vcpu does not support control register interception");
+}
+void VcpuImpl::remove_cr_write_intercept_ref(int cr) {
+    throw NotImplementedException("Vcpu does not support control register interception");
+}
+
+void VcpuImpl::system_call_gate(bool open) {
+    if (!open)
+        throw NotImplementedException("Vcpu does not support system call interception");
+}
+bool VcpuImpl::system_call_gate() const { return true; }
+
+void VcpuImpl::intercept_invlpg(bool enabled) {
+    throw NotImplementedException("Vcpu does not support INVLPG interception");
+}
+bool VcpuImpl::intercept_invlpg() const { return false; }
+
 Domain& VcpuImpl::domain() { return *pImpl_->domain_; }
 const Domain& VcpuImpl::domain() const { return *pImpl_->domain_; }
 
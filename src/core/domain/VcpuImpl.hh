@@ -71,6 +71,60 @@ class VcpuImpl : public Vcpu {
      */
     virtual std::unique_ptr<HypervisorEvent> event();
 
+    /**
+     * @brief Take a library-internal reference on control register write interception
+     *
+     * While any reference is held, writes to the register cause a VM exit. The resulting events
+     * are only delivered to the poll() callback if intercept_cr_writes() is also enabled.
+     *
+     * @param cr The control register
+     * @throws NotImplementedException if writes to the given CR cannot be intercepted
+     * @throws CommandFailedException If the hypervisor reports an error
+     */
+    virtual void add_cr_write_intercept_ref(int cr);
+
+    /**
+     * @brief Release a reference taken with add_cr_write_intercept_ref()
+     *
+     * @param cr The control register
+     */
+    virtual void remove_cr_write_intercept_ref(int cr);
+
+    /**
+     * @brief Hold back the system call intercept without changing intercept_system_calls()
+     *
+     * While the gate is closed, system calls don't exit even if intercept_system_calls() is
+     * enabled. Opening it again restores whatever intercept_system_calls() asks for. System call
+     * injection ignores the gate. Used by Domain::targeted_system_calls().
+     *
+     * @param open If set to false, system calls will not be intercepted
+     * @throws NotImplementedException if system call hooking is not supported
+     * @throws CommandFailedException If the hypervisor reports an error
+     */
+    virtual void system_call_gate(bool open);
+
+    /**
+     * @brief Check if the system call gate is open
+     */
+    virtual bool system_call_gate() const;
+
+    /**
+     * @brief Toggle interception of the INVLPG instruction
+     *
+     * Enables events of type EVENT_INVLPG. These are consumed by the library and are not
+     * delivered to the poll() callback.
+     *
+     * @param enabled If set to true, INVLPG will be intercepted
+     * @throws NotImplementedException if INVLPG cannot be intercepted
+     * @throws CommandFailedException If the hypervisor reports an error
+     */
+    virtual void intercept_invlpg(bool enabled);
+
+    /**
+     * @brief Check if INVLPG is being intercepted
+     */
+    virtual bool intercept_invlpg() const;
+
     /**
      * @brief Make sure system call intercepts can't be disabled while active
      */
@@ -20,6 +20,7 @@
 #include "HypervisorEvent.hh"
 #include "MemAccessEventImpl.hh"
 #include "core/domain/DomainImpl.hh"
+#include "core/domain/EventTimingRecorder.hh"
 #include "core/domain/VcpuImpl.hh"
 
 #include <introvirt/core/event/Event.hh>
@@ -85,6 +86,11 @@ class EventImpl {
     virtual std::unique_ptr<HypervisorEvent> release() = 0;
 
     virtual uint64_t page_directory() const = 0;
+
+    /**
+     * @brief Pipeline timestamps, if timing was enabled when the event arrived
+     */
+    virtual EventTimestamps& timestamps() = 0;
 };
 
 /**
@@ -192,6 +198,9 @@ class EventImplTpl : public _BaseClass, public EventImpl {
     std::unique_ptr<Event> suspend(std::function<WakeAction(Event&)> check_wakeup) override {
         introvirt_assert(check_wakeup != nullptr, "");
 
+        // Let the delivery pool replace this thread while it's parked
+        EventDeliveryPool::ScopedBlocking blocking;
+
         std::unique_lock lock(mtx_);
         hypervisor_event_->domain().suspend_event(*this);
 
@@ -303,6 +312,8 @@ class EventImplTpl : public _BaseClass, public EventImpl {
 
     uint64_t id() const override { return hypervisor_event_->id(); }
 
+    EventTimestamps& timestamps() override { return timestamps_; }
+
     EventImplTpl(std::unique_ptr<HypervisorEvent>&& hypervisor_event)
         : hypervisor_event_(std::move(hypervisor_event)) {
 
@@ -324,6 +335,7 @@ class EventImplTpl : public _BaseClass, public EventImpl {
     std::optional<ControlRegisterEventImpl> cr_;
     std::optional<ExceptionEventImpl> exception_;
     std::optional<MemAccessEventImpl> mem_access_;
+    EventTimestamps timestamps_;
 
   private:
     // Injection related
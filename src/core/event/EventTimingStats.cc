@@ -0,0 +1,100 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <introvirt/core/event/EventTimingStats.hh>
+
+#include <algorithm>
+
+namespace introvirt {
+
+static const std::string FETCH_STR("FETCH");
+static const std::string FILTER_STR("FILTER");
+static const std::string CONSTRUCT_STR("CONSTRUCT");
+static const std::string QUEUE_STR("QUEUE");
+static const std::string CALLBACK_STR("CALLBACK");
+static const std::string COMPLETE_STR("COMPLETE");
+static const std::string TOTAL_STR("TOTAL");
+static const std::string UNKNOWN_STR("UNKNOWN");
+
+const std::string& to_string(EventStage stage) {
+    switch (stage) {
+    case EventStage::FETCH:
+        return FETCH_STR;
+    case EventStage::FILTER:
+        return FILTER_STR;
+    case EventStage::CONSTRUCT:
+        return CONSTRUCT_STR;
+    case EventStage::QUEUE:
+        return QUEUE_STR;
+    case EventStage::CALLBACK:
+        return CALLBACK_STR;
+    case EventStage::COMPLETE:
+        return COMPLETE_STR;
+    case EventStage::TOTAL:
+        return TOTAL_STR;
+    case EventStage::STAGE_COUNT:
+        break;
+    }
+    return UNKNOWN_STR;
+}
+
+std::ostream& operator<<(std::ostream& os, EventStage stage) {
+    os << to_string(stage);
+    return os;
+}
+
+uint64_t LatencyHistogram::mean_ns() const { return count ? total_ns / count : 0; }
+
+uint64_t LatencyHistogram::percentile_ns(double percentile) const {
+    if (count == 0)
+        return 0;
+
+    const double target = std::clamp(percentile, 0.0, 100.0) / 100.0 * count;
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+        seen += buckets[i];
+        if (seen > 0 && seen >= target) {
+            if (i == 0)
+                return 0;
+            // The upper bound of the bucket, but never more than the largest sample
+            return std::min<uint64_t>(max_ns, (1ull << i) - 1);
+        }
+    }
+    return max_ns;
+}
+
+LatencyHistogram& LatencyHistogram::operator+=(const LatencyHistogram& other) {
+    count += other.count;
+    total_ns += other.total_ns;
+    max_ns = std::max(max_ns, other.max_ns);
+    for (unsigned int i = 0; i < BUCKET_COUNT; ++i)
+        buckets[i] += other.buckets[i];
+    return *this;
+}
+
+std::map<EventType, EventTimingStats::StageHistograms>
+EventTimingStats::combine(const std::vector<std::map<EventType, StageHistograms>>& per_vcpu) {
+    std::map<EventType, StageHistograms> result;
+    for (const auto& types : per_vcpu) {
+        for (const auto& [type, stages] : types) {
+            auto& combined = result[type];
+            for (size_t i = 0; i < stages.size(); ++i)
+                combined[i] += stages[i];
+        }
+    }
+    return result;
+}
+
+} // namespace introvirt
@@ -31,6 +31,7 @@ static const std::string EVENT_SINGLE_STEP_STR("EVENT_SINGLE_STEP");
 static const std::string EVENT_HYPERCALL_STR("EVENT_HYPERCALL");
 static const std::string EVENT_REBOOT_STR("EVENT_REBOOT");
 static const std::string EVENT_SHUTDOWN_STR("EVENT_SHUTDOWN");
+static const std::string EVENT_INVLPG_STR("EVENT_INVLPG");
 static const std::string EVENT_UNKNOWN_STR("EVENT_UNKNOWN");
 
 const std::string& to_string(EventType type) {
@@ -63,6 +64,8 @@ const std::string& to_string(EventType type) {
         return EVENT_REBOOT_STR;
     case EventType::EVENT_SHUTDOWN:
         return EVENT_SHUTDOWN_STR;
+    case EventType::EVENT_INVLPG:
+        return EVENT_INVLPG_STR;
     case EventType::EVENT_UNKNOWN:
         return EVENT_UNKNOWN_STR;
     }
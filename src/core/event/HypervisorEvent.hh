@@ -158,6 +158,15 @@ class HypervisorEvent {
      */
     virtual bool mem_access_execute() const = 0;
 
+    /**
+     * @brief Get the virtual address being invalidated
+     *
+     * Only valid for EventType::EVENT_INVLPG
+     *
+     * @return The operand of the INVLPG instruction
+     */
+    virtual uint64_t invlpg_address() const = 0;
+
     /**
      * @brief Discard this event.
      *
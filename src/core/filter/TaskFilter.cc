@@ -13,95 +13,244 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include "core/util/AtomicSnapshot.hh"
+
 #include <introvirt/core/event/Event.hh>
 #include <introvirt/core/event/EventTaskInformation.hh>
 #include <introvirt/core/filter/TaskFilter.hh>
+#include <introvirt/util/compiler.hh>
 
 #include <boost/algorithm/string.hpp>
 
-#include <mutex>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <vector>
 
 namespace introvirt {
 
-bool TaskFilter::matches(const Event& event) const {
+/*
+ * An immutable snapshot of the filter entries, rebuilt on every change.
+ *
+ * The process name result is cached in a small direct-mapped table keyed by the process object
+ * address and PID. A reused process object gets a new PID and simply misses. Each slot is
+ * protected by a sequence counter: a reader that races with a writer treats the lookup as a
+ * miss, and a writer that finds the slot busy skips the fill. A new snapshot starts with an empty
+ * cache, so changing the filter invalidates every cached result.
+ */
+class TaskFilter::Predicate final {
+  public:
+    bool empty() const { return empty_; }
 
-    switch (event.type()) {
-    case EventType::EVENT_SHUTDOWN:
-    case EventType::EVENT_REBOOT:
-        return true;
-    default:
-        break;
-    }
+    HOT bool matches(const EventTaskInformation& task_info) const {
+        if (empty_)
+            return true;
 
-    std::shared_lock<std::shared_mutex> read_lock(mtx_);
-    auto& task_info = event.task();
+        if (!tid_filter_.empty() && tid_filter_.count(task_info.tid()))
+            return true;
 
-    bool empty = true;
+        if (pid_filter_.empty() && proc_name_filter_.empty())
+            return false;
 
-    if (!pid_filter_.empty()) {
-        if (pid_filter_.count(task_info.pid()))
+        const uint64_t pid = task_info.pid();
+        if (pid_filter_.count(pid))
             return true;
-        empty = false;
+
+        if (proc_name_filter_.empty())
+            return false;
+
+        const uint64_t address = task_info.process_address();
+        bool result;
+        if (address && lookup(address, pid, result))
+            return result;
+
+        result = matches_name(task_info.process_name());
+        if (address)
+            insert(address, pid, result);
+        return result;
     }
 
-    if (!tid_filter_.empty()) {
-        if (tid_filter_.count(task_info.tid()))
+    std::optional<bool> matches_process(uint64_t address, uint64_t pid) const {
+        if (empty_)
             return true;
-        empty = false;
+
+        if (!tid_filter_.empty())
+            return std::nullopt;
+
+        if (pid_filter_.count(pid))
+            return true;
+
+        if (proc_name_filter_.empty())
+            return false;
+
+        bool result;
+        if (address && lookup(address, pid, result))
+            return result;
+
+        return std::nullopt;
     }
 
-    if (!proc_name_filter_.empty()) {
-        const std::string proc_name(boost::to_lower_copy(task_info.process_name()));
+    Predicate(const std::unordered_set<uint64_t>& tid_filter,
+              const std::unordered_set<uint64_t>& pid_filter,
+              const std::set<std::string>& proc_name_filter)
+        : tid_filter_(tid_filter), pid_filter_(pid_filter),
+          proc_name_filter_(proc_name_filter.begin(), proc_name_filter.end()),
+          empty_(tid_filter.empty() && pid_filter.empty() && proc_name_filter.empty()) {}
+
+  private:
+    static constexpr unsigned int CACHE_SIZE = 256;
+
+    struct CacheEntry {
+        std::atomic<uint32_t> seq{0};
+        std::atomic<uint64_t> address{0};
+        // (pid << 1) | result
+        std::atomic<uint64_t> value{0};
+    };
+
+    static unsigned int cache_index(uint64_t address) {
+        return (address * 0x9E3779B97F4A7C15ull >> 56) % CACHE_SIZE;
+    }
+
+    bool matches_name(const std::string& name) const {
+        // Either string may be a prefix of the other, ignoring case
         for (const std::string& filter : proc_name_filter_) {
-            if (boost::starts_with(proc_name, filter) || boost::starts_with(filter, proc_name))
+            const size_t length = std::min(filter.size(), name.size());
+            size_t i = 0;
+            while (i < length && filter[i] == std::tolower(static_cast<unsigned char>(name[i])))
+                ++i;
+            if (i == length)
                 return true;
         }
-        empty = false;
+        return false;
+    }
+
+    bool lookup(uint64_t address, uint64_t pid, bool& result) const {
+        const CacheEntry& entry = cache_[cache_index(address)];
+        const uint32_t seq = entry.seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            return false;
+
+        const bool match = entry.address.load(std::memory_order_relaxed) == address;
+        const uint64_t value = entry.value.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!match || (value >> 1) != pid || entry.seq.load(std::memory_order_relaxed) != seq)
+            return false;
+
+        result = value & 1;
+        return true;
     }
 
-    // The filter is empty, so just return the event
-    if (empty)
+    void insert(uint64_t address, uint64_t pid, bool result) const {
+        CacheEntry& entry = cache_[cache_index(address)];
+
+        // If another thread is writing this entry, just skip the fill
+        uint32_t seq = entry.seq.load(std::memory_order_relaxed);
+        if ((seq & 1) ||
+            !entry.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+
+        entry.address.store(address, std::memory_order_relaxed);
+        entry.value.store((pid << 1) | result, std::memory_order_relaxed);
+        entry.seq.store(seq + 2, std::memory_order_release);
+    }
+
+  private:
+    const std::unordered_set<uint64_t> tid_filter_;
+    const std::unordered_set<uint64_t> pid_filter_;
+    const std::vector<std::string> proc_name_filter_;
+    const bool empty_;
+
+    mutable std::array<CacheEntry, CACHE_SIZE> cache_;
+};
+
+bool TaskFilter::matches(const Event& event) const {
+
+    switch (event.type()) {
+    case EventType::EVENT_SHUTDOWN:
+    case EventType::EVENT_REBOOT:
         return true;
+    default:
+        break;
+    }
+
+    // Without a guest there's no task information, and an empty filter doesn't need any
+    if (empty())
+        return true;
+
+    SnapshotReadGuard guard;
+    return predicate_.load()->matches(event.task());
+}
+
+bool TaskFilter::empty() const { return empty_.load(std::memory_order_relaxed); }
+
+std::optional<bool> TaskFilter::matches_process(uint64_t process_address, uint64_t pid) const {
+    SnapshotReadGuard guard;
+    return predicate_.load()->matches_process(process_address, pid);
+}
 
-    // Our filter is not empty and we didn't have a match
-    return false;
+void TaskFilter::update() {
+    const Predicate* old =
+        predicate_.exchange(new Predicate(tid_filter_, pid_filter_, proc_name_filter_));
+    if (old)
+        SnapshotEpoch::retire([old]() { delete old; });
+    empty_.store(tid_filter_.empty() && pid_filter_.empty() && proc_name_filter_.empty(),
+                 std::memory_order_relaxed);
 }
 
 void TaskFilter::add_pid(uint64_t pid) {
-    std::unique_lock<std::shared_mutex> write_lock(mtx_);
+    std::lock_guard lock(mtx_);
     pid_filter_.insert(pid);
+    update();
 }
 
 bool TaskFilter::remove_pid(uint64_t pid) {
-    std::unique_lock<std::shared_mutex> write_lock(mtx_);
-    return pid_filter_.erase(pid);
+    std::lock_guard lock(mtx_);
+    const bool result = pid_filter_.erase(pid);
+    update();
+    return result;
 }
 
 void TaskFilter::add_tid(uint64_t tid) {
-    std::unique_lock<std::shared_mutex> write_lock(mtx_);
+    std::lock_guard lock(mtx_);
     tid_filter_.insert(tid);
+    update();
 }
 
 bool TaskFilter::remove_tid(uint64_t tid) {
-    std::unique_lock<std::shared_mutex> write_lock(mtx_);
-    return tid_filter_.erase(tid);
+    std::lock_guard lock(mtx_);
+    const bool result = tid_filter_.erase(tid);
+    update();
+    return result;
 }
 
 void TaskFilter::add_name(const std::string& name) {
-    std::unique_lock<std::shared_mutex> write_lock(mtx_);
+    std::lock_guard lock(mtx_);
     proc_name_filter_.insert(boost::to_lower_copy(name));
+    update();
 }
 
 bool TaskFilter::remove_name(const std::string& name) {
-    std::unique_lock<std::shared_mutex> write_lock(mtx_);
-    return proc_name_filter_.erase(boost::to_lower_copy(name));
+    std::lock_guard lock(mtx_);
+    const bool result = proc_name_filter_.erase(boost::to_lower_copy(name));
+    update();
+    return result;
 }
 
 void TaskFilter::clear() {
-    std::unique_lock<std::shared_mutex> write_lock(mtx_);
+    std::lock_guard lock(mtx_);
     pid_filter_.clear();
     tid_filter_.clear();
     proc_name_filter_.clear();
+    update();
+}
+
+TaskFilter::TaskFilter() { update(); }
+
+TaskFilter::~TaskFilter() {
+    const Predicate* old = predicate_.exchange(nullptr);
+    SnapshotEpoch::retire([old]() { delete old; });
 }
 
-} // namespace introvirt
\ No newline at end of file
+} // namespace introvirt
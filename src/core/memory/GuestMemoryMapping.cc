@@ -25,6 +25,7 @@ namespace introvirt {
 GuestMemoryMapping::GuestMemoryMapping(GuestMemoryMapping&& src) noexcept {
     mapping_ = src.mapping_;
     length_ = src.length_;
+    backing_ = std::move(src.backing_);
 
     src.mapping_ = nullptr;
     src.length_ = 0;
@@ -32,11 +33,12 @@ GuestMemoryMapping::GuestMemoryMapping(GuestMemoryMapping&& src) noexcept {
 
 GuestMemoryMapping& GuestMemoryMapping::operator=(GuestMemoryMapping&& src) noexcept {
     // Replace our mapping with the one in src
-    if (mapping_)
+    if (mapping_ && !backing_)
         munmap(mapping_, length_);
 
     mapping_ = src.mapping_;
     length_ = src.length_;
+    backing_ = std::move(src.backing_);
 
     src.mapping_ = nullptr;
     src.length_ = 0;
@@ -44,7 +46,7 @@ GuestMemoryMapping& GuestMemoryMapping::operator=(GuestMemoryMapping&& src) noex
 }
 
 GuestMemoryMapping::~GuestMemoryMapping() {
-    if (mapping_)
+    if (mapping_ && !backing_)
         munmap(mapping_, length_);
 }
 
@@ -0,0 +1,300 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "MemorySnapshotImpl.hh"
+#include "PageHash.hh"
+#include "core/domain/DomainImpl.hh"
+
+#include <introvirt/core/arch/x86/PageDirectory.hh>
+#include <introvirt/core/domain/Domain.hh>
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/TraceableException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <numeric>
+#include <thread>
+
+namespace introvirt {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.core.MemorySnapshot"));
+
+using x86::PageDirectory;
+
+// The most pages a thread maps and copies at once
+static constexpr uint64_t ChunkPages = 512;
+
+struct MemorySnapshotImpl::Counters {
+    std::atomic<uint64_t> written = 0;
+    std::atomic<uint64_t> failed = 0;
+};
+
+MemorySnapshotStats MemorySnapshotImpl::capture() {
+    std::lock_guard lock(mtx_);
+    const auto start = std::chrono::steady_clock::now();
+
+    // Start over if guest RAM was added or removed
+    const std::vector<PhysicalMemoryRange> ranges = domain_.physical_memory_ranges();
+    const bool full = (fd_ < 0) || !same_layout(ranges);
+    if (full)
+        create_file(ranges);
+
+    std::vector<Chunk> chunks;
+    for (uint32_t i = 0; i < segments_.size(); ++i) {
+        const uint64_t pages = segments_[i].length >> PageDirectory::PAGE_SHIFT;
+        for (uint64_t page = 0; page < pages; page += ChunkPages)
+            chunks.push_back(Chunk{i, page, std::min(ChunkPages, pages - page)});
+    }
+
+    Counters counters;
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex error_mtx;
+
+    auto worker = [&]() {
+        std::unique_ptr<char[]> buffer(new char[ChunkPages * PageDirectory::PAGE_SIZE]);
+        try {
+            for (size_t i = next++; i < chunks.size(); i = next++)
+                copy_chunk(chunks[i], full, buffer.get(), counters);
+        } catch (...) {
+            std::lock_guard error_lock(error_mtx);
+            if (!error)
+                error = std::current_exception();
+            next = chunks.size();
+        }
+    };
+
+    const uint32_t thread_count = std::max<size_t>(1, std::min<size_t>(threads_, chunks.size()));
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < thread_count; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    ++captures_;
+
+    MemorySnapshotStats stats;
+    stats.full = full;
+    stats.pages = hashes_.size();
+    stats.written_pages = counters.written;
+    stats.failed_pages = counters.failed;
+    stats.duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+    LOG4CXX_DEBUG(logger, "Snapshot " << path_ << ": wrote " << stats.written_pages << " of "
+                                      << stats.pages << " pages in " << stats.duration_ns / 1000
+                                      << "us");
+    return stats;
+}
+
+void MemorySnapshotImpl::copy_chunk(const Chunk& chunk, bool full, char* buffer,
+                                    Counters& counters) {
+    const Segment& segment = segments_[chunk.segment];
+    const uint64_t address = segment.address + (chunk.first_page << PageDirectory::PAGE_SHIFT);
+    uint64_t* hashes = &hashes_[segment.first_page + chunk.first_page];
+
+    std::vector<uint64_t> pfns(chunk.page_count);
+    std::iota(pfns.begin(), pfns.end(), address >> PageDirectory::PAGE_SHIFT);
+
+    std::shared_ptr<GuestMemoryMapping> mapping;
+    try {
+        mapping = domain_.map_pfns(pfns.data(), pfns.size());
+    } catch (TraceableException& ex) {
+        LOG4CXX_WARN(logger, "Snapshot " << path_ << ": failed to map 0x" << std::hex << address
+                                         << ": " << ex.what());
+        std::fill_n(hashes, chunk.page_count, 0);
+        counters.failed += chunk.page_count;
+        return;
+    }
+    const char* pages = static_cast<const char*>(mapping->get());
+
+    /*
+     * Changed pages are copied out before they're written, and the hash is taken from the copy.
+     * The guest may be running, and the recorded hash has to match what's in the file.
+     */
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    auto flush = [&]() {
+        if (!run_length)
+            return;
+        const uint64_t offset =
+            segment.file_offset + ((chunk.first_page + run_start) << PageDirectory::PAGE_SHIFT);
+        write_file(buffer, run_length << PageDirectory::PAGE_SHIFT, offset);
+        counters.written += run_length;
+        run_length = 0;
+    };
+
+    for (uint64_t i = 0; i < chunk.page_count; ++i) {
+        const char* page = pages + (i << PageDirectory::PAGE_SHIFT);
+        if (!full && hashes[i] != 0 && (hash_page(page) | 1) == hashes[i]) {
+            flush();
+            continue;
+        }
+
+        if (!run_length)
+            run_start = i;
+        char* copy = buffer + (run_length << PageDirectory::PAGE_SHIFT);
+        std::memcpy(copy, page, PageDirectory::PAGE_SIZE);
+        hashes[i] = hash_page(copy) | 1;
+        ++run_length;
+    }
+    flush();
+}
+
+bool MemorySnapshotImpl::same_layout(const std::vector<PhysicalMemoryRange>& ranges) const {
+    if (ranges.size() != segments_.size())
+        return false;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (ranges[i].address != segments_[i].address || ranges[i].length != segments_[i].length)
+            return false;
+    }
+    return true;
+}
+
+void MemorySnapshotImpl::create_file(const std::vector<PhysicalMemoryRange>& ranges) {
+    if (fd_ >= 0)
+        close(fd_);
+
+    fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+        throw CommandFailedException("Failed to create memory snapshot " + path_, errno);
+
+    // ELF segments start after the headers, on a page boundary
+    uint64_t offset = 0;
+    if (format_ == MemorySnapshotFormat::ELF) {
+        offset = sizeof(Elf64_Ehdr) + ranges.size() * sizeof(Elf64_Phdr);
+        offset = (offset + PageDirectory::PAGE_SIZE - 1) & PageDirectory::PAGE_MASK;
+    }
+
+    segments_.clear();
+    uint64_t page_count = 0;
+    for (const auto& range : ranges) {
+        Segment segment;
+        segment.address = range.address;
+        segment.length = range.length & PageDirectory::PAGE_MASK;
+        segment.first_page = page_count;
+        if (format_ == MemorySnapshotFormat::ELF) {
+            segment.file_offset = offset;
+            offset += segment.length;
+        } else {
+            segment.file_offset = segment.address;
+            offset = std::max(offset, segment.address + segment.length);
+        }
+        page_count += segment.length >> PageDirectory::PAGE_SHIFT;
+        segments_.push_back(segment);
+    }
+    hashes_.assign(page_count, 0);
+
+    // Reserve the whole file up front, leaving holes for pages that are never written
+    if (ftruncate(fd_, offset) < 0)
+        throw CommandFailedException("Failed to size memory snapshot " + path_, errno);
+
+    if (format_ != MemorySnapshotFormat::ELF)
+        return;
+
+    Elf64_Ehdr ehdr = {};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_CORE;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = segments_.size();
+    write_file(&ehdr, sizeof(ehdr), 0);
+
+    std::vector<Elf64_Phdr> phdrs;
+    for (const auto& segment : segments_) {
+        Elf64_Phdr phdr = {};
+        phdr.p_type = PT_LOAD;
+        phdr.p_flags = PF_R | PF_W | PF_X;
+        phdr.p_offset = segment.file_offset;
+        phdr.p_paddr = segment.address;
+        phdr.p_filesz = segment.length;
+        phdr.p_memsz = segment.length;
+        phdr.p_align = PageDirectory::PAGE_SIZE;
+        phdrs.push_back(phdr);
+    }
+    write_file(phdrs.data(), phdrs.size() * sizeof(Elf64_Phdr), sizeof(Elf64_Ehdr));
+}
+
+void MemorySnapshotImpl::write_file(const void* data, size_t length, uint64_t offset) {
+    const char* bytes = static_cast<const char*>(data);
+    while (length) {
+        const ssize_t written = pwrite(fd_, bytes, length, offset);
+        if (unlikely(written < 0)) {
+            if (errno == EINTR)
+                continue;
+            throw CommandFailedException("Failed to write memory snapshot " + path_, errno);
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+}
+
+uint64_t MemorySnapshotImpl::captures() const {
+    std::lock_guard lock(mtx_);
+    return captures_;
+}
+
+const std::string& MemorySnapshotImpl::path() const { return path_; }
+
+MemorySnapshotFormat MemorySnapshotImpl::format() const { return format_; }
+
+MemorySnapshotImpl::MemorySnapshotImpl(DomainImpl& domain, const std::string& path,
+                                       MemorySnapshotFormat format, uint32_t threads)
+    : domain_(domain), path_(path), format_(format),
+      threads_(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {
+
+    // Copying is much faster out of the persistent mapping. A reference keeps it enabled for the
+    // snapshot's lifetime without overriding what the user set with direct_memory_map().
+    try {
+        domain_.add_direct_memory_map_ref();
+        holds_direct_map_ref_ = true;
+    } catch (TraceableException& ex) {
+        LOG4CXX_DEBUG(logger, "Snapshot " << path_ << ": no persistent mapping: " << ex.what());
+    }
+}
+
+MemorySnapshotImpl::~MemorySnapshotImpl() {
+    if (fd_ >= 0 && close(fd_) < 0)
+        LOG4CXX_ERROR(logger,
+                      "Failed to close memory snapshot " << path_ << ": " << strerror(errno));
+
+    if (holds_direct_map_ref_)
+        domain_.remove_direct_memory_map_ref();
+}
+
+} // namespace introvirt
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/fwd.hh>
+#include <introvirt/core/memory/MemorySnapshot.hh>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace introvirt {
+
+class DomainImpl;
+
+class MemorySnapshotImpl final : public MemorySnapshot {
+  public:
+    MemorySnapshotStats capture() override;
+    uint64_t captures() const override;
+    const std::string& path() const override;
+    MemorySnapshotFormat format() const override;
+
+    /**
+     * @brief Create a snapshot
+     *
+     * Nothing is written until the first capture().
+     *
+     * @param domain The domain to copy memory from
+     * @param path The file to write
+     * @param format The format of the file
+     * @param threads The number of copy threads, or 0 for one per host CPU
+     */
+    MemorySnapshotImpl(DomainImpl& domain, const std::string& path, MemorySnapshotFormat format,
+                       uint32_t threads);
+    ~MemorySnapshotImpl() override;
+
+  private:
+    /*
+     * A range of guest RAM and where it lives in the file
+     */
+    struct Segment {
+        uint64_t address;
+        uint64_t length;
+        uint64_t file_offset;
+        uint64_t first_page; // Index of the segment's first page in hashes_
+    };
+
+    /*
+     * A piece of a segment copied by one thread at a time
+     */
+    struct Chunk {
+        uint32_t segment;
+        uint64_t first_page; // Page index within the segment
+        uint64_t page_count;
+    };
+
+    struct Counters;
+
+    bool same_layout(const std::vector<PhysicalMemoryRange>& ranges) const;
+    void create_file(const std::vector<PhysicalMemoryRange>& ranges);
+    void copy_chunk(const Chunk& chunk, bool full, char* buffer, Counters& counters);
+    void write_file(const void* data, size_t length, uint64_t offset);
+
+  private:
+    DomainImpl& domain_;
+    const std::string path_;
+    const MemorySnapshotFormat format_;
+    const uint32_t threads_;
+
+    // Set if we hold a reference on the persistent memory mapping
+    bool holds_direct_map_ref_ = false;
+
+    mutable std::mutex mtx_;
+    int fd_ = -1;
+    uint64_t captures_ = 0;
+    std::vector<Segment> segments_;
+
+    // The hash of every page as it was last written, with the low bit set; 0 if it wasn't written
+    std::vector<uint64_t> hashes_;
+};
+
+} // namespace introvirt
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "PageHash.hh"
+
+#include <introvirt/core/arch/x86/PageDirectory.hh>
+
+#include <cstring>
+
+namespace introvirt {
+
+// Four 64-bit lanes; the compiler splits these up for targets without 256-bit vectors
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+static constexpr uint64_t Prime1 = 0x9e3779b185ebca87ull;
+static constexpr uint64_t Prime2 = 0xc2b2ae3d27d4eb4full;
+static constexpr uint64_t Prime3 = 0x165667b19e3779f9ull;
+
+static inline uint64_t avalanche(uint64_t value) {
+    value ^= value >> 37;
+    value *= Prime3;
+    value ^= value >> 32;
+    return value;
+}
+
+__attribute__((target_clones("avx2", "default"))) uint64_t hash_page(const void* page) {
+    constexpr size_t WordCount = x86::PageDirectory::PAGE_SIZE / sizeof(uint64_t);
+    const char* data = static_cast<const char*>(page);
+
+    u64x4 acc0 = {Prime1, Prime2, Prime3, Prime1 ^ Prime2};
+    u64x4 acc1 = {Prime2 ^ Prime3, Prime3 ^ Prime1, Prime1 + Prime2, Prime2 + Prime3};
+    u64x4 key0 = {0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+                  0x78e5c0cc4ee679cbull};
+    u64x4 key1 = {0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull,
+                  0xcb00c391bb52283cull};
+    const u64x4 step = {Prime1, Prime1, Prime1, Prime1};
+    const u64x4 low = {0xffffffffull, 0xffffffffull, 0xffffffffull, 0xffffffffull};
+
+    for (size_t i = 0; i < WordCount; i += 8) {
+        u64x4 words0;
+        u64x4 words1;
+        std::memcpy(&words0, data + i * sizeof(uint64_t), sizeof(words0));
+        std::memcpy(&words1, data + (i + 4) * sizeof(uint64_t), sizeof(words1));
+
+        const u64x4 keyed0 = words0 ^ key0;
+        const u64x4 keyed1 = words1 ^ key1;
+        acc0 += words1 + (keyed0 & low) * (keyed0 >> 32);
+        acc1 += words0 + (keyed1 & low) * (keyed1 >> 32);
+
+        // Move the keys along so that the same word in another position hashes differently
+        key0 += step;
+        key1 += step;
+    }
+
+    uint64_t result = Prime3;
+    for (int lane = 0; lane < 4; ++lane) {
+        result = (result ^ avalanche(acc0[lane])) * Prime1;
+        result = (result ^ avalanche(acc1[lane])) * Prime2;
+    }
+    return avalanche(result);
+}
+
+} // namespace introvirt
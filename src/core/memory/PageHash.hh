@@ -0,0 +1,37 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/util/compiler.hh>
+
+#include <cstdint>
+
+namespace introvirt {
+
+/**
+ * @brief Hash a 4KiB page of guest memory
+ *
+ * Used to notice pages that changed, not for anything adversarial. The page is consumed as eight
+ * independent 64-bit lanes, each mixed with a 32x32->64 bit multiply of the word against a key
+ * that depends on its position. That keeps the loop vectorized (SSE2 everywhere, AVX2 where the
+ * host has it) while still telling apart words that moved within the page.
+ *
+ * @param page The page, which must be 8-byte aligned
+ * @return The hash
+ */
+uint64_t hash_page(const void* page) HOT;
+
+} // namespace introvirt
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "PageMapping.hh"
+
+#include <introvirt/core/arch/x86/PageDirectory.hh>
+#include <introvirt/core/exception/BadPhysicalAddressException.hh>
+#include <introvirt/core/exception/CommandFailedException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+
+namespace introvirt {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.memory.PageMapping"));
+
+std::shared_ptr<GuestMemoryMapping> map_guest_pages(const uint64_t* pfns, size_t count,
+                                                    const DirectPageMapper& direct,
+                                                    const PageMapper& map_page) {
+    const size_t region_size = count * x86::PageDirectory::PAGE_SIZE;
+
+    // Physically contiguous ranges come straight out of the persistent mapping
+    if (direct) {
+        bool contiguous = true;
+        for (size_t i = 1; i < count; ++i) {
+            if (pfns[i] != pfns[0] + i) {
+                contiguous = false;
+                break;
+            }
+        }
+        if (contiguous) {
+            auto result = direct(pfns[0], count);
+            if (likely(result != nullptr))
+                return result;
+        }
+    }
+
+    // Reserve address space for the mapping
+    void* result =
+        mmap(nullptr, region_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if ((unlikely(result == MAP_FAILED))) {
+        LOG4CXX_ERROR(logger, "Failed to reserve " << region_size << " bytes of address space");
+        throw CommandFailedException("Failed to reserve address space", errno);
+    }
+
+    // Go through each PFN and map it
+    char* mapping = static_cast<char*>(result);
+    try {
+        for (size_t i = 0; i < count; ++i) {
+            map_page(mapping, pfns[i]);
+            mapping += x86::PageDirectory::PAGE_SIZE;
+        }
+    } catch (...) {
+        munmap(result, region_size);
+        throw;
+    }
+    return std::make_shared<GuestMemoryMapping>(result, region_size);
+}
+
+void map_fd_page(char* address, int fd, off_t offset, int prot, int flags, uint64_t gpa) {
+    void* page = mmap(address, x86::PageDirectory::PAGE_SIZE, prot, flags | MAP_FIXED, fd, offset);
+    if ((unlikely(page == MAP_FAILED))) {
+        const int err = errno;
+        LOG4CXX_WARN(logger, "mmap for gpa 0x" << std::hex << gpa << " failed: " << strerror(err));
+        throw BadPhysicalAddressException(gpa, err);
+    }
+}
+
+} // namespace introvirt
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/memory/GuestMemoryMapping.hh>
+#include <introvirt/util/compiler.hh>
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace introvirt {
+
+/**
+ * @brief Serves a physically contiguous range from a persistent mapping
+ *
+ * Called with the first pfn and the page count. Returns nullptr if the range isn't available,
+ * in which case the pages are mapped one at a time instead.
+ */
+using DirectPageMapper = std::function<std::shared_ptr<GuestMemoryMapping>(uint64_t, size_t)>;
+
+/**
+ * @brief Places one guest page at a fixed address
+ *
+ * Called with the address to fill and the pfn. It must replace the page at that address, for
+ * example with map_fd_page(), and throw BadPhysicalAddressException if the pfn can't be mapped.
+ */
+using PageMapper = std::function<void(char*, uint64_t)>;
+
+/**
+ * @brief Map guest physical pages into one contiguous host mapping
+ *
+ * This is the common part of DomainImpl::map_pfns() for every backend. Contiguous ranges are
+ * given to direct first. Otherwise address space is reserved for all of the pages, and
+ * map_page is called to place each one. If map_page throws, the reservation is released and the
+ * exception is passed on.
+ *
+ * @param pfns The pfns to map
+ * @param count The number of pfns
+ * @param direct The persistent mapping lookup, or an empty function if there isn't one
+ * @param map_page Places one page
+ * @return The mapping
+ * @throws CommandFailedException if address space could not be reserved
+ */
+std::shared_ptr<GuestMemoryMapping> map_guest_pages(const uint64_t* pfns, size_t count,
+                                                    const DirectPageMapper& direct,
+                                                    const PageMapper& map_page) HOT;
+
+/**
+ * @brief Map one page of a file over an existing mapping
+ *
+ * @param address The page-aligned address to replace
+ * @param fd The file to map from
+ * @param offset The page-aligned offset in the file
+ * @param prot The protection for the page
+ * @param flags MAP_SHARED or MAP_PRIVATE. MAP_FIXED is added.
+ * @param gpa The guest physical address, for the exception
+ * @throws BadPhysicalAddressException if the page could not be mapped
+ */
+void map_fd_page(char* address, int fd, off_t offset, int prot, int flags, uint64_t gpa);
+
+} // namespace introvirt
@@ -19,9 +19,8 @@
 #include <introvirt/core/syscall/SystemCallFilter.hh>
 #include <introvirt/util/compiler.hh>
 
-#include <algorithm>
-#include <mutex>
-#include <vector>
+#include <array>
+#include <atomic>
 
 #include <log4cxx/logger.h>
 
@@ -30,18 +29,31 @@ static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.syscall.S
 namespace introvirt {
 
 static constexpr size_t MaxCall = 16384;
+static constexpr size_t BitsPerWord = 64;
 
+/*
+ * The filters are checked from the event thread for every system call, while tools may be
+ * changing them from their own threads. Each entry lives in an atomic word, so a check is a single
+ * load and updates never block readers. Setting one entry is atomic; clear() is atomic per word,
+ * meaning a concurrent check sees each entry either before or after the clear.
+ */
 class SystemCallFilter::IMPL {
   public:
-    void clear() {
-        std::lock_guard lock(mtx_);
+    using Bitmap = std::array<std::atomic<uint64_t>, MaxCall / BitsPerWord>;
 
-        std::fill(filter_32_.begin(), filter_32_.end(), 0);
-        std::fill(filter_64_.begin(), filter_64_.end(), 0);
+    static void clear(Bitmap& filter) {
+        for (auto& word : filter)
+            word.store(0, std::memory_order_relaxed);
     }
 
-    bool matches(unsigned int index, std::vector<bool>& filter) const {
-        index &= mask_;
+    void clear() {
+        clear(filter_32_);
+        clear(filter_64_);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    HOT bool matches(uint64_t index, const Bitmap& filter) const {
+        index &= mask_.load(std::memory_order_relaxed);
 
         // The incoming system call number is larger than we can fit in our map
         if (unlikely(index >= MaxCall)) {
@@ -50,11 +62,11 @@ class SystemCallFilter::IMPL {
             return false;
         }
 
-        std::lock_guard lock(mtx_);
-        return filter.at(index);
+        const uint64_t word = filter[index / BitsPerWord].load(std::memory_order_acquire);
+        return (word >> (index % BitsPerWord)) & 1;
     }
 
-    void set(unsigned int index, std::vector<bool>& filter, bool enabled) {
+    void set(unsigned int index, Bitmap& filter, bool enabled) {
         if (unlikely(index == 0xFFFFFFFF)) {
             LOG4CXX_DEBUG(
                 logger,
@@ -62,7 +74,7 @@ class SystemCallFilter::IMPL {
             return;
         }
 
-        index &= mask_;
+        index &= mask_.load(std::memory_order_relaxed);
 
         // The incoming system call number is larger than we can fit in our map
         if (unlikely(index >= MaxCall)) {
@@ -71,23 +83,24 @@ class SystemCallFilter::IMPL {
             return;
         }
 
-        std::lock_guard lock(mtx_);
-        filter[index] = enabled;
+        const uint64_t bit = 1ULL << (index % BitsPerWord);
+        if (enabled)
+            filter[index / BitsPerWord].fetch_or(bit, std::memory_order_release);
+        else
+            filter[index / BitsPerWord].fetch_and(~bit, std::memory_order_release);
     }
 
     IMPL() {
-        filter_32_.resize(MaxCall, false);
-        filter_64_.resize(MaxCall, false);
+        clear(filter_32_);
+        clear(filter_64_);
     }
 
   public:
-    mutable std::mutex mtx_;
-
-    std::vector<bool> filter_32_;
-    std::vector<bool> filter_64_;
+    Bitmap filter_32_;
+    Bitmap filter_64_;
 
-    bool enabled_ = false;
-    uint32_t mask_;
+    std::atomic<bool> enabled_ = false;
+    std::atomic<uint32_t> mask_ = 0xFFFFFFFF;
 };
 
 SystemCallFilter::SystemCallFilter() : pImpl_(std::make_unique<IMPL>()) {}
@@ -108,6 +121,14 @@ bool SystemCallFilter::matches(const Vcpu& vcpu) const {
     }
 }
 
+bool SystemCallFilter::matches_32(uint32_t index) const {
+    return pImpl_->matches(index, pImpl_->filter_32_);
+}
+
+bool SystemCallFilter::matches_64(uint32_t index) const {
+    return pImpl_->matches(index, pImpl_->filter_64_);
+}
+
 void SystemCallFilter::set_32(uint32_t index, bool enabled) {
     pImpl_->set(index, pImpl_->filter_32_, enabled);
 }
@@ -118,19 +139,14 @@ void SystemCallFilter::set_64(uint32_t index, bool enabled) {
 
 void SystemCallFilter::clear() { pImpl_->clear(); }
 
-void SystemCallFilter::mask(uint64_t mask) { pImpl_->mask_ = mask; }
-uint64_t SystemCallFilter::mask() const { return pImpl_->mask_; }
+void SystemCallFilter::mask(uint64_t mask) { pImpl_->mask_.store(mask, std::memory_order_release); }
+uint64_t SystemCallFilter::mask() const { return pImpl_->mask_.load(std::memory_order_acquire); }
 
 void SystemCallFilter::enabled(bool enabled) {
-    std::lock_guard lock(pImpl_->mtx_);
-
-    pImpl_->enabled_ = enabled;
+    pImpl_->enabled_.store(enabled, std::memory_order_release);
 }
 
-bool SystemCallFilter::enabled() const {
-    std::lock_guard lock(pImpl_->mtx_);
-    return pImpl_->enabled_;
-}
+bool SystemCallFilter::enabled() const { return pImpl_->enabled_.load(std::memory_order_acquire); }
 
 SystemCallFilter::~SystemCallFilter() = default;
 
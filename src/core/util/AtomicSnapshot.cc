@@ -0,0 +1,171 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "AtomicSnapshot.hh"
+
+#include <introvirt/util/compiler.hh>
+
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace introvirt {
+
+namespace {
+
+/*
+ * A reader slot. Slots are never freed; a thread that exits gives its slot to the next new
+ * thread. The epoch is 0 while the thread isn't reading.
+ */
+struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic_bool in_use{true};
+    ReaderSlot* next = nullptr;
+};
+
+struct Retired {
+    uint64_t epoch;
+    std::function<void()> deleter;
+};
+
+// Starts at 1, since 0 marks an idle slot
+std::atomic<uint64_t> GlobalEpoch{1};
+std::atomic<ReaderSlot*> Slots{nullptr};
+
+std::mutex RetiredMutex;
+std::vector<Retired> RetiredList;
+
+ReaderSlot* acquire_slot() {
+    for (ReaderSlot* slot = Slots.load(); slot; slot = slot->next) {
+        bool in_use = false;
+        if (!slot->in_use.load(std::memory_order_relaxed) &&
+            slot->in_use.compare_exchange_strong(in_use, true))
+            return slot;
+    }
+
+    auto* slot = new ReaderSlot();
+    ReaderSlot* head = Slots.load();
+    do {
+        slot->next = head;
+    } while (!Slots.compare_exchange_weak(head, slot));
+    return slot;
+}
+
+struct ThreadReader {
+    ReaderSlot* slot = nullptr;
+    unsigned int depth = 0;
+
+    ~ThreadReader() {
+        if (slot) {
+            slot->epoch.store(0);
+            slot->in_use.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local ThreadReader Reader;
+
+/*
+ * Check if every reader that pinned at or before an epoch has finished.
+ *
+ * A reader pinned after the epoch was advanced loads the snapshot that replaced the retired
+ * one, so only older readers matter. A reader that read the epoch but hasn't stored it yet is
+ * seen as idle, which is safe: its slot store is ordered after this scan, so its snapshot load
+ * sees the replacement too.
+ */
+bool quiescent(uint64_t epoch) {
+    for (ReaderSlot* slot = Slots.load(); slot; slot = slot->next) {
+        const uint64_t reader = slot->epoch.load();
+        if (reader != 0 && reader <= epoch)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Take the retired entries that are safe to delete. They're deleted by the caller without the
+ * lock held, since a deleter may destroy another AtomicSnapshot and retire its value.
+ */
+std::vector<Retired> collect(bool wait) {
+    std::vector<Retired> ready;
+    std::unique_lock lock(RetiredMutex);
+    if (RetiredList.empty())
+        return ready;
+
+    if (wait) {
+        // Everything up to now, once the readers that might see it are done
+        const uint64_t epoch = GlobalEpoch.fetch_add(1);
+        lock.unlock();
+        while (!quiescent(epoch))
+            std::this_thread::yield();
+        lock.lock();
+    }
+
+    // The list is in epoch order
+    auto iter = RetiredList.begin();
+    while (iter != RetiredList.end() && quiescent(iter->epoch))
+        ++iter;
+
+    ready.assign(std::make_move_iterator(RetiredList.begin()), std::make_move_iterator(iter));
+    RetiredList.erase(RetiredList.begin(), iter);
+    return ready;
+}
+
+} // namespace
+
+void SnapshotEpoch::enter() {
+    ThreadReader& reader = Reader;
+    if (reader.depth++ != 0)
+        return;
+    if (unlikely(!reader.slot))
+        reader.slot = acquire_slot();
+    reader.slot->epoch.store(GlobalEpoch.load());
+}
+
+void SnapshotEpoch::exit() {
+    ThreadReader& reader = Reader;
+    assert(reader.depth > 0);
+    if (--reader.depth == 0)
+        reader.slot->epoch.store(0, std::memory_order_release);
+}
+
+bool SnapshotEpoch::pinned() { return Reader.depth != 0; }
+
+void SnapshotEpoch::retire(std::function<void()> deleter) {
+    {
+        std::lock_guard lock(RetiredMutex);
+        RetiredList.push_back(Retired{GlobalEpoch.fetch_add(1), std::move(deleter)});
+    }
+
+    for (auto& entry : collect(false))
+        entry.deleter();
+}
+
+void SnapshotEpoch::synchronize() {
+    assert(!pinned());
+
+    // Deleters may retire more, so keep going until nothing is left
+    while (true) {
+        auto ready = collect(true);
+        if (ready.empty())
+            break;
+        for (auto& entry : ready)
+            entry.deleter();
+    }
+}
+
+} // namespace introvirt
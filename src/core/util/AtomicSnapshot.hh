@@ -0,0 +1,118 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+namespace introvirt {
+
+/**
+ * @brief Epoch based reclamation for immutable snapshots read without locking
+ *
+ * std::atomic_load() on a std::shared_ptr isn't lock-free with libstdc++; it takes a mutex from
+ * a small pool shared by every object in the process. Snapshots published through a plain
+ * atomic pointer avoid that, but the old snapshot can't be deleted while a reader might still
+ * be using it.
+ *
+ * Readers pin the current thread with a SnapshotReadGuard while they use a snapshot. Pinning
+ * records the global epoch in a slot owned by the thread, which is a single store to a cache
+ * line that no other thread writes. Retired snapshots are tagged with the epoch they were
+ * retired in, and deleted once no thread is still pinned from that epoch or earlier. Guards
+ * can be nested.
+ */
+class SnapshotEpoch final {
+  public:
+    /**
+     * @brief Delete something once every reader that might still see it has finished
+     *
+     * The object must already be unreachable for new readers. Objects that are ready are
+     * deleted here, so this must not be called while holding a lock that the deleter needs.
+     *
+     * @param deleter Deletes the object
+     */
+    static void retire(std::function<void()> deleter);
+
+    /**
+     * @brief Wait for the current readers, and delete everything that has been retired
+     *
+     * Used when a retired object has to be gone before its owner is destroyed, such as one
+     * holding a mapping of guest memory. Must not be called by a thread holding a
+     * SnapshotReadGuard.
+     */
+    static void synchronize();
+
+    /**
+     * @return true if the current thread holds a SnapshotReadGuard
+     */
+    static bool pinned();
+
+  private:
+    friend class SnapshotReadGuard;
+
+    static void enter();
+    static void exit();
+};
+
+/**
+ * @brief Keeps snapshots loaded from an AtomicSnapshot alive until it goes out of scope
+ */
+class SnapshotReadGuard final {
+  public:
+    SnapshotReadGuard() { SnapshotEpoch::enter(); }
+    ~SnapshotReadGuard() { SnapshotEpoch::exit(); }
+
+    SnapshotReadGuard(const SnapshotReadGuard&) = delete;
+    SnapshotReadGuard& operator=(const SnapshotReadGuard&) = delete;
+};
+
+/**
+ * @brief An immutable value that is replaced as a whole, and read without locking
+ *
+ * Readers must hold a SnapshotReadGuard for as long as they use the value returned by load().
+ * Code that replaces the value based on the current one must serialize itself, in which case
+ * it may also use load() without a guard, since only a store() can retire the value.
+ */
+template <typename T>
+class AtomicSnapshot final {
+  public:
+    /**
+     * @brief Get the current value
+     */
+    const T* load() const { return current_.load(); }
+
+    /**
+     * @brief Replace the value, retiring the old one
+     */
+    void store(std::unique_ptr<const T> value) { retire(current_.exchange(value.release())); }
+
+    explicit AtomicSnapshot(std::unique_ptr<const T> value) : current_(value.release()) {}
+    ~AtomicSnapshot() { retire(current_.exchange(nullptr)); }
+
+    AtomicSnapshot(const AtomicSnapshot&) = delete;
+    AtomicSnapshot& operator=(const AtomicSnapshot&) = delete;
+
+  private:
+    static void retire(const T* value) {
+        if (value)
+            SnapshotEpoch::retire([value]() { delete value; });
+    }
+
+    std::atomic<const T*> current_;
+};
+
+} // namespace introvirt
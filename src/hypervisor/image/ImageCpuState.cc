@@ -0,0 +1,158 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ImageCpuState.hh"
+
+#include <introvirt/core/exception/CommandFailedException.hh>
+
+#include <boost/algorithm/string.hpp>
+
+#include <log4cxx/logger.h>
+
+#include <cerrno>
+#include <fstream>
+#include <unordered_map>
+
+namespace introvirt {
+namespace image {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.image.ImageCpuState"));
+
+x86::Segment ImageSegment::segment() const {
+    return x86::Segment(x86::SegmentSelector(selector), base, limit, (flags >> 8) & 0xF,
+                        flags & (1u << 15), (flags >> 13) & 0x3, flags & (1u << 22),
+                        flags & (1u << 12), flags & (1u << 21), flags & (1u << 23),
+                        flags & (1u << 20));
+}
+
+static const std::unordered_map<std::string, uint64_t ImageCpuState::*> u64_fields = {
+    {"rax", &ImageCpuState::rax},       {"rbx", &ImageCpuState::rbx},
+    {"rcx", &ImageCpuState::rcx},       {"rdx", &ImageCpuState::rdx},
+    {"rsi", &ImageCpuState::rsi},       {"rdi", &ImageCpuState::rdi},
+    {"rsp", &ImageCpuState::rsp},       {"rbp", &ImageCpuState::rbp},
+    {"r8", &ImageCpuState::r8},         {"r9", &ImageCpuState::r9},
+    {"r10", &ImageCpuState::r10},       {"r11", &ImageCpuState::r11},
+    {"r12", &ImageCpuState::r12},       {"r13", &ImageCpuState::r13},
+    {"r14", &ImageCpuState::r14},       {"r15", &ImageCpuState::r15},
+    {"rip", &ImageCpuState::rip},       {"rflags", &ImageCpuState::rflags},
+    {"cr0", &ImageCpuState::cr0},       {"cr2", &ImageCpuState::cr2},
+    {"cr3", &ImageCpuState::cr3},       {"cr4", &ImageCpuState::cr4},
+    {"cr8", &ImageCpuState::cr8},       {"efer", &ImageCpuState::efer},
+    {"gdtr.base", &ImageCpuState::gdtr_base}, {"idtr.base", &ImageCpuState::idtr_base},
+};
+
+static const std::unordered_map<std::string, ImageSegment ImageCpuState::*> segment_fields = {
+    {"cs", &ImageCpuState::cs}, {"ds", &ImageCpuState::ds}, {"es", &ImageCpuState::es},
+    {"fs", &ImageCpuState::fs}, {"gs", &ImageCpuState::gs}, {"ss", &ImageCpuState::ss},
+    {"tr", &ImageCpuState::tr}, {"ldt", &ImageCpuState::ldt},
+};
+
+static bool set_field(ImageCpuState& state, const std::string& name, uint64_t value) {
+    auto u64 = u64_fields.find(name);
+    if (u64 != u64_fields.end()) {
+        state.*(u64->second) = value;
+        return true;
+    }
+    if (name == "gdtr.limit") {
+        state.gdtr_limit = value;
+        return true;
+    }
+    if (name == "idtr.limit") {
+        state.idtr_limit = value;
+        return true;
+    }
+
+    const size_t dot = name.find('.');
+    if (dot == std::string::npos)
+        return false;
+
+    const std::string prefix = name.substr(0, dot);
+    const std::string field = name.substr(dot + 1);
+
+    if (prefix == "msr") {
+        state.msrs[std::stoul(field, nullptr, 0)] = value;
+        return true;
+    }
+
+    auto seg = segment_fields.find(prefix);
+    if (seg == segment_fields.end())
+        return false;
+
+    ImageSegment& segment = state.*(seg->second);
+    if (field == "selector")
+        segment.selector = value;
+    else if (field == "base")
+        segment.base = value;
+    else if (field == "limit")
+        segment.limit = value;
+    else if (field == "flags")
+        segment.flags = value;
+    else
+        return false;
+    return true;
+}
+
+void read_register_file(const std::string& path, std::vector<ImageCpuState>& states) {
+    std::ifstream in(path);
+    if (!in) {
+        throw CommandFailedException("Failed to open register state file " + path, errno);
+    }
+
+    ImageCpuState* current = nullptr;
+    std::string line;
+    for (unsigned int line_number = 1; std::getline(in, line); ++line_number) {
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+        boost::algorithm::trim(line);
+        if (line.empty())
+            continue;
+
+        try {
+            if (line.front() == '[' && line.back() == ']') {
+                std::string header = line.substr(1, line.size() - 2);
+                boost::algorithm::trim(header);
+                if (!boost::algorithm::starts_with(header, "vcpu"))
+                    throw std::invalid_argument(header);
+
+                const unsigned long index = std::stoul(header.substr(4), nullptr, 0);
+                if (index >= states.size())
+                    states.resize(index + 1);
+                current = &states[index];
+                continue;
+            }
+
+            const size_t equals = line.find('=');
+            if (current == nullptr || equals == std::string::npos)
+                throw std::invalid_argument(line);
+
+            std::string name = boost::algorithm::to_lower_copy(line.substr(0, equals));
+            std::string value = line.substr(equals + 1);
+            boost::algorithm::trim(name);
+            boost::algorithm::trim(value);
+
+            if (!set_field(*current, name, std::stoull(value, nullptr, 0))) {
+                LOG4CXX_WARN(logger, path << ":" << line_number << ": Unknown register " << name);
+            }
+        } catch (std::logic_error& ex) {
+            throw CommandFailedException(path + ":" + std::to_string(line_number) +
+                                             ": Malformed register state",
+                                         EINVAL);
+        }
+    }
+}
+
+} // namespace image
+} // namespace introvirt
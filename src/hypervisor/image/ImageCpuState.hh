@@ -0,0 +1,91 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/arch/x86/Segment.hh>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace introvirt {
+namespace image {
+
+/**
+ * @brief A saved segment register
+ *
+ * The attribute bits use the same layout as the high dword of a segment descriptor (and QEMU's
+ * SegmentCache::flags): type in bits 8-11, S in bit 12, DPL in bits 13-14, P in bit 15, AVL in
+ * bit 20, L in bit 21, D/B in bit 22 and G in bit 23.
+ */
+struct ImageSegment {
+    uint32_t selector = 0;
+    uint64_t base = 0;
+    uint32_t limit = 0;
+    uint32_t flags = 0;
+
+    x86::Segment segment() const;
+};
+
+/**
+ * @brief The saved register state of a single vcpu
+ */
+struct ImageCpuState {
+    uint64_t rax = 0, rbx = 0, rcx = 0, rdx = 0;
+    uint64_t rsi = 0, rdi = 0, rsp = 0, rbp = 0;
+    uint64_t r8 = 0, r9 = 0, r10 = 0, r11 = 0;
+    uint64_t r12 = 0, r13 = 0, r14 = 0, r15 = 0;
+    uint64_t rip = 0;
+    uint64_t rflags = 0x2;
+
+    uint64_t cr0 = 0, cr2 = 0, cr3 = 0, cr4 = 0, cr8 = 0;
+    uint64_t efer = 0;
+
+    ImageSegment cs, ds, es, fs, gs, ss, tr, ldt;
+
+    uint64_t gdtr_base = 0;
+    uint32_t gdtr_limit = 0;
+    uint64_t idtr_base = 0;
+    uint32_t idtr_limit = 0;
+
+    // MSRs that were saved, by index
+    std::map<uint32_t, uint64_t> msrs;
+};
+
+/**
+ * @brief Read a register state file
+ *
+ * The file is plain text. Each vcpu starts with a "[vcpu N]" header, followed by "name = value"
+ * lines. Values are parsed as C integer literals, so hex values need a 0x prefix. Blank lines and
+ * anything after a '#' are ignored.
+ *
+ * Recognized names are the general purpose registers (rax ... r15, rip, rflags), cr0, cr2, cr3,
+ * cr4, cr8, efer, gdtr.base, gdtr.limit, idtr.base, idtr.limit, the segment registers as
+ * "<seg>.selector", "<seg>.base", "<seg>.limit" and "<seg>.flags" (for cs, ds, es, fs, gs, ss,
+ * tr and ldt), and model specific registers as "msr.<index>".
+ *
+ * Values in the file override the corresponding entry in @p states. New entries are added for
+ * vcpus that are not already present.
+ *
+ * @param path The path to the register state file
+ * @param states The vcpu states to update
+ * @throws CommandFailedException if the file cannot be read or is malformed
+ */
+void read_register_file(const std::string& path, std::vector<ImageCpuState>& states);
+
+} // namespace image
+} // namespace introvirt
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ImageDomain.hh"
+#include "core/memory/PageMapping.hh"
+
+#include <introvirt/core/exception/BadPhysicalAddressException.hh>
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/InvalidVcpuException.hh>
+#include <introvirt/core/exception/NotImplementedException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if __GNUC__ >= 8
+#include <filesystem>
+namespace filesystem = std::filesystem;
+#else
+#include <experimental/filesystem>
+namespace filesystem = std::experimental::filesystem;
+#endif
+
+namespace introvirt {
+namespace image {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.image.ImageDomain"));
+
+std::string ImageDomain::name() const { return name_; }
+
+uint32_t ImageDomain::id() const { return 0; }
+
+ImageVcpu& ImageDomain::vcpu(uint32_t index) {
+    auto const_this = const_cast<const ImageDomain*>(this);
+    return const_cast<ImageVcpu&>(const_this->vcpu(index));
+}
+
+const ImageVcpu& ImageDomain::vcpu(uint32_t index) const {
+    if (unlikely(index >= vcpus_.size())) {
+        throw InvalidVcpuException(index);
+    }
+    return *vcpus_[index];
+}
+
+uint32_t ImageDomain::vcpu_count() const { return vcpus_.size(); }
+
+void ImageDomain::intercept_mem_access(uint64_t gfn, bool on_read, bool on_write,
+                                       bool on_execute) {
+    throw NotImplementedException("Memory images do not support memory access interception");
+}
+
+void ImageDomain::intercept_mem_access(const std::vector<MemAccessRange>& ranges) {
+    throw NotImplementedException("Memory images do not support memory access interception");
+}
+
+// There are never any intercepts to clear
+void ImageDomain::clear_mem_access_intercepts() {}
+
+void ImageDomain::intercept_exception(x86::Exception vector, bool enabled) {
+    if (enabled)
+        throw NotImplementedException("Memory images do not support exception interception");
+}
+
+bool ImageDomain::intercept_exception(x86::Exception vector) const { return false; }
+
+void ImageDomain::poll(EventCallback& callback) {
+    throw NotImplementedException("Memory images do not generate events");
+}
+
+const ImageHypervisor& ImageDomain::hypervisor() const { return hypervisor_; }
+
+std::vector<PhysicalMemoryRange> ImageDomain::physical_memory_ranges() const {
+    std::vector<PhysicalMemoryRange> result;
+    for (const auto& region : memory_->regions())
+        result.push_back(PhysicalMemoryRange{region.gpa, region.length});
+    return result;
+}
+
+std::shared_ptr<GuestMemoryMapping> ImageDomain::map_pfns(const uint64_t* pfns,
+                                                          size_t count) const {
+    return map_guest_pages(
+        pfns, count,
+        [this](uint64_t pfn, size_t count) -> std::shared_ptr<GuestMemoryMapping> {
+            const size_t length = count * PageDirectory::PAGE_SIZE;
+            char* direct = memory_->find(pfn << PageDirectory::PAGE_SHIFT, length);
+            if (unlikely(direct == nullptr))
+                return nullptr;
+            return std::make_shared<GuestMemoryMapping>(direct, length, memory_);
+        },
+        [this](char* address, uint64_t pfn) {
+            const uint64_t gpa = pfn << PageDirectory::PAGE_SHIFT;
+            const int64_t offset = memory_->offset(gpa);
+            if (unlikely(offset < 0 || !memory_->find(gpa, PageDirectory::PAGE_SIZE)))
+                throw BadPhysicalAddressException(gpa, EFAULT);
+
+            // Read-only, the same as pages served from the image
+            if (likely((offset & ~PageDirectory::PAGE_MASK) == 0)) {
+                map_fd_page(address, memory_->fd(), offset, PROT_READ, MAP_PRIVATE, gpa);
+                return;
+            }
+
+            // ELF segments don't have to be page aligned in the file, those pages are copied
+            map_fd_page(address, -1, 0, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, gpa);
+            memcpy(address, memory_->find(gpa, PageDirectory::PAGE_SIZE), PageDirectory::PAGE_SIZE);
+            mprotect(address, PageDirectory::PAGE_SIZE, PROT_READ);
+        });
+}
+
+void ImageDomain::page_walk_accessed_bits(bool enabled) {
+    if (enabled)
+        throw NotImplementedException("Memory images are read-only");
+    DomainImpl::page_walk_accessed_bits(enabled);
+}
+
+ImageDomain::ImageDomain(const ImageHypervisor& hypervisor, const std::string& image_path)
+    : hypervisor_(hypervisor), name_(filesystem::path(image_path).filename().string()),
+      memory_(std::make_shared<ImageMemory>(image_path)) {
+
+    std::vector<ImageCpuState> states(memory_->cpu_states());
+
+    const std::string register_path = image_path + ".regs";
+    if (filesystem::exists(register_path)) {
+        LOG4CXX_DEBUG(logger, "Domain " << name_ << ": Loading register state from "
+                                        << register_path);
+        read_register_file(register_path, states);
+    }
+
+    if (states.empty()) {
+        LOG4CXX_ERROR(logger, "Domain " << name_ << ": No vcpu state in image and no "
+                                        << register_path);
+        throw CommandFailedException("No vcpu state available for " + image_path, ENOENT);
+    }
+
+    for (uint32_t i = 0; i < states.size(); ++i) {
+        vcpus_.emplace_back(std::make_unique<ImageVcpu>(*this, i, states[i]));
+    }
+
+    LOG4CXX_DEBUG(logger, "Domain " << name_ << " loaded " << vcpus_.size() << " vcpus and "
+                                    << memory_->regions().size() << " memory regions");
+
+    initialize();
+}
+
+ImageDomain::~ImageDomain() {
+    // Same teardown order as the live domains
+    reset_guest();
+    vcpus_.clear();
+}
+
+} // namespace image
+} // namespace introvirt
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "ImageHypervisor.hh"
+#include "ImageMemory.hh"
+#include "ImageVcpu.hh"
+
+#include "core/domain/DomainImpl.hh"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace introvirt {
+namespace image {
+
+/**
+ * @brief Domain class for guest physical memory images
+ *
+ * Guest memory comes from a raw or ELF core image, and vcpu state from the QEMU notes in an ELF
+ * core and/or a register state file next to the image (see read_register_file()). Event polling
+ * and interception are not supported, but everything that only reads guest state (guest
+ * detection, page walks, object parsing) works as it does on a live domain. Guest memory is
+ * read-only.
+ */
+class ImageDomain final : public DomainImpl {
+  public:
+    std::string name() const override;
+
+    uint32_t id() const override;
+
+    ImageVcpu& vcpu(uint32_t index) override;
+
+    const ImageVcpu& vcpu(uint32_t index) const override;
+
+    uint32_t vcpu_count() const override;
+
+    void intercept_mem_access(uint64_t gfn, bool on_read, bool on_write, bool on_execute) override;
+
+    void intercept_mem_access(const std::vector<MemAccessRange>& ranges) override;
+
+    void clear_mem_access_intercepts() override;
+
+    void intercept_exception(x86::Exception vector, bool enabled) override;
+
+    bool intercept_exception(x86::Exception vector) const override;
+
+    void poll(EventCallback& callback) override;
+
+    const ImageHypervisor& hypervisor() const override;
+
+    std::shared_ptr<GuestMemoryMapping> map_pfns(const uint64_t* pfns,
+                                                 size_t count) const override HOT;
+
+    std::vector<PhysicalMemoryRange> physical_memory_ranges() const override;
+
+    /**
+     * @brief Page walks can't set accessed bits in a read-only image
+     *
+     * @throws NotImplementedException if @p enabled is true
+     */
+    void page_walk_accessed_bits(bool enabled) override;
+    using DomainImpl::page_walk_accessed_bits;
+
+    /**
+     * @brief Open a memory image
+     *
+     * The register state is read from @p image_path + ".regs" if that file exists. Values in it
+     * override any vcpu state stored in the image itself.
+     *
+     * @param hypervisor The hypervisor instance
+     * @param image_path The path to the memory image
+     * @throws NoSuchDomainException if the image does not exist
+     * @throws CommandFailedException if the image or register state cannot be loaded
+     */
+    ImageDomain(const ImageHypervisor& hypervisor, const std::string& image_path);
+    ~ImageDomain() override;
+
+  private:
+    const ImageHypervisor& hypervisor_;
+    const std::string name_;
+
+    // Held by shared_ptr so that GuestMemoryMappings can keep it alive
+    std::shared_ptr<const ImageMemory> memory_;
+
+    std::vector<std::unique_ptr<ImageVcpu>> vcpus_;
+};
+
+} // namespace image
+} // namespace introvirt
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ImageHypervisor.hh"
+#include "ImageDomain.hh"
+#include "gitversion.h"
+
+#include <introvirt/core/exception/NoSuchDomainException.hh>
+
+namespace introvirt {
+namespace image {
+
+std::unique_ptr<Domain> ImageHypervisor::attach_domain(uint32_t domain_id) {
+    throw NoSuchDomainException(domain_id);
+}
+
+std::unique_ptr<Domain> ImageHypervisor::attach_domain(const std::string& domain_name) {
+    return std::make_unique<ImageDomain>(*this, domain_name);
+}
+
+std::vector<DomainInformation> ImageHypervisor::get_running_domains() { return {}; }
+
+std::string ImageHypervisor::hypervisor_name() const { return "Image"; }
+
+std::string ImageHypervisor::hypervisor_version() const { return "1"; }
+
+std::string ImageHypervisor::hypervisor_patch_version() const { return ""; }
+
+std::string ImageHypervisor::library_name() const { return "libintrovirt-image"; }
+
+std::string ImageHypervisor::library_version() const {
+#ifdef GIT_VERSION
+    return GIT_VERSION;
+#else
+    return "Unknown (Compiled without GIT_VERSION)";
+#endif
+}
+
+ImageHypervisor::ImageHypervisor() = default;
+ImageHypervisor::~ImageHypervisor() = default;
+
+} // namespace image
+} // namespace introvirt
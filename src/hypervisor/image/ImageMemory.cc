@@ -0,0 +1,274 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ImageMemory.hh"
+
+#include <introvirt/core/arch/x86/Msr.hh>
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/NoSuchDomainException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace introvirt {
+namespace image {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.image.ImageMemory"));
+
+/*
+ * Layout of the "QEMU" ELF note written by dump-guest-memory for x86 guests
+ * (see target/i386/arch_dump.c in QEMU).
+ */
+struct QemuCpuSegment {
+    uint32_t selector;
+    uint32_t limit;
+    uint32_t flags;
+    uint32_t pad;
+    uint64_t base;
+};
+
+struct QemuCpuState {
+    uint32_t version;
+    uint32_t size;
+    uint64_t rax, rbx, rcx, rdx, rsi, rdi, rsp, rbp;
+    uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
+    uint64_t rip, rflags;
+    QemuCpuSegment cs, ds, es, fs, gs, ss;
+    QemuCpuSegment ldt, tr, gdt, idt;
+    uint64_t cr[5];
+    uint64_t kernel_gs_base; // Optional, check size
+};
+
+static ImageSegment to_segment(const QemuCpuSegment& src) {
+    ImageSegment result;
+    result.selector = src.selector;
+    result.base = src.base;
+    result.limit = src.limit;
+    result.flags = src.flags;
+    return result;
+}
+
+static constexpr uint64_t CR0_PG = 1ull << 31;
+static constexpr uint64_t CR4_PAE = 1ull << 5;
+static constexpr uint64_t EFER_LME = 1ull << 8;
+static constexpr uint64_t EFER_LMA = 1ull << 10;
+static constexpr uint64_t EFER_NXE = 1ull << 11;
+static constexpr uint32_t SEGMENT_L = 1u << 21;
+
+char* ImageMemory::find(uint64_t gpa, uint64_t length) const {
+    auto it = std::upper_bound(regions_.begin(), regions_.end(), gpa,
+                               [](uint64_t value, const Region& r) { return value < r.gpa; });
+    if (unlikely(it == regions_.begin()))
+        return nullptr;
+    --it;
+
+    const uint64_t offset = gpa - it->gpa;
+    if (unlikely(offset >= it->length || length > it->length - offset))
+        return nullptr;
+
+    return it->base + offset;
+}
+
+int64_t ImageMemory::offset(uint64_t gpa) const {
+    const char* page = find(gpa, 1);
+    if (page == nullptr)
+        return -1;
+    return page - mapping_;
+}
+
+void ImageMemory::add_region(uint64_t gpa, uint64_t offset, uint64_t length) {
+    if (offset > length_ || length > length_ - offset) {
+        throw CommandFailedException(path_ + ": Memory segment extends past the end of the file",
+                                     EINVAL);
+    }
+    regions_.push_back(Region{gpa, length, mapping_ + offset});
+}
+
+void ImageMemory::parse_qemu_note(const char* desc, size_t size) {
+    QemuCpuState note = {};
+    if (size < offsetof(QemuCpuState, kernel_gs_base)) {
+        LOG4CXX_WARN(logger, path_ << ": Ignoring truncated QEMU cpu state note");
+        return;
+    }
+    memcpy(&note, desc, std::min(size, sizeof(note)));
+
+    ImageCpuState state;
+    state.rax = note.rax;
+    state.rbx = note.rbx;
+    state.rcx = note.rcx;
+    state.rdx = note.rdx;
+    state.rsi = note.rsi;
+    state.rdi = note.rdi;
+    state.rsp = note.rsp;
+    state.rbp = note.rbp;
+    state.r8 = note.r8;
+    state.r9 = note.r9;
+    state.r10 = note.r10;
+    state.r11 = note.r11;
+    state.r12 = note.r12;
+    state.r13 = note.r13;
+    state.r14 = note.r14;
+    state.r15 = note.r15;
+    state.rip = note.rip;
+    state.rflags = note.rflags;
+
+    state.cs = to_segment(note.cs);
+    state.ds = to_segment(note.ds);
+    state.es = to_segment(note.es);
+    state.fs = to_segment(note.fs);
+    state.gs = to_segment(note.gs);
+    state.ss = to_segment(note.ss);
+    state.ldt = to_segment(note.ldt);
+    state.tr = to_segment(note.tr);
+
+    state.gdtr_base = note.gdt.base;
+    state.gdtr_limit = note.gdt.limit;
+    state.idtr_base = note.idt.base;
+    state.idtr_limit = note.idt.limit;
+
+    state.cr0 = note.cr[0];
+    state.cr2 = note.cr[2];
+    state.cr3 = note.cr[3];
+    state.cr4 = note.cr[4];
+
+    /*
+     * The note doesn't include EFER. If paging with PAE is on and we're in a 64-bit code segment
+     * (or the GS bases are 64-bit kernel addresses), the guest must be in long mode.
+     */
+    if ((state.cr0 & CR0_PG) && (state.cr4 & CR4_PAE) &&
+        ((state.cs.flags & SEGMENT_L) || (state.gs.base >> 32) || (note.kernel_gs_base >> 32))) {
+        state.efer = EFER_LME | EFER_LMA | EFER_NXE;
+    }
+
+    if (size >= sizeof(note)) {
+        state.msrs[static_cast<uint32_t>(x86::Msr::MSR_KERNEL_GS_BASE)] = note.kernel_gs_base;
+    }
+
+    cpu_states_.push_back(std::move(state));
+}
+
+template <typename Ehdr, typename Phdr, typename Nhdr>
+void ImageMemory::parse_elf() {
+    if (length_ < sizeof(Ehdr)) {
+        throw CommandFailedException(path_ + ": Truncated ELF header", EINVAL);
+    }
+    const Ehdr* ehdr = reinterpret_cast<const Ehdr*>(mapping_);
+    if (ehdr->e_type != ET_CORE ||
+        (ehdr->e_machine != EM_X86_64 && ehdr->e_machine != EM_386)) {
+        throw CommandFailedException(path_ + ": Not an x86 ELF core file", EINVAL);
+    }
+    if (ehdr->e_phoff > length_ ||
+        static_cast<uint64_t>(ehdr->e_phnum) * sizeof(Phdr) > length_ - ehdr->e_phoff) {
+        throw CommandFailedException(path_ + ": Truncated ELF program headers", EINVAL);
+    }
+
+    const Phdr* phdrs = reinterpret_cast<const Phdr*>(mapping_ + ehdr->e_phoff);
+    for (unsigned int i = 0; i < ehdr->e_phnum; ++i) {
+        const Phdr& phdr = phdrs[i];
+        if (phdr.p_type == PT_LOAD) {
+            if (phdr.p_filesz == 0)
+                continue;
+            add_region(phdr.p_paddr, phdr.p_offset, phdr.p_filesz);
+        } else if (phdr.p_type == PT_NOTE) {
+            if (phdr.p_offset > length_ || phdr.p_filesz > length_ - phdr.p_offset)
+                throw CommandFailedException(path_ + ": Truncated ELF note segment", EINVAL);
+
+            const char* note = mapping_ + phdr.p_offset;
+            const char* end = note + phdr.p_filesz;
+            while (note + sizeof(Nhdr) <= end) {
+                const Nhdr* nhdr = reinterpret_cast<const Nhdr*>(note);
+                const char* name = note + sizeof(Nhdr);
+                const char* desc = name + ((nhdr->n_namesz + 3) & ~3u);
+                const char* next = desc + ((nhdr->n_descsz + 3) & ~3u);
+                if (next > end || next < note)
+                    break;
+
+                if (nhdr->n_namesz == 5 && memcmp(name, "QEMU", 5) == 0) {
+                    parse_qemu_note(desc, nhdr->n_descsz);
+                }
+                note = next;
+            }
+        }
+    }
+
+    if (regions_.empty()) {
+        throw CommandFailedException(path_ + ": ELF core has no memory segments", EINVAL);
+    }
+}
+
+ImageMemory::ImageMemory(const std::string& path) : path_(path) {
+    fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+        if (errno == ENOENT)
+            throw NoSuchDomainException(path);
+        throw CommandFailedException("Failed to open memory image " + path, errno);
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) < 0 || st.st_size == 0) {
+        const int err = errno;
+        close(fd_);
+        throw CommandFailedException("Failed to stat memory image " + path, err);
+    }
+    length_ = st.st_size;
+
+    // Page walks don't write to guest memory, so the image never needs to be writable
+    void* result = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd_, 0);
+    if (unlikely(result == MAP_FAILED)) {
+        const int err = errno;
+        close(fd_);
+        throw CommandFailedException("Failed to map memory image " + path, err);
+    }
+    mapping_ = reinterpret_cast<char*>(result);
+
+    try {
+        if (length_ >= SELFMAG && memcmp(mapping_, ELFMAG, SELFMAG) == 0 && length_ > EI_CLASS) {
+            if (mapping_[EI_CLASS] == ELFCLASS64)
+                parse_elf<Elf64_Ehdr, Elf64_Phdr, Elf64_Nhdr>();
+            else
+                parse_elf<Elf32_Ehdr, Elf32_Phdr, Elf32_Nhdr>();
+
+            std::sort(regions_.begin(), regions_.end(),
+                      [](const Region& a, const Region& b) { return a.gpa < b.gpa; });
+        } else {
+            add_region(0, 0, length_);
+        }
+    } catch (...) {
+        munmap(mapping_, length_);
+        close(fd_);
+        throw;
+    }
+
+    for (const auto& region : regions_) {
+        LOG4CXX_DEBUG(logger, path_ << ": Guest memory 0x" << std::hex << region.gpa << "-0x"
+                                    << (region.gpa + region.length));
+    }
+}
+
+ImageMemory::~ImageMemory() {
+    munmap(mapping_, length_);
+    close(fd_);
+}
+
+} // namespace image
+} // namespace introvirt
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "ImageCpuState.hh"
+
+#include <introvirt/util/compiler.hh>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace introvirt {
+namespace image {
+
+/**
+ * @brief A guest physical memory image
+ *
+ * Two formats are supported:
+ *  - Raw images, where the file offset is the guest physical address
+ *  - ELF core files, such as those written by QEMU's dump-guest-memory, where each PT_LOAD
+ *    segment describes a range of guest physical memory. If the dump contains QEMU CPU state
+ *    notes, they are made available from cpu_states().
+ *
+ * The file is opened and mapped once, read-only. The descriptor stays open so that single pages
+ * can be mapped from it.
+ */
+class ImageMemory final {
+  public:
+    /**
+     * @brief A contiguous range of guest physical memory present in the image
+     */
+    struct Region {
+        uint64_t gpa;
+        uint64_t length;
+        char* base;
+    };
+
+    /**
+     * @brief Get a pointer to guest physical memory
+     *
+     * @param gpa The guest physical address
+     * @param length The number of bytes that must be contiguously present
+     * @return A pointer to the memory, or nullptr if any part of the range is not in the image
+     */
+    char* find(uint64_t gpa, uint64_t length) const HOT;
+
+    /**
+     * @brief Get the offset of a guest physical address in the image file
+     *
+     * @param gpa The guest physical address
+     * @return The file offset, or -1 if the address is not in the image
+     */
+    int64_t offset(uint64_t gpa) const;
+
+    /**
+     * @brief Get the read-only file descriptor of the image
+     */
+    int fd() const { return fd_; }
+
+    /**
+     * @brief Get the memory regions in the image, sorted by guest physical address
+     */
+    const std::vector<Region>& regions() const { return regions_; }
+
+    /**
+     * @brief Get the vcpu states stored in the image, if any
+     */
+    const std::vector<ImageCpuState>& cpu_states() const { return cpu_states_; }
+
+    /**
+     * @brief Open and map a memory image
+     *
+     * @param path The path to the image
+     * @throws NoSuchDomainException if the file does not exist
+     * @throws CommandFailedException if the file cannot be mapped or is malformed
+     */
+    explicit ImageMemory(const std::string& path);
+
+    ImageMemory(const ImageMemory&) = delete;
+    ImageMemory& operator=(const ImageMemory&) = delete;
+
+    ~ImageMemory();
+
+  private:
+    template <typename Ehdr, typename Phdr, typename Nhdr>
+    void parse_elf();
+
+    void parse_qemu_note(const char* desc, size_t size);
+
+    void add_region(uint64_t gpa, uint64_t offset, uint64_t length);
+
+  private:
+    const std::string path_;
+    int fd_ = -1;
+    char* mapping_ = nullptr;
+    size_t length_ = 0;
+
+    std::vector<Region> regions_;
+    std::vector<ImageCpuState> cpu_states_;
+};
+
+} // namespace image
+} // namespace introvirt
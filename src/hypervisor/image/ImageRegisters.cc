@@ -0,0 +1,203 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ImageRegisters.hh"
+
+#include <introvirt/core/arch/x86/Msr.hh>
+
+namespace introvirt {
+namespace image {
+
+uint64_t ImageRegisters::rax() const { return state_.rax; }
+void ImageRegisters::rax(uint64_t val) {
+    state_.rax = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::rbx() const { return state_.rbx; }
+void ImageRegisters::rbx(uint64_t val) {
+    state_.rbx = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::rcx() const { return state_.rcx; }
+void ImageRegisters::rcx(uint64_t val) {
+    state_.rcx = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::rdx() const { return state_.rdx; }
+void ImageRegisters::rdx(uint64_t val) {
+    state_.rdx = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::r15() const { return state_.r15; }
+void ImageRegisters::r15(uint64_t val) {
+    state_.r15 = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::r14() const { return state_.r14; }
+void ImageRegisters::r14(uint64_t val) {
+    state_.r14 = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::r13() const { return state_.r13; }
+void ImageRegisters::r13(uint64_t val) {
+    state_.r13 = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::r12() const { return state_.r12; }
+void ImageRegisters::r12(uint64_t val) {
+    state_.r12 = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::r11() const { return state_.r11; }
+void ImageRegisters::r11(uint64_t val) {
+    state_.r11 = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::r10() const { return state_.r10; }
+void ImageRegisters::r10(uint64_t val) {
+    state_.r10 = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::r9() const { return state_.r9; }
+void ImageRegisters::r9(uint64_t val) {
+    state_.r9 = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::r8() const { return state_.r8; }
+void ImageRegisters::r8(uint64_t val) {
+    state_.r8 = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::rsi() const { return state_.rsi; }
+void ImageRegisters::rsi(uint64_t val) {
+    state_.rsi = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::rdi() const { return state_.rdi; }
+void ImageRegisters::rdi(uint64_t val) {
+    state_.rdi = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::rsp() const { return state_.rsp; }
+void ImageRegisters::rsp(uint64_t val) {
+    state_.rsp = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::rbp() const { return state_.rbp; }
+void ImageRegisters::rbp(uint64_t val) {
+    state_.rbp = val;
+    changed_ = true;
+}
+
+uint64_t ImageRegisters::rip() const { return state_.rip; }
+void ImageRegisters::rip(uint64_t val) {
+    state_.rip = val;
+    changed_ = true;
+}
+
+x86::Flags& ImageRegisters::rflags() { return rflags_; }
+const x86::Flags& ImageRegisters::rflags() const { return rflags_; }
+void ImageRegisters::rflags(const x86::Flags& val) { rflags_.value(val.value()); }
+
+x86::Efer ImageRegisters::efer() const { return x86::Efer(state_.efer); }
+
+x86::Cr0 ImageRegisters::cr0() const { return x86::Cr0(state_.cr0); }
+uint64_t ImageRegisters::cr2() const { return state_.cr2; }
+uint64_t ImageRegisters::cr3() const { return state_.cr3; }
+x86::Cr4 ImageRegisters::cr4() const { return x86::Cr4(state_.cr4); }
+uint64_t ImageRegisters::cr8() const { return state_.cr8; }
+
+uint64_t ImageRegisters::gdtr_base() const { return state_.gdtr_base; }
+uint32_t ImageRegisters::gdtr_limit() const { return state_.gdtr_limit; }
+
+uint64_t ImageRegisters::idtr_base() const { return state_.idtr_base; }
+uint32_t ImageRegisters::idtr_limit() const { return state_.idtr_limit; }
+
+bool ImageRegisters::cs_long_mode() const { return cs().long_mode(); }
+
+x86::Segment ImageRegisters::cs() const { return state_.cs.segment(); }
+
+void ImageRegisters::cs(x86::Segment src) {
+    auto& dst = state_.cs;
+    dst.selector = src.selector().value();
+    dst.base = src.base();
+    dst.limit = src.limit();
+    dst.flags = (src.type() << 8) | (src.s() << 12) | (src.dpl() << 13) | (src.present() << 15) |
+                (src.avl() << 20) | (src.long_mode() << 21) | (src.db() << 22) |
+                (src.granularity() << 23);
+    changed_ = true;
+}
+
+x86::Segment ImageRegisters::ds() const { return state_.ds.segment(); }
+x86::Segment ImageRegisters::es() const { return state_.es.segment(); }
+x86::Segment ImageRegisters::fs() const { return state_.fs.segment(); }
+x86::Segment ImageRegisters::gs() const { return state_.gs.segment(); }
+x86::Segment ImageRegisters::ss() const { return state_.ss.segment(); }
+x86::Segment ImageRegisters::tr() const { return state_.tr.segment(); }
+x86::Segment ImageRegisters::ldt() const { return state_.ldt.segment(); }
+
+uint64_t ImageRegisters::msr(x86::Msr msr) const {
+    auto it = state_.msrs.find(static_cast<uint32_t>(msr));
+    if (it != state_.msrs.end())
+        return it->second;
+
+    switch (msr) {
+    case x86::Msr::MSR_EFER:
+        return state_.efer;
+    case x86::Msr::MSR_FS_BASE:
+        return state_.fs.base;
+    case x86::Msr::MSR_GS_BASE:
+        return state_.gs.base;
+    default:
+        return 0;
+    }
+}
+
+void ImageRegisters::msr(x86::Msr msr, uint64_t val) {
+    state_.msrs[static_cast<uint32_t>(msr)] = val;
+    changed_ = true;
+}
+
+void ImageRegisters::state(const ImageCpuState& state) {
+    // rflags_ refers to state_.rflags, so it follows along
+    state_ = state;
+    changed_ = false;
+}
+
+ImageRegisters::ImageRegisters(const ImageCpuState& state)
+    : state_(state), rflags_(state_.rflags, &changed_) {}
+
+ImageRegisters::ImageRegisters(const ImageRegisters& src)
+    : state_(src.state_), rflags_(state_.rflags, &changed_) {}
+
+ImageRegisters::~ImageRegisters() = default;
+
+} // namespace image
+} // namespace introvirt
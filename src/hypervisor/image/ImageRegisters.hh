@@ -0,0 +1,160 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "ImageCpuState.hh"
+
+#include <introvirt/core/arch/x86/Registers.hh>
+#include <introvirt/util/compiler.hh>
+
+namespace introvirt {
+namespace image {
+
+/**
+ * @brief Registers backed by a saved vcpu state
+ *
+ * Changes are kept in memory only.
+ */
+class ImageRegisters final : public x86::Registers {
+  public:
+    uint64_t rax() const override;
+    void rax(uint64_t val) override;
+
+    uint64_t rbx() const override;
+    void rbx(uint64_t val) override;
+
+    uint64_t rcx() const override;
+    void rcx(uint64_t val) override;
+
+    uint64_t rdx() const override;
+    void rdx(uint64_t val) override;
+
+    uint64_t r15() const override;
+    void r15(uint64_t val) override;
+
+    uint64_t r14() const override;
+    void r14(uint64_t val) override;
+
+    uint64_t r13() const override;
+    void r13(uint64_t val) override;
+
+    uint64_t r12() const override;
+    void r12(uint64_t val) override;
+
+    uint64_t r11() const override;
+    void r11(uint64_t val) override;
+
+    uint64_t r10() const override;
+    void r10(uint64_t val) override;
+
+    uint64_t r9() const override;
+    void r9(uint64_t val) override;
+
+    uint64_t r8() const override;
+    void r8(uint64_t val) override;
+
+    uint64_t rsi() const override;
+    void rsi(uint64_t val) override;
+
+    uint64_t rdi() const override;
+    void rdi(uint64_t val) override;
+
+    uint64_t rsp() const override;
+    void rsp(uint64_t val) override;
+
+    uint64_t rbp() const override;
+    void rbp(uint64_t val) override;
+
+    uint64_t rip() const override;
+    void rip(uint64_t val) override;
+
+    x86::Flags& rflags() override;
+    const x86::Flags& rflags() const override;
+    void rflags(const x86::Flags& val) override;
+
+    x86::Efer efer() const override;
+
+    x86::Cr0 cr0() const override;
+    uint64_t cr2() const override;
+    uint64_t cr3() const override;
+    x86::Cr4 cr4() const override;
+    uint64_t cr8() const override;
+
+    uint64_t gdtr_base() const override;
+    uint32_t gdtr_limit() const override;
+
+    uint64_t idtr_base() const override;
+    uint32_t idtr_limit() const override;
+
+    bool cs_long_mode() const override;
+
+    x86::Segment cs() const override;
+    void cs(x86::Segment seg) override;
+
+    x86::Segment ds() const override;
+    x86::Segment es() const override;
+    x86::Segment fs() const override;
+    x86::Segment gs() const override;
+    x86::Segment ss() const override;
+    x86::Segment tr() const override;
+    x86::Segment ldt() const override;
+
+    /**
+     * @brief Read a saved MSR
+     *
+     * EFER, FS_BASE and GS_BASE are derived from the other registers if they were not saved.
+     * Any other MSR that was not saved reads as zero.
+     */
+    uint64_t msr(x86::Msr msr) const override;
+    void msr(x86::Msr msr, uint64_t val) override;
+
+    /**
+     * @brief Replace the whole saved state
+     *
+     * @param state The new vcpu state
+     */
+    void state(const ImageCpuState& state);
+
+    /**
+     * @brief Get the saved state, including any changes made since it was loaded
+     */
+    const ImageCpuState& state() const { return state_; }
+
+    /**
+     * @brief Construct a new ImageRegisters object
+     *
+     * @param state The saved vcpu state
+     */
+    explicit ImageRegisters(const ImageCpuState& state);
+
+    /**
+     * @brief Copy constructor
+     */
+    ImageRegisters(const ImageRegisters&);
+
+    /**
+     * @brief Destroy the instance
+     */
+    ~ImageRegisters() override;
+
+  private:
+    ImageCpuState state_;
+    x86::Flags rflags_;
+    bool changed_ = false;
+};
+
+} // namespace image
+} // namespace introvirt
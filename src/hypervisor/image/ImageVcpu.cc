@@ -0,0 +1,97 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ImageVcpu.hh"
+#include "ImageDomain.hh"
+
+#include <introvirt/core/exception/NotImplementedException.hh>
+
+namespace introvirt {
+namespace image {
+
+ImageRegisters& ImageVcpu::registers() { return registers_; }
+const ImageRegisters& ImageVcpu::registers() const { return registers_; }
+
+// There's nothing running to pause
+void ImageVcpu::pause() {}
+void ImageVcpu::resume() {}
+
+void ImageVcpu::intercept_system_calls(bool enabled) {
+    if (enabled)
+        throw NotImplementedException("Memory images do not support system call interception");
+}
+bool ImageVcpu::intercept_system_calls() const { return false; }
+
+void ImageVcpu::intercept_cr_writes(int cr, bool enabled) {
+    if (enabled)
+        throw NotImplementedException("Memory images do not support control register interception");
+}
+bool ImageVcpu::intercept_cr_writes(int cr) const { return false; }
+
+// The guest never runs, so cached translations can't go stale
+void ImageVcpu::add_cr_write_intercept_ref(int cr) {}
+void ImageVcpu::remove_cr_write_intercept_ref(int cr) {}
+void ImageVcpu::intercept_invlpg(bool enabled) {}
+
+void ImageVcpu::single_step(bool enabled) {
+    if (enabled)
+        throw NotImplementedException("Memory images do not support single stepping");
+}
+bool ImageVcpu::single_step() const { return false; }
+
+void ImageVcpu::inject_exception(x86::Exception vector) {
+    throw NotImplementedException("Memory images do not support exception injection");
+}
+void ImageVcpu::inject_exception(x86::Exception vector, int64_t error_code) {
+    throw NotImplementedException("Memory images do not support exception injection");
+}
+void ImageVcpu::inject_exception(x86::Exception vector, int64_t error_code, uint64_t cr2) {
+    throw NotImplementedException("Memory images do not support exception injection");
+}
+
+void ImageVcpu::inject_syscall() {
+    throw NotImplementedException("Memory images do not support system call injection");
+}
+void ImageVcpu::inject_sysenter() {
+    throw NotImplementedException("Memory images do not support system call injection");
+}
+
+// Register changes only live in registers_
+void ImageVcpu::write_registers() {}
+
+std::unique_ptr<Vcpu> ImageVcpu::clone() const { return std::make_unique<ImageVcpu>(*this); }
+
+bool ImageVcpu::handling_event() const { return false; }
+
+void ImageVcpu::syscall_injection_start() {
+    throw NotImplementedException("Memory images do not support system call injection");
+}
+void ImageVcpu::syscall_injection_end() {}
+
+void ImageVcpu::os_data(void* data) { os_data_ = data; }
+void* ImageVcpu::os_data() const { return os_data_; }
+
+void ImageVcpu::complete_event() {}
+
+ImageVcpu::ImageVcpu(ImageDomain& domain, uint32_t id, const ImageCpuState& state)
+    : VcpuImpl(domain, id), registers_(state) {}
+
+ImageVcpu::ImageVcpu(const ImageVcpu& src)
+    : VcpuImpl(src), registers_(src.registers_), os_data_(src.os_data_) {}
+
+ImageVcpu::~ImageVcpu() = default;
+
+} // namespace image
+} // namespace introvirt
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "ImageRegisters.hh"
+
+#include "core/domain/VcpuImpl.hh"
+
+namespace introvirt {
+namespace image {
+
+class ImageDomain;
+
+/**
+ * @brief Vcpu class for memory images
+ *
+ * The vcpu never runs. Registers are served from the saved state, and anything that would need
+ * a live vcpu (interception, injection, single stepping) throws NotImplementedException.
+ */
+class ImageVcpu final : public VcpuImpl {
+  public:
+    ImageRegisters& registers() override HOT;
+
+    const ImageRegisters& registers() const override HOT;
+
+    void pause() override;
+
+    void resume() override;
+
+    void intercept_system_calls(bool enabled) override;
+
+    bool intercept_system_calls() const override;
+
+    void intercept_cr_writes(int cr, bool enabled) override;
+
+    bool intercept_cr_writes(int cr) const override;
+
+    void add_cr_write_intercept_ref(int cr) override;
+
+    void remove_cr_write_intercept_ref(int cr) override;
+
+    void intercept_invlpg(bool enabled) override;
+
+    void single_step(bool enabled) override;
+
+    bool single_step() const override;
+
+    void inject_exception(x86::Exception vector) override;
+
+    void inject_exception(x86::Exception vector, int64_t error_code) override;
+
+    void inject_exception(x86::Exception vector, int64_t error_code, uint64_t cr2) override;
+
+    void inject_syscall() override;
+    void inject_sysenter() override;
+
+    void write_registers() override;
+
+    std::unique_ptr<Vcpu> clone() const override;
+
+    bool handling_event() const override;
+
+    void syscall_injection_start() override;
+    void syscall_injection_end() override;
+
+    void os_data(void* data) override;
+    void* os_data() const override;
+
+    void complete_event() override;
+
+    /**
+     * @brief Construct a new ImageVcpu object
+     *
+     * @param domain The domain the vcpu belongs to
+     * @param id The identifier of the vcpu
+     * @param state The saved register state
+     */
+    ImageVcpu(ImageDomain& domain, uint32_t id, const ImageCpuState& state);
+
+    /**
+     * @brief Copy constructor
+     */
+    ImageVcpu(const ImageVcpu&);
+
+    /**
+     * @brief Destroy the instance
+     */
+    ~ImageVcpu() override;
+
+  private:
+    ImageRegisters registers_;
+    void* os_data_ = nullptr;
+};
+
+} // namespace image
+} // namespace introvirt
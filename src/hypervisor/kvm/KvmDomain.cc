@@ -17,6 +17,8 @@
 #include "KvmHypervisor.hh"
 #include "kvm_introspection.hh"
 
+#include "core/memory/PageMapping.hh"
+
 #include <introvirt/core/exception/BadPhysicalAddressException.hh>
 #include <introvirt/core/exception/CommandFailedException.hh>
 #include <introvirt/core/exception/InvalidVcpuException.hh>
@@ -25,6 +27,8 @@
 
 #include <log4cxx/logger.h>
 
+#include <optional>
+
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -53,7 +57,7 @@ const KvmVcpu& KvmDomain::vcpu(uint32_t index) const {
 
 uint32_t KvmDomain::vcpu_count() const { return vcpus_.size(); }
 
-void KvmDomain::intercept_mem_access(uint64_t gfn, bool on_read, bool on_write, bool on_execute) {
+void KvmDomain::set_mem_access(uint64_t gfn, bool on_read, bool on_write, bool on_execute) {
     struct kvm_ept_permissions perms = {};
     perms.gfn = gfn;
     perms.perms = PFERR_PRESENT_MASK | PFERR_WRITE_MASK | PFERR_USER_MASK;
@@ -64,16 +68,59 @@ void KvmDomain::intercept_mem_access(uint64_t gfn, bool on_read, bool on_write,
     if (on_execute)
         perms.perms &= ~PFERR_USER_MASK; /* NOTE: This is weird but correct */
 
-    pause();
     LOG4CXX_DEBUG(logger, "intercept_mem_access(0x" << std::hex << gfn << ", " << on_read << ", "
                                                     << on_write << ", " << on_execute << ")");
-    if (unlikely(ioctl(fd_, KVM_SET_MEM_ACCESS, &perms))) {
-        resume();
+    if (unlikely(ioctl(fd_, KVM_SET_MEM_ACCESS, &perms)))
         throw CommandFailedException("Failed to set memory access intercept", errno);
+
+    if (on_read || on_write || on_execute)
+        mem_access_gfns_.insert(gfn);
+    else
+        mem_access_gfns_.erase(gfn);
+}
+
+void KvmDomain::intercept_mem_access(uint64_t gfn, bool on_read, bool on_write, bool on_execute) {
+    intercept_mem_access({MemAccessRange{gfn, 1, on_read, on_write, on_execute}});
+}
+
+void KvmDomain::intercept_mem_access(const std::vector<MemAccessRange>& ranges) {
+    if (ranges.empty())
+        return;
+
+    std::lock_guard lock(mem_access_mtx_);
+    pause();
+    try {
+        for (const auto& range : ranges) {
+            for (uint64_t gfn = range.gfn; gfn < range.gfn + range.count; ++gfn)
+                set_mem_access(gfn, range.on_read, range.on_write, range.on_execute);
+        }
+    } catch (...) {
+        resume();
+        throw;
+    }
+    resume();
+}
+
+void KvmDomain::clear_mem_access_intercepts() {
+    std::lock_guard lock(mem_access_mtx_);
+    if (mem_access_gfns_.empty())
+        return;
+
+    LOG4CXX_DEBUG(logger, "Clearing " << mem_access_gfns_.size() << " memory access intercepts");
+
+    // set_mem_access() modifies the set
+    const std::vector<uint64_t> gfns(mem_access_gfns_.begin(), mem_access_gfns_.end());
+
+    pause();
+    try {
+        for (uint64_t gfn : gfns)
+            set_mem_access(gfn, false, false, false);
+    } catch (...) {
+        resume();
+        throw;
     }
     resume();
 }
-void KvmDomain::clear_mem_access_intercepts() {}
 
 void KvmDomain::intercept_exception(x86::Exception vector, bool enabled) {
     pause();
@@ -100,33 +147,113 @@ bool KvmDomain::intercept_exception(x86::Exception vector) const {
 const KvmHypervisor& KvmDomain::hypervisor() const { return hypervisor_; }
 
 std::shared_ptr<GuestMemoryMapping> KvmDomain::map_pfns(const uint64_t* pfns, size_t count) const {
-    const size_t region_size = count * PageDirectory::PAGE_SIZE;
+    auto result = map_pfns(pfns, count, PROT_READ | PROT_WRITE);
+    record_pages(pfns, count, *result);
+    return result;
+}
+
+std::shared_ptr<GuestMemoryMapping> KvmDomain::map_pfns_read_only(const uint64_t* pfns,
+                                                                  size_t count) const {
+    auto result = map_pfns(pfns, count, PROT_READ);
+    record_pages(pfns, count, *result);
+    return result;
+}
+
+std::shared_ptr<GuestMemoryMapping> KvmDomain::map_pfns(const uint64_t* pfns, size_t count,
+                                                        int prot) const {
+    // The direct map is usually off, so it's only pinned when it's enabled
+    DirectPageMapper direct;
+    std::optional<SnapshotReadGuard> guard;
+    const KvmMemoryMap* memory_map = nullptr;
+    if (memory_map_.load(std::memory_order_relaxed)) {
+        guard.emplace();
+        memory_map = memory_map_.load();
+    }
+    if (memory_map) {
+        direct = [memory_map, prot](uint64_t pfn,
+                                    size_t count) -> std::shared_ptr<GuestMemoryMapping> {
+            const uint64_t gpa = pfn << PageDirectory::PAGE_SHIFT;
+            const size_t length = count * PageDirectory::PAGE_SIZE;
+            // Read-only requests get the PROT_READ alias, so they can't write through it
+            const char* result = (prot & PROT_WRITE) ? memory_map->find(gpa, length)
+                                                     : memory_map->find_read_only(gpa, length);
+            if (unlikely(result == nullptr))
+                return nullptr;
+            return std::make_shared<GuestMemoryMapping>(const_cast<char*>(result), length,
+                                                        memory_map->shared_from_this());
+        };
+    }
 
-    // Reserve address space for the mapping
-    void* result = mmap(nullptr, region_size, PROT_READ | PROT_WRITE,
-                        MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, 0, 0);
+    return map_guest_pages(pfns, count, direct, [this, prot](char* address, uint64_t pfn) {
+        const uint64_t gpa = pfn << PageDirectory::PAGE_SHIFT;
+        map_fd_page(address, fd_, gpa, prot, MAP_SHARED, gpa);
+    });
+}
+
+void KvmDomain::direct_memory_map(bool enabled) {
+    std::lock_guard lock(memory_map_mtx_);
+    _update_direct_memory_map(enabled || direct_map_refs_ > 0);
+    direct_map_user_ = enabled;
+}
+
+bool KvmDomain::direct_memory_map() const { return memory_map_.load() != nullptr; }
+
+void KvmDomain::add_direct_memory_map_ref() {
+    std::lock_guard lock(memory_map_mtx_);
+    _update_direct_memory_map(true);
+    ++direct_map_refs_;
+}
 
-    if ((unlikely(result == MAP_FAILED))) {
-        LOG4CXX_ERROR(logger, "Failed to reserve " << region_size << " bytes of address space");
-        throw CommandFailedException("Failed to reserve address space", errno);
+void KvmDomain::remove_direct_memory_map_ref() {
+    std::lock_guard lock(memory_map_mtx_);
+    introvirt_assert(direct_map_refs_ > 0, "");
+    --direct_map_refs_;
+    _update_direct_memory_map(direct_map_user_ || direct_map_refs_ > 0);
+}
+
+void KvmDomain::_update_direct_memory_map(bool enabled) {
+    if (enabled == (memory_map_owner_ != nullptr))
+        return;
+
+    if (enabled) {
+        auto memory_map = std::make_shared<const KvmMemoryMap>(fd_);
+        LOG4CXX_DEBUG(logger, "Domain " << name_ << " mapped " << memory_map->mapped_bytes()
+                                        << " bytes of guest memory in "
+                                        << memory_map->regions().size() << " regions");
+        memory_map_.store(memory_map.get());
+        memory_map_owner_ = std::move(memory_map);
+    } else {
+        // Readers that loaded the map finish with it first, and outstanding GuestMemoryMappings
+        // keep it alive until they're released
+        memory_map_.store(nullptr);
+        SnapshotEpoch::retire([old = std::move(memory_map_owner_)]() mutable { old.reset(); });
     }
+}
+
+std::vector<PhysicalMemoryRange> KvmDomain::physical_memory_ranges() const {
+    // The memory slots are probed on every call so that memory being added or removed is seen.
+    // Leaving out the pages in them that can't be read means touching all of RAM, so that's only
+    // done again when the slots change. Pages the persistent mapping has already checked aren't
+    // read again.
+    const auto layout = KvmMemoryMap::probe_layout(fd_);
 
-    // Go through each PFN and map it
-    char* mapping = reinterpret_cast<char*>(result);
-    for (size_t i = 0; i < count; ++i) {
-        const uint64_t pfn = pfns[i];
-        void* result =
-            mmap(mapping, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd_, pfn << 12);
-
-        if ((unlikely(result == MAP_FAILED))) {
-            LOG4CXX_WARN(logger,
-                         "mmap for pfn 0x" << std::hex << pfn << " failed: " << strerror(errno));
-            munmap(mapping, region_size);
-            throw BadPhysicalAddressException(pfn << 12, errno);
+    std::lock_guard lock(ram_ranges_mtx_);
+    if (ram_ranges_.empty() || layout != ram_layout_) {
+        std::shared_ptr<const KvmMemoryMap> memory_map;
+        {
+            SnapshotReadGuard guard;
+            if (const KvmMemoryMap* current = memory_map_.load())
+                memory_map = current->shared_from_this();
         }
-        mapping += 4096;
+        if (!memory_map || memory_map->layout() != layout)
+            memory_map = std::make_shared<const KvmMemoryMap>(fd_);
+
+        ram_layout_ = memory_map->layout();
+        ram_ranges_.clear();
+        for (const auto& extent : memory_map->readable_extents())
+            ram_ranges_.push_back(PhysicalMemoryRange{extent.gpa, extent.length});
     }
-    return std::make_shared<GuestMemoryMapping>(result, region_size);
+    return ram_ranges_;
 }
 
 KvmDomain::KvmDomain(const KvmHypervisor& hypervisor, const std::string& name, uint32_t id, int fd)
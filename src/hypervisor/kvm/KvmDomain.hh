@@ -16,12 +16,18 @@
 #pragma once
 
 #include "KvmHypervisor.hh"
+#include "KvmMemoryMap.hh"
 #include "KvmVcpu.hh"
 
 #include "core/domain/DomainImpl.hh"
+#include "core/util/AtomicSnapshot.hh"
 
 #include <introvirt/util/compiler.hh>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 #include <vector>
 
 namespace introvirt {
@@ -44,6 +50,8 @@ class KvmDomain final : public DomainImpl {
 
     void intercept_mem_access(uint64_t gfn, bool on_read, bool on_write, bool on_execute) override;
 
+    void intercept_mem_access(const std::vector<MemAccessRange>& ranges) override;
+
     void clear_mem_access_intercepts() override;
 
     void intercept_exception(x86::Exception vector, bool enabled) override;
@@ -55,10 +63,28 @@ class KvmDomain final : public DomainImpl {
     std::shared_ptr<GuestMemoryMapping> map_pfns(const uint64_t* pfns,
                                                  size_t count) const override HOT;
 
+    std::shared_ptr<GuestMemoryMapping> map_pfns_read_only(const uint64_t* pfns,
+                                                           size_t count) const override HOT;
+
+    void direct_memory_map(bool enabled) override;
+    bool direct_memory_map() const override;
+    void add_direct_memory_map_ref() override;
+    void remove_direct_memory_map_ref() override;
+
+    std::vector<PhysicalMemoryRange> physical_memory_ranges() const override;
+
     KvmDomain(const KvmHypervisor& hypervisor, const std::string& name, uint32_t id, int fd);
     ~KvmDomain() override;
 
   private:
+    std::shared_ptr<GuestMemoryMapping> map_pfns(const uint64_t* pfns, size_t count,
+                                                 int prot) const;
+
+    // Must be called with memory_map_mtx_ held
+    void _update_direct_memory_map(bool enabled);
+
+    void set_mem_access(uint64_t gfn, bool on_read, bool on_write, bool on_execute);
+
     const KvmHypervisor& hypervisor_;
     const std::string name_;
     const uint32_t id_;
@@ -72,6 +98,26 @@ class KvmDomain final : public DomainImpl {
 
     bool intercept_int3_ = false;
     std::atomic_int syscall_injection_ = 0;
+
+    // The direct map, null when disabled. It's only used under a SnapshotReadGuard, so
+    // map_pfns() takes no lock or reference unless it hands out a mapping backed by it.
+    // memory_map_owner_ holds the map, and is retired through SnapshotEpoch when it's replaced.
+    std::atomic<const KvmMemoryMap*> memory_map_ = nullptr;
+    std::shared_ptr<const KvmMemoryMap> memory_map_owner_;
+    std::mutex memory_map_mtx_;
+
+    // The setting from direct_memory_map() and the internal references, under memory_map_mtx_
+    bool direct_map_user_ = false;
+    unsigned direct_map_refs_ = 0;
+
+    // The readable RAM from the last full probe, and the memory slot layout it was made from
+    mutable std::vector<KvmMemoryMap::Extent> ram_layout_;
+    mutable std::vector<PhysicalMemoryRange> ram_ranges_;
+    mutable std::mutex ram_ranges_mtx_;
+
+    // Frames that currently have an intercept, so that they can all be cleared
+    std::unordered_set<uint64_t> mem_access_gfns_;
+    std::mutex mem_access_mtx_;
 };
 
 } // namespace kvm
@@ -73,6 +73,8 @@ class KvmEvent final : public HypervisorEvent {
         return event_data_.mem_event.error_code & PFERR_FETCH_MASK;
     }
 
+    uint64_t invlpg_address() const override { return event_data_.invlpg.gva; }
+
     /**
      * @brief Get the unique ID associated with this event
      */
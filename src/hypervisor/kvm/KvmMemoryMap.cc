@@ -0,0 +1,334 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "KvmMemoryMap.hh"
+
+#include <introvirt/core/exception/CommandFailedException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <sys/mman.h>
+
+namespace introvirt {
+namespace kvm {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.kvm.KvmMemoryMap"));
+
+// Probe in chunks the size of a typical KVM memory slot
+static constexpr uint64_t SLOT_SIZE = 1ull << 30;
+// Holes smaller than this are not carved out; those pages use the per-page fallback
+static constexpr uint64_t MIN_PROBE_SIZE = 1ull << 21;
+// RAM above the 32-bit PCI hole is contiguous, so the first empty slot past here ends the scan
+static constexpr uint64_t HIGH_MEMORY_START = 1ull << 32;
+static constexpr uint64_t MAX_GPA = 1ull << 40;
+static constexpr uint64_t PAGE_SIZE = 0x1000;
+
+static void* map_range(int fd, uint64_t gpa, uint64_t length) {
+    return mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, gpa);
+}
+
+/*
+ * The domain fd may accept any offset in mmap() and only fail when a page is touched, which
+ * raises SIGBUS. Pages are read under a SIGBUS handler before they are accepted. The handler is
+ * only installed while a SigbusGuard is held: while probing, and while a lookup reads a page for
+ * the first time.
+ */
+static thread_local sigjmp_buf* probe_env = nullptr;
+static struct sigaction previous_sigbus;
+
+static void probe_sigbus_handler(int sig, siginfo_t* info, void* context) {
+    if (probe_env != nullptr)
+        siglongjmp(*probe_env, 1);
+
+    // Not from a probe, pass it on to the previous handler
+    if (previous_sigbus.sa_flags & SA_SIGINFO) {
+        previous_sigbus.sa_sigaction(sig, info, context);
+    } else if (previous_sigbus.sa_handler != SIG_DFL && previous_sigbus.sa_handler != SIG_IGN) {
+        previous_sigbus.sa_handler(sig);
+    } else {
+        signal(SIGBUS, SIG_DFL);
+        raise(SIGBUS);
+    }
+}
+
+class SigbusGuard final {
+  public:
+    SigbusGuard() {
+        std::lock_guard lock(mtx_);
+        if (refs_++ != 0)
+            return;
+
+        // SA_NODEFER leaves SIGBUS unblocked when a probe jumps out of the handler, so the
+        // probes don't need to save and restore the signal mask
+        struct sigaction action = {};
+        action.sa_sigaction = probe_sigbus_handler;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGBUS, &action, &previous_sigbus);
+    }
+
+    ~SigbusGuard() {
+        std::lock_guard lock(mtx_);
+        if (--refs_ != 0)
+            return;
+
+        // Leave a handler the application installed in the meantime alone
+        struct sigaction current = {};
+        sigaction(SIGBUS, nullptr, &current);
+        if ((current.sa_flags & SA_SIGINFO) && current.sa_sigaction == probe_sigbus_handler)
+            sigaction(SIGBUS, &previous_sigbus, nullptr);
+    }
+
+  private:
+    static std::mutex mtx_;
+    static unsigned int refs_;
+};
+
+std::mutex SigbusGuard::mtx_;
+unsigned int SigbusGuard::refs_ = 0;
+
+/**
+ * @brief Check if a byte of a mapping can be read
+ *
+ * Must be called with a SigbusGuard held.
+ */
+static bool readable_byte(const char* address) {
+    sigjmp_buf env;
+    probe_env = &env;
+    if (sigsetjmp(env, 0) != 0) {
+        probe_env = nullptr;
+        return false;
+    }
+    *reinterpret_cast<const volatile char*>(address);
+    probe_env = nullptr;
+    return true;
+}
+
+const KvmMemoryMap::Region* KvmMemoryMap::lookup(uint64_t gpa, uint64_t length) const {
+    auto it = std::upper_bound(regions_.begin(), regions_.end(), gpa,
+                               [](uint64_t value, const Region& r) { return value < r.gpa; });
+    if (unlikely(it == regions_.begin()))
+        return nullptr;
+    --it;
+
+    const uint64_t offset = gpa - it->gpa;
+    if (unlikely(offset >= it->length || length > it->length - offset))
+        return nullptr;
+
+    return &*it;
+}
+
+bool KvmMemoryMap::check_page(const Region& region, uint64_t page) {
+    SigbusGuard guard;
+    const uint64_t bit = 1ull << (page % 64);
+    const bool readable = readable_byte(region.base + page * PAGE_SIZE);
+    if (!readable) {
+        LOG4CXX_DEBUG(logger, "Guest memory at 0x" << std::hex << (region.gpa + page * PAGE_SIZE)
+                                                   << " can't be read, leaving it out");
+        region.holes[page / 64].fetch_or(bit, std::memory_order_relaxed);
+    }
+    region.checked[page / 64].fetch_or(bit, std::memory_order_release);
+    return readable;
+}
+
+bool KvmMemoryMap::readable(const Region& region, uint64_t gpa, uint64_t length) {
+    const uint64_t first = (gpa - region.gpa) / PAGE_SIZE;
+    const uint64_t last = (gpa - region.gpa + length - 1) / PAGE_SIZE;
+    for (uint64_t page = first; page <= last; ++page) {
+        const uint64_t bit = 1ull << (page % 64);
+        if (likely(region.checked[page / 64].load(std::memory_order_acquire) & bit)) {
+            if (unlikely(region.holes[page / 64].load(std::memory_order_relaxed) & bit))
+                return false;
+        } else if (!check_page(region, page)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+char* KvmMemoryMap::find(uint64_t gpa, uint64_t length) const {
+    const Region* region = lookup(gpa, length);
+    if (unlikely(region == nullptr || length == 0 || !readable(*region, gpa, length)))
+        return nullptr;
+    return region->base + (gpa - region->gpa);
+}
+
+const char* KvmMemoryMap::find_read_only(uint64_t gpa, uint64_t length) const {
+    const Region* region = lookup(gpa, length);
+    if (unlikely(region == nullptr || region->read_only_base == nullptr || length == 0 ||
+                 !readable(*region, gpa, length)))
+        return nullptr;
+    return region->read_only_base + (gpa - region->gpa);
+}
+
+std::vector<KvmMemoryMap::Extent> KvmMemoryMap::readable_extents() const {
+    // Install the handler once, rather than for each page that hasn't been checked
+    SigbusGuard guard;
+    std::vector<Extent> result;
+    for (const auto& region : regions_) {
+        for (uint64_t offset = 0; offset < region.length; offset += PAGE_SIZE) {
+            if (!readable(region, region.gpa + offset, PAGE_SIZE))
+                continue;
+            const uint64_t gpa = region.gpa + offset;
+            if (!result.empty() && result.back().gpa + result.back().length == gpa)
+                result.back().length += PAGE_SIZE;
+            else
+                result.push_back(Extent{gpa, PAGE_SIZE});
+        }
+    }
+    return result;
+}
+
+uint64_t KvmMemoryMap::mapped_bytes() const {
+    uint64_t result = 0;
+    for (const auto& region : regions_)
+        result += region.length;
+    return result;
+}
+
+void KvmMemoryMap::probe(int fd, uint64_t gpa, uint64_t length, std::vector<Extent>& found) {
+    void* mapping = map_range(fd, gpa, length);
+    if (mapping != MAP_FAILED) {
+        // Memory slots start and end on probe boundaries, so the ends are enough to reject a range
+        // the fd only validates when it is touched. Smaller holes are found by lookups.
+        const char* base = static_cast<const char*>(mapping);
+        const bool readable = readable_byte(base) && readable_byte(base + length - PAGE_SIZE);
+        munmap(mapping, length);
+        if (readable) {
+            found.push_back(Extent{gpa, length});
+            return;
+        }
+    }
+    if (length <= MIN_PROBE_SIZE)
+        return;
+
+    // Part of the range is not backed by a memory slot, split it and try again
+    const uint64_t half = length / 2;
+    probe(fd, gpa, half, found);
+    probe(fd, gpa + half, half, found);
+}
+
+void KvmMemoryMap::add_region(char* base, uint64_t gpa, uint64_t length) {
+    // Pages are checked by the first lookup, see readable()
+    const uint64_t words = (length / PAGE_SIZE + 63) / 64;
+    Region region{gpa, length, base, nullptr, std::make_unique<std::atomic<uint64_t>[]>(words),
+                  std::make_unique<std::atomic<uint64_t>[]>(words)};
+    for (uint64_t i = 0; i < words; ++i) {
+        region.checked[i].store(0, std::memory_order_relaxed);
+        region.holes[i].store(0, std::memory_order_relaxed);
+    }
+    regions_.push_back(std::move(region));
+}
+
+/*
+ * Find out which ranges can be mapped. Must be called with a SigbusGuard held.
+ */
+std::vector<KvmMemoryMap::Extent> KvmMemoryMap::probe_slots(int fd) {
+    std::vector<Extent> pieces;
+    for (uint64_t gpa = 0; gpa < MAX_GPA; gpa += SLOT_SIZE) {
+        const size_t before = pieces.size();
+        probe(fd, gpa, SLOT_SIZE, pieces);
+        if (pieces.size() == before && gpa >= HIGH_MEMORY_START)
+            break;
+    }
+    return pieces;
+}
+
+using Extent = KvmMemoryMap::Extent;
+
+static std::vector<Extent> merge_extents(const std::vector<Extent>& pieces) {
+    std::vector<Extent> result;
+    for (const auto& piece : pieces) {
+        if (!result.empty() && result.back().gpa + result.back().length == piece.gpa)
+            result.back().length += piece.length;
+        else
+            result.push_back(piece);
+    }
+    return result;
+}
+
+std::vector<KvmMemoryMap::Extent> KvmMemoryMap::probe_layout(int fd) {
+    SigbusGuard guard;
+    return merge_extents(probe_slots(fd));
+}
+
+KvmMemoryMap::KvmMemoryMap(int fd) {
+    SigbusGuard guard;
+
+    const std::vector<Extent> pieces = probe_slots(fd);
+    layout_ = merge_extents(pieces);
+
+    // Map each contiguous extent once. If a single mapping can't span the extent (it crosses
+    // memory slots), map the pieces individually instead.
+    size_t i = 0;
+    while (i < pieces.size()) {
+        size_t end = i + 1;
+        uint64_t length = pieces[i].length;
+        while (end < pieces.size() && pieces[end].gpa == pieces[i].gpa + length) {
+            length += pieces[end].length;
+            ++end;
+        }
+
+        void* mapping = map_range(fd, pieces[i].gpa, length);
+        if (mapping != MAP_FAILED) {
+            add_region(reinterpret_cast<char*>(mapping), pieces[i].gpa, length);
+        } else {
+            for (size_t j = i; j < end; ++j) {
+                mapping = map_range(fd, pieces[j].gpa, pieces[j].length);
+                if (unlikely(mapping == MAP_FAILED)) {
+                    LOG4CXX_WARN(logger, "Failed to map guest memory at 0x"
+                                             << std::hex << pieces[j].gpa << ": "
+                                             << strerror(errno));
+                    continue;
+                }
+                add_region(reinterpret_cast<char*>(mapping), pieces[j].gpa, pieces[j].length);
+            }
+        }
+        i = end;
+    }
+
+    if (regions_.empty()) {
+        throw CommandFailedException("Failed to map guest physical memory", errno);
+    }
+
+    // Pages that can't be aliased read-only are mapped individually by the caller instead
+    for (auto& region : regions_) {
+        void* alias = mmap(nullptr, region.length, PROT_READ, MAP_SHARED, fd, region.gpa);
+        if (alias != MAP_FAILED)
+            region.read_only_base = static_cast<const char*>(alias);
+    }
+
+    for (const auto& region : regions_) {
+        LOG4CXX_DEBUG(logger, "Mapped guest memory 0x" << std::hex << region.gpa << "-0x"
+                                                        << (region.gpa + region.length));
+    }
+}
+
+KvmMemoryMap::~KvmMemoryMap() {
+    for (const auto& region : regions_) {
+        munmap(region.base, region.length);
+        if (region.read_only_base != nullptr)
+            munmap(const_cast<char*>(region.read_only_base), region.length);
+    }
+}
+
+} // namespace kvm
+} // namespace introvirt
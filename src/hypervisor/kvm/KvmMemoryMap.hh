@@ -0,0 +1,158 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/util/compiler.hh>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace introvirt {
+namespace kvm {
+
+/**
+ * @brief A persistent mapping of all guest physical memory
+ *
+ * Guest RAM is discovered by probing the domain fd in slot-sized chunks, and each contiguous
+ * extent is then mapped once with a single mmap(). Only the ends of each chunk are read while
+ * probing, so building the map doesn't fault in guest RAM. Since the fd may only validate offsets
+ * when they are touched, smaller holes inside an extent (such as the legacy VGA window) are found
+ * lazily: the first lookup of each page reads it under a SIGBUS guard, and pages that can't be
+ * read make every later lookup fail, so that the caller falls back to mapping the page itself.
+ * The process-wide SIGBUS handler is only replaced while a page is being read, and other SIGBUS
+ * signals are passed on to the previous handler.
+ *
+ * Each region is also mapped a second time with PROT_READ, for callers that must not write.
+ *
+ * The mappings are released when the instance is destroyed. GuestMemoryMapping objects that point
+ * into the region hold a reference to keep it alive.
+ */
+class KvmMemoryMap final : public std::enable_shared_from_this<KvmMemoryMap> {
+  public:
+    /**
+     * @brief A contiguous extent of mapped guest physical memory
+     */
+    struct Region {
+        uint64_t gpa;
+        uint64_t length;
+        char* base;
+        const char* read_only_base; ///< A read-only alias of base, or nullptr
+
+        // One bit per page: whether the page has been read yet, and whether that failed
+        std::unique_ptr<std::atomic<uint64_t>[]> checked;
+        std::unique_ptr<std::atomic<uint64_t>[]> holes;
+    };
+
+    /**
+     * @brief A contiguous extent of guest physical memory backed by memory slots
+     */
+    struct Extent {
+        uint64_t gpa;
+        uint64_t length;
+
+        bool operator==(const Extent& other) const {
+            return gpa == other.gpa && length == other.length;
+        }
+        bool operator!=(const Extent& other) const { return !(*this == other); }
+    };
+
+    /**
+     * @brief Find the extents of guest memory without mapping them
+     *
+     * Only the first and last page of each slot-sized piece is touched, so this is cheap enough to
+     * repeat to notice memory being added or removed. Holes smaller than a piece aren't found; see
+     * readable_extents().
+     *
+     * @param fd The domain fd to probe
+     * @return The extents, sorted by guest physical address
+     */
+    static std::vector<Extent> probe_layout(int fd);
+
+    /**
+     * @brief Get a pointer to guest physical memory
+     *
+     * @param gpa The guest physical address
+     * @param length The number of bytes that must be contiguously mapped
+     * @return A pointer to the memory, or nullptr if any part of the range is not mapped
+     */
+    char* find(uint64_t gpa, uint64_t length) const HOT;
+
+    /**
+     * @brief Get a read-only pointer to guest physical memory
+     *
+     * This points into a second, PROT_READ mapping of the same memory, so that a stray write
+     * faults instead of changing the guest.
+     *
+     * @param gpa The guest physical address
+     * @param length The number of bytes that must be contiguously mapped
+     * @return A pointer to the memory, or nullptr if any part of the range is not mapped
+     */
+    const char* find_read_only(uint64_t gpa, uint64_t length) const HOT;
+
+    /**
+     * @brief Find the guest memory that can actually be read, leaving out holes
+     *
+     * Every page that hasn't been looked up yet is read, so this faults in all of guest RAM. It
+     * is meant for callers that are about to read all of it anyway, such as memory snapshots.
+     *
+     * @return The readable extents, sorted by guest physical address
+     */
+    std::vector<Extent> readable_extents() const;
+
+    /**
+     * @brief Get the mapped regions, sorted by guest physical address
+     */
+    const std::vector<Region>& regions() const { return regions_; }
+
+    /**
+     * @brief Get the extents found by probe_layout() when this map was built
+     */
+    const std::vector<Extent>& layout() const { return layout_; }
+
+    /**
+     * @brief The total number of bytes mapped
+     */
+    uint64_t mapped_bytes() const;
+
+    /**
+     * @brief Probe and map guest physical memory
+     *
+     * @param fd The domain fd to map memory from
+     * @throws CommandFailedException if no guest memory could be mapped
+     */
+    explicit KvmMemoryMap(int fd);
+
+    KvmMemoryMap(const KvmMemoryMap&) = delete;
+    KvmMemoryMap& operator=(const KvmMemoryMap&) = delete;
+
+    ~KvmMemoryMap();
+
+  private:
+    static std::vector<Extent> probe_slots(int fd);
+    static void probe(int fd, uint64_t gpa, uint64_t length, std::vector<Extent>& found);
+    void add_region(char* base, uint64_t gpa, uint64_t length);
+    const Region* lookup(uint64_t gpa, uint64_t length) const HOT;
+    static bool readable(const Region& region, uint64_t gpa, uint64_t length) HOT;
+    static bool check_page(const Region& region, uint64_t page);
+
+    std::vector<Extent> layout_;
+    std::vector<Region> regions_;
+};
+
+} // namespace kvm
+} // namespace introvirt
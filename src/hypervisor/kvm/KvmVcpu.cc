@@ -115,22 +115,51 @@ void KvmVcpu::intercept_system_calls(bool enabled) {
     static const std::string error_string = "Failed to set vcpu system call intercept";
 
     if (enabled != syscall_intercept_) {
-        if (syscall_injection_count_ == 0) {
-            _send_command(KVM_SET_SYSCALL_HOOK, enabled, error_string);
-
-            // When this function runs during the destructor this log causes a segfault
-            // unless we build the log message first. Fixes #15
-            if (unlikely(logger->isDebugEnabled())) {
-                std::stringstream ss;
-                ss << "Domain " << domain().name() << " Vcpu" << id_ << " intercept_system_calls("
-                   << enabled << ")";
-                LOG4CXX_DEBUG(logger, ss.str());
-            }
-        }
+        // Only record the new setting once the hypervisor has accepted it
+        _update_syscall_hook(enabled, syscall_gate_, syscall_injection_count_, error_string);
         syscall_intercept_ = enabled;
+
+        // When this function runs during the destructor this log causes a segfault
+        // unless we build the log message first. Fixes #15
+        if (unlikely(logger->isDebugEnabled())) {
+            std::stringstream ss;
+            ss << "Domain " << domain().name() << " Vcpu" << id_ << " intercept_system_calls("
+               << enabled << ")";
+            LOG4CXX_DEBUG(logger, ss.str());
+        }
     }
 }
 
+void KvmVcpu::system_call_gate(bool open) {
+    std::lock_guard lock(mtx_);
+
+    static const std::string error_string = "Failed to gate vcpu system call intercept";
+
+    if (open == syscall_gate_)
+        return;
+
+    _update_syscall_hook(syscall_intercept_, open, syscall_injection_count_, error_string);
+    syscall_gate_ = open;
+    LOG4CXX_TRACE(logger, "Domain " << domain().name() << " Vcpu " << id_ << " system_call_gate("
+                                    << open << ")");
+}
+
+bool KvmVcpu::system_call_gate() const {
+    std::lock_guard lock(mtx_);
+    return syscall_gate_;
+}
+
+void KvmVcpu::_update_syscall_hook(bool intercept, bool gate, int injection_count,
+                                   const std::string& errstr) {
+    // Injection needs the hook regardless of the user's setting or the gate
+    const bool hook = (intercept && gate) || injection_count > 0;
+    if (hook == syscall_hook_applied_)
+        return;
+
+    _send_command(KVM_SET_SYSCALL_HOOK, hook, errstr);
+    syscall_hook_applied_ = hook;
+}
+
 bool KvmVcpu::intercept_system_calls() const {
     std::lock_guard lock(mtx_);
     return syscall_intercept_;
@@ -139,29 +168,25 @@ bool KvmVcpu::intercept_system_calls() const {
 void KvmVcpu::intercept_cr_writes(int cr, bool enabled) {
     std::lock_guard lock(mtx_);
 
-    static const std::string error_string = "Failed to set control register intercept";
-
     switch (cr) {
     case 0:
     case 2:
     case 3:
     case 4:
     case 8: {
-        struct kvm_cr_monitor cr_mon;
-        cr_mon.cr = cr;
-        cr_mon.mode = cr_hook_[cr];
+        uint8_t mode = cr_hook_[cr];
         if (enabled) {
-            cr_mon.mode |= KVM_MONITOR_CR_WRITE;
+            mode |= KVM_MONITOR_CR_WRITE;
         } else {
-            cr_mon.mode &= ~KVM_MONITOR_CR_WRITE;
+            mode &= ~KVM_MONITOR_CR_WRITE;
         }
 
         // No change is being made
-        if (cr_mon.mode == cr_hook_[cr])
+        if (mode == cr_hook_[cr])
             return;
 
-        _send_command(KVM_SET_CR_MONITOR, reinterpret_cast<unsigned long>(&cr_mon), error_string);
-        cr_hook_[cr] = cr_mon.mode;
+        _update_cr_monitor(cr, mode, cr_internal_refs_[cr]);
+        cr_hook_[cr] = mode;
         LOG4CXX_DEBUG(logger, "Domain " << domain().name() << " Vcpu " << id_
                                         << " intercept_cr_writes(" << cr << ", " << enabled << ")");
         break;
@@ -171,6 +196,78 @@ void KvmVcpu::intercept_cr_writes(int cr, bool enabled) {
     }
 }
 
+void KvmVcpu::add_cr_write_intercept_ref(int cr) {
+    std::lock_guard lock(mtx_);
+
+    switch (cr) {
+    case 0:
+    case 2:
+    case 3:
+    case 4:
+    case 8:
+        _update_cr_monitor(cr, cr_hook_[cr], cr_internal_refs_[cr] + 1);
+        ++cr_internal_refs_[cr];
+        break;
+    default:
+        throw NotImplementedException("Invalid Control Register: " + std::to_string(cr));
+    }
+}
+
+void KvmVcpu::remove_cr_write_intercept_ref(int cr) {
+    std::lock_guard lock(mtx_);
+
+    switch (cr) {
+    case 0:
+    case 2:
+    case 3:
+    case 4:
+    case 8:
+        introvirt_assert(cr_internal_refs_[cr] > 0, "");
+        _update_cr_monitor(cr, cr_hook_[cr], cr_internal_refs_[cr] - 1);
+        --cr_internal_refs_[cr];
+        break;
+    default:
+        throw NotImplementedException("Invalid Control Register: " + std::to_string(cr));
+    }
+}
+
+void KvmVcpu::_update_cr_monitor(int cr, uint8_t hook, int internal_refs) {
+    static const std::string error_string = "Failed to set control register intercept";
+
+    // The hypervisor sees the union of the user's hooks and the library's own references.
+    // The caller records the new state once this returns, so a failure leaves it unchanged.
+    struct kvm_cr_monitor cr_mon;
+    cr_mon.cr = cr;
+    cr_mon.mode = hook;
+    if (internal_refs > 0)
+        cr_mon.mode |= KVM_MONITOR_CR_WRITE;
+
+    if (cr_mon.mode == cr_applied_[cr])
+        return;
+
+    _send_command(KVM_SET_CR_MONITOR, reinterpret_cast<unsigned long>(&cr_mon), error_string);
+    cr_applied_[cr] = cr_mon.mode;
+}
+
+void KvmVcpu::intercept_invlpg(bool enabled) {
+    std::lock_guard lock(mtx_);
+
+    static const std::string error_string = "Failed to set vcpu INVLPG intercept";
+
+    if (enabled == invlpg_intercept_)
+        return;
+
+    _send_command(KVM_SET_INVLPG_HOOK, enabled, error_string);
+    invlpg_intercept_ = enabled;
+    LOG4CXX_DEBUG(logger, "Domain " << domain().name() << " Vcpu " << id_ << " intercept_invlpg("
+                                    << enabled << ")");
+}
+
+bool KvmVcpu::intercept_invlpg() const {
+    std::lock_guard lock(mtx_);
+    return invlpg_intercept_;
+}
+
 bool KvmVcpu::intercept_cr_writes(int cr) const {
     std::lock_guard lock(mtx_);
 
@@ -368,10 +465,8 @@ void KvmVcpu::syscall_injection_start() {
         "Failed to toggle system call intercept in syscall_injection_start()");
 
     std::lock_guard lock(mtx_);
-    if (++syscall_injection_count_ == 1) {
-        if (syscall_intercept_ != true)
-            _send_command(KVM_SET_SYSCALL_HOOK, true, err);
-    }
+    _update_syscall_hook(syscall_intercept_, syscall_gate_, syscall_injection_count_ + 1, err);
+    ++syscall_injection_count_;
 }
 
 void KvmVcpu::syscall_injection_end() {
@@ -379,10 +474,8 @@ void KvmVcpu::syscall_injection_end() {
         "Failed to toggle system call intercept in syscall_injection_end()");
 
     std::lock_guard lock(mtx_);
-    if (--syscall_injection_count_ == 0) {
-        if (syscall_intercept_ != true)
-            _send_command(KVM_SET_SYSCALL_HOOK, false, err);
-    }
+    _update_syscall_hook(syscall_intercept_, syscall_gate_, syscall_injection_count_ - 1, err);
+    --syscall_injection_count_;
 }
 
 void KvmVcpu::_send_command(unsigned long request, unsigned long value, const std::string& errstr) {
@@ -48,6 +48,18 @@ class KvmVcpu final : public VcpuImpl {
 
     bool intercept_cr_writes(int cr) const override;
 
+    void add_cr_write_intercept_ref(int cr) override;
+
+    void remove_cr_write_intercept_ref(int cr) override;
+
+    void system_call_gate(bool open) override;
+
+    bool system_call_gate() const override;
+
+    void intercept_invlpg(bool enabled) override;
+
+    bool intercept_invlpg() const override;
+
     void intercept_exception(x86::Exception vector, bool enabled);
 
     bool intercept_exception(x86::Exception vector) const;
@@ -106,6 +118,9 @@ class KvmVcpu final : public VcpuImpl {
 
   private:
     void _send_command(unsigned long request, unsigned long value, const std::string& errstr);
+    void _update_cr_monitor(int cr, uint8_t hook, int internal_refs);
+    void _update_syscall_hook(bool intercept, bool gate, int injection_count,
+                              const std::string& errstr);
 
   private:
     const uint32_t id_;
@@ -121,9 +136,14 @@ class KvmVcpu final : public VcpuImpl {
     int pause_count_ = 0;
 
     std::array<uint8_t, 9> cr_hook_ = {};
+    std::array<uint8_t, 9> cr_applied_ = {};
+    std::array<int, 9> cr_internal_refs_ = {};
 
     bool syscall_intercept_ = false;
+    bool syscall_gate_ = true;
+    bool syscall_hook_applied_ = false;
     bool int3_intercept_ = false;
+    bool invlpg_intercept_ = false;
     bool single_stepping_ = false;
     bool in_event_ = false;
     int syscall_injection_count_ = 0;
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ReplayDomain.hh"
+#include "core/memory/PageMapping.hh"
+
+#include <introvirt/core/exception/BadPhysicalAddressException.hh>
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/InvalidVcpuException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <thread>
+
+#if __GNUC__ >= 8
+#include <filesystem>
+namespace filesystem = std::filesystem;
+#else
+#include <experimental/filesystem>
+namespace filesystem = std::experimental::filesystem;
+#endif
+
+namespace introvirt {
+namespace replay {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.replay.ReplayDomain"));
+
+std::string ReplayDomain::name() const { return name_; }
+
+uint32_t ReplayDomain::id() const { return 0; }
+
+ReplayVcpu& ReplayDomain::vcpu(uint32_t index) {
+    auto const_this = const_cast<const ReplayDomain*>(this);
+    return const_cast<ReplayVcpu&>(const_this->vcpu(index));
+}
+
+const ReplayVcpu& ReplayDomain::vcpu(uint32_t index) const {
+    if (unlikely(index >= vcpus_.size())) {
+        throw InvalidVcpuException(index);
+    }
+    return *vcpus_[index];
+}
+
+uint32_t ReplayDomain::vcpu_count() const { return vcpus_.size(); }
+
+// The recording already has whatever memory events the intercepts produced
+void ReplayDomain::intercept_mem_access(uint64_t gfn, bool on_read, bool on_write,
+                                        bool on_execute) {}
+
+void ReplayDomain::intercept_mem_access(const std::vector<MemAccessRange>& ranges) {}
+
+void ReplayDomain::clear_mem_access_intercepts() {}
+
+void ReplayDomain::intercept_exception(x86::Exception vector, bool enabled) {
+    if (vector == x86::Exception::INT3)
+        intercept_int3_ = enabled;
+}
+
+bool ReplayDomain::intercept_exception(x86::Exception vector) const {
+    return vector == x86::Exception::INT3 && intercept_int3_;
+}
+
+void ReplayDomain::poll(EventCallback& callback) {
+    {
+        std::lock_guard lock(completed_mtx_);
+        polling_ = true;
+    }
+
+    // Stop the pollers once the last event is done
+    std::thread watcher([this] {
+        std::unique_lock lock(completed_mtx_);
+        completed_cv_.wait(lock, [this] { return !polling_ || completed_ == event_count(); });
+        if (polling_) {
+            lock.unlock();
+            LOG4CXX_DEBUG(logger, "Domain " << name_ << ": Replayed " << completed_ << " events");
+            interrupt();
+        }
+    });
+
+    try {
+        DomainImpl::poll(callback);
+    } catch (...) {
+        {
+            std::lock_guard lock(completed_mtx_);
+            polling_ = false;
+        }
+        completed_cv_.notify_all();
+        watcher.join();
+        throw;
+    }
+
+    {
+        std::lock_guard lock(completed_mtx_);
+        polling_ = false;
+    }
+    completed_cv_.notify_all();
+    watcher.join();
+}
+
+const ReplayHypervisor& ReplayDomain::hypervisor() const { return hypervisor_; }
+
+std::vector<PhysicalMemoryRange> ReplayDomain::physical_memory_ranges() const {
+    return memory_->ranges();
+}
+
+std::shared_ptr<GuestMemoryMapping> ReplayDomain::map_pfns(const uint64_t* pfns,
+                                                           size_t count) const {
+    return map_guest_pages(
+        pfns, count,
+        [this](uint64_t pfn, size_t count) -> std::shared_ptr<GuestMemoryMapping> {
+            char* direct = memory_->find(pfn, count);
+            if (unlikely(direct == nullptr))
+                return nullptr;
+            return std::make_shared<GuestMemoryMapping>(direct, count * PageDirectory::PAGE_SIZE,
+                                                        memory_);
+        },
+        [this](char* address, uint64_t pfn) {
+            const uint64_t gpa = pfn << PageDirectory::PAGE_SHIFT;
+            const int64_t offset = memory_->offset(pfn);
+            if (unlikely(offset < 0))
+                throw BadPhysicalAddressException(gpa, EFAULT);
+
+            // Map each page from the memfd so that writes are shared
+            map_fd_page(address, memory_->fd(), offset, PROT_READ | PROT_WRITE, MAP_SHARED, gpa);
+        });
+}
+
+void ReplayDomain::load_pages(const ReplayEventRecord& record) {
+    for (const auto& [pfn, data] : record.pages)
+        memory_->update(pfn, data);
+}
+
+void ReplayDomain::event_completed() {
+    if (unlikely(completed_.fetch_add(1, std::memory_order_relaxed) + 1 == event_count())) {
+        // Take the lock so the watcher can't miss the wakeup between its check and its wait
+        std::lock_guard lock(completed_mtx_);
+        completed_cv_.notify_all();
+    }
+}
+
+ReplayDomain::ReplayDomain(const ReplayHypervisor& hypervisor, const std::string& path)
+    : hypervisor_(hypervisor), name_(filesystem::path(path).filename().string()),
+      log_(std::make_unique<ReplayLog>(path)), memory_(std::make_shared<ReplayMemory>(*log_)) {
+
+    for (uint32_t i = 0; i < log_->vcpu_count(); ++i) {
+        vcpus_.emplace_back(std::make_unique<ReplayVcpu>(*this, i, *log_));
+    }
+
+    LOG4CXX_DEBUG(logger, "Domain " << name_ << " loaded " << vcpus_.size() << " vcpus and "
+                                    << log_->event_count() << " events");
+
+    initialize();
+}
+
+ReplayDomain::~ReplayDomain() {
+    // Same teardown order as the live domains
+    reset_guest();
+    vcpus_.clear();
+}
+
+} // namespace replay
+} // namespace introvirt
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "ReplayHypervisor.hh"
+#include "ReplayLog.hh"
+#include "ReplayMemory.hh"
+#include "ReplayVcpu.hh"
+
+#include "core/domain/DomainImpl.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace introvirt {
+namespace replay {
+
+/**
+ * @brief Domain class for replaying an event recording
+ *
+ * Guest memory and vcpu state come from a file written by Domain::record_events(). poll() feeds
+ * the recorded events through the normal event pipeline (filtering, guest event parsing and the
+ * delivery threads) and returns once every event has been completed, or when interrupted.
+ */
+class ReplayDomain final : public DomainImpl {
+  public:
+    std::string name() const override;
+
+    uint32_t id() const override;
+
+    ReplayVcpu& vcpu(uint32_t index) override;
+
+    const ReplayVcpu& vcpu(uint32_t index) const override;
+
+    uint32_t vcpu_count() const override;
+
+    void intercept_mem_access(uint64_t gfn, bool on_read, bool on_write, bool on_execute) override;
+
+    void intercept_mem_access(const std::vector<MemAccessRange>& ranges) override;
+
+    void clear_mem_access_intercepts() override;
+
+    void intercept_exception(x86::Exception vector, bool enabled) override;
+
+    bool intercept_exception(x86::Exception vector) const override;
+
+    void poll(EventCallback& callback) override;
+
+    const ReplayHypervisor& hypervisor() const override;
+
+    std::shared_ptr<GuestMemoryMapping> map_pfns(const uint64_t* pfns,
+                                                 size_t count) const override HOT;
+
+    std::vector<PhysicalMemoryRange> physical_memory_ranges() const override;
+
+    /**
+     * @brief Get the total number of events in the recording
+     */
+    uint64_t event_count() const { return log_->event_count(); }
+
+    /**
+     * @brief Get the number of events completed so far
+     */
+    uint64_t completed_events() const { return completed_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Load the pages that changed while an event was recorded
+     */
+    void load_pages(const ReplayEventRecord& record);
+
+    /**
+     * @brief Called by the vcpus each time an event is completed
+     */
+    void event_completed();
+
+    /**
+     * @brief Open an event recording
+     *
+     * @param hypervisor The hypervisor instance
+     * @param path The path to the recording
+     * @throws NoSuchDomainException if the recording does not exist
+     * @throws CommandFailedException if the recording cannot be loaded
+     */
+    ReplayDomain(const ReplayHypervisor& hypervisor, const std::string& path);
+    ~ReplayDomain() override;
+
+  private:
+    const ReplayHypervisor& hypervisor_;
+    const std::string name_;
+
+    std::unique_ptr<const ReplayLog> log_;
+
+    // Held by shared_ptr so that GuestMemoryMappings can keep it alive
+    std::shared_ptr<ReplayMemory> memory_;
+
+    std::vector<std::unique_ptr<ReplayVcpu>> vcpus_;
+
+    std::atomic<bool> intercept_int3_ = false;
+
+    std::atomic<uint64_t> completed_ = 0;
+    std::mutex completed_mtx_;
+    std::condition_variable completed_cv_;
+    bool polling_ = false;
+};
+
+} // namespace replay
+} // namespace introvirt
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "ReplayVcpu.hh"
+
+#include "core/domain/EventLog.hh"
+#include "core/event/HypervisorEvent.hh"
+
+#include <introvirt/core/domain/Domain.hh>
+
+#include <introvirt/util/compiler.hh>
+
+namespace introvirt {
+namespace replay {
+
+class ReplayEvent final : public HypervisorEvent {
+  public:
+    Vcpu& vcpu() override { return vcpu_; }
+    const Vcpu& vcpu() const override { return vcpu_; }
+
+    Domain& domain() override { return vcpu_.domain(); }
+    const Domain& domain() const override { return vcpu_.domain(); }
+
+    EventType type() const override { return static_cast<EventType>(record_.type); }
+
+    FastCallType system_call_type() const override {
+        return static_cast<FastCallType>(record_.fastcall_type);
+    }
+
+    uint64_t syscall_return_address() const override { return record_.syscall_return_address; }
+
+    int control_register() const override { return record_.control_register; }
+    uint64_t control_register_value() const override { return record_.control_register_value; }
+
+    uint64_t msr_index() const override { return 0; }
+    uint64_t msr_value() const override { return 0; }
+
+    x86::Exception exception() const override {
+        return static_cast<x86::Exception>(record_.exception);
+    }
+
+    guest_phys_ptr<void> mem_access_physical_address() const override {
+        return guest_phys_ptr<void>(vcpu_.domain(), record_.mem_access_address);
+    }
+
+    bool mem_access_read() const override { return record_.mem_access & EVENT_LOG_MEM_READ; }
+    bool mem_access_write() const override { return record_.mem_access & EVENT_LOG_MEM_WRITE; }
+    bool mem_access_execute() const override {
+        return record_.mem_access & EVENT_LOG_MEM_EXECUTE;
+    }
+
+    uint64_t invlpg_address() const override { return record_.invlpg_address; }
+
+    uint64_t id() const override { return record_.id; }
+
+    void discard(bool value) override { discarded_ = value; }
+
+    ReplayEvent(ReplayVcpu& vcpu, const EventLogEvent& record) : vcpu_(vcpu), record_(record) {}
+
+    ~ReplayEvent() override {
+        if (likely(!discarded_))
+            vcpu_.complete_event();
+    }
+
+  private:
+    ReplayVcpu& vcpu_;
+    const EventLogEvent& record_;
+    bool discarded_ = false;
+};
+
+} // namespace replay
+} // namespace introvirt
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ReplayHypervisor.hh"
+#include "ReplayDomain.hh"
+#include "gitversion.h"
+
+#include "core/domain/EventLog.hh"
+
+#include <introvirt/core/exception/NoSuchDomainException.hh>
+
+namespace introvirt {
+namespace replay {
+
+std::unique_ptr<Domain> ReplayHypervisor::attach_domain(uint32_t domain_id) {
+    throw NoSuchDomainException(domain_id);
+}
+
+std::unique_ptr<Domain> ReplayHypervisor::attach_domain(const std::string& domain_name) {
+    return std::make_unique<ReplayDomain>(*this, domain_name);
+}
+
+std::vector<DomainInformation> ReplayHypervisor::get_running_domains() { return {}; }
+
+std::string ReplayHypervisor::hypervisor_name() const { return "Replay"; }
+
+std::string ReplayHypervisor::hypervisor_version() const {
+    return std::to_string(EVENT_LOG_VERSION);
+}
+
+std::string ReplayHypervisor::hypervisor_patch_version() const { return ""; }
+
+std::string ReplayHypervisor::library_name() const { return "libintrovirt-replay"; }
+
+std::string ReplayHypervisor::library_version() const {
+#ifdef GIT_VERSION
+    return GIT_VERSION;
+#else
+    return "Unknown (Compiled without GIT_VERSION)";
+#endif
+}
+
+ReplayHypervisor::ReplayHypervisor() = default;
+ReplayHypervisor::~ReplayHypervisor() = default;
+
+} // namespace replay
+} // namespace introvirt
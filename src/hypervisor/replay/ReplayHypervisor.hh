@@ -0,0 +1,74 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/domain/Hypervisor.hh>
+
+#include <string>
+
+namespace introvirt {
+namespace replay {
+
+/**
+ * @brief Hypervisor class for replaying event recordings
+ *
+ * Domains are attached by the path to a file written by Domain::record_events(). Selected by
+ * setting the INTROVIRT_HYPERVISOR environment variable to "replay".
+ */
+class ReplayHypervisor final : public Hypervisor {
+  public:
+    /**
+     * @brief Not supported, recordings do not have numeric ids
+     *
+     * @throws NoSuchDomainException
+     */
+    std::unique_ptr<Domain> attach_domain(uint32_t domain_id) override;
+
+    /**
+     * @brief Open an event recording
+     *
+     * @param domain_name The path to the recording
+     */
+    std::unique_ptr<Domain> attach_domain(const std::string& domain_name) override;
+
+    /**
+     * @brief Recordings are not running, so this is always empty
+     */
+    std::vector<DomainInformation> get_running_domains() override;
+
+    std::string hypervisor_name() const override;
+
+    std::string hypervisor_version() const override;
+
+    std::string hypervisor_patch_version() const override;
+
+    std::string library_name() const override;
+
+    std::string library_version() const override;
+
+    /**
+     * @brief Construct a new ReplayHypervisor object
+     */
+    ReplayHypervisor();
+
+    /**
+     * @brief Destroy the instance
+     */
+    ~ReplayHypervisor() override;
+};
+
+} // namespace replay
+} // namespace introvirt
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ReplayLog.hh"
+
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/NoSuchDomainException.hh>
+#include <introvirt/util/compiler.hh>
+
+#include <log4cxx/logger.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace introvirt {
+namespace replay {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.replay.ReplayLog"));
+
+namespace {
+
+// Walks the records of the file, which are packed with no alignment
+class RecordReader {
+  public:
+    bool done() const { return offset_ == size_; }
+
+    template <typename T>
+    void read(T& out) {
+        if (unlikely(size_ - offset_ < sizeof(T)))
+            throw CommandFailedException("Truncated event recording " + path_, EINVAL);
+        std::memcpy(&out, data_ + offset_, sizeof(T));
+        offset_ += sizeof(T);
+    }
+
+    const uint8_t* skip(size_t length) {
+        if (unlikely(size_ - offset_ < length))
+            throw CommandFailedException("Truncated event recording " + path_, EINVAL);
+        const uint8_t* result = data_ + offset_;
+        offset_ += length;
+        return result;
+    }
+
+    void read_msrs(uint32_t count, std::vector<EventLogMsr>& out) {
+        out.resize(count);
+        for (auto& msr : out)
+            read(msr);
+    }
+
+    RecordReader(const uint8_t* data, size_t size, const std::string& path)
+        : data_(data), size_(size), path_(path) {}
+
+  private:
+    const uint8_t* const data_;
+    const size_t size_;
+    size_t offset_ = 0;
+    const std::string& path_;
+};
+
+} // namespace
+
+static void load_segment(const EventLogSegment& src, image::ImageSegment& dst) {
+    dst.selector = src.selector;
+    dst.base = src.base;
+    dst.limit = src.limit;
+    dst.flags = src.flags;
+}
+
+void load_cpu_state(const EventLogRegisters& regs, const std::vector<EventLogMsr>& msrs,
+                    image::ImageCpuState& state) {
+    state.rax = regs.rax;
+    state.rbx = regs.rbx;
+    state.rcx = regs.rcx;
+    state.rdx = regs.rdx;
+    state.rsi = regs.rsi;
+    state.rdi = regs.rdi;
+    state.rsp = regs.rsp;
+    state.rbp = regs.rbp;
+    state.r8 = regs.r8;
+    state.r9 = regs.r9;
+    state.r10 = regs.r10;
+    state.r11 = regs.r11;
+    state.r12 = regs.r12;
+    state.r13 = regs.r13;
+    state.r14 = regs.r14;
+    state.r15 = regs.r15;
+    state.rip = regs.rip;
+    state.rflags = regs.rflags;
+
+    state.cr0 = regs.cr0;
+    state.cr2 = regs.cr2;
+    state.cr3 = regs.cr3;
+    state.cr4 = regs.cr4;
+    state.cr8 = regs.cr8;
+    state.efer = regs.efer;
+
+    load_segment(regs.cs, state.cs);
+    load_segment(regs.ds, state.ds);
+    load_segment(regs.es, state.es);
+    load_segment(regs.fs, state.fs);
+    load_segment(regs.gs, state.gs);
+    load_segment(regs.ss, state.ss);
+    load_segment(regs.tr, state.tr);
+    load_segment(regs.ldt, state.ldt);
+
+    state.gdtr_base = regs.gdtr_base;
+    state.gdtr_limit = regs.gdtr_limit;
+    state.idtr_base = regs.idtr_base;
+    state.idtr_limit = regs.idtr_limit;
+
+    for (const auto& msr : msrs)
+        state.msrs[msr.index] = msr.value;
+}
+
+ReplayLog::ReplayLog(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            throw NoSuchDomainException(path);
+        throw CommandFailedException("Failed to open event recording " + path, errno);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        const int err = errno;
+        close(fd);
+        throw CommandFailedException("Failed to stat event recording " + path, err);
+    }
+    size_ = st.st_size;
+
+    if (size_ < sizeof(EventLogHeader)) {
+        close(fd);
+        throw CommandFailedException("Not an event recording: " + path, EINVAL);
+    }
+
+    void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    const int err = errno;
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw CommandFailedException("Failed to map event recording " + path, err);
+    data_ = static_cast<const uint8_t*>(mapping);
+
+    try {
+        RecordReader reader(data_, size_, path);
+
+        EventLogHeader header;
+        reader.read(header);
+        if (std::memcmp(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic)) != 0)
+            throw CommandFailedException("Not an event recording: " + path, EINVAL);
+        if (header.version != EVENT_LOG_VERSION) {
+            throw CommandFailedException("Unsupported event recording version " +
+                                             std::to_string(header.version),
+                                         EINVAL);
+        }
+        if (header.vcpu_count == 0)
+            throw CommandFailedException("Event recording has no vcpus: " + path, EINVAL);
+
+        vcpus_.resize(header.vcpu_count);
+        events_.resize(header.vcpu_count);
+        std::vector<bool> seen_vcpus(header.vcpu_count);
+
+        // Changed pages belong to the last event read before them
+        ReplayEventRecord* last_event = nullptr;
+
+        while (!reader.done()) {
+            EventLogRecordType type;
+            reader.read(type);
+
+            switch (type) {
+            case EventLogRecordType::VCPU: {
+                EventLogVcpu record;
+                reader.read(record);
+                if (record.vcpu_id >= header.vcpu_count)
+                    throw CommandFailedException("Bad vcpu id in " + path, EINVAL);
+                auto& vcpu = vcpus_[record.vcpu_id];
+                vcpu.vcpu = record;
+                reader.read_msrs(record.registers.msr_count, vcpu.msrs);
+                seen_vcpus[record.vcpu_id] = true;
+                break;
+            }
+            case EventLogRecordType::EVENT: {
+                ReplayEventRecord record;
+                reader.read(record.event);
+                if (record.event.vcpu_id >= header.vcpu_count)
+                    throw CommandFailedException("Bad vcpu id in " + path, EINVAL);
+                reader.read_msrs(record.event.registers.msr_count, record.msrs);
+                auto& events = events_[record.event.vcpu_id];
+                events.push_back(std::move(record));
+                last_event = &events.back();
+                ++event_count_;
+                break;
+            }
+            case EventLogRecordType::PAGE: {
+                uint64_t pfn;
+                reader.read(pfn);
+                const uint8_t* data = reader.skip(sizeof(EventLogPage::data));
+
+                // The first copy of a page is loaded up front, later copies when their event is
+                auto [iter, inserted] = pages_.try_emplace(pfn, data);
+                if (!inserted) {
+                    if (last_event != nullptr)
+                        last_event->pages.emplace_back(pfn, data);
+                    else
+                        iter->second = data;
+                }
+                break;
+            }
+            default:
+                throw CommandFailedException("Bad record type in " + path, EINVAL);
+            }
+        }
+
+        for (uint32_t i = 0; i < header.vcpu_count; ++i) {
+            if (!seen_vcpus[i])
+                throw CommandFailedException("Missing state for vcpu " + std::to_string(i), EINVAL);
+        }
+    } catch (...) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+        throw;
+    }
+
+    LOG4CXX_DEBUG(logger, path << ": " << vcpus_.size() << " vcpus, " << event_count_
+                               << " events, " << pages_.size() << " pages");
+}
+
+ReplayLog::~ReplayLog() { munmap(const_cast<uint8_t*>(data_), size_); }
+
+} // namespace replay
+} // namespace introvirt
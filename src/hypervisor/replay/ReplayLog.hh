@@ -0,0 +1,120 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "core/domain/EventLog.hh"
+#include "hypervisor/image/ImageCpuState.hh"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace introvirt {
+namespace replay {
+
+/**
+ * @brief A recorded event, ready to be replayed
+ */
+struct ReplayEventRecord {
+    EventLogEvent event;
+    std::vector<EventLogMsr> msrs;
+
+    // Page contents that changed while the event was being handled, as pfn/data pairs
+    std::vector<std::pair<uint64_t, const uint8_t*>> pages;
+};
+
+/**
+ * @brief The state of a vcpu when the recording started
+ */
+struct ReplayVcpuRecord {
+    EventLogVcpu vcpu;
+    std::vector<EventLogMsr> msrs;
+};
+
+/**
+ * @brief An event recording opened for replay
+ *
+ * The file is mapped read-only and indexed once when it's opened. Page data points straight into
+ * the mapping.
+ */
+class ReplayLog final {
+  public:
+    /**
+     * @brief Get the number of vcpus in the recorded domain
+     */
+    uint32_t vcpu_count() const { return vcpus_.size(); }
+
+    /**
+     * @brief Get the starting state of a vcpu
+     */
+    const ReplayVcpuRecord& vcpu(uint32_t id) const { return vcpus_[id]; }
+
+    /**
+     * @brief Get the events of a vcpu, in the order they were recorded
+     */
+    const std::vector<ReplayEventRecord>& events(uint32_t id) const { return events_[id]; }
+
+    /**
+     * @brief Get the total number of recorded events
+     */
+    uint64_t event_count() const { return event_count_; }
+
+    /**
+     * @brief Get the first recorded contents of every page, by pfn
+     */
+    const std::unordered_map<uint64_t, const uint8_t*>& pages() const { return pages_; }
+
+    /**
+     * @brief Open a recording
+     *
+     * @param path The path to the file written by Domain::record_events()
+     * @throws NoSuchDomainException if the file does not exist
+     * @throws CommandFailedException if the file cannot be read or is malformed
+     */
+    explicit ReplayLog(const std::string& path);
+
+    ReplayLog(const ReplayLog&) = delete;
+    ReplayLog& operator=(const ReplayLog&) = delete;
+
+    /**
+     * @brief Destroy the instance
+     */
+    ~ReplayLog();
+
+  private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+
+    std::vector<ReplayVcpuRecord> vcpus_;
+    std::vector<std::vector<ReplayEventRecord>> events_;
+    std::unordered_map<uint64_t, const uint8_t*> pages_;
+    uint64_t event_count_ = 0;
+};
+
+/**
+ * @brief Convert recorded registers to the form used by ImageRegisters
+ *
+ * @param regs The recorded registers
+ * @param msrs The MSRs recorded with them
+ * @param state The state to update. Existing MSR values are kept unless they were recorded again.
+ */
+void load_cpu_state(const EventLogRegisters& regs, const std::vector<EventLogMsr>& msrs,
+                    image::ImageCpuState& state);
+
+} // namespace replay
+} // namespace introvirt
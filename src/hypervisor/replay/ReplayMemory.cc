@@ -0,0 +1,125 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ReplayMemory.hh"
+#include "ReplayLog.hh"
+
+#include <introvirt/core/arch/x86/PageDirectory.hh>
+#include <introvirt/core/exception/CommandFailedException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+namespace introvirt {
+namespace replay {
+
+using x86::PageDirectory;
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.replay.ReplayMemory"));
+
+char* ReplayMemory::find(uint64_t pfn, size_t count) const {
+    auto iter = slots_.find(pfn);
+    if (unlikely(iter == slots_.end()))
+        return nullptr;
+
+    const uint64_t slot = iter->second;
+    for (size_t i = 1; i < count; ++i) {
+        auto next = slots_.find(pfn + i);
+        if (next == slots_.end() || next->second != slot + i)
+            return nullptr;
+    }
+    return mapping_ + (slot << PageDirectory::PAGE_SHIFT);
+}
+
+int64_t ReplayMemory::offset(uint64_t pfn) const {
+    auto iter = slots_.find(pfn);
+    if (unlikely(iter == slots_.end()))
+        return -1;
+    return iter->second << PageDirectory::PAGE_SHIFT;
+}
+
+std::vector<PhysicalMemoryRange> ReplayMemory::ranges() const {
+    // Slots are assigned in pfn order, so a run of pfns is also a run in the mapping
+    std::vector<std::pair<uint64_t, uint64_t>> pages(slots_.begin(), slots_.end());
+    std::sort(pages.begin(), pages.end());
+
+    std::vector<PhysicalMemoryRange> result;
+    for (const auto& [pfn, slot] : pages) {
+        const uint64_t address = pfn << PageDirectory::PAGE_SHIFT;
+        if (!result.empty() && result.back().address + result.back().length == address)
+            result.back().length += PageDirectory::PAGE_SIZE;
+        else
+            result.push_back(PhysicalMemoryRange{address, PageDirectory::PAGE_SIZE});
+    }
+    return result;
+}
+
+void ReplayMemory::update(uint64_t pfn, const uint8_t* data) {
+    char* page = find(pfn, 1);
+    if (likely(page != nullptr))
+        std::memcpy(page, data, PageDirectory::PAGE_SIZE);
+}
+
+ReplayMemory::ReplayMemory(const ReplayLog& log) {
+    std::vector<uint64_t> pfns;
+    pfns.reserve(log.pages().size());
+    for (const auto& entry : log.pages())
+        pfns.push_back(entry.first);
+    std::sort(pfns.begin(), pfns.end());
+
+    slots_.reserve(pfns.size());
+    for (uint64_t i = 0; i < pfns.size(); ++i)
+        slots_.emplace(pfns[i], i);
+
+    // mmap() doesn't accept a zero length
+    size_ = std::max<size_t>(pfns.size(), 1) * PageDirectory::PAGE_SIZE;
+
+    fd_ = memfd_create("introvirt-replay", MFD_CLOEXEC);
+    if (fd_ < 0)
+        throw CommandFailedException("Failed to create replay memory", errno);
+
+    if (ftruncate(fd_, size_) != 0) {
+        const int err = errno;
+        close(fd_);
+        throw CommandFailedException("Failed to size replay memory", err);
+    }
+
+    void* mapping = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        const int err = errno;
+        close(fd_);
+        throw CommandFailedException("Failed to map replay memory", err);
+    }
+    mapping_ = static_cast<char*>(mapping);
+
+    for (const auto& [pfn, data] : log.pages())
+        update(pfn, data);
+
+    LOG4CXX_DEBUG(logger, "Loaded " << pfns.size() << " pages");
+}
+
+ReplayMemory::~ReplayMemory() {
+    munmap(mapping_, size_);
+    close(fd_);
+}
+
+} // namespace replay
+} // namespace introvirt
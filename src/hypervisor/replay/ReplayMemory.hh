@@ -0,0 +1,96 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/memory/MemorySnapshot.hh>
+#include <introvirt/util/compiler.hh>
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace introvirt {
+namespace replay {
+
+class ReplayLog;
+
+/**
+ * @brief Guest physical memory rebuilt from the pages in an event recording
+ *
+ * Each recorded page gets a slot in a memfd, in pfn order, and the whole file is mapped once.
+ * Physically contiguous pages that were all recorded are contiguous in the mapping as well.
+ * Writes are shared by every mapping of a page, as they are on a live domain.
+ */
+class ReplayMemory final {
+  public:
+    /**
+     * @brief Get a pointer to a run of pages
+     *
+     * @param pfn The first pfn
+     * @param count The number of pages
+     * @return A pointer into the mapping, or nullptr if the pages aren't all present
+     */
+    char* find(uint64_t pfn, size_t count) const HOT;
+
+    /**
+     * @brief Get the offset of a page in fd()
+     *
+     * @return The offset, or -1 if the page was never recorded
+     */
+    int64_t offset(uint64_t pfn) const HOT;
+
+    /**
+     * @brief Get the runs of physically contiguous pages that were recorded
+     *
+     * @return The runs, sorted by address
+     */
+    std::vector<PhysicalMemoryRange> ranges() const;
+
+    /**
+     * @brief Get the memfd holding the pages
+     */
+    int fd() const { return fd_; }
+
+    /**
+     * @brief Replace the contents of a page
+     */
+    void update(uint64_t pfn, const uint8_t* data);
+
+    /**
+     * @brief Load the first recorded copy of every page
+     *
+     * @param log The recording
+     * @throws CommandFailedException if the memory could not be allocated
+     */
+    explicit ReplayMemory(const ReplayLog& log);
+
+    ReplayMemory(const ReplayMemory&) = delete;
+    ReplayMemory& operator=(const ReplayMemory&) = delete;
+
+    ~ReplayMemory();
+
+  private:
+    int fd_ = -1;
+    char* mapping_ = nullptr;
+    size_t size_ = 0;
+
+    // Slot index by pfn
+    std::unordered_map<uint64_t, uint64_t> slots_;
+};
+
+} // namespace replay
+} // namespace introvirt
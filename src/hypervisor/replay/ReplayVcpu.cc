@@ -0,0 +1,141 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ReplayVcpu.hh"
+#include "ReplayDomain.hh"
+#include "ReplayEvent.hh"
+
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/NotImplementedException.hh>
+
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace introvirt {
+namespace replay {
+
+image::ImageRegisters& ReplayVcpu::registers() { return registers_; }
+const image::ImageRegisters& ReplayVcpu::registers() const { return registers_; }
+
+// There's nothing running to pause
+void ReplayVcpu::pause() {}
+void ReplayVcpu::resume() {}
+
+void ReplayVcpu::intercept_system_calls(bool enabled) { intercept_system_calls_ = enabled; }
+bool ReplayVcpu::intercept_system_calls() const { return intercept_system_calls_; }
+
+void ReplayVcpu::intercept_cr_writes(int cr, bool enabled) { intercept_cr_writes_[cr] = enabled; }
+bool ReplayVcpu::intercept_cr_writes(int cr) const { return intercept_cr_writes_[cr]; }
+
+// The recording already has whatever CR writes were intercepted
+void ReplayVcpu::add_cr_write_intercept_ref(int cr) {}
+void ReplayVcpu::remove_cr_write_intercept_ref(int cr) {}
+
+void ReplayVcpu::system_call_gate(bool open) { system_call_gate_ = open; }
+bool ReplayVcpu::system_call_gate() const { return system_call_gate_; }
+
+void ReplayVcpu::intercept_invlpg(bool enabled) { intercept_invlpg_ = enabled; }
+bool ReplayVcpu::intercept_invlpg() const { return intercept_invlpg_; }
+
+void ReplayVcpu::single_step(bool enabled) { single_step_ = enabled; }
+bool ReplayVcpu::single_step() const { return single_step_; }
+
+void ReplayVcpu::inject_exception(x86::Exception vector) {
+    throw NotImplementedException("Replayed domains do not support exception injection");
+}
+void ReplayVcpu::inject_exception(x86::Exception vector, int64_t error_code) {
+    throw NotImplementedException("Replayed domains do not support exception injection");
+}
+void ReplayVcpu::inject_exception(x86::Exception vector, int64_t error_code, uint64_t cr2) {
+    throw NotImplementedException("Replayed domains do not support exception injection");
+}
+
+void ReplayVcpu::inject_syscall() {
+    throw NotImplementedException("Replayed domains do not support system call injection");
+}
+void ReplayVcpu::inject_sysenter() {
+    throw NotImplementedException("Replayed domains do not support system call injection");
+}
+
+// Register changes only last until the next event is loaded
+void ReplayVcpu::write_registers() {}
+
+std::unique_ptr<Vcpu> ReplayVcpu::clone() const { return std::make_unique<ReplayVcpu>(*this); }
+
+bool ReplayVcpu::handling_event() const { return in_event_; }
+
+int ReplayVcpu::event_fd() const { return efd_; }
+
+std::unique_ptr<HypervisorEvent> ReplayVcpu::event() {
+    uint64_t ready;
+    if (unlikely(::read(efd_, &ready, sizeof(ready)) != sizeof(ready)))
+        return nullptr;
+
+    if (unlikely(next_ >= events_.size()))
+        return nullptr;
+
+    const ReplayEventRecord& record = events_[next_++];
+    domain_.load_pages(record);
+
+    load_cpu_state(record.event.registers, record.msrs, state_);
+    registers_.state(state_);
+
+    in_event_ = true;
+    return std::make_unique<ReplayEvent>(*this, record.event);
+}
+
+// System call returns are hooked by the recording, if they were hooked live
+void ReplayVcpu::syscall_injection_start() {}
+void ReplayVcpu::syscall_injection_end() {}
+
+void ReplayVcpu::os_data(void* data) { os_data_ = data; }
+void* ReplayVcpu::os_data() const { return os_data_; }
+
+void ReplayVcpu::complete_event() {
+    in_event_ = false;
+
+    // Make the next event ready
+    if (next_ < events_.size()) {
+        const uint64_t ready = 1;
+        if (unlikely(::write(efd_, &ready, sizeof(ready)) != sizeof(ready)))
+            throw CommandFailedException("Failed to signal replay eventfd", errno);
+    }
+    domain_.event_completed();
+}
+
+ReplayVcpu::ReplayVcpu(ReplayDomain& domain, uint32_t id, const ReplayLog& log)
+    : VcpuImpl(domain, id), domain_(domain), events_(log.events(id)), registers_(state_) {
+
+    load_cpu_state(log.vcpu(id).vcpu.registers, log.vcpu(id).msrs, state_);
+    registers_.state(state_);
+
+    efd_ = eventfd(events_.empty() ? 0 : 1, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd_ < 0)
+        throw CommandFailedException("Failed to create replay eventfd", errno);
+}
+
+ReplayVcpu::ReplayVcpu(const ReplayVcpu& src)
+    : VcpuImpl(src), domain_(src.domain_), events_(src.events_), next_(src.next_),
+      state_(src.state_), registers_(src.registers_), in_event_(src.in_event_),
+      os_data_(src.os_data_) {}
+
+ReplayVcpu::~ReplayVcpu() {
+    if (efd_ >= 0)
+        close(efd_);
+}
+
+} // namespace replay
+} // namespace introvirt
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "ReplayLog.hh"
+
+#include "core/domain/VcpuImpl.hh"
+#include "hypervisor/image/ImageRegisters.hh"
+
+#include <bitset>
+#include <vector>
+
+namespace introvirt {
+namespace replay {
+
+class ReplayDomain;
+
+/**
+ * @brief Vcpu class for replayed recordings
+ *
+ * Events are handed out one at a time in the order they were recorded, and the next one only
+ * becomes ready once the current one is completed, as on a live vcpu. The registers are loaded
+ * from each event. Intercept and single step settings are accepted and kept, but they don't
+ * change which events are replayed. Anything that would need the guest to run (injection) throws
+ * NotImplementedException.
+ */
+class ReplayVcpu final : public VcpuImpl {
+  public:
+    image::ImageRegisters& registers() override HOT;
+
+    const image::ImageRegisters& registers() const override HOT;
+
+    void pause() override;
+
+    void resume() override;
+
+    void intercept_system_calls(bool enabled) override;
+
+    bool intercept_system_calls() const override;
+
+    void intercept_cr_writes(int cr, bool enabled) override;
+
+    bool intercept_cr_writes(int cr) const override;
+
+    void add_cr_write_intercept_ref(int cr) override;
+
+    void remove_cr_write_intercept_ref(int cr) override;
+
+    void system_call_gate(bool open) override;
+
+    bool system_call_gate() const override;
+
+    void intercept_invlpg(bool enabled) override;
+
+    bool intercept_invlpg() const override;
+
+    void single_step(bool enabled) override;
+
+    bool single_step() const override;
+
+    void inject_exception(x86::Exception vector) override;
+
+    void inject_exception(x86::Exception vector, int64_t error_code) override;
+
+    void inject_exception(x86::Exception vector, int64_t error_code, uint64_t cr2) override;
+
+    void inject_syscall() override;
+    void inject_sysenter() override;
+
+    void write_registers() override;
+
+    std::unique_ptr<Vcpu> clone() const override;
+
+    bool handling_event() const override;
+
+    int event_fd() const override;
+
+    std::unique_ptr<HypervisorEvent> event() override HOT;
+
+    void syscall_injection_start() override;
+    void syscall_injection_end() override;
+
+    void os_data(void* data) override;
+    void* os_data() const override;
+
+    void complete_event() override HOT;
+
+    /**
+     * @brief Construct a new ReplayVcpu object
+     *
+     * @param domain The domain the vcpu belongs to
+     * @param id The identifier of the vcpu
+     * @param log The recording to replay
+     * @throws CommandFailedException if the eventfd could not be created
+     */
+    ReplayVcpu(ReplayDomain& domain, uint32_t id, const ReplayLog& log);
+
+    /**
+     * @brief Copy constructor
+     *
+     * The copy only has the register state, it can't be polled for events.
+     */
+    ReplayVcpu(const ReplayVcpu&);
+
+    /**
+     * @brief Destroy the instance
+     */
+    ~ReplayVcpu() override;
+
+  private:
+    ReplayDomain& domain_;
+    const std::vector<ReplayEventRecord>& events_;
+    size_t next_ = 0;
+    int efd_ = -1;
+
+    // Kept across events so that MSRs that are only recorded at the start stay set
+    image::ImageCpuState state_;
+    image::ImageRegisters registers_;
+
+    bool in_event_ = false;
+    bool intercept_system_calls_ = false;
+    bool system_call_gate_ = true;
+    bool intercept_invlpg_ = false;
+    bool single_step_ = false;
+    std::bitset<16> intercept_cr_writes_;
+    void* os_data_ = nullptr;
+};
+
+} // namespace replay
+} // namespace introvirt
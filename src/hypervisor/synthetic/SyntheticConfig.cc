@@ -0,0 +1,83 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "SyntheticConfig.hh"
+
+#include <introvirt/core/exception/CommandFailedException.hh>
+
+#include <boost/algorithm/string.hpp>
+
+#include <cerrno>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace introvirt {
+namespace synthetic {
+
+SyntheticConfig SyntheticConfig::parse(const std::string& spec) {
+    SyntheticConfig result;
+
+    const std::unordered_map<std::string, std::function<void(uint64_t)>> fields = {
+        {"vcpus", [&](uint64_t v) { result.vcpus = v; }},
+        {"events", [&](uint64_t v) { result.events = v; }},
+        {"rate", [&](uint64_t v) { result.rate = v; }},
+        {"syscall", [&](uint64_t v) { result.syscall_weight = v; }},
+        {"cr", [&](uint64_t v) { result.cr_weight = v; }},
+        {"bp", [&](uint64_t v) { result.bp_weight = v; }},
+        {"mem", [&](uint64_t v) { result.mem_weight = v; }},
+        {"pages", [&](uint64_t v) { result.data_pages = v; }},
+        {"syscalls", [&](uint64_t v) { result.syscalls = v; }},
+        {"seed", [&](uint64_t v) { result.seed = v; }},
+    };
+
+    std::vector<std::string> entries;
+    boost::split(entries, spec, boost::is_any_of(","), boost::token_compress_on);
+    for (auto& entry : entries) {
+        boost::trim(entry);
+        if (entry.empty())
+            continue;
+
+        const auto equals = entry.find('=');
+        if (equals == std::string::npos)
+            throw CommandFailedException("Expected key=value in synthetic domain: " + entry,
+                                         EINVAL);
+
+        const std::string key = boost::trim_copy(entry.substr(0, equals));
+        auto iter = fields.find(key);
+        if (iter == fields.end())
+            throw CommandFailedException("Unknown synthetic domain setting: " + key, EINVAL);
+
+        try {
+            iter->second(std::stoull(entry.substr(equals + 1), nullptr, 0));
+        } catch (std::logic_error&) {
+            throw CommandFailedException("Bad value for synthetic domain setting: " + key, EINVAL);
+        }
+    }
+
+    if (result.vcpus == 0)
+        throw CommandFailedException("Synthetic domain needs at least one vcpu", EINVAL);
+    if (result.data_pages == 0 || result.data_pages > 256)
+        throw CommandFailedException("Synthetic domain pages must be between 1 and 256", EINVAL);
+    if (result.syscalls == 0)
+        throw CommandFailedException("Synthetic domain needs at least one system call", EINVAL);
+    if (result.syscall_weight + result.cr_weight + result.bp_weight + result.mem_weight == 0)
+        throw CommandFailedException("Synthetic domain event weights are all zero", EINVAL);
+
+    return result;
+}
+
+} // namespace synthetic
+} // namespace introvirt
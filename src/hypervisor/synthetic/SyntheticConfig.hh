@@ -0,0 +1,63 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace introvirt {
+namespace synthetic {
+
+/**
+ * @brief Parameters for a synthetic domain
+ *
+ * Parsed from the domain name given to SyntheticHypervisor::attach_domain(), as a comma separated
+ * list of key=value pairs, for example "vcpus=4,events=1000000,syscall=8,cr=1,bp=1".
+ *
+ *   vcpus    Number of vcpus (default 1)
+ *   events   Events to generate on each vcpu (default 100000)
+ *   rate     Events per second on each vcpu, 0 for as fast as they're taken (default 0)
+ *   syscall  Relative weight of EVENT_FAST_SYSCALL (default 1)
+ *   cr       Relative weight of EVENT_CR_WRITE to CR3 (default 0)
+ *   bp       Relative weight of INT3 EVENT_EXCEPTION at code_address() (default 0)
+ *   mem      Relative weight of EVENT_MEM_ACCESS on the data pages (default 0)
+ *   pages    Number of data pages (default 16, at most 256)
+ *   syscalls Number of distinct system call indexes (default 64)
+ *   seed     Seed for the event mix (default 1)
+ */
+struct SyntheticConfig {
+    uint32_t vcpus = 1;
+    uint64_t events = 100000;
+    uint64_t rate = 0;
+    uint32_t syscall_weight = 1;
+    uint32_t cr_weight = 0;
+    uint32_t bp_weight = 0;
+    uint32_t mem_weight = 0;
+    uint32_t data_pages = 16;
+    uint32_t syscalls = 64;
+    uint64_t seed = 1;
+
+    /**
+     * @brief Parse a configuration string
+     *
+     * @param spec The key=value list. Keys that aren't given keep their defaults.
+     * @throws CommandFailedException if the string is malformed
+     */
+    static SyntheticConfig parse(const std::string& spec);
+};
+
+} // namespace synthetic
+} // namespace introvirt
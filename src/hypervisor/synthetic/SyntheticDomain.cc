@@ -0,0 +1,228 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "SyntheticDomain.hh"
+#include "core/memory/PageMapping.hh"
+
+#include <introvirt/core/exception/BadPhysicalAddressException.hh>
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/InvalidVcpuException.hh>
+
+#include <log4cxx/logger.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+namespace introvirt {
+namespace synthetic {
+
+static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("introvirt.synthetic.SyntheticDomain"));
+
+// Present, writable and user accessible
+static constexpr uint64_t PTE_FLAGS = 0x7;
+
+std::string SyntheticDomain::name() const { return name_; }
+
+uint32_t SyntheticDomain::id() const { return 0; }
+
+SyntheticVcpu& SyntheticDomain::vcpu(uint32_t index) {
+    auto const_this = const_cast<const SyntheticDomain*>(this);
+    return const_cast<SyntheticVcpu&>(const_this->vcpu(index));
+}
+
+const SyntheticVcpu& SyntheticDomain::vcpu(uint32_t index) const {
+    if (unlikely(index >= vcpus_.size())) {
+        throw InvalidVcpuException(index);
+    }
+    return *vcpus_[index];
+}
+
+uint32_t SyntheticDomain::vcpu_count() const { return vcpus_.size(); }
+
+// Memory access events are generated whether or not anything is intercepted
+void SyntheticDomain::intercept_mem_access(uint64_t gfn, bool on_read, bool on_write,
+                                           bool on_execute) {}
+
+void SyntheticDomain::intercept_mem_access(const std::vector<MemAccessRange>& ranges) {}
+
+void SyntheticDomain::clear_mem_access_intercepts() {}
+
+void SyntheticDomain::intercept_exception(x86::Exception vector, bool enabled) {
+    if (vector == x86::Exception::INT3)
+        intercept_int3_ = enabled;
+}
+
+bool SyntheticDomain::intercept_exception(x86::Exception vector) const {
+    return vector == x86::Exception::INT3 && intercept_int3_;
+}
+
+void SyntheticDomain::poll(EventCallback& callback) {
+    {
+        std::lock_guard lock(completed_mtx_);
+        polling_ = true;
+    }
+
+    // Stop the pollers once the last event is done
+    std::thread watcher([this] {
+        std::unique_lock lock(completed_mtx_);
+        completed_cv_.wait(lock, [this] { return !polling_ || completed_ == event_count(); });
+        if (polling_) {
+            lock.unlock();
+            LOG4CXX_DEBUG(logger, "Domain " << name_ << ": Generated " << completed_ << " events");
+            interrupt();
+        }
+    });
+
+    auto stop_watcher = [&]() {
+        {
+            std::lock_guard lock(completed_mtx_);
+            polling_ = false;
+        }
+        completed_cv_.notify_all();
+        watcher.join();
+    };
+
+    try {
+        DomainImpl::poll(callback);
+    } catch (...) {
+        stop_watcher();
+        throw;
+    }
+    stop_watcher();
+}
+
+const SyntheticHypervisor& SyntheticDomain::hypervisor() const { return hypervisor_; }
+
+std::vector<PhysicalMemoryRange> SyntheticDomain::physical_memory_ranges() const {
+    return {PhysicalMemoryRange{0, memory_->pages << PageDirectory::PAGE_SHIFT}};
+}
+
+std::shared_ptr<GuestMemoryMapping> SyntheticDomain::map_pfns(const uint64_t* pfns,
+                                                              size_t count) const {
+    return map_guest_pages(
+        pfns, count,
+        [this](uint64_t pfn, size_t count) -> std::shared_ptr<GuestMemoryMapping> {
+            if (unlikely(pfn + count > memory_->pages))
+                return nullptr;
+            return std::make_shared<GuestMemoryMapping>(
+                memory_->base + (pfn << PageDirectory::PAGE_SHIFT),
+                count * PageDirectory::PAGE_SIZE, memory_);
+        },
+        [this](char* address, uint64_t pfn) {
+            const uint64_t gpa = pfn << PageDirectory::PAGE_SHIFT;
+            if (unlikely(pfn >= memory_->pages))
+                throw BadPhysicalAddressException(gpa, EFAULT);
+
+            // Map each page from the memfd so that writes are shared
+            map_fd_page(address, memory_->fd, gpa, PROT_READ | PROT_WRITE, MAP_SHARED, gpa);
+        });
+}
+
+void SyntheticDomain::event_completed() {
+    if (unlikely(completed_.fetch_add(1, std::memory_order_relaxed) + 1 == event_count())) {
+        // Take the lock so the watcher can't miss the wakeup between its check and its wait
+        std::lock_guard lock(completed_mtx_);
+        completed_cv_.notify_all();
+    }
+}
+
+SyntheticDomain::Memory::Memory(uint64_t pages) : pages(pages) {
+    const size_t size = pages * PageDirectory::PAGE_SIZE;
+
+    fd = memfd_create("introvirt-synthetic", MFD_CLOEXEC);
+    if (fd < 0)
+        throw CommandFailedException("Failed to create synthetic memory", errno);
+
+    if (ftruncate(fd, size) != 0) {
+        const int err = errno;
+        close(fd);
+        throw CommandFailedException("Failed to size synthetic memory", err);
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        const int err = errno;
+        close(fd);
+        throw CommandFailedException("Failed to map synthetic memory", err);
+    }
+    base = static_cast<char*>(mapping);
+}
+
+SyntheticDomain::Memory::~Memory() {
+    munmap(base, pages * PageDirectory::PAGE_SIZE);
+    close(fd);
+}
+
+void SyntheticDomain::build_page_tables() {
+    auto table = [this](uint64_t pfn) {
+        return reinterpret_cast<uint64_t*>(memory_->base + (pfn << PageDirectory::PAGE_SHIFT));
+    };
+    auto entry = [](uint64_t pfn) { return (pfn << PageDirectory::PAGE_SHIFT) | PTE_FLAGS; };
+
+    // Every page lives under PML4[0], PDPT[0], PD[2], starting at PT[0]
+    table(PML4_PFN)[(CODE_ADDRESS >> 39) & 0x1FF] = entry(PDPT_PFN);
+    table(PDPT_PFN)[(CODE_ADDRESS >> 30) & 0x1FF] = entry(PD_PFN);
+    table(PD_PFN)[(CODE_ADDRESS >> 21) & 0x1FF] = entry(PT_PFN);
+
+    const uint64_t first = (CODE_ADDRESS >> PageDirectory::PAGE_SHIFT) & 0x1FF;
+    for (uint64_t i = 0; i <= config_.data_pages; ++i)
+        table(PT_PFN)[first + i] = entry(CODE_PFN + i);
+
+    std::memset(table(CODE_PFN), 0x90, PageDirectory::PAGE_SIZE);
+}
+
+SyntheticDomain::SyntheticDomain(const SyntheticHypervisor& hypervisor, const std::string& spec)
+    : hypervisor_(hypervisor), name_(spec), config_(SyntheticConfig::parse(spec)),
+      memory_(std::make_shared<Memory>(CODE_PFN + 1 + config_.data_pages)) {
+
+    build_page_tables();
+
+    // 64-bit user mode with paging on
+    image::ImageCpuState state;
+    state.cr0 = 0x80050033;
+    state.cr3 = PML4_PFN << PageDirectory::PAGE_SHIFT;
+    state.cr4 = 0x6f8;
+    state.efer = 0xd01;
+    state.rflags = 0x202;
+    state.rip = CODE_ADDRESS;
+    state.rsp = data_address() + (config_.data_pages << PageDirectory::PAGE_SHIFT) - 8;
+
+    state.cs.selector = 0x33;
+    state.cs.flags = (0xB << 8) | (1u << 12) | (3u << 13) | (1u << 15) | (1u << 21);
+    state.ss.selector = 0x2b;
+    state.ss.flags = (0x3 << 8) | (1u << 12) | (3u << 13) | (1u << 15) | (1u << 22);
+    state.ds = state.ss;
+    state.es = state.ss;
+
+    for (uint32_t i = 0; i < config_.vcpus; ++i) {
+        vcpus_.emplace_back(std::make_unique<SyntheticVcpu>(*this, i, config_, state));
+    }
+
+    LOG4CXX_DEBUG(logger, "Domain " << name_ << " created with " << vcpus_.size() << " vcpus");
+
+    initialize();
+}
+
+SyntheticDomain::~SyntheticDomain() {
+    // Same teardown order as the live domains
+    reset_guest();
+    vcpus_.clear();
+}
+
+} // namespace synthetic
+} // namespace introvirt
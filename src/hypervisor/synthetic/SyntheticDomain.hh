@@ -0,0 +1,175 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "SyntheticConfig.hh"
+#include "SyntheticHypervisor.hh"
+#include "SyntheticVcpu.hh"
+
+#include "core/domain/DomainImpl.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace introvirt {
+namespace synthetic {
+
+/**
+ * @brief Domain class that generates events instead of running a guest
+ *
+ * Memory is a small set of synthetic 4-level page tables mapping one code page at code_address()
+ * (filled with NOPs, so breakpoints on it can be emulated) and the configured number of data
+ * pages right after it. Every vcpu runs in 64-bit user mode on those page tables. poll() feeds
+ * the generated events through the normal event pipeline and returns once every vcpu has
+ * generated and completed its configured number of events, or when interrupted.
+ *
+ * There is no guest OS to detect, so events are delivered without OS information.
+ */
+class SyntheticDomain final : public DomainImpl {
+  public:
+    std::string name() const override;
+
+    uint32_t id() const override;
+
+    SyntheticVcpu& vcpu(uint32_t index) override;
+
+    const SyntheticVcpu& vcpu(uint32_t index) const override;
+
+    uint32_t vcpu_count() const override;
+
+    void intercept_mem_access(uint64_t gfn, bool on_read, bool on_write, bool on_execute) override;
+
+    void intercept_mem_access(const std::vector<MemAccessRange>& ranges) override;
+
+    void clear_mem_access_intercepts() override;
+
+    void intercept_exception(x86::Exception vector, bool enabled) override;
+
+    bool intercept_exception(x86::Exception vector) const override;
+
+    void poll(EventCallback& callback) override;
+
+    const SyntheticHypervisor& hypervisor() const override;
+
+    std::shared_ptr<GuestMemoryMapping> map_pfns(const uint64_t* pfns,
+                                                 size_t count) const override HOT;
+
+    std::vector<PhysicalMemoryRange> physical_memory_ranges() const override;
+
+    /**
+     * @brief Get the virtual address of the code page
+     *
+     * Breakpoint events are generated with the instruction pointer here.
+     */
+    static constexpr uint64_t code_address() { return CODE_ADDRESS; }
+
+    /**
+     * @brief Get the virtual address of the first data page
+     */
+    static constexpr uint64_t data_address() {
+        return CODE_ADDRESS + x86::PageDirectory::PAGE_SIZE;
+    }
+
+    /**
+     * @brief Get the physical address of the first data page
+     *
+     * Memory access events are generated for addresses in the data pages.
+     */
+    static constexpr uint64_t data_physical_address() {
+        return (CODE_PFN + 1) << x86::PageDirectory::PAGE_SHIFT;
+    }
+
+    /**
+     * @brief Get the configuration the domain was created with
+     */
+    const SyntheticConfig& config() const { return config_; }
+
+    /**
+     * @brief Get the total number of events the vcpus will generate
+     */
+    uint64_t event_count() const { return config_.events * config_.vcpus; }
+
+    /**
+     * @brief Get the number of generated events completed so far
+     */
+    uint64_t completed_events() const { return completed_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Allocate an event id
+     */
+    uint64_t next_event_id() { return next_event_id_.fetch_add(1, std::memory_order_relaxed); }
+
+    /**
+     * @brief Called by the vcpus each time a generated event is completed
+     */
+    void event_completed();
+
+    /**
+     * @brief Create a synthetic domain
+     *
+     * @param hypervisor The hypervisor instance
+     * @param spec The configuration, see SyntheticConfig
+     * @throws CommandFailedException if the configuration is malformed or the memory could not
+     * be allocated
+     */
+    SyntheticDomain(const SyntheticHypervisor& hypervisor, const std::string& spec);
+    ~SyntheticDomain() override;
+
+  private:
+    static constexpr uint64_t CODE_ADDRESS = 0x400000;
+    static constexpr uint64_t PML4_PFN = 1;
+    static constexpr uint64_t PDPT_PFN = 2;
+    static constexpr uint64_t PD_PFN = 3;
+    static constexpr uint64_t PT_PFN = 4;
+    static constexpr uint64_t CODE_PFN = 16;
+
+    // Guest physical memory, shared by every mapping of it
+    struct Memory {
+        int fd = -1;
+        char* base = nullptr;
+        uint64_t pages = 0;
+
+        explicit Memory(uint64_t pages);
+        ~Memory();
+    };
+
+    void build_page_tables();
+
+  private:
+    const SyntheticHypervisor& hypervisor_;
+    const std::string name_;
+    const SyntheticConfig config_;
+
+    // Held by shared_ptr so that GuestMemoryMappings can keep it alive
+    std::shared_ptr<Memory> memory_;
+
+    std::vector<std::unique_ptr<SyntheticVcpu>> vcpus_;
+
+    std::atomic<bool> intercept_int3_ = false;
+    std::atomic<uint64_t> next_event_id_ = 1;
+
+    std::atomic<uint64_t> completed_ = 0;
+    std::mutex completed_mtx_;
+    std::condition_variable completed_cv_;
+    bool polling_ = false;
+};
+
+} // namespace synthetic
+} // namespace introvirt
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "SyntheticVcpu.hh"
+
+#include "core/event/HypervisorEvent.hh"
+
+#include <introvirt/core/domain/Domain.hh>
+
+#include <introvirt/util/compiler.hh>
+
+namespace introvirt {
+namespace synthetic {
+
+/**
+ * @brief The fields of a generated event
+ */
+struct SyntheticEventData {
+    uint64_t id = 0;
+    EventType type = EventType::EVENT_FAST_SYSCALL;
+    FastCallType fastcall_type = FastCallType::FASTCALL_UNKNOWN;
+    uint64_t syscall_return_address = 0;
+    uint64_t cr3 = 0;
+    uint64_t gpa = 0;
+    bool read = false;
+    bool write = false;
+};
+
+class SyntheticEvent final : public HypervisorEvent {
+  public:
+    Vcpu& vcpu() override { return vcpu_; }
+    const Vcpu& vcpu() const override { return vcpu_; }
+
+    Domain& domain() override { return vcpu_.domain(); }
+    const Domain& domain() const override { return vcpu_.domain(); }
+
+    EventType type() const override { return data_.type; }
+
+    FastCallType system_call_type() const override { return data_.fastcall_type; }
+
+    uint64_t syscall_return_address() const override { return data_.syscall_return_address; }
+
+    int control_register() const override { return 3; }
+    uint64_t control_register_value() const override { return data_.cr3; }
+
+    uint64_t msr_index() const override { return 0; }
+    uint64_t msr_value() const override { return 0; }
+
+    x86::Exception exception() const override {
+        return data_.type == EventType::EVENT_EXCEPTION ? x86::Exception::INT3
+                                                        : x86::Exception::UNKNOWN;
+    }
+
+    guest_phys_ptr<void> mem_access_physical_address() const override {
+        return guest_phys_ptr<void>(vcpu_.domain(), data_.gpa);
+    }
+
+    bool mem_access_read() const override { return data_.read; }
+    bool mem_access_write() const override { return data_.write; }
+    bool mem_access_execute() const override { return false; }
+
+    uint64_t invlpg_address() const override { return 0; }
+
+    uint64_t id() const override { return data_.id; }
+
+    void discard(bool value) override { discarded_ = value; }
+
+    SyntheticEvent(SyntheticVcpu& vcpu, const SyntheticEventData& data)
+        : vcpu_(vcpu), data_(data) {}
+
+    ~SyntheticEvent() override {
+        if (likely(!discarded_))
+            vcpu_.complete_event();
+    }
+
+  private:
+    SyntheticVcpu& vcpu_;
+    const SyntheticEventData data_;
+    bool discarded_ = false;
+};
+
+} // namespace synthetic
+} // namespace introvirt
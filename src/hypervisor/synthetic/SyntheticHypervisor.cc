@@ -0,0 +1,55 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "SyntheticHypervisor.hh"
+#include "SyntheticDomain.hh"
+#include "gitversion.h"
+
+#include <introvirt/core/exception/NoSuchDomainException.hh>
+
+namespace introvirt {
+namespace synthetic {
+
+std::unique_ptr<Domain> SyntheticHypervisor::attach_domain(uint32_t domain_id) {
+    throw NoSuchDomainException(domain_id);
+}
+
+std::unique_ptr<Domain> SyntheticHypervisor::attach_domain(const std::string& domain_name) {
+    return std::make_unique<SyntheticDomain>(*this, domain_name);
+}
+
+std::vector<DomainInformation> SyntheticHypervisor::get_running_domains() { return {}; }
+
+std::string SyntheticHypervisor::hypervisor_name() const { return "Synthetic"; }
+
+std::string SyntheticHypervisor::hypervisor_version() const { return "1"; }
+
+std::string SyntheticHypervisor::hypervisor_patch_version() const { return ""; }
+
+std::string SyntheticHypervisor::library_name() const { return "libintrovirt-synthetic"; }
+
+std::string SyntheticHypervisor::library_version() const {
+#ifdef GIT_VERSION
+    return GIT_VERSION;
+#else
+    return "Unknown (Compiled without GIT_VERSION)";
+#endif
+}
+
+SyntheticHypervisor::SyntheticHypervisor() = default;
+SyntheticHypervisor::~SyntheticHypervisor() = default;
+
+} // namespace synthetic
+} // namespace introvirt
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/core/domain/Hypervisor.hh>
+
+#include <string>
+
+namespace introvirt {
+namespace synthetic {
+
+/**
+ * @brief Hypervisor class for synthetic event generators
+ *
+ * Domains are attached by a configuration string (see SyntheticConfig) and generate events
+ * without a guest, for measuring the library's own overhead. Selected by setting the
+ * INTROVIRT_HYPERVISOR environment variable to "synthetic".
+ */
+class SyntheticHypervisor final : public Hypervisor {
+  public:
+    /**
+     * @brief Not supported, synthetic domains do not have numeric ids
+     *
+     * @throws NoSuchDomainException
+     */
+    std::unique_ptr<Domain> attach_domain(uint32_t domain_id) override;
+
+    /**
+     * @brief Create a synthetic domain
+     *
+     * @param domain_name The configuration string, see SyntheticConfig
+     */
+    std::unique_ptr<Domain> attach_domain(const std::string& domain_name) override;
+
+    /**
+     * @brief Synthetic domains are created on demand, so this is always empty
+     */
+    std::vector<DomainInformation> get_running_domains() override;
+
+    std::string hypervisor_name() const override;
+
+    std::string hypervisor_version() const override;
+
+    std::string hypervisor_patch_version() const override;
+
+    std::string library_name() const override;
+
+    std::string library_version() const override;
+
+    /**
+     * @brief Construct a new SyntheticHypervisor object
+     */
+    SyntheticHypervisor();
+
+    /**
+     * @brief Destroy the instance
+     */
+    ~SyntheticHypervisor() override;
+};
+
+} // namespace synthetic
+} // namespace introvirt
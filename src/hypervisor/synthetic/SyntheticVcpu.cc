@@ -0,0 +1,216 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "SyntheticVcpu.hh"
+#include "SyntheticDomain.hh"
+#include "SyntheticEvent.hh"
+
+#include <introvirt/core/exception/CommandFailedException.hh>
+#include <introvirt/core/exception/NotImplementedException.hh>
+
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+namespace introvirt {
+namespace synthetic {
+
+image::ImageRegisters& SyntheticVcpu::registers() { return registers_; }
+const image::ImageRegisters& SyntheticVcpu::registers() const { return registers_; }
+
+void SyntheticVcpu::pause() {
+    std::lock_guard lock(mtx_);
+    ++pause_count_;
+}
+
+void SyntheticVcpu::resume() {
+    std::lock_guard lock(mtx_);
+    if (pause_count_ > 0 && --pause_count_ == 0 && ready_) {
+        ready_ = false;
+        signal();
+    }
+}
+
+void SyntheticVcpu::intercept_system_calls(bool enabled) { intercept_system_calls_ = enabled; }
+bool SyntheticVcpu::intercept_system_calls() const { return intercept_system_calls_; }
+
+void SyntheticVcpu::intercept_cr_writes(int cr, bool enabled) {
+    intercept_cr_writes_[cr] = enabled;
+}
+bool SyntheticVcpu::intercept_cr_writes(int cr) const { return intercept_cr_writes_[cr]; }
+
+// CR writes are generated whether or not they're intercepted, the domain filters them
+void SyntheticVcpu::add_cr_write_intercept_ref(int cr) {}
+void SyntheticVcpu::remove_cr_write_intercept_ref(int cr) {}
+
+void SyntheticVcpu::system_call_gate(bool open) { system_call_gate_ = open; }
+bool SyntheticVcpu::system_call_gate() const { return system_call_gate_; }
+
+void SyntheticVcpu::intercept_invlpg(bool enabled) { intercept_invlpg_ = enabled; }
+bool SyntheticVcpu::intercept_invlpg() const { return intercept_invlpg_; }
+
+void SyntheticVcpu::single_step(bool enabled) { single_step_ = enabled; }
+bool SyntheticVcpu::single_step() const { return single_step_; }
+
+void SyntheticVcpu::inject_exception(x86::Exception vector) {
+    throw NotImplementedException("Synthetic domains do not support exception injection");
+}
+void SyntheticVcpu::inject_exception(x86::Exception vector, int64_t error_code) {
+    throw NotImplementedException("Synthetic domains do not support exception injection");
+}
+void SyntheticVcpu::inject_exception(x86::Exception vector, int64_t error_code, uint64_t cr2) {
+    throw NotImplementedException("Synthetic domains do not support exception injection");
+}
+
+void SyntheticVcpu::inject_syscall() {
+    throw NotImplementedException("Synthetic domains do not support system call injection");
+}
+void SyntheticVcpu::inject_sysenter() {
+    throw NotImplementedException("Synthetic domains do not support system call injection");
+}
+
+// Register changes only live in registers_
+void SyntheticVcpu::write_registers() {}
+
+std::unique_ptr<Vcpu> SyntheticVcpu::clone() const {
+    return std::make_unique<SyntheticVcpu>(*this);
+}
+
+bool SyntheticVcpu::handling_event() const { return in_event_; }
+
+int SyntheticVcpu::event_fd() const { return efd_; }
+
+// xorshift64*, the mix only has to look random
+uint64_t SyntheticVcpu::random() {
+    rng_ ^= rng_ >> 12;
+    rng_ ^= rng_ << 25;
+    rng_ ^= rng_ >> 27;
+    return rng_ * 0x2545f4914f6cdd1dull;
+}
+
+void SyntheticVcpu::signal() {
+    const uint64_t ready = 1;
+    if (unlikely(::write(efd_, &ready, sizeof(ready)) != sizeof(ready)))
+        throw CommandFailedException("Failed to signal synthetic eventfd", errno);
+}
+
+std::unique_ptr<HypervisorEvent> SyntheticVcpu::event() {
+    uint64_t ready;
+    if (unlikely(::read(efd_, &ready, sizeof(ready)) != sizeof(ready)))
+        return nullptr;
+
+    SyntheticEventData data;
+    data.id = domain_.next_event_id();
+
+    if (single_step_) {
+        data.type = EventType::EVENT_SINGLE_STEP;
+        registers_.rip(registers_.rip() + 1);
+        in_event_ = true;
+        counted_ = false;
+        return std::make_unique<SyntheticEvent>(*this, data);
+    }
+
+    if (unlikely(generated_ >= config_.events))
+        return nullptr;
+
+    // Hold back until the event is due
+    if (generated_ == 0)
+        start_ = std::chrono::steady_clock::now();
+    if (config_.rate != 0) {
+        const std::chrono::duration<double> offset(static_cast<double>(generated_) / config_.rate);
+        const auto due =
+            start_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset);
+        if (std::chrono::steady_clock::now() < due)
+            std::this_thread::sleep_until(due);
+    }
+    ++generated_;
+
+    const uint64_t total_weight =
+        config_.syscall_weight + config_.cr_weight + config_.bp_weight + config_.mem_weight;
+    uint64_t pick = random() % total_weight;
+
+    registers_.rip(SyntheticDomain::code_address());
+    if (pick < config_.syscall_weight) {
+        data.type = EventType::EVENT_FAST_SYSCALL;
+        data.fastcall_type = FastCallType::FASTCALL_SYSCALL;
+        data.syscall_return_address = registers_.rip() + 2;
+        registers_.rax(random() % config_.syscalls);
+    } else if ((pick -= config_.syscall_weight) < config_.cr_weight) {
+        data.type = EventType::EVENT_CR_WRITE;
+        data.cr3 = registers_.cr3();
+    } else if ((pick -= config_.cr_weight) < config_.bp_weight) {
+        data.type = EventType::EVENT_EXCEPTION;
+    } else {
+        data.type = EventType::EVENT_MEM_ACCESS;
+        const uint64_t page = random() % config_.data_pages;
+        const uint64_t offset = (random() % x86::PageDirectory::PAGE_SIZE) & ~0x7ull;
+        data.gpa = domain_.data_physical_address() + (page << x86::PageDirectory::PAGE_SHIFT) +
+                   offset;
+        data.write = random() & 1;
+        data.read = !data.write;
+    }
+
+    in_event_ = true;
+    counted_ = true;
+    return std::make_unique<SyntheticEvent>(*this, data);
+}
+
+// There's no live interception for injection to keep on
+void SyntheticVcpu::syscall_injection_start() {}
+void SyntheticVcpu::syscall_injection_end() {}
+
+void SyntheticVcpu::os_data(void* data) { os_data_ = data; }
+void* SyntheticVcpu::os_data() const { return os_data_; }
+
+void SyntheticVcpu::complete_event() {
+    in_event_ = false;
+
+    if (counted_)
+        domain_.event_completed();
+
+    if (generated_ >= config_.events && !single_step_)
+        return;
+
+    // A paused vcpu doesn't run, so it can't cause the next event yet
+    std::lock_guard lock(mtx_);
+    if (pause_count_ > 0)
+        ready_ = true;
+    else
+        signal();
+}
+
+SyntheticVcpu::SyntheticVcpu(SyntheticDomain& domain, uint32_t id, const SyntheticConfig& config,
+                             const image::ImageCpuState& state)
+    : VcpuImpl(domain, id), domain_(domain), config_(config), registers_(state),
+      rng_(config.seed * 0x9e3779b97f4a7c15ull + id + 1) {
+
+    efd_ = eventfd(config_.events != 0 ? 1 : 0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd_ < 0)
+        throw CommandFailedException("Failed to create synthetic eventfd", errno);
+}
+
+SyntheticVcpu::SyntheticVcpu(const SyntheticVcpu& src)
+    : VcpuImpl(src), domain_(src.domain_), config_(src.config_), registers_(src.registers_),
+      generated_(src.generated_), rng_(src.rng_), start_(src.start_), in_event_(src.in_event_),
+      counted_(src.counted_), os_data_(src.os_data_) {}
+
+SyntheticVcpu::~SyntheticVcpu() {
+    if (efd_ >= 0)
+        close(efd_);
+}
+
+} // namespace synthetic
+} // namespace introvirt
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "SyntheticConfig.hh"
+
+#include "core/domain/VcpuImpl.hh"
+#include "hypervisor/image/ImageRegisters.hh"
+
+#include <bitset>
+#include <chrono>
+#include <mutex>
+
+namespace introvirt {
+namespace synthetic {
+
+class SyntheticDomain;
+
+/**
+ * @brief Vcpu class for synthetic domains
+ *
+ * Generates the configured mix of events, one at a time: the next event is only ready once the
+ * current one is completed, and not while the vcpu is paused. When single stepping is enabled,
+ * the next event is an EVENT_SINGLE_STEP one byte further on, which doesn't count towards the
+ * configured number of events. Anything that would need a real guest (injection) throws
+ * NotImplementedException.
+ */
+class SyntheticVcpu final : public VcpuImpl {
+  public:
+    image::ImageRegisters& registers() override HOT;
+
+    const image::ImageRegisters& registers() const override HOT;
+
+    void pause() override;
+
+    void resume() override;
+
+    void intercept_system_calls(bool enabled) override;
+
+    bool intercept_system_calls() const override;
+
+    void intercept_cr_writes(int cr, bool enabled) override;
+
+    bool intercept_cr_writes(int cr) const override;
+
+    void add_cr_write_intercept_ref(int cr) override;
+
+    void remove_cr_write_intercept_ref(int cr) override;
+
+    void system_call_gate(bool open) override;
+
+    bool system_call_gate() const override;
+
+    void intercept_invlpg(bool enabled) override;
+
+    bool intercept_invlpg() const override;
+
+    void single_step(bool enabled) override;
+
+    bool single_step() const override;
+
+    void inject_exception(x86::Exception vector) override;
+
+    void inject_exception(x86::Exception vector, int64_t error_code) override;
+
+    void inject_exception(x86::Exception vector, int64_t error_code, uint64_t cr2) override;
+
+    void inject_syscall() override;
+    void inject_sysenter() override;
+
+    void write_registers() override;
+
+    std::unique_ptr<Vcpu> clone() const override;
+
+    bool handling_event() const override;
+
+    int event_fd() const override;
+
+    std::unique_ptr<HypervisorEvent> event() override HOT;
+
+    void syscall_injection_start() override;
+    void syscall_injection_end() override;
+
+    void os_data(void* data) override;
+    void* os_data() const override;
+
+    void complete_event() override HOT;
+
+    /**
+     * @brief Construct a new SyntheticVcpu object
+     *
+     * @param domain The domain the vcpu belongs to
+     * @param id The identifier of the vcpu
+     * @param config The event mix to generate
+     * @param state The starting register state
+     * @throws CommandFailedException if the eventfd could not be created
+     */
+    SyntheticVcpu(SyntheticDomain& domain, uint32_t id, const SyntheticConfig& config,
+                  const image::ImageCpuState& state);
+
+    /**
+     * @brief Copy constructor
+     *
+     * The copy only has the register state, it can't be polled for events.
+     */
+    SyntheticVcpu(const SyntheticVcpu&);
+
+    /**
+     * @brief Destroy the instance
+     */
+    ~SyntheticVcpu() override;
+
+  private:
+    uint64_t random();
+    void signal();
+
+  private:
+    SyntheticDomain& domain_;
+    const SyntheticConfig& config_;
+    image::ImageRegisters registers_;
+    int efd_ = -1;
+
+    uint64_t generated_ = 0;
+    uint64_t rng_;
+    std::chrono::steady_clock::time_point start_;
+
+    // Guards the paused/ready handoff between pause() and complete_event()
+    std::mutex mtx_;
+    int pause_count_ = 0;
+    bool ready_ = false;
+
+    bool in_event_ = false;
+    bool counted_ = false; // The current event counts towards config_.events
+    bool intercept_system_calls_ = false;
+    bool system_call_gate_ = true;
+    bool intercept_invlpg_ = false;
+    bool single_step_ = false;
+    std::bitset<16> intercept_cr_writes_;
+    void* os_data_ = nullptr;
+};
+
+} // namespace synthetic
+} // namespace introvirt
@@ -26,6 +26,7 @@
 #include <introvirt/core/injection/system_call.hh>
 #include <introvirt/util/compiler.hh>
 #include <introvirt/windows/WindowsGuest.hh>
+#include <introvirt/windows/exception/SymbolNotFoundException.hh>
 #include <introvirt/windows/kernel/nt/NtKernel.hh>
 #include <introvirt/windows/kernel/nt/syscall/NtAllocateVirtualMemory.hh>
 #include <introvirt/windows/kernel/nt/syscall/NtClose.hh>
@@ -33,6 +34,8 @@
 #include <introvirt/windows/kernel/nt/syscall/NtLockVirtualMemory.hh>
 #include <introvirt/windows/kernel/nt/syscall/NtOpenProcess.hh>
 #include <introvirt/windows/kernel/nt/syscall/NtReadVirtualMemory.hh>
+#include <introvirt/windows/kernel/nt/types/HANDLE_TABLE.hh>
+#include <introvirt/windows/kernel/nt/types/HANDLE_TABLE_ENTRY.hh>
 #include <introvirt/windows/kernel/nt/types/KPCR.hh>
 #include <introvirt/windows/kernel/nt/types/MMVAD.hh>
 #include <introvirt/windows/kernel/nt/types/objects/PROCESS.hh>
@@ -43,6 +46,7 @@
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <mutex>
 
 namespace introvirt {
@@ -73,6 +77,16 @@ void WindowsGuestImpl<PtrType>::enable_category(const std::string& category,
     }
 }
 
+// The least time between rebuilds of the process index, which are done in the background
+static constexpr std::chrono::milliseconds ProcessIndexRefreshInterval(100);
+
+static bool owns_directory_table(const nt::PROCESS& process, uint64_t pid, uint64_t cr3) {
+    if (process.UniqueProcessId() != pid)
+        return false;
+    return PageDirectory::directory_table_base(process.DirectoryTableBase()) == cr3 ||
+           PageDirectory::directory_table_base(process.UserDirectoryTableBase()) == cr3;
+}
+
 template <typename PtrType>
 std::unique_ptr<Event>
 WindowsGuestImpl<PtrType>::filter_event(std::unique_ptr<HypervisorEvent>&& hypervisor_event) {
@@ -80,6 +94,154 @@ WindowsGuestImpl<PtrType>::filter_event(std::unique_ptr<HypervisorEvent>&& hyper
     return std::make_unique<WindowsEventImpl>(*this, std::move(hypervisor_event));
 }
 
+template <typename PtrType>
+bool WindowsGuestImpl<PtrType>::prefilter_event(const HypervisorEvent& event,
+                                                const TaskFilter& filter) {
+    // System calls are made from user mode, where CR3 always belongs to the current process.
+    // Anywhere else the kernel may be attached to another process's address space.
+    if (filter.empty() || event.type() != EventType::EVENT_FAST_SYSCALL)
+        return true;
+
+    return match_page_directory(event.vcpu().registers().cr3(), filter).value_or(true);
+}
+
+template <typename PtrType>
+std::optional<bool> WindowsGuestImpl<PtrType>::match_page_directory(uint64_t cr3,
+                                                                    const TaskFilter& filter) {
+    // Don't look up (or start indexing) processes for a filter that lets everything through
+    if (filter.empty())
+        return true;
+
+    SnapshotReadGuard guard;
+    const ProcessIndexEntry* entry = lookup_process(cr3);
+    if (unlikely(!entry))
+        return std::nullopt;
+    return filter.matches_process(entry->address, entry->pid);
+}
+
+template <typename PtrType>
+const typename WindowsGuestImpl<PtrType>::ProcessIndexEntry*
+WindowsGuestImpl<PtrType>::lookup_process(uint64_t cr3) const {
+    cr3 = PageDirectory::directory_table_base(cr3);
+
+    const ProcessIndex* index = process_index_.load();
+    auto iter = index->find(cr3);
+    if (likely(iter != index->end())) {
+        const ProcessIndexEntry& entry = iter->second;
+        if (likely(owns_directory_table(*entry.process, entry.pid, cr3)))
+            return &entry;
+    }
+
+    // Either a new process, or one exited and something else has its page directory now
+    request_process_index();
+    return nullptr;
+}
+
+template <typename PtrType>
+bool WindowsGuestImpl<PtrType>::kva_shadowing() {
+    try {
+        return *guest_ptr<uint8_t>(kernel_->symbol("KiKvaShadow")) != 0;
+    } catch (SymbolNotFoundException&) {
+        // Kernels from before the Meltdown mitigations don't have it
+        return false;
+    } catch (TraceableException& ex) {
+        LOG4CXX_DEBUG(logger, "Failed to read KiKvaShadow, checking the processes: " << ex);
+    }
+
+    // Shadowed processes have a separate user page directory. This isn't called while polling,
+    // so the index can be brought up to date here.
+    build_process_index();
+    SnapshotReadGuard guard;
+    for (const auto& [cr3, entry] : *process_index_.load()) {
+        if (cr3 != PageDirectory::directory_table_base(entry.process->DirectoryTableBase()))
+            return true;
+    }
+    return false;
+}
+
+template <typename PtrType>
+void WindowsGuestImpl<PtrType>::refresh_process_index() {
+    build_process_index();
+}
+
+template <typename PtrType>
+void WindowsGuestImpl<PtrType>::request_process_index() const {
+    {
+        std::lock_guard lock(process_index_mtx_);
+        if (process_index_requested_ || process_index_stopping_)
+            return;
+        process_index_requested_ = true;
+
+        // The thread is only started once something needs the index
+        if (!process_index_thread_.joinable()) {
+            process_index_thread_ = std::thread(&WindowsGuestImpl::process_index_thread, this);
+            return;
+        }
+    }
+    process_index_cv_.notify_one();
+}
+
+template <typename PtrType>
+void WindowsGuestImpl<PtrType>::process_index_thread() const {
+    std::unique_lock lock(process_index_mtx_);
+    while (true) {
+        process_index_cv_.wait(
+            lock, [this] { return process_index_requested_ || process_index_stopping_; });
+        if (process_index_stopping_)
+            break;
+
+        // Misses from while the index is being built ask for another one
+        process_index_requested_ = false;
+        lock.unlock();
+        build_process_index();
+        lock.lock();
+
+        // Misses keep coming until the process shows up, don't rebuild for every one of them
+        process_index_cv_.wait_for(lock, ProcessIndexRefreshInterval,
+                                   [this] { return process_index_stopping_; });
+    }
+}
+
+template <typename PtrType>
+void WindowsGuestImpl<PtrType>::build_process_index() const {
+    std::unique_ptr<const nt::HANDLE_TABLE> cidtable;
+    try {
+        cidtable = kernel_->CidTable();
+    } catch (TraceableException& ex) {
+        LOG4CXX_DEBUG(logger, "Failed to get the CID table for the process index: " << ex);
+        return;
+    }
+
+    auto index = std::make_unique<ProcessIndex>();
+    for (const auto& handle : cidtable->open_handles()) {
+        try {
+            std::unique_ptr<nt::OBJECT_HEADER> header(handle->ObjectHeader());
+            if (header->type() != nt::ObjectType::Process)
+                continue;
+
+            ProcessIndexEntry entry;
+            entry.process = kernel_->process(header->Body());
+            entry.address = entry.process->ptr().address();
+            entry.pid = entry.process->UniqueProcessId();
+
+            // Address space switches load the kernel page directory when KVA shadowing is on
+            const uint64_t kernel_cr3 =
+                PageDirectory::directory_table_base(entry.process->DirectoryTableBase());
+            const uint64_t user_cr3 =
+                PageDirectory::directory_table_base(entry.process->UserDirectoryTableBase());
+            if (user_cr3 != 0 && user_cr3 != kernel_cr3)
+                (*index)[user_cr3] = entry;
+            (*index)[kernel_cr3] = std::move(entry);
+        } catch (TraceableException& ex) {
+            // The process may be exiting while we read it
+            LOG4CXX_TRACE(logger, "Skipping CID table entry: " << ex);
+        }
+    }
+
+    LOG4CXX_DEBUG(logger, "Process index rebuilt with " << index->size() << " page directories");
+    process_index_.store(std::move(index));
+}
+
 template <typename PtrType>
 template <typename PteType>
 GuestPageFaultResult WindowsGuestImpl<PtrType>::handle_prototype_pte(uint64_t prototype_address,
@@ -156,12 +318,25 @@ GuestPageFaultResult WindowsGuestImpl<PtrType>::handle_page_fault_mmvad(uint64_t
         return GuestPageFaultResult::FAILURE;
     }
 
-    // TODO: This all feels hacky
-    auto& event = ThreadLocalEvent::get();
-    const Vcpu& vcpu = event.vcpu();
-    const auto* process = reinterpret_cast<const nt::PROCESS*>(vcpu.os_data());
+    // The VAD tree only describes the address space of the process it belongs to. The event's
+    // process is used if it owns the page directory, otherwise the owner is looked up in the
+    // process index, so that walks made outside of an event (such as ivprocmemdump's scan)
+    // resolve too once the index has the process. refresh_process_index() makes sure of that.
+    const uint64_t cr3 = PageDirectory::directory_table_base(page_directory);
+    const nt::PROCESS* process = nullptr;
+    if (ThreadLocalEvent::active()) {
+        process = reinterpret_cast<const nt::PROCESS*>(ThreadLocalEvent::get().vcpu().os_data());
+        if (process && !owns_directory_table(*process, process->UniqueProcessId(), cr3))
+            process = nullptr;
+    }
+
+    // Keeps the index entry alive for the rest of the walk
+    SnapshotReadGuard guard;
     if (!process) {
-        return GuestPageFaultResult::FAILURE;
+        const ProcessIndexEntry* owner = lookup_process(cr3);
+        if (!owner)
+            return GuestPageFaultResult::FAILURE;
+        process = owner->process.get();
     }
 
     auto vadroot = process->VadRoot();
@@ -349,7 +524,8 @@ GuestPageFaultResult WindowsGuestImpl<PtrType>::handle_page_fault(uint64_t virtu
                                                                   uint64_t page_directory,
                                                                   uint64_t& pte) const {
 
-    if (unlikely(!ThreadLocalEvent::active()))
+    // The PTE layouts aren't known until the kernel has been bootstrapped
+    if (unlikely(mmpte_transition_ == nullptr))
         return GuestPageFaultResult::FAILURE;
 
     if (unlikely(PageFaultDepth > 50)) {
@@ -538,6 +714,21 @@ WindowsGuestImpl<PtrType>::WindowsGuestImpl(Domain& domain) : domain_(&domain) {
     domain.resume();
 }
 
+template <typename PtrType>
+WindowsGuestImpl<PtrType>::~WindowsGuestImpl() {
+    {
+        std::lock_guard lock(process_index_mtx_);
+        process_index_stopping_ = true;
+    }
+    process_index_cv_.notify_all();
+    if (process_index_thread_.joinable())
+        process_index_thread_.join();
+
+    // The retired indexes hold processes that read through this guest
+    process_index_.store(std::make_unique<const ProcessIndex>());
+    SnapshotEpoch::synchronize();
+}
+
 template class WindowsGuestImpl<uint32_t>;
 template class WindowsGuestImpl<uint64_t>;
 
@@ -16,12 +16,18 @@
 #pragma once
 
 #include "core/domain/GuestImpl.hh"
+#include "core/util/AtomicSnapshot.hh"
 #include "windows/kernel/nt/NtKernelImpl.hh"
 #include "windows/kernel/nt/structs/structs.hh"
 
 #include <introvirt/windows/WindowsGuest.hh>
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <optional>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 namespace introvirt {
@@ -32,6 +38,12 @@ class WindowsGuestImpl final : public WindowsGuest, public GuestImpl {
   public:
     std::unique_ptr<Event> filter_event(std::unique_ptr<HypervisorEvent>&& event) override;
 
+    bool prefilter_event(const HypervisorEvent& event, const TaskFilter& filter) override;
+
+    std::optional<bool> match_page_directory(uint64_t cr3, const TaskFilter& filter) override;
+
+    bool kva_shadowing() override;
+
     OS os() const override;
 
     bool x64() const override;
@@ -54,6 +66,8 @@ class WindowsGuestImpl final : public WindowsGuest, public GuestImpl {
 
     void enable_category(const std::string& category, SystemCallFilter& filter) const override;
 
+    void refresh_process_index() override;
+
     guest_ptr<void> allocate(size_t& region_size, bool executable = false) override;
     void guest_free(const guest_ptr<void>& ptr, size_t region_size) override;
 
@@ -66,6 +80,7 @@ class WindowsGuestImpl final : public WindowsGuest, public GuestImpl {
     }
 
     WindowsGuestImpl(Domain& domain);
+    ~WindowsGuestImpl() override;
 
   private:
     static constexpr bool is64Bit() { return sizeof(PtrType) == sizeof(uint64_t); }
@@ -84,6 +99,43 @@ class WindowsGuestImpl final : public WindowsGuest, public GuestImpl {
 
     bool page_in(Event& event, uint64_t virtual_address) override;
 
+    /*
+     * Maps the page directories of every process to the process, so that the task filter can be
+     * checked without parsing the KPCR and thread, and so that the page fault handler can find
+     * the VADs of an address space without an event. With KVA shadowing, both the user and
+     * kernel page directories are indexed.
+     *
+     * The index is an immutable snapshot of the kernel's CID table, published through an
+     * AtomicSnapshot so that lookups take no lock. lookup_process() returns an entry of the
+     * snapshot, so the caller must hold a SnapshotReadGuard for as long as it uses the entry. An
+     * entry is only trusted if the process still has the same PID and page directory. When a page directory isn't found or fails that check, which
+     * is how process creation and exit are picked up, the lookup reports the owner as unknown and
+     * wakes a background thread to rebuild the index. Walking the CID table reads every process,
+     * so it's never done on the thread that looked up the page directory. The thread is started
+     * by the first miss, so the index costs nothing unless a task filter or the page fault
+     * handler needs it.
+     */
+    struct ProcessIndexEntry {
+        std::shared_ptr<nt::PROCESS> process;
+        uint64_t address;
+        uint64_t pid;
+    };
+    using ProcessIndex = std::unordered_map<uint64_t, ProcessIndexEntry>;
+
+    const ProcessIndexEntry* lookup_process(uint64_t cr3) const;
+    void request_process_index() const;
+    void build_process_index() const;
+    void process_index_thread() const;
+
+    mutable AtomicSnapshot<ProcessIndex> process_index_{std::make_unique<const ProcessIndex>()};
+
+    // Wakes the rebuild thread; the flags are guarded by process_index_mtx_
+    mutable std::mutex process_index_mtx_;
+    mutable std::condition_variable process_index_cv_;
+    mutable bool process_index_requested_ = false;
+    bool process_index_stopping_ = false;
+    mutable std::thread process_index_thread_;
+
     const nt::structs::MMPTE_HARDWARE* mmpte_hardware_ = nullptr;
     const nt::structs::MMPTE_PROTOTYPE* mmpte_prototype_ = nullptr;
     const nt::structs::MMPTE_SOFTWARE* mmpte_software_ = nullptr;
@@ -16,6 +16,8 @@
 #include <introvirt/windows/event/WindowsEventTaskInformation.hh>
 
 #include <introvirt/windows/kernel/nt/types/KPCR.hh>
+#include <introvirt/windows/kernel/nt/types/objects/PROCESS.hh>
+#include <introvirt/windows/kernel/nt/types/objects/THREAD.hh>
 
 namespace introvirt {
 namespace windows {
@@ -26,6 +28,12 @@ uint64_t WindowsEventTaskInformation::tid() const { return kpcr_.tid(); }
 
 std::string WindowsEventTaskInformation::process_name() const { return kpcr_.process_name(); }
 
+uint64_t WindowsEventTaskInformation::process_address() const {
+    if (kpcr_.idle())
+        return 0;
+    return kpcr_.CurrentThread().Process().ptr().address();
+}
+
 nt::KPCR& WindowsEventTaskInformation::pcr() { return kpcr_; }
 
 const nt::KPCR& WindowsEventTaskInformation::pcr() const { return kpcr_; }
@@ -376,61 +376,64 @@ NtKernelImpl<PtrType>::NtKernelImpl(WindowsGuest& guest) : guest_(guest) {
      * MSR_LSTAR is for 64-bit and MSR_IA32_SYSENTER_EIP is for 32-bit.
      */
     const auto& registers = vcpu->registers();
-    guest_ptr<uint16_t> search_ptr(*vcpu, std::max(registers.msr(x86::Msr::MSR_LSTAR),
-                                                   registers.msr(x86::Msr::MSR_IA32_SYSENTER_EIP)) &
-                                              PageDirectory::PAGE_MASK);
+    const uint64_t search_start = std::max(registers.msr(x86::Msr::MSR_LSTAR),
+                                           registers.msr(x86::Msr::MSR_IA32_SYSENTER_EIP)) &
+                                  PageDirectory::PAGE_MASK;
 
-    LOG4CXX_DEBUG(logger, "Starting NT kernel search at address " << search_ptr);
+    LOG4CXX_DEBUG(logger, "Starting NT kernel search at address 0x" << std::hex << search_start);
 
     /*
      * TODO: Sometimes this fails. I think the processor is in usermode at the time, and
      *       spectre/meltdown protection is on, so the page tables don't map the kernel.
      */
     // Go down one page at a time and look for the MZ header
+    // Most pages in the range aren't mapped, so use try_reset() to skip them without throwing
     static const uint64_t MaxRange = 0x1000000;
-    const uint64_t search_bottom = search_ptr.address() - MaxRange;
-    while (search_ptr.address() > search_bottom) {
+    const uint64_t search_bottom = search_start - MaxRange;
+    guest_ptr<uint16_t> search_ptr;
+    for (uint64_t address = search_start; address > search_bottom;
+         address -= PageDirectory::PAGE_SIZE) {
+        if (!search_ptr.try_reset(*vcpu, address))
+            continue;
+
+        if (likely(*search_ptr != 0x5a4D)) // "MZ"
+            continue;
+
+        LOG4CXX_DEBUG(logger, "Found MZ at " << search_ptr);
         try {
-            if (unlikely(*search_ptr == 0x5a4D)) { // "MZ"
-                LOG4CXX_DEBUG(logger, "Found MZ at " << search_ptr);
-                try {
-                    /*
-                     * Parse the PE of the image and make sure it's one we're expecting
-                     */
-                    static const std::set<std::string> ValidKernelNames{
-                        "ntkrnlmp.pdb", "ntkrnlpa.pdb", "ntoskrnl.pdb", "ntkrpamp.pdb"};
-                    pe_.emplace(search_ptr);
-
-                    const auto* debug_directory = pe_->optional_header().debug_directory();
-
-                    if (!debug_directory ||
-                        debug_directory->Type() != pe::ImageDebugType::IMAGE_DEBUG_TYPE_CODEVIEW) {
-                        LOG4CXX_DEBUG(logger, "Missing IMAGE_DEBUG_DIRECTORY, continuing scan...");
-                        search_ptr -= PageDirectory::PAGE_SIZE / sizeof(uint16_t);
-                        continue;
-                    }
-
-                    const auto* cv_data = debug_directory->codeview_data();
-
-                    const std::string pdb_filename = cv_data->PdbFileName();
-                    if (ValidKernelNames.count(pdb_filename) == 0) {
-                        LOG4CXX_DEBUG(logger, "Incorrect PDB file name: " << pdb_filename);
-                        search_ptr -= PageDirectory::PAGE_SIZE / sizeof(uint16_t);
-                        continue; // Try again
-                    }
-
-                    LOG4CXX_DEBUG(logger, "Found PDB Filename: " << pdb_filename);
-                    break;
-                } catch (pe::PeException& ex) {
-                    LOG4CXX_DEBUG(logger, "Failed to parse PE at " + to_string(search_ptr));
-                } catch (VirtualAddressNotPresentException& ex) {
-                    LOG4CXX_DEBUG(logger, ex.what());
-                }
+            /*
+             * Parse the PE of the image and make sure it's one we're expecting
+             */
+            static const std::set<std::string> ValidKernelNames{"ntkrnlmp.pdb", "ntkrnlpa.pdb",
+                                                                "ntoskrnl.pdb", "ntkrpamp.pdb"};
+            pe_.emplace(search_ptr);
+
+            const auto* debug_directory = pe_->optional_header().debug_directory();
+
+            if (!debug_directory ||
+                debug_directory->Type() != pe::ImageDebugType::IMAGE_DEBUG_TYPE_CODEVIEW) {
+                LOG4CXX_DEBUG(logger, "Missing IMAGE_DEBUG_DIRECTORY, continuing scan...");
+                pe_.reset();
+                continue;
             }
-            search_ptr -= PageDirectory::PAGE_SIZE / sizeof(uint16_t);
+
+            const auto* cv_data = debug_directory->codeview_data();
+
+            const std::string pdb_filename = cv_data->PdbFileName();
+            if (ValidKernelNames.count(pdb_filename) == 0) {
+                LOG4CXX_DEBUG(logger, "Incorrect PDB file name: " << pdb_filename);
+                pe_.reset();
+                continue; // Try again
+            }
+
+            LOG4CXX_DEBUG(logger, "Found PDB Filename: " << pdb_filename);
+            break;
+        } catch (pe::PeException& ex) {
+            LOG4CXX_DEBUG(logger, "Failed to parse PE at " + to_string(search_ptr));
         } catch (VirtualAddressNotPresentException& ex) {
             LOG4CXX_DEBUG(logger, ex.what());
         }
+        pe_.reset();
     }
 
     if (!pe_)
@@ -583,6 +586,12 @@ NtKernelImpl<PtrType>::NtKernelImpl(WindowsGuest& guest) : guest_(guest) {
         if (header->type() == ObjectType::Process) {
             try {
                 auto process = PROCESS::make_shared(*this, std::move(header));
+
+                // Skip processes that don't have the table mapped without throwing
+                if (!domain.page_directory().try_translate(
+                        pKeServiceDescriptorTableShadow.address(), process->DirectoryTableBase()))
+                    continue;
+
                 pKeServiceDescriptorTableShadow.reset(domain,
                                                       pKeServiceDescriptorTableShadow.address(),
                                                       process->DirectoryTableBase());
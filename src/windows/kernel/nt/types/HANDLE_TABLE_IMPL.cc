@@ -17,7 +17,6 @@
 #include "HANDLE_TABLE_ENTRY_IMPL.hh"
 #include "windows/kernel/nt/NtKernelImpl.hh"
 
-#include <introvirt/core/exception/VirtualAddressNotPresentException.hh>
 #include <introvirt/windows/WindowsGuest.hh>
 #include <introvirt/windows/kernel/nt/NtKernel.hh>
 #include <introvirt/windows/kernel/nt/const/ObjectType.hh>
@@ -373,19 +372,23 @@ void HANDLE_TABLE_IMPL<PtrType>::parse_open_handles_l1(
     constexpr unsigned int MaxCount = PageDirectory::PAGE_SIZE / sizeof(PtrType);
     guest_ptr<void*[], PtrType> entries(TableAddress, MaxCount);
     for (unsigned int i = 0; i < MaxCount; ++i) {
-        try {
-            guest_ptr<void> entry = entries[i];
-            if (entry) {
-                constexpr unsigned int Shift = (std::is_same_v<uint64_t, PtrType> ? 10 : 11);
-                parse_open_handles_l0(entry, handles, i << Shift);
-            }
-        } catch (VirtualAddressNotPresentException& ex) {
+        guest_ptr<void> entry = entries[i];
+        if (!entry)
+            continue;
+
+        // Each level 0 table is a single page
+        if (!entry.domain().page_directory().try_translate(entry.address(),
+                                                           entry.page_directory())) {
             /*
              * Note: This seems to be legitimate sometimes.
              *       WinDbg is also unable to read any handle information for a process.
              */
             LOG4CXX_DEBUG(logger, "Could not read handle data");
+            continue;
         }
+
+        constexpr unsigned int Shift = (std::is_same_v<uint64_t, PtrType> ? 10 : 11);
+        parse_open_handles_l0(entry, handles, i << Shift);
     }
 }
 
@@ -425,9 +428,10 @@ HANDLE_TABLE_IMPL<PtrType>::open_handles() const {
     else if (TableLevel == 1)
         parse_open_handles_l1(TableAddress, result);
     else if (TableLevel == 0) {
-        try {
+        if (TableAddress.domain().page_directory().try_translate(TableAddress.address(),
+                                                                 TableAddress.page_directory())) {
             parse_open_handles_l0(TableAddress, result);
-        } catch (VirtualAddressNotPresentException& ex) {
+        } else {
             /*
              * Note: This seems to be legitimate sometimes.
              *       WinDbg is also unable to read any handle information for a process.
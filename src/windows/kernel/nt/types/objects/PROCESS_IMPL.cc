@@ -28,7 +28,6 @@
 #include <introvirt/windows/util/WindowsTime.hh>
 
 #include <introvirt/core/domain/Vcpu.hh>
-#include <introvirt/core/exception/VirtualAddressNotPresentException.hh>
 
 #include <algorithm>
 #include <cstring>
@@ -235,11 +234,13 @@ const PEB* PROCESS_IMPL<PtrType>::WoW64Process() const {
             const auto pWoW64Process =
                 this->ptr_.clone(eprocess_->Wow64Process.get<PtrType>(buffer_));
             if (pWoW64Process) {
-                try {
-                    const auto pPeb32 = this->ptr_.clone(*guest_ptr<uint64_t>(pWoW64Process));
+                guest_ptr<uint64_t> ppPeb32;
+                if (ppPeb32.try_reset(pWoW64Process.domain(), pWoW64Process.address(),
+                                      pWoW64Process.page_directory())) {
+                    const auto pPeb32 = this->ptr_.clone(*ppPeb32);
                     if (pPeb32)
                         WoW64Process_.emplace(pPeb32);
-                } catch (VirtualAddressNotPresentException& ex) {
+                } else {
                     // Older version of Windows point directly to the WoW64Process
                     WoW64Process_.emplace(pWoW64Process);
                 }
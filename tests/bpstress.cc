@@ -0,0 +1,207 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "core/breakpoint/BreakpointImpl.hh"
+#include "core/breakpoint/BreakpointManager.hh"
+#include "core/domain/DomainImpl.hh"
+
+#include <introvirt/introvirt.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace introvirt;
+
+/*
+ * Stress test for concurrent breakpoint handling. Breakpoints are installed on many sites spread
+ * over several physical pages, and each thread (standing in for a vcpu) repeatedly looks up and
+ * delivers hits the way BreakpointManager does for an INT3, while another thread keeps adding and
+ * removing breakpoints. Reports the hit rate for 1 up to the requested number of threads.
+ *
+ * With --serialized, every hit also takes one global lock, the way DomainImpl used to hold
+ * bp_mutex_ for all breakpoint handling.
+ *
+ * Breakpoint bytes are written into guest memory, so this only runs against a generated synthetic
+ * domain (INTROVIRT_HYPERVISOR=synthetic). The sites are placed at the end of its memory.
+ */
+
+/*
+ * Breakpoint callbacks only need something to pass along. Delivery reads CR3 from the vcpu to
+ * match scoped breakpoints, so the synthetic domain's first vcpu is handed out.
+ */
+class StressEvent final : public Event {
+  public:
+    Vcpu& vcpu() override { return domain_.vcpu(0); }
+    const Vcpu& vcpu() const override { return domain_.vcpu(0); }
+    Domain& domain() override { return domain_; }
+    const Domain& domain() const override { return domain_; }
+    EventType type() const override { return EventType::EVENT_EXCEPTION; }
+    SystemCallEvent& syscall() override { throw NotImplementedException("syscall"); }
+    const SystemCallEvent& syscall() const override { throw NotImplementedException("syscall"); }
+    ControlRegisterEvent& cr() override { throw NotImplementedException("cr"); }
+    const ControlRegisterEvent& cr() const override { throw NotImplementedException("cr"); }
+    MsrAccessEvent& msr() override { throw NotImplementedException("msr"); }
+    const MsrAccessEvent& msr() const override { throw NotImplementedException("msr"); }
+    ExceptionEvent& exception() override { throw NotImplementedException("exception"); }
+    const ExceptionEvent& exception() const override {
+        throw NotImplementedException("exception");
+    }
+    MemAccessEvent& mem_access() override { throw NotImplementedException("mem_access"); }
+    const MemAccessEvent& mem_access() const override {
+        throw NotImplementedException("mem_access");
+    }
+    EventTaskInformation& task() override { throw NotImplementedException("task"); }
+    const EventTaskInformation& task() const override { throw NotImplementedException("task"); }
+    OS os_type() const override { return OS::Unknown; }
+    Json::Value json() const override { return Json::Value(); }
+    uint64_t id() const override { return 0; }
+    EventImpl& impl() override { throw NotImplementedException("impl"); }
+
+    StressEvent(Domain& domain) : domain_(domain) {}
+
+  private:
+    Domain& domain_;
+};
+
+static constexpr uint64_t SITE_STRIDE = 0x40;
+
+// The churn thread also uses a page past the last site
+static constexpr uint32_t EXTRA_SITE_OFFSET = 0x100;
+
+static uint64_t site_base = 0;
+
+static uint64_t site_address(uint32_t site) { return site_base + site * SITE_STRIDE; }
+
+static double run(DomainImpl& domain, int threads, uint32_t sites, double seconds,
+                  bool serialized) {
+    auto& manager = domain.breakpoint_manager();
+    std::recursive_mutex global_mutex;
+    std::atomic<bool> stop = false;
+
+    // Keep adding and removing breakpoints, both on existing sites and on a page of its own
+    std::thread churn([&]() {
+        uint32_t site = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            auto extra =
+                std::make_shared<BreakpointImpl>(domain, site_address(site), [](Event&) {});
+            manager.add_ref(extra);
+            auto fresh = std::make_shared<BreakpointImpl>(
+                domain, site_address(sites + EXTRA_SITE_OFFSET), [](Event&) {});
+            manager.add_ref(fresh);
+            site = (site + 1) % sites;
+        }
+    });
+
+    std::vector<uint64_t> hits(threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back([&, i]() {
+            StressEvent event(domain);
+            const auto end = std::chrono::steady_clock::now() +
+                             std::chrono::duration<double>(seconds);
+            uint32_t site = i * 7919;
+            uint64_t count = 0;
+            while ((count & 0xFF) != 0 || std::chrono::steady_clock::now() < end) {
+                site = (site + 1) % sites;
+                std::unique_lock<std::recursive_mutex> lock;
+                if (serialized)
+                    lock = std::unique_lock(global_mutex);
+                auto entry = manager.find(site_address(site));
+                if (entry)
+                    entry->deliver_breakpoint(event);
+                ++count;
+            }
+            hits[i] = count;
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+
+    stop = true;
+    churn.join();
+
+    uint64_t total = 0;
+    for (uint64_t count : hits)
+        total += count;
+    return total / seconds;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> args;
+    bool serialized = false;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == std::string("--serialized"))
+            serialized = true;
+        else
+            args.push_back(argv[i]);
+    }
+
+    if (args.size() > 3 || (!args.empty() && !std::isdigit(args[0][0]))) {
+        cerr << "Usage: " << argv[0] << " [--serialized] [max threads] [sites] [seconds per run]\n";
+        return 1;
+    }
+    const int max_threads =
+        (args.size() > 0) ? std::stoi(args[0]) : std::thread::hardware_concurrency();
+    const uint32_t sites = (args.size() > 1) ? std::stoul(args[1]) : 1024;
+    const double seconds = (args.size() > 2) ? std::stod(args[2]) : 1.0;
+
+    setenv("INTROVIRT_HYPERVISOR", "synthetic", 0);
+    auto hypervisor = Hypervisor::instance();
+    if (hypervisor->hypervisor_name() != "Synthetic") {
+        cerr << "Refusing to patch breakpoints into a live guest, use "
+                "INTROVIRT_HYPERVISOR=synthetic\n";
+        return 1;
+    }
+
+    std::unique_ptr<Domain> d = hypervisor->attach_domain("events=0,pages=256");
+    auto& domain = static_cast<DomainImpl&>(*d);
+
+    const uint64_t span = (sites + EXTRA_SITE_OFFSET + 1) * SITE_STRIDE;
+    const auto ranges = d->physical_memory_ranges();
+    if (ranges.empty() || ranges.back().length < span) {
+        cerr << "Too many sites for the synthetic domain's memory\n";
+        return 1;
+    }
+    site_base = (ranges.back().address + ranges.back().length - span) & PageDirectory::PAGE_MASK;
+
+    BreakpointManager::BreakpointList breakpoints;
+    for (uint32_t site = 0; site < sites; ++site) {
+        breakpoints.push_back(
+            std::make_shared<BreakpointImpl>(domain, site_address(site), [](Event&) {}));
+    }
+    domain.breakpoint_manager().add_refs(breakpoints);
+
+    cout << sites << " sites on " << (sites * SITE_STRIDE + PageDirectory::PAGE_SIZE - 1) /
+                                         PageDirectory::PAGE_SIZE
+         << " pages" << (serialized ? ", serialized" : "") << '\n';
+    for (int threads = 1; threads <= max_threads;
+         threads = (threads < max_threads) ? std::min(threads * 2, max_threads) : threads + 1) {
+        const double rate = run(domain, threads, sites, seconds, serialized);
+        cout << "Threads: " << threads << "  " << static_cast<uint64_t>(rate) << " hits/s  "
+             << static_cast<uint64_t>(rate / threads) << " hits/s/thread\n";
+    }
+
+    breakpoints.clear();
+    return 0;
+}
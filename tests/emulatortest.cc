@@ -0,0 +1,307 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "core/arch/x86/InstructionEmulator.hh"
+#include "hypervisor/image/ImageRegisters.hh"
+
+#include <introvirt/introvirt.hh>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace introvirt;
+
+/*
+ * Checks InstructionEmulator against a generated synthetic domain (INTROVIRT_HYPERVISOR=synthetic),
+ * which supplies the page tables and the stack. Decoding is checked against known instruction
+ * lengths, and execution against the expected registers and memory. Stores must only complete
+ * when the processor would do them without a fault and without setting the accessed or dirty
+ * bits, so each leaf PTE bit is cleared in turn and the store must be refused. Accesses to pages
+ * with a watchpoint or write tracker must be refused as well, as must CALL and RET while CET is
+ * enabled, since they would leave the shadow stack out of sync.
+ *
+ * Returns non-zero if any check fails.
+ */
+
+static constexpr uint64_t PTE_WRITABLE = 1ull << 1;
+static constexpr uint64_t PTE_USER = 1ull << 2;
+static constexpr uint64_t PTE_ACCESSED = 1ull << 5;
+static constexpr uint64_t PTE_DIRTY = 1ull << 6;
+static constexpr uint64_t CR4_CET = 1ull << 23;
+
+static int failures = 0;
+
+static void check(bool condition, const string& what) {
+    if (!condition) {
+        cerr << "FAILED: " << what << '\n';
+        ++failures;
+    }
+}
+
+/*
+ * Set and clear bits in the page table entries mapping an address. The accessed bit is applied
+ * at every level, everything else only on the leaf.
+ */
+static void update_ptes(Domain& domain, uint64_t cr3, uint64_t address, uint64_t set,
+                        uint64_t clear) {
+    uint64_t table = PageDirectory::directory_table_base(cr3);
+    for (int level = 4; level > 0; --level) {
+        const uint64_t index = (address >> (PageDirectory::PAGE_SHIFT + 9 * (level - 1))) & 0x1FF;
+        guest_phys_ptr<uint64_t> pte(domain, table + index * sizeof(uint64_t));
+        uint64_t value = *pte;
+        if (level == 1) {
+            value = (value | set) & ~clear;
+        } else {
+            value = (value | (set & PTE_ACCESSED)) & ~(clear & PTE_ACCESSED);
+        }
+        *pte = value;
+        table = value & 0x000FFFFFFFFFF000ull;
+    }
+}
+
+static uint64_t read_stack(Vcpu& vcpu, uint64_t address) {
+    return *guest_ptr<uint64_t>(vcpu, address);
+}
+
+static void write_stack(Vcpu& vcpu, uint64_t address, uint64_t value) {
+    *guest_ptr<uint64_t>(vcpu, address) = value;
+}
+
+static void test_decode() {
+    struct DecodeCase {
+        vector<uint8_t> bytes;
+        bool supported;
+        uint8_t length;
+        const char* name;
+    };
+    const vector<DecodeCase> cases = {
+        {{0x90}, true, 1, "nop"},
+        {{0x0F, 0x1F, 0x44, 0x00, 0x00}, true, 5, "nop dword [rax+rax]"},
+        {{0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00}, true, 6, "nop word [rax+rax]"},
+        {{0x48, 0x89, 0xD8}, true, 3, "mov rax, rbx"},
+        {{0x48, 0x8B, 0x44, 0x24, 0x08}, true, 5, "mov rax, [rsp+8]"},
+        {{0x48, 0x89, 0x44, 0x24, 0x08}, true, 5, "mov [rsp+8], rax"},
+        {{0x48, 0xB8, 1, 2, 3, 4, 5, 6, 7, 8}, true, 10, "mov rax, imm64"},
+        {{0x48, 0x8D, 0x44, 0x24, 0x10}, true, 5, "lea rax, [rsp+0x10]"},
+        {{0x48, 0x83, 0xC0, 0x01}, true, 4, "add rax, 1"},
+        {{0x31, 0xC0}, true, 2, "xor eax, eax"},
+        {{0x50}, true, 1, "push rax"},
+        {{0x41, 0x50}, true, 2, "push r8"},
+        {{0x58}, true, 1, "pop rax"},
+        {{0xEB, 0x10}, true, 2, "jmp rel8"},
+        {{0xE8, 0x00, 0x01, 0x00, 0x00}, true, 5, "call rel32"},
+        {{0xC3}, true, 1, "ret"},
+        {{0xC2, 0x08, 0x00}, true, 3, "ret imm16"},
+        {{0xCC}, false, 0, "int3"},
+        {{0x0F, 0x0B}, false, 0, "ud2"},
+        {{0xF3, 0xA4}, false, 0, "rep movsb"},
+        {{0x48, 0x89, 0x03}, false, 0, "mov [rbx], rax"},
+        {{0x48, 0x83, 0xD0, 0x01}, false, 0, "adc rax, 1"},
+        {{0x41, 0x90}, false, 0, "xchg r8, rax"},
+        {{0xE8, 0x00, 0x01}, false, 0, "truncated call"},
+    };
+
+    for (const auto& entry : cases) {
+        x86::InstructionEmulator emulator;
+        const bool supported = emulator.decode(entry.bytes.data(), entry.bytes.size(), true);
+        check(supported == entry.supported, string("decode support: ") + entry.name);
+        if (supported && entry.supported)
+            check(emulator.length() == entry.length, string("decode length: ") + entry.name);
+    }
+
+    // 0x40-0x4F are INC/DEC outside of long mode, not REX prefixes
+    x86::InstructionEmulator emulator;
+    const uint8_t inc_eax[] = {0x40};
+    check(!emulator.decode(inc_eax, sizeof(inc_eax), false), "decode: inc eax in 32-bit mode");
+}
+
+static bool execute(Vcpu& vcpu, const vector<uint8_t>& bytes) {
+    x86::InstructionEmulator emulator;
+    if (!emulator.decode(bytes.data(), bytes.size(), true))
+        return false;
+    return emulator.execute(vcpu);
+}
+
+static void test_registers(Vcpu& vcpu) {
+    auto& regs = vcpu.registers();
+    const uint64_t rip = regs.rip();
+
+    regs.rbx(0x1122334455667788);
+    check(execute(vcpu, {0x48, 0x89, 0xD8}), "execute: mov rax, rbx");
+    check(regs.rax() == 0x1122334455667788, "mov rax, rbx: value");
+    check(regs.rip() == rip + 3, "mov rax, rbx: rip");
+
+    check(execute(vcpu, {0x31, 0xC0}), "execute: xor eax, eax");
+    check(regs.rax() == 0, "xor eax, eax: clears the upper half");
+    check(regs.rflags().zero(), "xor eax, eax: zero flag");
+
+    regs.rax(~0ull);
+    check(execute(vcpu, {0x48, 0x83, 0xC0, 0x01}), "execute: add rax, 1");
+    check(regs.rax() == 0, "add rax, 1: value");
+    check(regs.rflags().carry() && regs.rflags().zero(), "add rax, 1: carry and zero flags");
+
+    const uint64_t before = regs.rip();
+    check(execute(vcpu, {0xEB, 0x10}), "execute: jmp rel8");
+    check(regs.rip() == before + 2 + 0x10, "jmp rel8: rip");
+}
+
+static void test_stack(Domain& domain, Vcpu& vcpu) {
+    auto& regs = vcpu.registers();
+    const uint64_t cr3 = regs.cr3();
+    const uint64_t rsp = regs.rsp() & ~0xFull;
+    regs.rsp(rsp);
+
+    // A page the guest has already written to
+    update_ptes(domain, cr3, rsp - 8, PTE_ACCESSED | PTE_DIRTY, 0);
+
+    regs.rax(0xA5A5A5A5A5A5A5A5);
+    uint64_t rip = regs.rip();
+    check(execute(vcpu, {0x50}), "execute: push rax");
+    check(regs.rsp() == rsp - 8, "push rax: rsp");
+    check(regs.rip() == rip + 1, "push rax: rip");
+    check(read_stack(vcpu, rsp - 8) == 0xA5A5A5A5A5A5A5A5, "push rax: memory");
+
+    check(execute(vcpu, {0x5B}), "execute: pop rbx");
+    check(regs.rbx() == 0xA5A5A5A5A5A5A5A5 && regs.rsp() == rsp, "pop rbx");
+
+    write_stack(vcpu, rsp, 0x1234);
+    check(execute(vcpu, {0x48, 0x8B, 0x0C, 0x24}), "execute: mov rcx, [rsp]");
+    check(regs.rcx() == 0x1234, "mov rcx, [rsp]: value");
+
+    rip = regs.rip();
+    check(execute(vcpu, {0xE8, 0x00, 0x01, 0x00, 0x00}), "execute: call rel32");
+    check(regs.rip() == rip + 5 + 0x100, "call rel32: rip");
+    check(read_stack(vcpu, rsp - 8) == rip + 5, "call rel32: return address");
+    check(execute(vcpu, {0xC3}), "execute: ret");
+    check(regs.rip() == rip + 5 && regs.rsp() == rsp, "ret");
+
+    // Every one of these would make the processor fault or update the PTE, so the emulator
+    // must leave the store to the real instruction
+    struct RefusedCase {
+        uint64_t clear;
+        const char* name;
+    };
+    const vector<RefusedCase> refused = {
+        {PTE_DIRTY, "clean page"},
+        {PTE_ACCESSED, "page not accessed"},
+        {PTE_WRITABLE, "read-only page"},
+        {PTE_USER, "supervisor page"},
+    };
+    for (const auto& entry : refused) {
+        update_ptes(domain, cr3, rsp - 8, 0, entry.clear);
+        write_stack(vcpu, rsp - 8, 0);
+        rip = regs.rip();
+        check(!execute(vcpu, {0x50}), string("push rax refused: ") + entry.name);
+        check(!execute(vcpu, {0xE8, 0x00, 0x01, 0x00, 0x00}),
+              string("call rel32 refused: ") + entry.name);
+        check(!execute(vcpu, {0x48, 0x89, 0x44, 0x24, 0xF8}),
+              string("mov [rsp-8], rax refused: ") + entry.name);
+        check(regs.rsp() == rsp && regs.rip() == rip,
+              string("registers unchanged: ") + entry.name);
+        check(read_stack(vcpu, rsp - 8) == 0, string("memory unchanged: ") + entry.name);
+        update_ptes(domain, cr3, rsp - 8, entry.clear, 0);
+    }
+
+    // Loads don't need the dirty bit, but do need the accessed bit
+    update_ptes(domain, cr3, rsp, 0, PTE_DIRTY);
+    check(execute(vcpu, {0x48, 0x8B, 0x0C, 0x24}), "mov rcx, [rsp] from a clean page");
+    update_ptes(domain, cr3, rsp, 0, PTE_ACCESSED);
+    check(!execute(vcpu, {0x48, 0x8B, 0x0C, 0x24}), "mov rcx, [rsp] refused: not accessed");
+    update_ptes(domain, cr3, rsp, PTE_ACCESSED | PTE_DIRTY, 0);
+
+    // Accesses that cross a page boundary are left to the processor
+    const uint64_t boundary = rsp & PageDirectory::PAGE_MASK;
+    update_ptes(domain, cr3, boundary - 8, PTE_ACCESSED | PTE_DIRTY, 0);
+    regs.rsp(boundary + 4);
+    check(!execute(vcpu, {0x50}), "push rax refused: crosses a page");
+    regs.rsp(rsp);
+
+    // Watchpoints and write trackers only see accesses that fault, so those pages are refused
+    {
+        auto watchpoint = domain.create_watchpoint(guest_ptr<void>(vcpu, rsp - 8), 8, false, true,
+                                                   false, [](Event&) {});
+        write_stack(vcpu, rsp - 8, 0);
+        rip = regs.rip();
+        check(!execute(vcpu, {0x50}), "push rax refused: write watchpoint");
+        check(!execute(vcpu, {0x48, 0x89, 0x44, 0x24, 0xF8}),
+              "mov [rsp-8], rax refused: write watchpoint");
+        check(regs.rsp() == rsp && regs.rip() == rip, "registers unchanged: write watchpoint");
+        check(read_stack(vcpu, rsp - 8) == 0, "memory unchanged: write watchpoint");
+        check(execute(vcpu, {0x48, 0x8B, 0x0C, 0x24}), "mov rcx, [rsp] past a write watchpoint");
+    }
+    {
+        auto watchpoint = domain.create_watchpoint(guest_ptr<void>(vcpu, rsp), 8, true, false,
+                                                   false, [](Event&) {});
+        check(!execute(vcpu, {0x48, 0x8B, 0x0C, 0x24}), "mov rcx, [rsp] refused: read watchpoint");
+    }
+    {
+        auto tracker = domain.create_write_tracker(guest_ptr<void>(vcpu, rsp - 8), 8);
+        check(!execute(vcpu, {0x50}), "push rax refused: write tracker");
+    }
+    check(execute(vcpu, {0x50}), "push rax after the watchpoints are removed");
+    check(execute(vcpu, {0x5B}), "pop rbx after the watchpoints are removed");
+
+    // CALL and RET also use the shadow stack when CET is enabled
+    auto& image_regs = dynamic_cast<image::ImageRegisters&>(regs);
+    image::ImageCpuState state = image_regs.state();
+    const uint64_t cr4 = state.cr4;
+    state.cr4 |= CR4_CET;
+    image_regs.state(state);
+    write_stack(vcpu, rsp - 8, 0);
+    rip = regs.rip();
+    check(!execute(vcpu, {0xE8, 0x00, 0x01, 0x00, 0x00}), "call rel32 refused: CET");
+    write_stack(vcpu, rsp, rip);
+    check(!execute(vcpu, {0xC3}), "ret refused: CET");
+    check(regs.rsp() == rsp && regs.rip() == rip, "registers unchanged: CET");
+    check(read_stack(vcpu, rsp - 8) == 0, "memory unchanged: CET");
+    check(execute(vcpu, {0x50}) && execute(vcpu, {0x5B}), "push and pop with CET");
+    state = image_regs.state();
+    state.cr4 = cr4;
+    image_regs.state(state);
+}
+
+int main(int argc, char** argv) {
+    setenv("INTROVIRT_HYPERVISOR", "synthetic", 0);
+
+    try {
+        auto hypervisor = Hypervisor::instance();
+        if (hypervisor->hypervisor_name() != "Synthetic") {
+            cerr << "This test needs INTROVIRT_HYPERVISOR=synthetic\n";
+            return 1;
+        }
+
+        // Two data pages, so that the stack has a page below it
+        auto domain = hypervisor->attach_domain("events=0,pages=2");
+        Vcpu& vcpu = domain->vcpu(0);
+
+        test_decode();
+        test_registers(vcpu);
+        test_stack(*domain, vcpu);
+    } catch (TraceableException& ex) {
+        cerr << ex;
+        return 1;
+    }
+
+    if (failures) {
+        cerr << failures << " checks failed\n";
+        return 1;
+    }
+    cout << "All checks passed\n";
+    return 0;
+}
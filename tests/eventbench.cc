@@ -0,0 +1,152 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "hypervisor/synthetic/SyntheticDomain.hh"
+
+#include <introvirt/introvirt.hh>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace introvirt;
+using introvirt::synthetic::SyntheticDomain;
+
+/*
+ * Throughput benchmark for the DomainImpl event dispatch path. Events come from a synthetic
+ * domain (INTROVIRT_HYPERVISOR=synthetic) so that only the library's own overhead is measured:
+ * filtering, event construction, the delivery threads, breakpoint emulation and watchpoint
+ * absorption.
+ *
+ * With no arguments, a set of scenarios is run: each event type on its own, then a mix. Pass a
+ * synthetic domain configuration (see SyntheticConfig) to run just that one.
+ *
+ * For each scenario, reports events per second, heap allocations per event (counted by the
+ * operator new below, for the whole poll() call, so thread startup is included) and the latency
+ * percentiles of each event type from Domain::event_timing_stats().
+ */
+
+static std::atomic<uint64_t> allocations = 0;
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* result = std::malloc(size ? size : 1);
+    if (result == nullptr)
+        throw std::bad_alloc();
+    return result;
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+class CountingCallback final : public EventCallback {
+  public:
+    void process_event(Event& event) override { ++events; }
+
+    std::atomic<uint64_t> events = 0;
+};
+
+static void run_scenario(Hypervisor& hypervisor, const std::string& config) {
+    std::unique_ptr<Domain> d = hypervisor.attach_domain(config);
+    auto& domain = static_cast<SyntheticDomain&>(*d);
+
+    d->intercept_system_calls(true);
+    d->intercept_cr_writes(3, true);
+
+    // Breakpoint events land on this, and are emulated as the NOP it covers
+    std::atomic<uint64_t> breakpoint_hits = 0;
+    auto breakpoint = d->create_breakpoint(guest_ptr<void>(d->vcpu(0), domain.code_address()),
+                                           [&](Event&) { ++breakpoint_hits; });
+
+    // Only faults on the first 64 bytes are delivered, the rest are stepped over by the pollers
+    std::atomic<uint64_t> watchpoint_hits = 0;
+    auto watchpoint =
+        d->create_watchpoint(guest_ptr<void>(d->vcpu(0), domain.data_address()), 64, true, true,
+                             false, [&](Event&) { ++watchpoint_hits; });
+
+    d->event_timing(true);
+
+    CountingCallback callback;
+    const uint64_t allocations_start = allocations.load();
+    const auto begin = std::chrono::steady_clock::now();
+    d->poll(callback);
+    const auto elapsed = std::chrono::steady_clock::now() - begin;
+    const uint64_t allocated = allocations.load() - allocations_start;
+
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    const double events = domain.completed_events();
+
+    cout << config << '\n';
+    cout << "  " << domain.completed_events() << " events in " << std::setprecision(3) << seconds
+         << " s: " << std::fixed << std::setprecision(0) << (seconds > 0 ? events / seconds : 0)
+         << " events/s, " << std::setprecision(2) << (events > 0 ? allocated / events : 0)
+         << " allocations/event\n";
+    cout << "  Delivered " << callback.events << ", breakpoint hits " << breakpoint_hits
+         << ", watchpoint hits " << watchpoint_hits << ", faults stepped over "
+         << d->watchpoint_stats().absorbed << '\n';
+
+    const EventTimingStats stats = d->event_timing_stats();
+    auto write_types = [](const char* title, const auto& types) {
+        for (const auto& [type, stages] : types) {
+            const auto& total = stages[static_cast<int>(EventStage::TOTAL)];
+            if (total.count == 0)
+                continue;
+            cout << "  " << std::left << std::setw(10) << title << std::setw(24) << type
+                 << std::right << std::setw(10) << total.count << std::setprecision(2)
+                 << std::setw(10) << total.percentile_ns(50) / 1000.0 << std::setw(10)
+                 << total.percentile_ns(90) / 1000.0 << std::setw(10)
+                 << total.percentile_ns(99) / 1000.0 << std::setw(10) << total.max_ns / 1000.0
+                 << '\n';
+        }
+    };
+    cout << "  " << std::left << std::setw(10) << "" << std::setw(24) << "type" << std::right
+         << std::setw(10) << "count" << std::setw(10) << "p50(us)" << std::setw(10) << "p90(us)"
+         << std::setw(10) << "p99(us)" << std::setw(10) << "max(us)" << '\n';
+    write_types("delivered", EventTimingStats::combine(stats.delivered));
+    write_types("filtered", EventTimingStats::combine(stats.filtered));
+    cout << std::defaultfloat;
+}
+
+int main(int argc, char** argv) {
+    auto hypervisor = Hypervisor::instance();
+    if (hypervisor->hypervisor_name() != "Synthetic") {
+        cerr << "Set INTROVIRT_HYPERVISOR=synthetic to run this\n";
+        return 1;
+    }
+
+    std::vector<std::string> scenarios;
+    if (argc > 1) {
+        scenarios.emplace_back(argv[1]);
+    } else {
+        scenarios = {
+            "events=200000,syscall=1",
+            "events=200000,syscall=0,cr=1",
+            "events=200000,syscall=0,bp=1",
+            "events=200000,syscall=0,mem=1",
+            "vcpus=4,events=100000,syscall=8,cr=2,bp=1,mem=1",
+        };
+    }
+
+    for (const auto& scenario : scenarios)
+        run_scenario(*hypervisor, scenario);
+
+    return 0;
+}
@@ -0,0 +1,352 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <introvirt/introvirt.hh>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace introvirt;
+using namespace introvirt::windows;
+using namespace introvirt::windows::nt;
+
+/*
+ * Microbenchmarks for the library's hot primitives.
+ *
+ * Memory and translation benchmarks (guest_ptr, PageDirectory::translate(), map_pfns()) run on
+ * any domain. With no domain argument, a synthetic domain (INTROVIRT_HYPERVISOR=synthetic) is
+ * generated, so they run on a plain Linux box. Windows object parsing (KPCR, EPROCESS and
+ * ETHREAD fields, handle tables, VAD search, registry keys) needs a detected Windows guest, such
+ * as a memory image (INTROVIRT_HYPERVISOR=image). Event::json() needs events, so it's measured
+ * while replaying a recording (INTROVIRT_HYPERVISOR=replay).
+ *
+ * Each benchmark is calibrated to run for at least 10ms per sample, and the median of 7 samples
+ * is reported. --save writes the results to a baseline file, and --baseline compares against one
+ * and exits with 1 if anything got slower than the threshold.
+ *
+ * Usage: microbench [--baseline FILE] [--save FILE] [--threshold PERCENT] [domain]
+ */
+
+template <typename T>
+static inline void keep(const T& value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct Result {
+    std::string name;
+    double ns_per_op;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+template <typename F>
+static double run_batch(F& op, uint64_t iterations) {
+    const auto begin = clock_type::now();
+    for (uint64_t i = 0; i < iterations; ++i)
+        op();
+    return std::chrono::duration<double, std::nano>(clock_type::now() - begin).count();
+}
+
+template <typename F>
+static void measure(std::vector<Result>& results, const std::string& name, F&& op) {
+    static constexpr double MIN_SAMPLE_NS = 10e6;
+    static constexpr int SAMPLES = 7;
+
+    try {
+        // Also serves as the warmup
+        uint64_t iterations = 1;
+        while (run_batch(op, iterations) < MIN_SAMPLE_NS)
+            iterations *= 2;
+
+        std::vector<double> samples;
+        for (int i = 0; i < SAMPLES; ++i)
+            samples.push_back(run_batch(op, iterations) / iterations);
+        std::sort(samples.begin(), samples.end());
+
+        results.push_back(Result{name, samples[SAMPLES / 2]});
+    } catch (TraceableException& ex) {
+        cerr << name << ": skipped, " << ex.what() << '\n';
+    }
+}
+
+static void memory_benchmarks(Domain& domain, std::vector<Result>& results) {
+    Vcpu& vcpu = domain.vcpu(0);
+    const uint64_t address = vcpu.registers().rip();
+    const uint64_t cr3 = vcpu.registers().cr3();
+    const PageDirectory& page_directory = domain.page_directory();
+
+    measure(results, "guest_ptr_construct", [&] {
+        guest_ptr<uint64_t> ptr(vcpu, address);
+        keep(ptr);
+    });
+
+    const guest_ptr<uint64_t> source(vcpu, address);
+    measure(results, "guest_ptr_copy", [&] {
+        guest_ptr<uint64_t> ptr(source);
+        keep(ptr);
+    });
+
+    measure(results, "guest_ptr_deref", [&] {
+        guest_ptr<uint64_t> ptr(vcpu, address);
+        keep(*ptr);
+    });
+
+    measure(results, "page_directory_translate", [&] {
+        keep(page_directory.translate(address, cr3));
+    });
+
+    const uint64_t pfn = page_directory.translate(address, cr3) >> PageDirectory::PAGE_SHIFT;
+    measure(results, "map_pfns", [&] {
+        auto mapping = domain.map_pfns(&pfn, 1);
+        keep(mapping);
+    });
+}
+
+static void windows_benchmarks(Domain& domain, WindowsGuest& guest, std::vector<Result>& results) {
+    NtKernel& kernel = guest.kernel();
+
+    measure(results, "kpcr_reset", [&] { kernel.kpcr(domain.vcpu(0)).reset(); });
+
+    // Use the process with the most handles, and any process with an open registry key
+    std::shared_ptr<PROCESS> target;
+    guest_ptr<void> target_body;
+    int32_t target_handles = -1;
+    std::shared_ptr<PROCESS> key_process;
+    uint64_t key_handle = 0;
+
+    auto cid_table = kernel.CidTable();
+    for (const auto& entry : cid_table->open_handles()) {
+        try {
+            std::unique_ptr<OBJECT_HEADER> header(entry->ObjectHeader());
+            if (header->type() != ObjectType::Process)
+                continue;
+
+            auto process = kernel.process(header->Body());
+            auto table = process->ObjectTable();
+            if (!table)
+                continue;
+
+            if (table->HandleCount() > target_handles) {
+                target = process;
+                target_body = header->Body();
+                target_handles = table->HandleCount();
+            }
+
+            if (key_process)
+                continue;
+            for (const auto& handle : table->open_handles()) {
+                std::unique_ptr<OBJECT_HEADER> handle_header(handle->ObjectHeader());
+                if (handle_header->type() == ObjectType::Key) {
+                    key_process = process;
+                    key_handle = handle->Handle();
+                    break;
+                }
+            }
+        } catch (TraceableException&) {
+            // Processes that are exiting can have parts paged out
+        }
+    }
+
+    if (!target) {
+        cerr << "No processes found, skipping Windows object benchmarks\n";
+        return;
+    }
+
+    measure(results, "eprocess_construct", [&] { keep(kernel.process(target_body)); });
+
+    measure(results, "eprocess_fields", [&] {
+        keep(target->UniqueProcessId() + target->InheritedFromUniqueProcessId() +
+             target->DirectoryTableBase() + target->Cookie() + target->ImageFileName().size());
+    });
+
+    auto threads = target->ThreadList();
+    if (!threads.empty()) {
+        auto& thread = *threads.front();
+        measure(results, "ethread_fields", [&] {
+            keep(thread.Cid().UniqueThread() + thread.Priority() + thread.BasePriority() +
+                 thread.Affinity());
+        });
+    }
+
+    measure(results, "handle_table_enumerate",
+            [&] { keep(target->ObjectTable()->open_handles().size()); });
+
+    auto vad_root = target->VadRoot();
+    if (vad_root) {
+        auto vads = vad_root->VadTreeInOrder();
+        if (!vads.empty()) {
+            const uint64_t vad_address = vads[vads.size() / 2]->StartingAddress();
+            measure(results, "vad_search", [&] { keep(vad_root->search(vad_address)); });
+        }
+    }
+
+    if (key_process) {
+        auto table = key_process->ObjectTable();
+        measure(results, "registry_key_lookup",
+                [&] { keep(table->KeyObject(key_handle)->full_key_path().size()); });
+    }
+}
+
+static void conversion_benchmarks(std::vector<Result>& results) {
+    const std::string utf8 =
+        "\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Winlogon";
+    const std::u16string utf16 = Utf16String::convert(utf8);
+
+    measure(results, "utf16_to_utf8", [&] { keep(Utf16String::convert(utf16)); });
+    measure(results, "utf8_to_utf16", [&] { keep(Utf16String::convert(utf8)); });
+}
+
+/*
+ * Times Event::json() on every event of a replayed recording
+ */
+class JsonCallback final : public EventCallback {
+  public:
+    void process_event(Event& event) override {
+        const auto begin = clock_type::now();
+        try {
+            Json::Value value = event.json();
+            keep(value);
+        } catch (TraceableException&) {
+            return;
+        }
+        const double elapsed =
+            std::chrono::duration<double, std::nano>(clock_type::now() - begin).count();
+
+        std::lock_guard lock(mtx_);
+        samples_.push_back(elapsed);
+    }
+
+    void report(std::vector<Result>& results) {
+        if (samples_.empty())
+            return;
+        std::sort(samples_.begin(), samples_.end());
+        results.push_back(Result{"event_json", samples_[samples_.size() / 2]});
+    }
+
+  private:
+    std::mutex mtx_;
+    std::vector<double> samples_;
+};
+
+static std::map<std::string, double> read_baseline(const std::string& path) {
+    std::map<std::string, double> result;
+    std::ifstream file(path);
+    if (!file) {
+        cerr << "Failed to open baseline " << path << '\n';
+        exit(1);
+    }
+
+    std::string name;
+    double ns_per_op;
+    while (file >> name >> ns_per_op)
+        result[name] = ns_per_op;
+    return result;
+}
+
+static void write_baseline(const std::string& path, const std::vector<Result>& results) {
+    std::ofstream file(path);
+    for (const auto& result : results)
+        file << result.name << ' ' << std::fixed << std::setprecision(2) << result.ns_per_op
+             << '\n';
+    if (!file)
+        cerr << "Failed to write baseline " << path << '\n';
+}
+
+int main(int argc, char** argv) {
+    std::string baseline_path;
+    std::string save_path;
+    std::string domain_name;
+    double threshold = 10;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--baseline" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (arg == "--save" && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            threshold = std::stod(argv[++i]);
+        } else if (arg[0] != '-' && domain_name.empty()) {
+            domain_name = arg;
+        } else {
+            cerr << "Usage: " << argv[0]
+                 << " [--baseline FILE] [--save FILE] [--threshold PERCENT] [domain]\n";
+            return 1;
+        }
+    }
+
+    // Generate a domain when none is given
+    if (domain_name.empty()) {
+        setenv("INTROVIRT_HYPERVISOR", "synthetic", 0);
+        domain_name = "events=0";
+    }
+
+    auto hypervisor = Hypervisor::instance();
+    std::unique_ptr<Domain> domain = hypervisor->attach_domain(domain_name);
+
+    std::vector<Result> results;
+    memory_benchmarks(*domain, results);
+    conversion_benchmarks(results);
+
+    if (domain->detect_guest() && domain->guest()->os() == OS::Windows) {
+        windows_benchmarks(*domain, *static_cast<WindowsGuest*>(domain->guest()), results);
+
+        if (hypervisor->hypervisor_name() == "Replay") {
+            JsonCallback callback;
+            domain->poll(callback);
+            callback.report(results);
+        }
+    } else {
+        cerr << "No Windows guest detected, skipping Windows object benchmarks\n";
+    }
+
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty())
+        baseline = read_baseline(baseline_path);
+
+    int regressions = 0;
+    cout << std::left << std::setw(28) << "benchmark" << std::right << std::setw(14) << "ns/op"
+         << std::setw(14) << "baseline" << std::setw(10) << "change" << '\n';
+    for (const auto& result : results) {
+        cout << std::left << std::setw(28) << result.name << std::right << std::fixed
+             << std::setprecision(2) << std::setw(14) << result.ns_per_op;
+
+        auto iter = baseline.find(result.name);
+        if (iter != baseline.end() && iter->second > 0) {
+            const double change = (result.ns_per_op - iter->second) * 100.0 / iter->second;
+            cout << std::setw(14) << iter->second << std::setw(9) << std::showpos
+                 << std::setprecision(1) << change << std::noshowpos << '%';
+            if (change > threshold) {
+                cout << "  REGRESSION";
+                ++regressions;
+            }
+        }
+        cout << '\n';
+    }
+
+    if (!save_path.empty())
+        write_baseline(save_path, results);
+
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <introvirt/introvirt.hh>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using namespace std;
+using namespace introvirt;
+
+/*
+ * Replays an event recording (see Domain::record_events()) through the event pipeline and
+ * reports the throughput. The recording is replayed as fast as the pipeline accepts events, so
+ * this measures the library's own overhead per event without a live guest.
+ *
+ * Only runs against recordings (INTROVIRT_HYPERVISOR=replay).
+ */
+class CountingCallback final : public EventCallback {
+  public:
+    void process_event(Event& event) override {
+        ++events;
+        if (event.type() == EventType::EVENT_FAST_SYSCALL)
+            ++system_calls;
+    }
+
+    std::atomic<uint64_t> events = 0;
+    std::atomic<uint64_t> system_calls = 0;
+};
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <recording> [delivery threads]\n";
+        return 1;
+    }
+
+    auto hypervisor = Hypervisor::instance();
+    if (hypervisor->hypervisor_name() != "Replay") {
+        cerr << "Set INTROVIRT_HYPERVISOR=replay to run this\n";
+        return 1;
+    }
+
+    std::unique_ptr<Domain> d = hypervisor->attach_domain(argv[1]);
+    if (argc > 2)
+        d->event_delivery_threads(std::stoul(argv[2]));
+
+    using clock = std::chrono::steady_clock;
+
+    auto begin = clock::now();
+    const bool detected = d->detect_guest();
+    const auto detection = clock::now() - begin;
+    if (!detected)
+        cerr << "Guest not detected, events will not be parsed\n";
+
+    CountingCallback callback;
+    begin = clock::now();
+    d->poll(callback);
+    const auto replay = clock::now() - begin;
+
+    const double seconds = std::chrono::duration<double>(replay).count();
+    const EventDeliveryStats stats = d->event_delivery_stats();
+
+    cout << "Guest detection: " << std::chrono::duration<double, std::milli>(detection).count()
+         << " ms\n";
+    cout << "Delivered " << callback.events << " events (" << callback.system_calls
+         << " system calls) in " << seconds << " s\n";
+    cout << "Throughput: " << (seconds > 0 ? callback.events / seconds : 0) << " events/s\n";
+    cout << "Delivery threads: " << d->event_delivery_threads()
+         << ", queue high water: " << stats.queue_high_water << '\n';
+
+    return 0;
+}
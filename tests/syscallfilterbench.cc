@@ -0,0 +1,86 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <introvirt/introvirt.hh>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace introvirt;
+
+/*
+ * Measures the per-call cost of SystemCallFilter::matches_64() from several reader threads, with
+ * and without another thread toggling entries at the same time. No domain is required.
+ */
+static double run(SystemCallFilter& filter, int readers, uint64_t calls, bool writer) {
+    std::atomic<bool> stop = false;
+    std::thread updater;
+    if (writer) {
+        updater = std::thread([&]() {
+            uint32_t index = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                filter.set_64(index, !filter.matches_64(index));
+                index = (index + 1) & 0x3FF;
+            }
+        });
+    }
+
+    std::vector<double> results(readers);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < readers; ++i) {
+        threads.emplace_back([&, i]() {
+            uint64_t hits = 0;
+            const auto begin = std::chrono::steady_clock::now();
+            for (uint64_t call = 0; call < calls; ++call)
+                hits += filter.matches_64(call & 0x3FF);
+            const auto elapsed = std::chrono::steady_clock::now() - begin;
+            results[i] = std::chrono::duration<double, std::nano>(elapsed).count() / calls;
+            // Keep the loop from being optimized away
+            if (hits == ~0ULL)
+                cout << hits;
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    stop = true;
+    if (updater.joinable())
+        updater.join();
+
+    double total = 0;
+    for (double result : results)
+        total += result;
+    return total / readers;
+}
+
+int main(int argc, char** argv) {
+    const int readers = (argc > 1) ? std::stoi(argv[1]) : std::thread::hardware_concurrency();
+    const uint64_t calls = (argc > 2) ? std::stoull(argv[2]) : 10000000;
+
+    SystemCallFilter filter;
+    filter.enabled(true);
+    for (uint32_t index = 0; index < 0x400; index += 3)
+        filter.set_64(index, true);
+
+    cout << "Readers: " << readers << ", " << calls << " calls each\n";
+    cout << "matches_64():                " << run(filter, readers, calls, false) << " ns/call\n";
+    cout << "matches_64() with an update: " << run(filter, readers, calls, true) << " ns/call\n";
+    return 0;
+}
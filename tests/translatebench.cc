@@ -0,0 +1,136 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <introvirt/introvirt.hh>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace introvirt;
+
+/*
+ * Compares the cost of a missing page through PageDirectory::translate() (throw/catch) and
+ * PageDirectory::try_translate(). Scans down from the system call entry point, the same range
+ * the NT kernel base search uses.
+ *
+ * Also compares translating that whole range page by page against
+ * PageDirectory::translate_range(), and checks that both give the same frames.
+ */
+int main(int argc, char** argv) {
+    auto hypervisor = Hypervisor::instance();
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <domain id> [iterations]\n";
+        return 1;
+    }
+    const int iterations = (argc > 2) ? std::stoi(argv[2]) : 10;
+
+    std::unique_ptr<Domain> d = hypervisor->attach_domain(argv[1]);
+    const PageDirectory& page_directory = d->page_directory();
+
+    Vcpu& vcpu = d->vcpu(0);
+    vcpu.pause();
+
+    const auto& regs = vcpu.registers();
+    const uint64_t cr3 = regs.cr3();
+    const uint64_t start =
+        std::max(regs.msr(x86::Msr::MSR_LSTAR), regs.msr(x86::Msr::MSR_IA32_SYSENTER_EIP)) &
+        PageDirectory::PAGE_MASK;
+
+    // Find the pages that aren't present
+    std::vector<uint64_t> missing;
+    for (uint64_t address = start; address > start - 0x1000000;
+         address -= PageDirectory::PAGE_SIZE) {
+        if (!page_directory.try_translate(address, cr3))
+            missing.push_back(address);
+    }
+    if (missing.empty()) {
+        cerr << "No missing pages found below 0x" << hex << start << '\n';
+        vcpu.resume();
+        return 1;
+    }
+
+    using clock = std::chrono::steady_clock;
+
+    auto begin = clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (uint64_t address : missing) {
+            try {
+                page_directory.translate(address, cr3);
+            } catch (VirtualAddressNotPresentException& ex) {
+            }
+        }
+    }
+    const auto throwing = clock::now() - begin;
+
+    begin = clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (uint64_t address : missing) {
+            page_directory.try_translate(address, cr3);
+        }
+    }
+    const auto non_throwing = clock::now() - begin;
+
+    // The same range, forwards, one page at a time and in a single walk
+    const uint64_t range_start = start - 0x1000000 + PageDirectory::PAGE_SIZE;
+    const uint64_t range_pages = 0x1000000 / PageDirectory::PAGE_SIZE;
+    std::vector<uint64_t> single_pfns(range_pages);
+    std::vector<uint64_t> range_pfns(range_pages);
+
+    begin = clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (uint64_t page = 0; page < range_pages; ++page) {
+            const auto pa = page_directory.try_translate(
+                range_start + (page << PageDirectory::PAGE_SHIFT), cr3);
+            single_pfns[page] = pa ? (*pa >> PageDirectory::PAGE_SHIFT) : 0;
+        }
+    }
+    const auto single = clock::now() - begin;
+
+    std::vector<PageDirectory::PageRun> runs;
+    begin = clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        runs = page_directory.translate_range(range_start, range_pages, cr3, range_pfns.data());
+    }
+    const auto ranged = clock::now() - begin;
+
+    vcpu.resume();
+
+    if (single_pfns != range_pfns) {
+        cerr << "translate_range() does not match try_translate()\n";
+        return 1;
+    }
+
+    const double count = static_cast<double>(missing.size()) * iterations;
+    cout << "Missing pages: " << missing.size() << " x " << iterations << " iterations\n";
+    cout << "translate():     "
+         << std::chrono::duration<double, std::nano>(throwing).count() / count << " ns/page\n";
+    cout << "try_translate(): "
+         << std::chrono::duration<double, std::nano>(non_throwing).count() / count
+         << " ns/page\n";
+
+    const double range_count = static_cast<double>(range_pages) * iterations;
+    cout << "Range: " << range_pages << " pages in " << runs.size() << " present/absent runs\n";
+    cout << "try_translate() per page: "
+         << std::chrono::duration<double, std::nano>(single).count() / range_count
+         << " ns/page\n";
+    cout << "translate_range():        "
+         << std::chrono::duration<double, std::nano>(ranged).count() / range_count
+         << " ns/page\n";
+
+    return 0;
+}
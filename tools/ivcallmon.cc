@@ -22,6 +22,8 @@
  * event handling for a target process.
  */
 
+#include "shared/EventTimingReport.hh"
+
 #include <introvirt/introvirt.hh>
 
 #include <boost/algorithm/string.hpp>
@@ -99,27 +101,12 @@ class BreakpointHandler final {
         return_bp_.reset();
     }
 
-    BreakpointHandler(BreakpointHandler&& src) noexcept
-        : domain_(src.domain_), bp_(std::move(src.bp_)), name_(std::move(src.name_)),
-          pid_(src.pid_) {
-        bp_->callback(std::bind(&BreakpointHandler::breakpoint_hit, this, std::placeholders::_1));
-    }
+    BreakpointHandler(Domain& domain, const std::string& name, uint64_t pid)
+        : domain_(&domain), name_(name), pid_(pid) {}
 
-    BreakpointHandler& operator=(BreakpointHandler&& src) noexcept {
-        bp_ = std::move(src.bp_);
-        name_ = std::move(src.name_);
-        domain_ = src.domain_;
-        pid_ = src.pid_;
-        bp_->callback(std::bind(&BreakpointHandler::breakpoint_hit, this, std::placeholders::_1));
-        return *this;
-    }
-
-    BreakpointHandler(Domain& domain, const guest_ptr<void>& address, const std::string& name,
-                      uint64_t pid)
-        : domain_(&domain), name_(name), pid_(pid) {
-        bp_ = domain.create_breakpoint(
-            address, std::bind(&BreakpointHandler::breakpoint_hit, this, std::placeholders::_1));
-    }
+    // Breakpoints call back into the handler, so it can't move
+    BreakpointHandler(const BreakpointHandler&) = delete;
+    BreakpointHandler& operator=(const BreakpointHandler&) = delete;
 
     ~BreakpointHandler() = default;
 
@@ -169,6 +156,13 @@ class CallMonitor final : public EventCallback {
                 auto lib =
                     pe::PE::make_unique(guest_ptr<void>(event.vcpu(), entry->StartingAddress()));
                 auto& pdb = lib->pdb();
+                std::vector<BreakpointRequest> requests;
+                std::vector<std::unique_ptr<BreakpointHandler>> handlers;
+
+                // ntdll is shared by every process, only stop in this one
+                const std::vector<uint64_t> page_directories{process.DirectoryTableBase(),
+                                                             process.UserDirectoryTableBase()};
+
                 for (const auto& symbol : pdb.global_symbols()) {
                     if (symbol->function() || symbol->code()) {
                         if (!boost::starts_with(symbol->name(), "Nt"))
@@ -176,18 +170,38 @@ class CallMonitor final : public EventCallback {
                         if (symbol->name() == "KiUserCallbackDispatch" ||
                             symbol->name() == "KiUserCallbackDispatcher")
                             continue;
-                        std::cout << "Adding breakpoint for " << symbol->name() << '\n';
                         try {
                             guest_ptr<void> ptr(event.vcpu(),
                                                 entry->StartingAddress() + symbol->image_offset());
-                            breakpoints_.emplace_back(event.domain(), ptr, symbol->name(),
-                                                      process.UniqueProcessId());
+                            // The handler exists before the breakpoint is armed
+                            auto handler = std::make_unique<BreakpointHandler>(
+                                event.domain(), symbol->name(), process.UniqueProcessId());
+                            requests.push_back(BreakpointRequest{
+                                ptr,
+                                std::bind(&BreakpointHandler::breakpoint_hit, handler.get(),
+                                          std::placeholders::_1),
+                                page_directories});
+                            handlers.push_back(std::move(handler));
                         } catch (VirtualAddressNotPresentException& ex) {
+                            std::cout << "Adding breakpoint for " << symbol->name() << '\n';
                             std::cout << "  Not present!\n";
                         }
                     }
                 }
 
+                // Install them all at once
+                auto bps = event.domain().create_breakpoints(requests);
+                breakpoints_.reserve(bps.size());
+                for (size_t i = 0; i < bps.size(); ++i) {
+                    std::cout << "Adding breakpoint for " << handlers[i]->name_ << '\n';
+                    if (!bps[i]) {
+                        std::cout << "  Not present!\n";
+                        continue;
+                    }
+                    handlers[i]->bp_ = std::move(bps[i]);
+                    breakpoints_.push_back(std::move(handlers[i]));
+                }
+
                 if (flush_)
                     std::cout.flush();
 
@@ -205,7 +219,7 @@ class CallMonitor final : public EventCallback {
     std::mutex mtx_;
     const bool flush_;
     bool ready_ = false;
-    std::vector<BreakpointHandler> breakpoints_;
+    std::vector<std::unique_ptr<BreakpointHandler>> breakpoints_;
 };
 
 int main(int argc, char** argv) {
@@ -218,6 +232,7 @@ int main(int argc, char** argv) {
       ("domain,D", po::value<std::string>(&domain_name)->required(), "The domain name or ID attach to")
       ("procname", po::value<std::string>(&process_name)->required(), "A process name to filter for")
       ("no-flush", "Don't flush the output buffer after each event")
+      ("timing", "Time the event pipeline, and print it on exit or SIGUSR1")
       ("help", "Display program help");
     // clang-format on
 
@@ -249,9 +264,20 @@ int main(int argc, char** argv) {
     domain->intercept_cr_writes(3, true);
 
     // Start the poll
+    std::unique_ptr<EventTimingReporter> timing_reporter;
+    if (vm.count("timing")) {
+        domain->event_timing(true);
+        timing_reporter = start_event_timing_reporter(*domain);
+    }
+
     CallMonitor monitor(!vm.count("no-flush"));
     domain->poll(monitor);
 
+    if (vm.count("timing")) {
+        timing_reporter.reset();
+        write_event_timing(*domain, std::cerr);
+    }
+
     return 0;
 }
 
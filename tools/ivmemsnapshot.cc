@@ -0,0 +1,164 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @example ivmemsnapshot.cc
+ *
+ * Writes all guest physical memory to a raw or ELF core file. With --interval,
+ * the file is kept up to date by rewriting only the pages that changed since
+ * the previous capture.
+ */
+
+#include <introvirt/introvirt.hh>
+
+#include <boost/program_options.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+using namespace introvirt;
+
+namespace po = boost::program_options;
+
+void parse_program_options(int argc, char** argv, po::options_description& desc,
+                           po::variables_map& vm);
+
+std::atomic_bool interrupted = false;
+
+void sig_handler(int signum) { interrupted = true; }
+
+int main(int argc, char** argv) {
+    po::options_description desc("Options");
+    std::string domain_name;
+    std::string output;
+    std::string format_name;
+    uint32_t threads;
+    double interval;
+    uint64_t count;
+
+    // clang-format off
+    desc.add_options()
+      ("domain,D", po::value<std::string>(&domain_name)->required(), "The domain name or ID attach to")
+      ("output,o", po::value<std::string>(&output)->required(), "A path to an output file")
+      ("format,f", po::value<std::string>(&format_name)->default_value("raw"), "The output format: raw (a sparse file indexed by physical address) or elf")
+      ("threads,j", po::value<uint32_t>(&threads)->default_value(0), "The number of copy threads, 0 for one per CPU")
+      ("interval,i", po::value<double>(&interval)->default_value(0), "Seconds between captures. Later captures only write pages that changed.")
+      ("count,n", po::value<uint64_t>(&count)->default_value(0), "Stop after this many captures, 0 to run until interrupted (with --interval)")
+      ("live", "Don't pause the domain during captures")
+      ("help", "Display program help");
+    // clang-format on
+
+    // We're not mixing with printf, improve cout performance.
+    std::cout.sync_with_stdio(false);
+
+    po::variables_map vm;
+    parse_program_options(argc, argv, desc, vm);
+
+    MemorySnapshotFormat format;
+    if (format_name == "raw") {
+        format = MemorySnapshotFormat::RAW;
+    } else if (format_name == "elf") {
+        format = MemorySnapshotFormat::ELF;
+    } else {
+        std::cerr << "Unknown format: " << format_name << '\n';
+        return 1;
+    }
+
+    if (interval <= 0)
+        count = 1;
+
+    const bool live = vm.count("live");
+
+    // Get a hypervisor instance
+    // This will automatically select the correct type of hypervisor.
+    auto hypervisor = Hypervisor::instance();
+
+    // Attach to the domain
+    signal(SIGINT, &sig_handler);
+    signal(SIGTERM, &sig_handler);
+    auto domain = hypervisor->attach_domain(domain_name);
+    auto snapshot = domain->create_memory_snapshot(output, format, threads);
+
+    const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(interval));
+    auto next = std::chrono::steady_clock::now();
+
+    while (!interrupted && (count == 0 || snapshot->captures() < count)) {
+        MemorySnapshotStats stats;
+        if (!live)
+            domain->pause();
+        try {
+            stats = snapshot->capture();
+        } catch (TraceableException& ex) {
+            if (!live)
+                domain->resume();
+            std::cerr << "Capture failed: " << ex.what() << '\n';
+            return 1;
+        }
+        if (!live)
+            domain->resume();
+
+        const double seconds = stats.duration_ns / 1e9;
+        const double mib = (stats.written_pages * x86::PageDirectory::PAGE_SIZE) / 1048576.0;
+        std::cout << "Capture " << snapshot->captures() << ": wrote " << stats.written_pages
+                  << " of " << stats.pages << " pages (" << std::fixed << std::setprecision(1)
+                  << mib << " MiB) in " << std::setprecision(3) << seconds << "s";
+        if (stats.failed_pages)
+            std::cout << ", " << stats.failed_pages << " pages could not be read";
+        std::cout << std::endl;
+
+        if (count != 0 && snapshot->captures() >= count)
+            break;
+
+        // Sleep until the next capture, or until we're interrupted
+        next += period;
+        while (!interrupted && std::chrono::steady_clock::now() < next) {
+            std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                next - std::chrono::steady_clock::now(), std::chrono::milliseconds(100)));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Parse command line options here
+ */
+void parse_program_options(int argc, char** argv, po::options_description& desc,
+                           po::variables_map& vm) {
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        /*
+         * --help option
+         */
+        if (vm.count("help")) {
+            std::cout << "ivmemsnapshot - Write guest physical memory to a file" << '\n';
+            std::cout << desc << '\n';
+            exit(0);
+        }
+
+        po::notify(vm); // throws on error, so do after help in case
+                        // there are any problems
+    } catch (po::error& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        std::cerr << desc << std::endl;
+        exit(1);
+    }
+}
@@ -219,6 +219,10 @@ int main(int argc, char** argv) {
     EventHandler handler;
     domain->poll(handler);
 
+    const auto stats = domain->watchpoint_stats();
+    std::cout << "Faults on watched pages: " << stats.faults << " (" << stats.absorbed
+              << " outside the watched range, " << stats.delivered << " delivered)\n";
+
     return 0;
 }
 
@@ -18,8 +18,9 @@
  * @example ivprocmemdump.cc
  *
  * Dumps memory of a guest process to a file. Demonstrates attaching to a
- * domain, resolving a process by name, and reading guest virtual memory
- * (e.g. via NtReadVirtualMemory or guest memory mapping).
+ * domain, resolving a process by name, walking its VAD tree and page tables
+ * directly, and reading guest memory through host mappings. Pages that are not
+ * resident are read with NtReadVirtualMemory from inside the process.
  */
 
 #include <introvirt/introvirt.hh>
@@ -27,18 +28,25 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/program_options.hpp>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <csignal>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <memory>
+#include <system_error>
 #include <thread>
+#include <vector>
 
 using namespace introvirt;
 using namespace introvirt::windows;
 using namespace introvirt::windows::nt;
-using namespace introvirt::windows::kernel32;
-using namespace introvirt::windows::condrv;
 
 namespace po = boost::program_options;
 
@@ -55,147 +63,478 @@ void sig_handler(int signum) {
     }
 }
 
-class MemDumpTool final : public EventCallback {
-  public:
-    MemDumpTool(const std::string& output_file) : output_file_(output_file) {}
+static constexpr uint64_t PAGE_SIZE = x86::PageDirectory::PAGE_SIZE;
+static constexpr uint64_t PAGE_SHIFT = x86::PageDirectory::PAGE_SHIFT;
 
-    void dump(Event& event) {
-        auto& vcpu = event.vcpu();
-        auto& wevent = static_cast<WindowsEvent&>(event);
-        auto& current_process = wevent.task().pcr().CurrentThread().Process();
+// The number of pages translated in one pass, and the most pages in one write
+static constexpr uint64_t ScanPages = 0x10000;
+static constexpr uint64_t MaxRangePages = 256;
 
-        const uint64_t pid = current_process.UniqueProcessId();
+// The size of the guest buffer used for NtReadVirtualMemory
+static constexpr uint32_t ReadBufferSize = 0x10000;
 
-        // Try to open the process (which should be ourselves)
-        auto object_attributes = inject::allocate<nt::OBJECT_ATTRIBUTES>();
-        auto client_id = inject::allocate<nt::CLIENT_ID>(pid, 0);
-        const uint32_t access_mask =
-            PROCESS_VM_READ | PROCESS_VM_OPERATION | PROCESS_QUERY_INFORMATION;
+enum class DumpFormat { Raw, Minidump };
 
-        uint64_t process_handle;
-        auto result = inject::system_call<nt::NtOpenProcess>(process_handle, access_mask,
-                                                             object_attributes, client_id);
+/*
+ * Just enough of the minidump format to hold the memory of a process
+ */
+namespace minidump {
+
+static constexpr uint32_t Signature = 0x504d444d; // "MDMP"
+static constexpr uint32_t Version = 0xa793;
+static constexpr uint64_t MiniDumpWithFullMemory = 0x2;
+static constexpr uint32_t SystemInfoStream = 7;
+static constexpr uint32_t Memory64ListStream = 9;
+static constexpr uint16_t PROCESSOR_ARCHITECTURE_INTEL = 0;
+static constexpr uint16_t PROCESSOR_ARCHITECTURE_AMD64 = 9;
+static constexpr uint32_t VER_PLATFORM_WIN32_NT = 2;
+
+#pragma pack(push, 4)
+struct Header {
+    uint32_t Signature;
+    uint32_t Version;
+    uint32_t NumberOfStreams;
+    uint32_t StreamDirectoryRva;
+    uint32_t CheckSum;
+    uint32_t TimeDateStamp;
+    uint64_t Flags;
+};
 
-        if (!result.NT_SUCCESS()) {
-            std::cerr << "Failed to open PID " << pid << ": " << result << '\n';
-            return;
-        }
+struct Directory {
+    uint32_t StreamType;
+    uint32_t DataSize;
+    uint32_t Rva;
+};
+
+struct SystemInfo {
+    uint16_t ProcessorArchitecture;
+    uint16_t ProcessorLevel;
+    uint16_t ProcessorRevision;
+    uint8_t NumberOfProcessors;
+    uint8_t ProductType;
+    uint32_t MajorVersion;
+    uint32_t MinorVersion;
+    uint32_t BuildNumber;
+    uint32_t PlatformId;
+    uint32_t CSDVersionRva;
+    uint16_t SuiteMask;
+    uint16_t Reserved2;
+    uint8_t Cpu[24];
+};
+
+struct Memory64List {
+    uint64_t NumberOfMemoryRanges;
+    uint64_t BaseRva;
+};
 
-        // Find the newly opened process in the handle table
-        auto ObjectTable = current_process.ObjectTable();
-        auto process = ObjectTable->ProcessObject(process_handle);
-        std::cout << "Opened process " << process->ImageFileName() << std::endl;
+struct MemoryDescriptor64 {
+    uint64_t StartOfMemoryRange;
+    uint64_t DataSize;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(Header) == 32);
+static_assert(sizeof(Directory) == 12);
+static_assert(sizeof(SystemInfo) == 56);
+
+} // namespace minidump
+
+/*
+ * Pages to write to the output file. Resident pages are written straight from the guest's memory
+ * by frame number, pages that were read through the guest are written from a copy.
+ */
+struct DumpRange {
+    uint64_t address = 0;
+    uint64_t page_count = 0;
+    std::vector<uint64_t> pfns;
+    std::vector<char> data;
+    uint64_t file_offset = 0;
+
+    uint64_t end() const { return address + (page_count << PAGE_SHIFT); }
+};
+
+/*
+ * Pages inside of the process's VADs that could not be translated
+ */
+struct MissingRun {
+    uint64_t address = 0;
+    uint64_t page_count = 0;
+
+    uint64_t end() const { return address + (page_count << PAGE_SHIFT); }
+};
 
-        auto mmvad = process->VadRoot();
-        if (!mmvad) {
+static bool write_all(int fd, const void* buffer, size_t length, off64_t offset) {
+    const char* data = static_cast<const char*>(buffer);
+    while (length) {
+        const ssize_t written = pwrite64(fd, data, length, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+class ProcessDumper final {
+  public:
+    /**
+     * @brief Find the process's pages
+     *
+     * Every VAD region is translated through the process's page tables. Transition and prototype
+     * PTEs are resolved by the guest's page fault handler. Must be called with the domain paused.
+     */
+    void scan() {
+        resident_.clear();
+        missing_.clear();
+
+        auto vad_root = process_->VadRoot();
+        if (!vad_root) {
             std::cerr << "MMVAD was null\n";
             return;
         }
 
-        auto mbi = inject::allocate<MEMORY_BASIC_INFORMATION>();
+        const auto& page_directory = domain_.page_directory();
+        const uint64_t cr3 = process_->DirectoryTableBase();
+        std::vector<uint64_t> pfns(ScanPages);
 
-        std::vector<std::pair<guest_ptr<void>, guest_ptr<void>>> dump_regions;
-        for (const auto& entry : mmvad->VadTreeInOrder()) {
+        for (const auto& entry : vad_root->VadTreeInOrder()) {
             // Skip regions that are completely inaccessible
             if ((entry->Protection().value() & PAGE_PROTECTION::PAGE_NOACCESS))
                 continue;
 
-            if (pid == current_process.UniqueProcessId()) {
-                // Reading from the process itself, so we have to skip anything we allocated
-                if (object_attributes.ptr().page_number() == entry->StartingVpn())
-                    continue;
-                if (client_id.ptr().page_number() == entry->StartingVpn())
-                    continue;
-                if (mbi.ptr().page_number() == entry->StartingVpn())
-                    continue;
+            uint64_t address = entry->StartingAddress();
+            uint64_t remaining = entry->EndingVpn() - entry->StartingVpn() + 1;
+            try {
+                while (remaining) {
+                    const uint64_t count = std::min(remaining, ScanPages);
+                    auto runs = page_directory.translate_range(address, count, cr3, pfns.data());
+                    for (const auto& run : runs) {
+                        const uint64_t run_address = address + (run.first_page << PAGE_SHIFT);
+                        if (run.present)
+                            add_resident(run_address, &pfns[run.first_page], run.page_count);
+                        else
+                            add_missing(run_address, run.page_count);
+                    }
+                    address += count << PAGE_SHIFT;
+                    remaining -= count;
+                }
+            } catch (TraceableException& ex) {
+                std::cerr << "Failed to translate 0x" << std::hex << address << std::dec << ": "
+                          << ex.what() << '\n';
+                add_missing(address, remaining);
             }
+        }
+    }
+
+    /**
+     * @brief Read the pages the last scan could not translate
+     *
+     * This injects system calls, so it must be called from an event in the target process.
+     * The scan has to be repeated afterwards; copies are only used for pages that are still
+     * not resident.
+     */
+    void read_missing(Event& event) {
+        auto& vcpu = event.vcpu();
+        copied_.clear();
 
-            uint64_t addr;
-            for (addr = entry->StartingAddress(); addr < entry->EndingAddress();) {
+        auto mbi = inject::allocate<MEMORY_BASIC_INFORMATION>();
+        auto buffer = inject::allocate<char[]>(ReadBufferSize);
 
-                // TODO: We shouldn't need injection to figure this information out
+        for (const auto& run : missing_) {
+            for (uint64_t addr = run.address; addr < run.end();) {
                 auto result = inject::system_call<nt::NtQueryVirtualMemory>(
-                    process_handle, guest_ptr<void>(vcpu, addr), MemoryBasicInformation, mbi,
+                    NtCurrentProcess(), guest_ptr<void>(vcpu, addr), MemoryBasicInformation, mbi,
                     mbi->buffer_size(), nullptr);
 
                 if (!result.NT_SUCCESS()) {
-                    std::cerr << "NtQueryVirtualMemory failed for " << addr << ": " << result
-                              << '\n';
-
-                    addr += x86::PageDirectory::PAGE_SIZE;
+                    addr += PAGE_SIZE;
                     continue;
                 }
 
+                const uint64_t region_end =
+                    std::min(run.end(), mbi->BaseAddress() + mbi->RegionSize());
+
                 if (mbi->State().MEM_COMMIT() == false ||
                     (mbi->Protect() &
-                     (PAGE_PROTECTION::PAGE_GUARD | PAGE_PROTECTION::PAGE_NOACCESS)) != 0 ||
-                    (mbi->Type() & (MEM_IMAGE | MEM_MAPPED | MEM_PRIVATE)) == 0) {
-                    // std::cout << "Skipping region 0x" << addr << std::endl;
-                    addr += mbi->RegionSize();
+                     (PAGE_PROTECTION::PAGE_GUARD | PAGE_PROTECTION::PAGE_NOACCESS)) != 0) {
+                    addr = region_end;
                     continue;
                 }
 
-                // This region is good, add it
-                guest_ptr<void> gva(event.domain(), addr, process->DirectoryTableBase());
-                dump_regions.push_back(std::make_pair(gva, gva + mbi->RegionSize()));
-
-                // Skip past the region
-                addr += mbi->RegionSize();
+                while (addr < region_end) {
+                    const uint32_t size = std::min<uint64_t>(region_end - addr, ReadBufferSize);
+
+                    uint32_t ResultLength = 0;
+                    inject::system_call<nt::NtReadVirtualMemory>(
+                        NtCurrentProcess(), guest_ptr<void>(vcpu, addr), buffer, size,
+                        &ResultLength);
+
+                    // A partial copy stops at the first page that couldn't be read
+                    const uint64_t copied = std::min(ResultLength, size) & ~(PAGE_SIZE - 1);
+                    if (copied) {
+                        DumpRange range;
+                        range.address = addr;
+                        range.page_count = copied >> PAGE_SHIFT;
+                        const char* data = buffer.ptr().get();
+                        range.data.assign(data, data + copied);
+                        copied_.push_back(std::move(range));
+                    }
+
+                    addr += copied;
+                    if (copied < size)
+                        addr += PAGE_SIZE;
+                }
             }
         }
+    }
 
-        int count = 0;
-        constexpr int BufferSize = x86::PageDirectory::PAGE_SIZE * 4;
-        auto buffer = inject::allocate<char[]>(BufferSize);
-
-        // Things are looking good, open our output file
-        FILE* output = fopen64(output_file_.c_str(), "wb");
-        if (!output) {
-            std::cerr << "Failed to open output file\n";
-            goto bad_fopen;
+    /**
+     * @brief Write the pages to a file
+     *
+     * Should be called with the domain paused, directly after scan().
+     *
+     * @return true if every page was written
+     */
+    bool write(const std::string& path, DumpFormat format, unsigned int threads) {
+        std::vector<DumpRange> ranges = std::move(resident_);
+        use_copies(ranges);
+        std::sort(ranges.begin(), ranges.end(),
+                  [](const DumpRange& a, const DumpRange& b) { return a.address < b.address; });
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to open output file: " << strerror(errno) << '\n';
+            return false;
         }
 
-        // Now we will try to read them all
-        for (const auto& region : dump_regions) {
-            for (auto addr = region.first; addr < region.second;) {
-                const uint32_t copy_size =
-                    std::min<uint64_t>(region.second.address() - addr.address(), BufferSize);
+        bool success;
+        if (format == DumpFormat::Minidump)
+            success = write_minidump_header(fd, ranges);
+        else
+            success = layout_raw(ranges);
 
-                uint32_t ResultLength = 0;
-                auto result = inject::system_call<nt::NtReadVirtualMemory>(
-                    process_handle, addr, buffer, x86::PageDirectory::PAGE_SIZE, &ResultLength);
+        if (success)
+            success = write_ranges(fd, ranges, threads);
 
-                if (!result.NT_SUCCESS() || ResultLength != x86::PageDirectory::PAGE_SIZE) {
-                    std::cerr << "Failed to copy " << addr << ": " << result << '\n';
-                    addr += x86::PageDirectory::PAGE_SIZE;
-                    continue;
-                }
+        if (close(fd) < 0) {
+            std::cerr << "Failed to close output file: " << strerror(errno) << '\n';
+            success = false;
+        }
+        return success;
+    }
 
-                // Write it to our file
-                off64_t offset = addr.address();
+    uint64_t missing_pages() const {
+        uint64_t result = 0;
+        for (const auto& run : missing_)
+            result += run.page_count;
+        return result;
+    }
 
-                // std::cout << "Seeking to " << std::hex << offset << std::endl << std::dec;
-                if (fseeko64(output, offset, SEEK_SET) < 0) {
-                    // std::cerr << "Bad fseek: " << strerror(errno) << std::endl;
-                }
+    uint64_t resident_pages() const { return resident_pages_; }
+    uint64_t copied_pages() const { return copied_pages_; }
 
-                fwrite(buffer.ptr().get(), 1, copy_size, output);
+    ProcessDumper(Domain& domain, std::shared_ptr<PROCESS> process)
+        : domain_(domain), process_(std::move(process)) {}
 
-                count += (copy_size / x86::PageDirectory::PAGE_SIZE);
-                addr += copy_size;
+  private:
+    void add_resident(uint64_t address, const uint64_t* pfns, uint64_t page_count) {
+        for (uint64_t i = 0; i < page_count; i += MaxRangePages) {
+            DumpRange range;
+            range.address = address + (i << PAGE_SHIFT);
+            range.page_count = std::min(page_count - i, MaxRangePages);
+            range.pfns.assign(pfns + i, pfns + i + range.page_count);
+            resident_.push_back(std::move(range));
+        }
+    }
+
+    void add_missing(uint64_t address, uint64_t page_count) {
+        if (!missing_.empty() && missing_.back().end() == address)
+            missing_.back().page_count += page_count;
+        else
+            missing_.push_back(MissingRun{address, page_count});
+    }
+
+    /*
+     * Add the parts of the copied pages that are still not resident
+     */
+    void use_copies(std::vector<DumpRange>& ranges) {
+        for (const auto& copy : copied_) {
+            // The first missing run that ends after the copy starts
+            auto iter = std::upper_bound(
+                missing_.begin(), missing_.end(), copy.address,
+                [](uint64_t address, const MissingRun& run) { return address < run.end(); });
+
+            for (; iter != missing_.end() && iter->address < copy.end(); ++iter) {
+                const uint64_t start = std::max(copy.address, iter->address);
+                const uint64_t end = std::min(copy.end(), iter->end());
+
+                DumpRange range;
+                range.address = start;
+                range.page_count = (end - start) >> PAGE_SHIFT;
+                range.data.assign(copy.data.begin() + (start - copy.address),
+                                  copy.data.begin() + (end - copy.address));
+                ranges.push_back(std::move(range));
             }
         }
-        fclose(output);
-        std::cerr << "Done!\n";
-        std::cerr << "Copied " << count << " pages\n";
-        result_ = 0;
+        copied_.clear();
+    }
 
-    bad_fopen:
-        result = inject::system_call<nt::NtClose>(process_handle);
-        if (!result.NT_SUCCESS())
-            std::cerr << "Failed to close target process: " << result << '\n';
+    /*
+     * Pages go at their virtual address, leaving holes in a sparse file
+     */
+    bool layout_raw(std::vector<DumpRange>& ranges) {
+        for (auto& range : ranges)
+            range.file_offset = range.address;
+        return true;
     }
 
+    bool write_minidump_header(int fd, std::vector<DumpRange>& ranges) {
+        using namespace minidump;
+
+        // Adjacent ranges share a descriptor
+        std::vector<MemoryDescriptor64> descriptors;
+        for (const auto& range : ranges) {
+            const uint64_t size = range.page_count << PAGE_SHIFT;
+            if (!descriptors.empty() && descriptors.back().StartOfMemoryRange +
+                                                descriptors.back().DataSize ==
+                                            range.address)
+                descriptors.back().DataSize += size;
+            else
+                descriptors.push_back(MemoryDescriptor64{range.address, size});
+        }
+
+        const uint32_t directory_rva = sizeof(Header);
+        const uint32_t system_info_rva = directory_rva + 2 * sizeof(Directory);
+        const uint32_t csd_version_rva = system_info_rva + sizeof(SystemInfo);
+        const uint32_t memory_list_rva = (csd_version_rva + 6 + 7) & ~7u;
+        const uint64_t memory_list_size =
+            sizeof(Memory64List) + descriptors.size() * sizeof(MemoryDescriptor64);
+
+        // Page align the memory so that the writes are too
+        uint64_t offset = (memory_list_rva + memory_list_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        const uint64_t base_rva = offset;
+        for (auto& range : ranges) {
+            range.file_offset = offset;
+            offset += range.page_count << PAGE_SHIFT;
+        }
+
+        Header header{};
+        header.Signature = Signature;
+        header.Version = Version;
+        header.NumberOfStreams = 2;
+        header.StreamDirectoryRva = directory_rva;
+        header.TimeDateStamp = time(nullptr);
+        header.Flags = MiniDumpWithFullMemory;
+
+        Directory directory[2] = {
+            {SystemInfoStream, sizeof(SystemInfo), system_info_rva},
+            {Memory64ListStream, static_cast<uint32_t>(memory_list_size), memory_list_rva},
+        };
+
+        const auto& guest = static_cast<const WindowsGuest&>(*domain_.guest());
+        const auto& kernel = guest.kernel();
+        SystemInfo system_info{};
+        system_info.ProcessorArchitecture =
+            guest.x64() ? PROCESSOR_ARCHITECTURE_AMD64 : PROCESSOR_ARCHITECTURE_INTEL;
+        system_info.NumberOfProcessors = std::min(domain_.vcpu_count(), 255u);
+        system_info.ProductType = 1;
+        system_info.MajorVersion = kernel.MajorVersion();
+        system_info.MinorVersion = kernel.MinorVersion();
+        system_info.BuildNumber = kernel.NtBuildNumber();
+        system_info.PlatformId = VER_PLATFORM_WIN32_NT;
+        system_info.CSDVersionRva = csd_version_rva;
+
+        // An empty MINIDUMP_STRING: a zero length and the terminator
+        const char csd_version[6] = {};
+
+        Memory64List memory_list{descriptors.size(), base_rva};
+
+        bool success = ftruncate64(fd, offset) == 0;
+        success = success && write_all(fd, &header, sizeof(header), 0);
+        success = success && write_all(fd, directory, sizeof(directory), directory_rva);
+        success = success && write_all(fd, &system_info, sizeof(system_info), system_info_rva);
+        success = success && write_all(fd, csd_version, sizeof(csd_version), csd_version_rva);
+        success = success && write_all(fd, &memory_list, sizeof(memory_list), memory_list_rva);
+        success = success && write_all(fd, descriptors.data(),
+                                       descriptors.size() * sizeof(MemoryDescriptor64),
+                                       memory_list_rva + sizeof(Memory64List));
+        if (!success)
+            std::cerr << "Failed to write minidump header: " << strerror(errno) << '\n';
+        return success;
+    }
+
+    /*
+     * Split the ranges between writer threads. Resident pages are mapped and written without
+     * copying them.
+     */
+    bool write_ranges(int fd, const std::vector<DumpRange>& ranges, unsigned int threads) {
+        std::atomic<size_t> next = 0;
+        std::atomic<uint64_t> resident = 0;
+        std::atomic<uint64_t> copied = 0;
+        std::atomic<bool> failed = false;
+
+        auto writer = [&]() {
+            for (size_t i = next++; i < ranges.size(); i = next++) {
+                const auto& range = ranges[i];
+                const size_t length = range.page_count << PAGE_SHIFT;
+                try {
+                    if (range.pfns.empty()) {
+                        if (!write_all(fd, range.data.data(), length, range.file_offset))
+                            throw std::system_error(errno, std::generic_category());
+                        copied += range.page_count;
+                    } else {
+                        auto mapping = domain_.map_pfns(range.pfns.data(), range.page_count);
+                        if (!write_all(fd, mapping->get(), length, range.file_offset))
+                            throw std::system_error(errno, std::generic_category());
+                        resident += range.page_count;
+                    }
+                } catch (TraceableException& ex) {
+                    std::cerr << "Failed to map 0x" << std::hex << range.address << std::dec
+                              << ": " << ex.what() << '\n';
+                    failed = true;
+                } catch (std::system_error& ex) {
+                    std::cerr << "Failed to write 0x" << std::hex << range.address << std::dec
+                              << ": " << ex.what() << '\n';
+                    failed = true;
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < threads; ++i)
+            workers.emplace_back(writer);
+        writer();
+        for (auto& worker : workers)
+            worker.join();
+
+        resident_pages_ = resident;
+        copied_pages_ = copied;
+        return !failed;
+    }
+
+  private:
+    Domain& domain_;
+    const std::shared_ptr<PROCESS> process_;
+
+    std::vector<DumpRange> resident_;
+    std::vector<MissingRun> missing_;
+    std::vector<DumpRange> copied_;
+
+    uint64_t resident_pages_ = 0;
+    uint64_t copied_pages_ = 0;
+};
+
+/*
+ * Reads the pages that aren't resident from inside the target process
+ */
+class PageInTool final : public EventCallback {
+  public:
+    PageInTool(ProcessDumper& dumper) : dumper_(dumper) {}
+
     void process_event(Event& event) override {
         if (unlikely(event.type() == EventType::EVENT_SHUTDOWN ||
                      event.type() == EventType::EVENT_REBOOT)) {
@@ -209,29 +548,56 @@ class MemDumpTool final : public EventCallback {
 
         // No more events, please.
         event.domain().intercept_system_calls(false);
-        dump(event);
+        dumper_.read_missing(event);
+        result_ = 0;
         event.domain().interrupt();
     }
 
     int result() const { return result_; }
 
   private:
-    const std::string output_file_;
+    ProcessDumper& dumper_;
     std::atomic_flag started_ = false;
     uint8_t result_ = 1;
 };
 
+static std::shared_ptr<PROCESS> find_process(const NtKernel& kernel, const std::string& name,
+                                             uint64_t pid) {
+    auto cidtable = kernel.CidTable();
+    for (const auto& entry : cidtable->open_handles()) {
+        std::unique_ptr<OBJECT_HEADER> header(entry->ObjectHeader());
+        if (header->type() != ObjectType::Process)
+            continue;
+
+        auto process = kernel.process(header->Body());
+        if (name.empty()) {
+            if (process->UniqueProcessId() == pid)
+                return process;
+        } else if (boost::starts_with(boost::to_lower_copy(process->ImageFileName()), name)) {
+            return process;
+        }
+    }
+    return nullptr;
+}
+
 int main(int argc, char** argv) {
     po::options_description desc("Options");
     std::string domain_name;
     std::string process_name;
+    uint64_t pid = 0;
     std::string output;
+    std::string format_name;
+    unsigned int threads;
 
     // clang-format off
     desc.add_options()
       ("domain,D", po::value<std::string>(&domain_name)->required(), "The domain name or ID attach to")    
-      ("procname,P", po::value<std::string>(&process_name)->required(), "The name of a process to hijack")
+      ("procname,P", po::value<std::string>(&process_name), "The name of the process to dump")
+      ("pid,p", po::value<uint64_t>(&pid), "The PID of the process to dump")
       ("output,o", po::value<std::string>(&output)->required(), "A path to an output file")
+      ("format,f", po::value<std::string>(&format_name)->default_value("raw"), "The output format: raw (a sparse file indexed by virtual address) or minidump")
+      ("threads,j", po::value<unsigned int>(&threads)->default_value(4), "The number of writer threads")
+      ("no-inject", "Don't inject system calls to read pages that aren't resident")
       ("help", "Display program help");
     // clang-format on
 
@@ -241,6 +607,23 @@ int main(int argc, char** argv) {
     po::variables_map vm;
     parse_program_options(argc, argv, desc, vm);
 
+    if (vm.count("procname") == vm.count("pid")) {
+        std::cerr << "Exactly one of --procname or --pid is required\n";
+        return 1;
+    }
+
+    DumpFormat format;
+    if (format_name == "raw") {
+        format = DumpFormat::Raw;
+    } else if (format_name == "minidump") {
+        format = DumpFormat::Minidump;
+    } else {
+        std::cerr << "Unknown format: " << format_name << '\n';
+        return 1;
+    }
+    threads = std::max(threads, 1u);
+    boost::to_lower(process_name);
+
     // Get a hypervisor instance
     // This will automatically select the correct type of hypervisor.
     auto hypervisor = Hypervisor::instance();
@@ -260,15 +643,56 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    domain->task_filter().add_name(process_name);
+    auto* guest = static_cast<WindowsGuest*>(domain->guest());
+    const auto& kernel = guest->kernel();
+
+    domain->pause();
+    auto process = find_process(kernel, process_name, pid);
+    if (!process) {
+        domain->resume();
+        std::cerr << "Failed to find a matching process\n";
+        return 1;
+    }
+    std::cout << "Dumping process " << process->ImageFileName() << " ("
+              << process->UniqueProcessId() << ")" << std::endl;
+
+    // The scan isn't made from an event, so pages backed by prototype PTEs are resolved through
+    // the process index
+    guest->refresh_process_index();
+    ProcessDumper dumper(*domain, process);
+    dumper.scan();
+
+    if (dumper.missing_pages() && !vm.count("no-inject")) {
+        std::cout << "Reading " << dumper.missing_pages() << " non-resident pages in the guest"
+                  << std::endl;
+
+        domain->task_filter().add_pid(process->UniqueProcessId());
+        domain->resume();
+
+        try {
+            domain->intercept_system_calls(true);
+
+            PageInTool tool(dumper);
+            domain->poll(tool);
+            if (tool.result() != 0)
+                return tool.result();
+        } catch (TraceableException& ex) {
+            std::cerr << "Failed to read non-resident pages: " << ex.what() << '\n';
+        }
+
+        // The guest ran, so the resident pages have to be found again
+        domain->pause();
+        guest->refresh_process_index();
+        dumper.scan();
+    }
 
-    // Enable system call hooking on all vcpus
-    domain->intercept_system_calls(true);
+    const bool success = dumper.write(output, format, threads);
+    domain->resume();
 
-    // Start the poll
-    MemDumpTool tool(output);
-    domain->poll(tool);
-    return tool.result();
+    std::cerr << "Done!\n";
+    std::cerr << "Copied " << dumper.resident_pages() << " resident pages and "
+              << dumper.copied_pages() << " pages read through the guest\n";
+    return success ? 0 : 1;
 }
 
 /**
@@ -282,7 +706,7 @@ void parse_program_options(int argc, char** argv, po::options_description& desc,
          * --help option
          */
         if (vm.count("help")) {
-            std::cout << "ivexec - Execute a file in the guest" << '\n';
+            std::cout << "ivprocmemdump - Dump the memory of a guest process" << '\n';
             std::cout << desc << '\n';
             exit(0);
         }
@@ -294,4 +718,4 @@ void parse_program_options(int argc, char** argv, po::options_description& desc,
         std::cerr << desc << std::endl;
         exit(1);
     }
-}
\ No newline at end of file
+}
@@ -22,6 +22,7 @@
  * system-call filtering, WindowsEvent, and SystemCallMonitor usage.
  */
 
+#include "shared/EventTimingReport.hh"
 #include "shared/SystemCallMonitor.hh"
 
 #include <introvirt/introvirt.hh>
@@ -54,12 +55,17 @@ int main(int argc, char** argv) {
     po::options_description desc("Options");
     std::string domain_name;
     std::string process_name;
+    std::string record_path;
 
     // clang-format off
     desc.add_options()
       ("domain,D", po::value<std::string>(&domain_name)->required(), "The domain name or ID attach to")
       ("procname", po::value<std::string>(&process_name), "A process name to filter for")
       ("no-flush", "Don't flush the output buffer after each event")
+      ("timing", "Time the event pipeline, and print it on exit or SIGUSR1")
+      ("correlate-returns", "Match system call returns without parking a thread per pending call")
+      ("targeted", "Only intercept system calls while the filtered process is running. Requires procname.")
+      ("record", po::value<std::string>(&record_path), "Record the events to a file, for replay with INTROVIRT_HYPERVISOR=replay")
       ("json", "Output JSON format")
       ("help", "Display program help")
       ("unsupported", "Display system calls that we don't have handlers for");
@@ -84,6 +90,11 @@ int main(int argc, char** argv) {
     signal(SIGINT, &sig_handler);
     domain = hypervisor->attach_domain(domain_name);
 
+    // Start recording first, so that the recording has what guest detection reads
+    if (!record_path.empty()) {
+        domain->record_events(record_path);
+    }
+
     // Detect the guest OS
     if (!domain->detect_guest()) {
         std::cerr << "Failed to detect guest OS\n";
@@ -119,13 +130,41 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (vm.count("correlate-returns")) {
+        domain->syscall_return_correlation(true);
+    }
+
+    if (vm.count("targeted")) {
+        if (process_name.empty()) {
+            std::cerr << "--targeted requires --procname\n";
+            return 1;
+        }
+        try {
+            domain->targeted_system_calls(true);
+        } catch (NotImplementedException& ex) {
+            std::cerr << "--targeted is not available: " << ex.what() << '\n';
+            return 1;
+        }
+    }
+
     // Enable system call hooking on all vcpus
     domain->intercept_system_calls(true);
 
     // Start the poll
+    std::unique_ptr<EventTimingReporter> timing_reporter;
+    if (vm.count("timing")) {
+        domain->event_timing(true);
+        timing_reporter = start_event_timing_reporter(*domain);
+    }
+
     SystemCallMonitor monitor(!vm.count("no-flush"), vm.count("json"), vm.count("unsupported"));
     domain->poll(monitor);
 
+    if (vm.count("timing")) {
+        timing_reporter.reset();
+        write_event_timing(*domain, std::cerr);
+    }
+
     return 0;
 }
 
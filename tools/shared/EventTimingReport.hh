@@ -0,0 +1,130 @@
+/*
+ * Copyright 2021 Assured Information Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <introvirt/introvirt.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <pthread.h>
+#include <thread>
+#include <vector>
+
+namespace introvirt {
+
+/**
+ * Writes the event pipeline histograms from Domain::event_timing_stats()
+ */
+inline void write_event_timing(const Domain& domain, std::ostream& os) {
+    const EventTimingStats stats = domain.event_timing_stats();
+
+    auto write_histogram = [&os](const std::string& label, const LatencyHistogram& histogram) {
+        os << "  " << std::left << std::setw(12) << label << std::right << std::setw(10)
+           << histogram.count << std::setw(12) << histogram.mean_ns() / 1000.0 << std::setw(12)
+           << histogram.percentile_ns(50) / 1000.0 << std::setw(12)
+           << histogram.percentile_ns(99) / 1000.0 << std::setw(12) << histogram.max_ns / 1000.0
+           << '\n';
+    };
+
+    auto write_types = [&](const char* title, const auto& types) {
+        for (const auto& [type, stages] : types) {
+            os << title << ' ' << type << '\n';
+            os << "  " << std::left << std::setw(12) << "stage" << std::right << std::setw(10)
+               << "count" << std::setw(12) << "mean(us)" << std::setw(12) << "p50(us)"
+               << std::setw(12) << "p99(us)" << std::setw(12) << "max(us)" << '\n';
+            for (int stage = 0; stage < static_cast<int>(EventStage::STAGE_COUNT); ++stage) {
+                if (stages[stage].count)
+                    write_histogram(to_string(static_cast<EventStage>(stage)), stages[stage]);
+            }
+        }
+    };
+
+    os << std::fixed << std::setprecision(1);
+    write_types("Delivered", EventTimingStats::combine(stats.delivered));
+    write_types("Filtered", EventTimingStats::combine(stats.filtered));
+
+    // The system calls that kept vcpus paused the longest
+    std::vector<std::pair<uint64_t, LatencyHistogram>> syscalls(stats.syscalls.begin(),
+                                                                stats.syscalls.end());
+    std::sort(syscalls.begin(), syscalls.end(), [](const auto& a, const auto& b) {
+        return a.second.total_ns > b.second.total_ns;
+    });
+    if (syscalls.size() > 20)
+        syscalls.resize(20);
+
+    if (!syscalls.empty())
+        os << "System calls by total time\n";
+
+    const Guest* guest = domain.guest();
+    for (const auto& [index, histogram] : syscalls) {
+        std::string name = "0x" + n2hexstr(index, 4);
+        if (guest && guest->os() == OS::Windows) {
+            const auto* windows_guest = static_cast<const windows::WindowsGuest*>(guest);
+            name = to_string(windows_guest->syscalls().normalize(index));
+        }
+        write_histogram(name, histogram);
+    }
+    os.flush();
+}
+
+/**
+ * Writes the event timing to stderr whenever SIGUSR1 is received, until destroyed
+ *
+ * The reporter reads from the domain, so it must be destroyed before the domain is.
+ */
+class EventTimingReporter final {
+  public:
+    /**
+     * Must be created from the main thread before Domain::poll(), so that every thread inherits
+     * SIGUSR1 as blocked and it's only picked up here.
+     */
+    explicit EventTimingReporter(const Domain& domain) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        thread_ = std::thread([this, &domain, set]() {
+            int signum;
+            while (sigwait(&set, &signum) == 0 && !stopping_)
+                write_event_timing(domain, std::cerr);
+        });
+    }
+
+    EventTimingReporter(const EventTimingReporter&) = delete;
+    EventTimingReporter& operator=(const EventTimingReporter&) = delete;
+
+    ~EventTimingReporter() {
+        // Wake the thread up out of sigwait(), it's the only one waiting for SIGUSR1
+        stopping_ = true;
+        pthread_kill(thread_.native_handle(), SIGUSR1);
+        thread_.join();
+    }
+
+  private:
+    std::atomic_bool stopping_ = false;
+    std::thread thread_;
+};
+
+inline std::unique_ptr<EventTimingReporter> start_event_timing_reporter(const Domain& domain) {
+    return std::make_unique<EventTimingReporter>(domain);
+}
+
+} // namespace introvirt